@@ -37,6 +37,12 @@ typedef	void (*fr_event_callback_t)(void *);
 typedef	void (*fr_event_status_t)(struct timeval *);
 typedef void (*fr_event_fd_handler_t)(fr_event_list_t *el, int sock, void *ctx);
 
+/*
+ *	Types for fr_event_fd_insert() and fr_event_fd_delete().
+ */
+#define FR_EVENT_FD_READ	(0)
+#define FR_EVENT_FD_WRITE	(1)
+
 fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status);
 
 int fr_event_list_num_fds(fr_event_list_t *el);
@@ -870,6 +870,31 @@ void		*fr_fifo_pop(fr_fifo_t *fi);
 void		*fr_fifo_peek(fr_fifo_t *fi);
 int		fr_fifo_num_elements(fr_fifo_t *fi);
 
+/*
+ *	Caches of expiring entries, with CLOCK eviction.  Entries
+ *	are talloc'd, and start with an fr_cache_entry_t.
+ */
+typedef struct fr_cache_entry {
+	uint32_t		hash;		//!< Of the key, set by the caller.
+	time_t			expires;	//!< Set by the caller.
+	bool			referenced;	//!< Used since the CLOCK hand last passed.
+
+	struct fr_cache_entry	*prev;
+	struct fr_cache_entry	*next;
+} fr_cache_entry_t;
+
+typedef struct	fr_cache_t fr_cache_t;
+typedef int (*fr_cache_copy_t)(void *ctx, void const *entry);
+typedef bool (*fr_cache_match_t)(void *ctx, void const *entry);
+
+fr_cache_t	*fr_cache_create(TALLOC_CTX *ctx, int max_entries, fr_hash_table_cmp_t cmp, int num_stats);
+void		fr_cache_free(fr_cache_t *cache);
+int		fr_cache_find(fr_cache_t *cache, void const *match, time_t now, int stat,
+			      fr_cache_copy_t copy, void *ctx);
+void		fr_cache_insert(fr_cache_t *cache, void *entry, time_t now);
+int		fr_cache_flush(fr_cache_t *cache, fr_cache_match_t match, void *ctx);
+int		fr_cache_stats(fr_cache_t *cache, uint64_t *hits, uint64_t *misses);
+
 #ifdef __cplusplus
 }
 #endif
@@ -134,6 +134,7 @@ typedef enum RAD_LISTEN_TYPE {
 	RAD_LISTEN_DHCP,
 	RAD_LISTEN_COMMAND,
 	RAD_LISTEN_COA,
+	RAD_LISTEN_METRICS,
 	RAD_LISTEN_MAX
 } RAD_LISTEN_TYPE;
 
@@ -219,6 +220,8 @@ struct request {
 #ifdef HAVE_PTHREAD_H
 	pthread_t    		child_pid;	//!< Current thread handling
 						//!< the request.
+	struct timeval		queued;		//!< When the request was placed
+						//!< in the thread pool queue.
 #endif
 	time_t			timestamp;	//!< When the request was
 						//!< received.
@@ -655,6 +658,39 @@ ssize_t		xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt)
 void		xlat_free(void);
 
 /* threads.c */
+typedef enum thread_pool_action_t {
+	THREAD_POOL_HOLD = 0,			//!< Pool size left alone.
+	THREAD_POOL_SPAWN,			//!< Threads were spawned.
+	THREAD_POOL_RETIRE,			//!< A thread was retired.
+	THREAD_POOL_CPU_BOUND,			//!< Queue is backing up, but threads
+						//!< are CPU bound, so more won't help.
+	THREAD_POOL_MEMORY_LIMIT		//!< Spawning would exceed max_memory.
+} thread_pool_action_t;
+
+/** Thread pool auto-scaling controller state
+ *
+ */
+typedef struct thread_pool_stats_t {
+	bool			auto_scale;	//!< Whether the latency driven
+						//!< controller is enabled.
+	int			total_threads;	//!< Threads in the pool.
+	int			active_threads;	//!< Threads processing a request.
+	int			max_threads;	//!< max_servers.
+	uint32_t		queue_wait;	//!< Smoothed time requests spend
+						//!< in the queue (microseconds).
+	uint32_t		target_queue_wait; //!< Queue wait the controller
+						//!< aims for (microseconds).
+	uint32_t		busy;		//!< Percentage of wall clock time
+						//!< threads spent processing requests.
+	uint32_t		blocked;	//!< Percentage of busy time threads
+						//!< spent off-CPU, i.e. waiting on I/O.
+	uint64_t		memory;		//!< Memory reserved for thread stacks.
+	uint64_t		max_memory;	//!< Memory budget (0 is unlimited).
+	uint32_t		spawned;	//!< Threads spawned by the controller.
+	uint32_t		retired;	//!< Threads retired by the controller.
+	char const		*action;	//!< Last controller decision.
+} thread_pool_stats_t;
+
 extern		int thread_pool_init(CONF_SECTION *cs, bool *spawn_flag);
 extern		void thread_pool_stop(void);
 extern		int thread_pool_addrequest(REQUEST *, RAD_REQUEST_FUNP);
@@ -663,7 +699,8 @@ extern		pid_t rad_waitpid(pid_t pid, int *status);
 extern	  int total_active_threads(void);
 extern	  void thread_pool_lock(void);
 extern	  void thread_pool_unlock(void);
-extern		void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2]);
+extern		void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2], thread_pool_stats_t *stats);
+extern		int thread_pool_max_threads(CONF_SECTION *cs);
 
 #ifndef HAVE_PTHREAD_H
 #define rad_fork(n) fork()
@@ -760,6 +797,11 @@ int proxy_tls_send(rad_listen_t *listener, REQUEST *request);
  */
 #define PW_RADMIN_PORT 18120
 
+/*
+ *	For OpenMetrics (Prometheus) scrapes.
+ */
+#define PW_METRICS_PORT 9812
+
 #ifdef __cplusplus
 }
 #endif
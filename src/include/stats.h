@@ -62,24 +62,36 @@ typedef struct fr_stats_ema_t {
 
 } fr_stats_ema_t;
 
-extern fr_stats_t	radius_auth_stats;
+/*
+ *	The server-wide counters.  Each thread increments its own
+ *	copy, so the counters are never lost to races, and the hot
+ *	cache lines are never shared between CPUs.  The copies are
+ *	only summed when the statistics are read.
+ */
+typedef struct fr_stats_global_t {
+	fr_stats_t	auth;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	radius_acct_stats;
+	fr_stats_t	acct;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	radius_coa_stats;
-extern fr_stats_t	radius_dsc_stats;
+	fr_stats_t	coa;
+	fr_stats_t	dsc;
 #endif
 #ifdef WITH_PROXY
-extern fr_stats_t	proxy_auth_stats;
+	fr_stats_t	proxy_auth;
 #ifdef WITH_ACCOUNTING
-extern fr_stats_t	proxy_acct_stats;
+	fr_stats_t	proxy_acct;
 #endif
 #ifdef WITH_COA
-extern fr_stats_t	proxy_coa_stats;
-extern fr_stats_t	proxy_dsc_stats;
+	fr_stats_t	proxy_coa;
+	fr_stats_t	proxy_dsc;
 #endif
 #endif
+} fr_stats_global_t;
+
+fr_stats_global_t *radius_stats_local(void);
+void radius_stats_global(fr_stats_t *out, size_t offset);
+void radius_stats_thread_exit(void);
 
 void radius_stats_init(int flag);
 void request_stats_final(REQUEST *request);
@@ -87,7 +99,39 @@ void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
+/*
+ *	Module and section latency, in microseconds.
+ */
+typedef struct fr_latency_stats_t {
+	uint64_t	count;
+	uint64_t	total;
+	uint32_t	mean;
+	uint32_t	max;
+	uint32_t	p50;
+	uint32_t	p90;
+	uint32_t	p99;
+	uint32_t	p999;
+} fr_latency_stats_t;
+
+uint64_t fr_latency_now(void);
+int fr_latency_register(char const *module, int component);
+void fr_latency_record(int slot, uint64_t usec);
+void fr_latency_thread_exit(void);
+int fr_latency_stats(fr_latency_stats_t *out, char const *module, int component);
+
+typedef void (*fr_latency_walk_t)(void *ctx, char const *module, int component,
+				  fr_latency_stats_t const *stats);
+void fr_latency_walk(fr_latency_walk_t callback, void *ctx);
+
+/*
+ *	FR_STATS_LOCAL(auth) is this thread's copy of the server-wide
+ *	authentication counters.  FR_STATS_GLOBAL(&stats, auth) sums
+ *	the copies from all threads.
+ */
+#define FR_STATS_LOCAL(_x) (radius_stats_local()->_x)
+#define FR_STATS_GLOBAL(_out, _x) radius_stats_global(_out, offsetof(fr_stats_global_t, _x))
+
+#define FR_STATS_INC(_x, _y) FR_STATS_LOCAL(_x)._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
 #define FR_STATS_TYPE_INC(_x) _x++
 
 #else  /* WITH_STATS */
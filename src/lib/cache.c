@@ -0,0 +1,359 @@
+/*
+ * cache.c	Thread-safe cache of expiring entries, split into shards,
+ *		with CLOCK eviction.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2014  The FreeRADIUS server project
+ */
+
+/*
+ *	Entries are talloc'd structures which start with an
+ *	fr_cache_entry_t.  The caller sets the hash of the key, and
+ *	when the entry expires, and provides the comparison function.
+ *
+ *	The low bits of the hash pick a shard.  Each shard has its own
+ *	lock, hash table and CLOCK ring, so that threads looking up
+ *	different keys rarely contend.  When a shard is full, expired
+ *	entries are evicted first, then entries which haven't been
+ *	used since the hand last passed.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define FR_CACHE_SHARDS (16)
+
+typedef struct fr_cache_shard {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*table;
+	fr_cache_entry_t	*hand;
+	int			max_entries;
+
+	uint64_t		*hits;		//!< One counter for each statistic.
+	uint64_t		*misses;
+} fr_cache_shard_t;
+
+struct fr_cache_t {
+	fr_cache_shard_t	shards[FR_CACHE_SHARDS];
+	int			num_stats;
+};
+
+/*
+ *	The low bits of the key hash pick the shard, so mix it again
+ *	for the table.
+ */
+static uint32_t cache_entry_hash(void const *data)
+{
+	fr_cache_entry_t const *c = data;
+
+	return fr_hash(&c->hash, sizeof(c->hash));
+}
+
+static void cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static fr_cache_shard_t *cache_shard(fr_cache_t *cache, uint32_t hash)
+{
+	return &cache->shards[hash % FR_CACHE_SHARDS];
+}
+
+/*
+ *	Unlink an entry from the CLOCK ring of its shard, and free it.
+ */
+static void cache_delete(fr_cache_shard_t *shard, fr_cache_entry_t *c)
+{
+	if (c->next == c) {
+		shard->hand = NULL;
+	} else {
+		if (shard->hand == c) shard->hand = c->next;
+		c->prev->next = c->next;
+		c->next->prev = c->prev;
+	}
+
+	fr_hash_table_delete(shard->table, c);
+}
+
+/*
+ *	Make room in a full shard.
+ */
+static void cache_evict(fr_cache_shard_t *shard, time_t now)
+{
+	fr_cache_entry_t *c;
+	int i, num;
+
+	num = fr_hash_table_num_elements(shard->table);
+	for (i = 0; (i < (2 * num)) && shard->hand; i++) {
+		c = shard->hand;
+
+		if ((c->expires <= now) || !c->referenced) {
+			cache_delete(shard, c);
+			return;
+		}
+
+		c->referenced = false;
+		shard->hand = c->next;
+	}
+}
+
+/** Create a cache
+ *
+ * @param ctx to allocate the cache in.
+ * @param max_entries across all the shards.
+ * @param cmp compares the keys of two entries.
+ * @param num_stats number of hit and miss counters to keep, at least 1.
+ * @return the new cache, or NULL on error.
+ */
+fr_cache_t *fr_cache_create(TALLOC_CTX *ctx, int max_entries, fr_hash_table_cmp_t cmp, int num_stats)
+{
+	fr_cache_t *cache;
+	int i;
+
+	if (num_stats < 1) num_stats = 1;
+
+	cache = talloc_zero(ctx, fr_cache_t);
+	if (!cache) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	cache->num_stats = num_stats;
+
+	for (i = 0; i < FR_CACHE_SHARDS; i++) {
+		fr_cache_shard_t *shard = &cache->shards[i];
+
+		shard->max_entries = (max_entries + FR_CACHE_SHARDS - 1) / FR_CACHE_SHARDS;
+		shard->hits = talloc_zero_array(cache, uint64_t, num_stats);
+		shard->misses = talloc_zero_array(cache, uint64_t, num_stats);
+		if (!shard->hits || !shard->misses) {
+			fr_strerror_printf("Out of memory");
+			goto error;
+		}
+
+		shard->table = fr_hash_table_create(cache_entry_hash, cmp, cache_entry_free);
+		if (!shard->table) {
+			fr_strerror_printf("Failed creating hash table");
+			goto error;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+			fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+			fr_hash_table_free(shard->table);
+			shard->table = NULL;
+			goto error;
+		}
+#endif
+	}
+
+	return cache;
+
+error:
+	fr_cache_free(cache);
+	return NULL;
+}
+
+/** Free a cache, and all its entries
+ *
+ */
+void fr_cache_free(fr_cache_t *cache)
+{
+	int i;
+
+	if (!cache) return;
+
+	for (i = 0; i < FR_CACHE_SHARDS; i++) {
+		if (!cache->shards[i].table) continue;
+
+		fr_hash_table_free(cache->shards[i].table);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&cache->shards[i].mutex);
+#endif
+	}
+	talloc_free(cache);
+}
+
+/** Look up an entry, and copy what the caller needs from it
+ *
+ * @param cache to search.
+ * @param match an entry with the hash and key set.
+ * @param now entries which expired before this are deleted, and not returned.
+ * @param stat which hit or miss counter to increment.
+ * @param copy called with the shard locked, to copy the entry.  May be NULL.
+ *	It must not use the cache.  A negative return is counted as a miss.
+ * @param ctx passed to copy.
+ * @return what copy returned, 0 if copy is NULL, or -1 if there's no (unexpired) entry.
+ */
+int fr_cache_find(fr_cache_t *cache, void const *match, time_t now, int stat,
+		  fr_cache_copy_t copy, void *ctx)
+{
+	fr_cache_shard_t *shard;
+	fr_cache_entry_t *c;
+	int rcode = -1;
+
+	if ((stat < 0) || (stat >= cache->num_stats)) stat = 0;
+
+	shard = cache_shard(cache, ((fr_cache_entry_t const *) match)->hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	c = fr_hash_table_finddata(shard->table, match);
+	if (!c) goto finish;
+
+	if (c->expires <= now) {
+		cache_delete(shard, c);
+		goto finish;
+	}
+
+	c->referenced = true;
+	rcode = copy ? copy(ctx, c) : 0;
+
+finish:
+	if (rcode < 0) {
+		shard->misses[stat]++;
+	} else {
+		shard->hits[stat]++;
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rcode;
+}
+
+/** Add an entry, replacing any with the same key
+ *
+ * @param cache to add to.
+ * @param entry talloc'd, with the hash, key and expiry set.  The cache
+ *	owns it from now on, and frees it if it can't be added.
+ * @param now entries which expired before this are evicted first.
+ */
+void fr_cache_insert(fr_cache_t *cache, void *entry, time_t now)
+{
+	fr_cache_shard_t *shard;
+	fr_cache_entry_t *c = entry, *old;
+
+	c->referenced = false;
+	shard = cache_shard(cache, c->hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Another thread may have added the same key while the
+	 *	caller was producing the entry.  Ours is at least as
+	 *	fresh.
+	 */
+	old = fr_hash_table_finddata(shard->table, c);
+	if (old) cache_delete(shard, old);
+
+	if (fr_hash_table_num_elements(shard->table) >= shard->max_entries) {
+		cache_evict(shard, now);
+	}
+
+	if (!fr_hash_table_insert(shard->table, c)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		talloc_free(c);
+		return;
+	}
+
+	if (!shard->hand) {
+		c->prev = c->next = c;
+		shard->hand = c;
+	} else {
+		c->next = shard->hand;
+		c->prev = shard->hand->prev;
+		c->prev->next = c;
+		shard->hand->prev = c;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+/** Remove entries
+ *
+ * @param cache to remove entries from.
+ * @param match called with the shard locked, returns true for the entries
+ *	to remove.  If NULL, all entries are removed.
+ * @param ctx passed to match.
+ * @return the number of entries removed.
+ */
+int fr_cache_flush(fr_cache_t *cache, fr_cache_match_t match, void *ctx)
+{
+	fr_cache_shard_t *shard;
+	fr_cache_entry_t *c, *next;
+	int i, j, num, removed = 0;
+
+	for (i = 0; i < FR_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		num = fr_hash_table_num_elements(shard->table);
+		c = shard->hand;
+		for (j = 0; (j < num) && c; j++) {
+			next = c->next;
+
+			if (!match || match(ctx, c)) {
+				cache_delete(shard, c);
+				removed++;
+			}
+
+			c = shard->hand ? next : NULL;
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return removed;
+}
+
+/** Add up the hit and miss counters of all the shards
+ *
+ * @param cache to read.
+ * @param hits array of num_stats counters to write to, may be NULL.
+ * @param misses array of num_stats counters to write to, may be NULL.
+ * @return the number of entries in the cache.
+ */
+int fr_cache_stats(fr_cache_t *cache, uint64_t *hits, uint64_t *misses)
+{
+	int i, j, entries = 0;
+
+	if (hits) memset(hits, 0, sizeof(hits[0]) * cache->num_stats);
+	if (misses) memset(misses, 0, sizeof(misses[0]) * cache->num_stats);
+
+	for (i = 0; i < FR_CACHE_SHARDS; i++) {
+		fr_cache_shard_t *shard = &cache->shards[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		for (j = 0; j < cache->num_stats; j++) {
+			if (hits) hits[j] += shard->hits[j];
+			if (misses) misses[j] += shard->misses[j];
+		}
+		entries += fr_hash_table_num_elements(shard->table);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return entries;
+}
@@ -53,6 +53,10 @@ struct fr_event_list_t {
 	int		max_readers;
 	int		num_readers;
 	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+
+	int		max_writers;
+	int		num_writers;
+	fr_event_fd_t	writers[FR_EV_MAX_FDS];
 };
 
 /*
@@ -116,6 +120,7 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
+		el->writers[i].fd = -1;
 	}
 
 	el->status = status;
@@ -271,11 +276,34 @@ int fr_event_now(fr_event_list_t *el, struct timeval *when)
 }
 
 
+/*
+ *	Readers are called when the FD is readable, writers when it's
+ *	writable.
+ */
+static fr_event_fd_t *fr_event_fds(fr_event_list_t *el, int type, int **max_fds, int **num_fds)
+{
+	switch (type) {
+	case FR_EVENT_FD_READ:
+		*max_fds = &el->max_readers;
+		*num_fds = &el->num_readers;
+		return el->readers;
+
+	case FR_EVENT_FD_WRITE:
+		*max_fds = &el->max_writers;
+		*num_fds = &el->num_writers;
+		return el->writers;
+
+	default:
+		return NULL;
+	}
+}
+
 int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		       fr_event_fd_handler_t handler, void *ctx)
 {
 	int i;
-	fr_event_fd_t *ef;
+	int *max_fds, *num_fds;
+	fr_event_fd_t *ef, *fds;
 
 	if (!el) {
 		fr_strerror_printf("Invalid arguments (NULL event list)");
@@ -297,24 +325,25 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		return 0;
 	}
 
-	if (type != 0) {
+	fds = fr_event_fds(el, type, &max_fds, &num_fds);
+	if (!fds) {
 		fr_strerror_printf("Invalid type %i", type);
 		return 0;
 	}
 
-	if (el->max_readers >= FR_EV_MAX_FDS) {
-		fr_strerror_printf("Too many readers");
+	if (*max_fds >= FR_EV_MAX_FDS) {
+		fr_strerror_printf("Too many %s", (type == FR_EVENT_FD_READ) ? "readers" : "writers");
 		return 0;
 	}
 
 	ef = NULL;
-	for (i = 0; i <= el->max_readers; i++) {
+	for (i = 0; i <= *max_fds; i++) {
 		/*
 		 *	Be fail-safe on multiple inserts.
 		 */
-		if (el->readers[i].fd == fd) {
-			if ((el->readers[i].handler != handler) ||
-			    (el->readers[i].ctx != ctx)) {
+		if (fds[i].fd == fd) {
+			if ((fds[i].handler != handler) ||
+			    (fds[i].ctx != ctx)) {
 				fr_strerror_printf("Multiple handlers for same FD");
 				return 0;
 			}
@@ -325,11 +354,11 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 			return 1;
 		}
 
-		if (el->readers[i].fd < 0) {
-			ef = &el->readers[i];
-			el->num_readers++;
+		if (fds[i].fd < 0) {
+			ef = &fds[i];
+			(*num_fds)++;
 
-			if (i == el->max_readers) el->max_readers = i + 1;
+			if (i == *max_fds) *max_fds = i + 1;
 			break;
 		}
 	}
@@ -351,17 +380,20 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 {
 	int i;
+	int *max_fds, *num_fds;
+	fr_event_fd_t *fds;
 
 	if (!el || (fd < 0)) return 0;
 
-	if (type != 0) return 0;
+	fds = fr_event_fds(el, type, &max_fds, &num_fds);
+	if (!fds) return 0;
 
-	for (i = 0; i < el->max_readers; i++) {
-		if (el->readers[i].fd == fd) {
-			el->readers[i].fd = -1;
-			el->num_readers--;
+	for (i = 0; i < *max_fds; i++) {
+		if (fds[i].fd == fd) {
+			fds[i].fd = -1;
+			(*num_fds)--;
 
-			if ((i + 1) == el->max_readers) el->max_readers = i;
+			if ((i + 1) == *max_fds) *max_fds = i;
 			el->changed = true;
 			return 1;
 		}
@@ -388,6 +420,7 @@ int fr_event_loop(fr_event_list_t *el)
 	int i, rcode, maxfd = 0;
 	struct timeval when, *wake;
 	fd_set read_fds, master_fds;
+	fd_set write_fds, master_write_fds;
 
 	el->exit = 0;
 	el->dispatch = true;
@@ -399,6 +432,7 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->changed) {
 			FD_ZERO(&master_fds);
+			FD_ZERO(&master_write_fds);
 
 			for (i = 0; i < el->max_readers; i++) {
 				if (el->readers[i].fd < 0) continue;
@@ -409,6 +443,15 @@ int fr_event_loop(fr_event_list_t *el)
 				FD_SET(el->readers[i].fd, &master_fds);
 			}
 
+			for (i = 0; i < el->max_writers; i++) {
+				if (el->writers[i].fd < 0) continue;
+
+				if (el->writers[i].fd > maxfd) {
+					maxfd = el->writers[i].fd;
+				}
+				FD_SET(el->writers[i].fd, &master_write_fds);
+			}
+
 			el->changed = false;
 		}
 
@@ -461,7 +504,8 @@ int fr_event_loop(fr_event_list_t *el)
 		if (el->status) el->status(wake);
 
 		read_fds = master_fds;
-		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+		write_fds = master_write_fds;
+		rcode = select(maxfd + 1, &read_fds, el->num_writers ? &write_fds : NULL, NULL, wake);
 		if ((rcode < 0) && (errno != EINTR)) {
 			fr_strerror_printf("Failed in select: %s", fr_syserror(errno));
 			el->dispatch = false;
@@ -488,6 +532,25 @@ int fr_event_loop(fr_event_list_t *el)
 
 			if (el->changed) break;
 		}
+
+		/*
+		 *	The handlers may have closed or re-used the
+		 *	FDs.  Any writers still waiting will be
+		 *	selected again on the next loop.
+		 */
+		if (el->changed || !el->num_writers) continue;
+
+		for (i = 0; i < el->max_writers; i++) {
+			fr_event_fd_t *ef = &el->writers[i];
+
+			if (ef->fd < 0) continue;
+
+			if (!FD_ISSET(ef->fd, &write_fds)) continue;
+
+			ef->handler(el, ef->fd, ef->ctx);
+
+			if (el->changed) break;
+		}
 	}
 
 	el->dispatch = false;
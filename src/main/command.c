@@ -1712,6 +1712,7 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 static int command_stats_home_server(rad_listen_t *listener, int argc, char *argv[])
 {
 	home_server_t *home;
+	fr_stats_t stats;
 
 	if (argc == 0) {
 		cprintf(listener, "ERROR: Must specify [auth/acct] OR <ipaddr> <port>\n");
@@ -1721,13 +1722,13 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 	if (argc == 1) {
 #ifdef WITH_ACCOUNTING
 		if (strcmp(argv[0], "acct") == 0) {
-			return command_print_stats(listener,
-						   &proxy_acct_stats, 0, 1);
+			FR_STATS_GLOBAL(&stats, proxy_acct);
+			return command_print_stats(listener, &stats, 0, 1);
 		}
 #endif
 		if (strcmp(argv[0], "auth") == 0) {
-			return command_print_stats(listener,
-						   &proxy_auth_stats, 1, 1);
+			FR_STATS_GLOBAL(&stats, proxy_auth);
+			return command_print_stats(listener, &stats, 1, 1);
 		}
 
 		cprintf(listener, "ERROR: Should specify [auth/acct]\n");
@@ -1761,13 +1762,13 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		/*
 		 *	Global statistics.
 		 */
-		fake.auth = radius_auth_stats;
+		FR_STATS_GLOBAL(&fake.auth, auth);
 #ifdef WITH_ACCOUNTING
-		fake.auth = radius_acct_stats;
+		FR_STATS_GLOBAL(&fake.acct, acct);
 #endif
 #ifdef WITH_COA
-		fake.coa = radius_coa_stats;
-		fake.dsc = radius_dsc_stats;
+		FR_STATS_GLOBAL(&fake.coa, coa);
+		FR_STATS_GLOBAL(&fake.dsc, dsc);
 #endif
 		client = &fake;
 
@@ -1817,19 +1818,6 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		return 0;
 	}
 
-	/*
-	 *	Global results for all client.
-	 */
-	if (argc == 1) {
-#ifdef WITH_ACCOUNTING
-		if (!auth) {
-			return command_print_stats(listener,
-						   &radius_acct_stats, auth, 0);
-		}
-#endif
-		return command_print_stats(listener, &radius_auth_stats, auth, 0);
-	}
-
 	return command_print_stats(listener, stats, auth, 0);
 }
 
@@ -1848,6 +1836,130 @@ static int command_stats_socket(rad_listen_t *listener, int argc, char *argv[])
 
 	return command_print_stats(listener, &sock->stats, auth, 0);
 }
+
+#ifdef HAVE_PTHREAD_H
+static int command_stats_threads(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	int i, array[RAD_LISTEN_MAX], pps[2];
+	thread_pool_stats_t stats;
+
+	thread_pool_queue_stats(array, pps, &stats);
+
+	cprintf(listener, "\ttotal_threads\t%d\n", stats.total_threads);
+	cprintf(listener, "\tactive_threads\t%d\n", stats.active_threads);
+	cprintf(listener, "\tmax_threads\t%d\n", stats.max_threads);
+
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		cprintf(listener, "\tqueue.%d\t\t%d\n", i, array[i]);
+	}
+	cprintf(listener, "\tpps_in\t\t%d\n", pps[0]);
+	cprintf(listener, "\tpps_out\t\t%d\n", pps[1]);
+
+	cprintf(listener, "\tauto_scale\t%s\n", stats.auto_scale ? "yes" : "no");
+	if (!stats.auto_scale) return 1;
+
+	cprintf(listener, "\tqueue_wait\t%u\n", stats.queue_wait);
+	cprintf(listener, "\ttarget_queue_wait\t%u\n", stats.target_queue_wait);
+	cprintf(listener, "\tbusy\t\t%u%%\n", stats.busy);
+	cprintf(listener, "\tblocked\t\t%u%%\n", stats.blocked);
+	cprintf(listener, "\tmemory\t\t%" PRIu64 "\n", stats.memory);
+	cprintf(listener, "\tmax_memory\t%" PRIu64 "\n", stats.max_memory);
+	cprintf(listener, "\tspawned\t\t%u\n", stats.spawned);
+	cprintf(listener, "\tretired\t\t%u\n", stats.retired);
+	cprintf(listener, "\taction\t\t%s\n", stats.action ? stats.action : "hold");
+
+	return 1;
+}
+#endif
+
+static int latency_component(char const *name)
+{
+	int i;
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if (strcmp(name, section_type_value[i].section) == 0) return i;
+	}
+
+	return -1;
+}
+
+static void cprint_latency(rad_listen_t *listener, char const *module, int component)
+{
+	fr_latency_stats_t stats;
+	char const *name = section_type_value[component].section;
+
+	if (fr_latency_stats(&stats, module, component) <= 0) return;
+	if (!stats.count) return;
+
+	cprintf(listener, "\t%s.count\t%" PRIu64 "\n", name, stats.count);
+	cprintf(listener, "\t%s.mean\t%u\n", name, stats.mean);
+	cprintf(listener, "\t%s.max\t%u\n", name, stats.max);
+	cprintf(listener, "\t%s.p50\t%u\n", name, stats.p50);
+	cprintf(listener, "\t%s.p90\t%u\n", name, stats.p90);
+	cprintf(listener, "\t%s.p99\t%u\n", name, stats.p99);
+	cprintf(listener, "\t%s.p999\t%u\n", name, stats.p999);
+}
+
+static int command_stats_module(rad_listen_t *listener, int argc, char *argv[])
+{
+	int i, comp = -1;
+	CONF_SECTION *cs;
+	module_instance_t *mi;
+
+	if (argc < 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], 0);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (argc > 1) {
+		comp = latency_component(argv[1]);
+		if (comp < 0) {
+			cprintf(listener, "ERROR: Unknown section \"%s\"\n", argv[1]);
+			return 0;
+		}
+	}
+
+	/*
+	 *	All latencies are in microseconds.
+	 */
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if ((comp >= 0) && (i != comp)) continue;
+
+		cprint_latency(listener, mi->name, i);
+	}
+
+	return 1;
+}
+
+static int command_stats_section(rad_listen_t *listener, int argc, char *argv[])
+{
+	int i, comp = -1;
+
+	if (argc > 0) {
+		comp = latency_component(argv[0]);
+		if (comp < 0) {
+			cprintf(listener, "ERROR: Unknown section \"%s\"\n", argv[0]);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if ((comp >= 0) && (i != comp)) continue;
+
+		cprint_latency(listener, NULL, i);
+	}
+
+	return 1;
+}
 #endif	/* WITH_STATS */
 
 
@@ -2009,6 +2121,20 @@ static fr_command_table_t command_table_stats[] = {
 	  "- show statistics for given socket",
 	  command_stats_socket, NULL },
 
+	{ "module", FR_READ,
+	  "stats module <module> [<section>] - show latency histogram summary (in microseconds) for the given module",
+	  command_stats_module, NULL },
+
+	{ "section", FR_READ,
+	  "stats section [<section>] - show latency histogram summary (in microseconds) for processing sections",
+	  command_stats_section, NULL },
+
+#ifdef HAVE_PTHREAD_H
+	{ "threads", FR_READ,
+	  "stats threads - show thread pool queue and auto-scaling statistics",
+	  command_stats_threads, NULL },
+#endif
+
 	{ NULL, 0, NULL, NULL, NULL }
 };
 #endif
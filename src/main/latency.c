@@ -0,0 +1,540 @@
+/*
+ * latency.c	Module and section latency histograms.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/threads.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_STATS
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define USEC (1000000)
+
+/*
+ *	The histograms are log-linear, in the style of HdrHistogram.
+ *
+ *	Values below LATENCY_SUB_COUNT microseconds get a bucket each.
+ *	After that, every power of two is split into LATENCY_HALF
+ *	buckets, so the value reported for a bucket is never more
+ *	than 1/LATENCY_HALF (~3%) larger than the values counted in
+ *	it.  Values are in microseconds, and are clamped to 32 bits
+ *	(a bit more than an hour).
+ */
+#define LATENCY_SUB_BITS	(6)
+#define LATENCY_SUB_COUNT	(1 << LATENCY_SUB_BITS)
+#define LATENCY_HALF		(LATENCY_SUB_COUNT / 2)
+#define LATENCY_BUCKETS		(LATENCY_SUB_COUNT + ((32 - LATENCY_SUB_BITS) * LATENCY_HALF))
+
+typedef struct latency_histogram_t {
+	uint64_t		count;
+	uint64_t		total;
+	uint32_t		max;
+	uint32_t		bucket[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+/*
+ *	What a slot is recording.  Sections are the first
+ *	RLM_COMPONENT_COUNT slots, with no module name.
+ */
+typedef struct latency_slot_t {
+	char const		*module;
+	int			component;
+} latency_slot_t;
+
+/*
+ *	Each thread records into its own shard, so recording never
+ *	shares a cache line with another thread.  The mutex is taken
+ *	by the owning thread when it records or grows the shard, and
+ *	by the aggregator when it reads the shard, so it's only ever
+ *	contended while statistics are being read.
+ */
+typedef struct latency_shard_t {
+	struct latency_shard_t	*next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	int			num_slots;
+	latency_histogram_t	**slots;
+} latency_shard_t;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static latency_slot_t		*latency_slots = NULL;
+static int			latency_num_slots = 0;
+static latency_shard_t		*latency_shards = NULL;
+
+/*
+ *	Totals from threads which have exited.
+ */
+#ifdef HAVE_PTHREAD_H
+static latency_shard_t		latency_retired = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+#else
+static latency_shard_t		latency_retired;
+#endif
+
+fr_thread_local_setup(latency_shard_t *, latency_shard);	/* macro */
+
+static void latency_shard_retire(latency_shard_t *shard);
+
+static int latency_index(uint64_t usec)
+{
+	int msb, shift;
+
+	if (usec > UINT32_MAX) usec = UINT32_MAX;
+	if (usec < LATENCY_SUB_COUNT) return usec;
+
+	for (msb = LATENCY_SUB_BITS; (usec >> (msb + 1)) != 0; msb++);
+
+	shift = msb - LATENCY_SUB_BITS + 1;
+
+	return LATENCY_SUB_COUNT + ((shift - 1) * LATENCY_HALF) + ((usec >> shift) - LATENCY_HALF);
+}
+
+/*
+ *	The highest value which would be counted in a bucket.
+ */
+static uint32_t latency_value(int idx)
+{
+	int shift;
+	uint64_t value;
+
+	if (idx < LATENCY_SUB_COUNT) return idx;
+
+	shift = ((idx - LATENCY_SUB_COUNT) / LATENCY_HALF) + 1;
+	value = (uint64_t) (((idx - LATENCY_SUB_COUNT) % LATENCY_HALF) + LATENCY_HALF) << shift;
+	value += (1 << shift) - 1;
+
+	if (value > UINT32_MAX) return UINT32_MAX;
+
+	return value;
+}
+
+/** Get a monotonic timestamp in microseconds
+ *
+ * Falls back to gettimeofday() if there's no monotonic clock.
+ */
+uint64_t fr_latency_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ((uint64_t) ts.tv_sec * USEC) + (ts.tv_nsec / 1000);
+	}
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return ((uint64_t) tv.tv_sec * USEC) + tv.tv_usec;
+	}
+}
+
+/*
+ *	The first slots are for the sections.  Called with
+ *	latency_mutex held.
+ */
+static int latency_slots_init(void)
+{
+	int i;
+
+	if (latency_slots) return 0;
+
+	latency_slots = talloc_zero_array(NULL, latency_slot_t, RLM_COMPONENT_COUNT);
+	if (!latency_slots) return -1;
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		latency_slots[i].component = i;
+	}
+	latency_num_slots = RLM_COMPONENT_COUNT;
+
+	return 0;
+}
+
+/** Find or create the slot for a module instance and component
+ *
+ * Called when the configuration is compiled, so it's allowed to be slow.
+ *
+ * @param module instance name, or NULL for the section itself.
+ * @param component the module is being called for.
+ * @return the slot number, or -1 on error.
+ */
+int fr_latency_register(char const *module, int component)
+{
+	int i;
+	latency_slot_t *slots;
+
+	rad_assert((component >= 0) && (component < RLM_COMPONENT_COUNT));
+
+	PTHREAD_MUTEX_LOCK(&latency_mutex);
+
+	if (latency_slots_init() < 0) goto error;
+
+	if (!module) {
+		PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+		return component;
+	}
+
+	for (i = RLM_COMPONENT_COUNT; i < latency_num_slots; i++) {
+		if ((latency_slots[i].component == component) &&
+		    (strcmp(latency_slots[i].module, module) == 0)) {
+			PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+			return i;
+		}
+	}
+
+	slots = talloc_realloc(NULL, latency_slots, latency_slot_t, latency_num_slots + 1);
+	if (!slots) goto error;
+	latency_slots = slots;
+
+	latency_slots[i].module = talloc_typed_strdup(latency_slots, module);
+	latency_slots[i].component = component;
+	latency_num_slots++;
+
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+	return i;
+
+error:
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+	ERROR("Failed allocating latency statistics");
+	return -1;
+}
+
+static void _latency_shard_free(void *arg)
+{
+	latency_shard_retire(arg);
+}
+
+/*
+ *	Make sure the shard has room for a slot.  Only ever called by
+ *	the thread which owns the shard, or with latency_mutex held
+ *	for the retired shard.
+ *
+ *	The mutex stops the aggregator from reading the slots while
+ *	they're being reallocated.
+ */
+static latency_histogram_t *latency_shard_slot(latency_shard_t *shard, int slot)
+{
+	latency_histogram_t *hist = NULL;
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (slot >= shard->num_slots) {
+		latency_histogram_t **slots;
+		int num_slots = latency_num_slots;
+
+		if (slot >= num_slots) num_slots = slot + 1;
+
+		slots = talloc_realloc(shard == &latency_retired ? NULL : shard,
+				       shard->slots, latency_histogram_t *, num_slots);
+		if (!slots) goto done;
+		memset(slots + shard->num_slots, 0, (num_slots - shard->num_slots) * sizeof(*slots));
+
+		shard->slots = slots;
+		shard->num_slots = num_slots;
+	}
+
+	if (!shard->slots[slot]) {
+		shard->slots[slot] = talloc_zero(shard->slots, latency_histogram_t);
+	}
+	hist = shard->slots[slot];
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return hist;
+}
+
+/*
+ *	Get (or create) the shard for the current thread.
+ */
+static latency_shard_t *latency_shard_get(void)
+{
+	latency_shard_t *shard;
+
+	shard = fr_thread_local_init(latency_shard, _latency_shard_free);
+	if (shard) return shard;
+
+	shard = talloc_zero(NULL, latency_shard_t);
+	if (!shard) return NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&shard->mutex, NULL);
+#endif
+
+	if (fr_thread_local_set(latency_shard, shard) != 0) {
+		talloc_free(shard);
+		return NULL;
+	}
+
+	PTHREAD_MUTEX_LOCK(&latency_mutex);
+	shard->next = latency_shards;
+	latency_shards = shard;
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+
+	return shard;
+}
+
+static void latency_add(latency_histogram_t *hist, uint64_t usec)
+{
+	hist->bucket[latency_index(usec)]++;
+	hist->count++;
+	hist->total += usec;
+	if (usec > hist->max) hist->max = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+}
+
+static void latency_merge(latency_histogram_t *out, latency_histogram_t const *in)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		out->bucket[i] += in->bucket[i];
+	}
+	out->count += in->count;
+	out->total += in->total;
+	if (in->max > out->max) out->max = in->max;
+}
+
+/** Record the time taken by a module or section
+ *
+ * @param slot returned by fr_latency_register().
+ * @param usec time taken.
+ */
+void fr_latency_record(int slot, uint64_t usec)
+{
+	latency_shard_t *shard;
+	latency_histogram_t *hist;
+
+	if (slot < 0) return;
+
+	shard = latency_shard_get();
+	if (!shard) return;
+
+	if ((slot >= shard->num_slots) || !shard->slots[slot]) {
+		hist = latency_shard_slot(shard, slot);
+		if (!hist) return;
+	}
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	hist = shard->slots[slot];
+	latency_add(hist, usec);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+/*
+ *	Merge a shard into the retired totals, and free it.
+ */
+static void latency_shard_retire(latency_shard_t *shard)
+{
+	int i;
+	latency_shard_t **last;
+
+	if (!shard) return;
+
+	PTHREAD_MUTEX_LOCK(&latency_mutex);
+	for (last = &latency_shards; *last; last = &(*last)->next) {
+		if (*last == shard) {
+			*last = shard->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < shard->num_slots; i++) {
+		latency_histogram_t *hist;
+
+		if (!shard->slots[i]) continue;
+
+		hist = latency_shard_slot(&latency_retired, i);
+		if (hist) latency_merge(hist, shard->slots[i]);
+	}
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&shard->mutex);
+#endif
+	talloc_free(shard);
+}
+
+/** Merge the current thread's histograms into the totals
+ *
+ * Called by threads before they exit, so that their statistics
+ * aren't lost.
+ */
+void fr_latency_thread_exit(void)
+{
+	latency_shard_t *shard;
+
+	shard = fr_thread_local_init(latency_shard, _latency_shard_free);
+	if (!shard) return;
+
+	(void) fr_thread_local_set(latency_shard, NULL);
+	latency_shard_retire(shard);
+}
+
+/*
+ *	Add one slot from every shard to a histogram.
+ *
+ *	Called with latency_mutex held.  Each shard is locked while
+ *	it's read, so its counts are consistent with each other, but
+ *	the shards are read one after another, so the totals are a
+ *	close approximation, not a perfect snapshot.
+ */
+static void latency_collect(latency_histogram_t *out, int slot)
+{
+	latency_shard_t *shard;
+
+	if ((slot < latency_retired.num_slots) && latency_retired.slots[slot]) {
+		latency_merge(out, latency_retired.slots[slot]);
+	}
+
+	for (shard = latency_shards; shard; shard = shard->next) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		if ((slot < shard->num_slots) && shard->slots[slot]) {
+			latency_merge(out, shard->slots[slot]);
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+static uint32_t latency_percentile(latency_histogram_t const *hist, uint32_t per_mille)
+{
+	int i;
+	uint64_t seen, wanted;
+
+	if (!hist->count) return 0;
+
+	wanted = ((hist->count * per_mille) + 999) / 1000;
+	if (!wanted) wanted = 1;
+
+	seen = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= wanted) {
+			uint32_t value = latency_value(i);
+
+			/*
+			 *	Don't report more than we've seen.
+			 */
+			return (value > hist->max) ? hist->max : value;
+		}
+	}
+
+	return hist->max;
+}
+
+/** Aggregate the latency statistics for a module instance or section
+ *
+ * @param[out] out where to write the statistics.
+ * @param module instance name, or NULL for the section(s).
+ * @param component to get statistics for, or -1 for all components.
+ * @return the number of slots which matched, 0 if the module hasn't
+ *	been called for that component (or doesn't exist).
+ */
+int fr_latency_stats(fr_latency_stats_t *out, char const *module, int component)
+{
+	int i, found = 0;
+	latency_histogram_t *hist;
+
+	memset(out, 0, sizeof(*out));
+
+	hist = talloc_zero(NULL, latency_histogram_t);
+	if (!hist) return 0;
+
+	PTHREAD_MUTEX_LOCK(&latency_mutex);
+	(void) latency_slots_init();
+	for (i = 0; i < latency_num_slots; i++) {
+		if ((component >= 0) && (latency_slots[i].component != component)) continue;
+
+		if (!module) {
+			if (latency_slots[i].module) continue;
+		} else {
+			if (!latency_slots[i].module ||
+			    (strcmp(latency_slots[i].module, module) != 0)) continue;
+		}
+
+		latency_collect(hist, i);
+		found++;
+	}
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+
+	out->count = hist->count;
+	out->total = hist->total;
+	if (hist->count) out->mean = hist->total / hist->count;
+	out->max = hist->max;
+	out->p50 = latency_percentile(hist, 500);
+	out->p90 = latency_percentile(hist, 900);
+	out->p99 = latency_percentile(hist, 990);
+	out->p999 = latency_percentile(hist, 999);
+
+	talloc_free(hist);
+
+	return found;
+}
+/** Call a function with the statistics for every section and module
+ *
+ * Sections are passed with a NULL module name.  Slots which haven't
+ * recorded anything are skipped.
+ *
+ * @param callback to call for each slot.
+ * @param ctx passed to the callback.
+ */
+void fr_latency_walk(fr_latency_walk_t callback, void *ctx)
+{
+	int i, num_slots;
+	latency_slot_t *slots;
+	fr_latency_stats_t stats;
+
+	/*
+	 *	Copy the slots, so that fr_latency_stats() can take
+	 *	the mutex.  The module names are never freed.
+	 */
+	PTHREAD_MUTEX_LOCK(&latency_mutex);
+	if (latency_slots_init() < 0) {
+		PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+		return;
+	}
+	num_slots = latency_num_slots;
+	slots = talloc_memdup(NULL, latency_slots, num_slots * sizeof(*slots));
+	PTHREAD_MUTEX_UNLOCK(&latency_mutex);
+
+	if (!slots) return;
+
+	for (i = 0; i < num_slots; i++) {
+		if (fr_latency_stats(&stats, slots[i].module, slots[i].component) <= 0) continue;
+		if (!stats.count) continue;
+
+		callback(ctx, slots[i].module, slots[i].component, &stats);
+	}
+
+	talloc_free(slots);
+}
+#endif /* WITH_STATS */
@@ -72,6 +72,12 @@ static int command_tcp_send(rad_listen_t *listener, REQUEST *request);
 static int command_write_magic(int newfd, listen_socket_t *sock);
 #endif
 
+#if defined(WITH_STATS) && defined(WITH_TCP)
+#define WITH_METRICS (1)
+static int metrics_tcp_recv(rad_listen_t *listener);
+static int metrics_tcp_send(rad_listen_t *listener, REQUEST *request);
+#endif
+
 static int last_listener = RAD_LISTEN_MAX;
 #define MAX_LISTENER (256)
 static fr_protocol_t master_listen[MAX_LISTENER];
@@ -672,6 +678,12 @@ static int dual_tcp_accept(rad_listen_t *listener)
 		this->send = command_tcp_send;
 		command_write_magic(this->fd, sock);
 	} else
+#endif
+#ifdef WITH_METRICS
+	if (this->type == RAD_LISTEN_METRICS) {
+		this->recv = metrics_tcp_recv;
+		this->send = metrics_tcp_send;
+	} else
 #endif
 	{
 
@@ -2056,6 +2068,7 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 #endif
 
 #include "command.c"
+#include "metrics.c"
 
 #define NO_LISTENER { 0, "undefined", 0, NULL, \
 	  NULL, NULL, NULL, NULL, NULL, NULL, NULL}
@@ -2133,7 +2146,15 @@ static fr_protocol_t master_listen[MAX_LISTENER] = {
 	NO_LISTENER,
 #endif
 
-	NO_LISTENER		/* bfd */
+#ifdef WITH_METRICS
+	/* OpenMetrics exporter */
+	{ RLM_MODULE_INIT, "metrics", sizeof(listen_socket_t), NULL,
+	  metrics_socket_parse, common_socket_free,
+	  metrics_tcp_recv, metrics_tcp_send,
+	  common_socket_print, metrics_socket_encode, metrics_socket_decode },
+#else
+	NO_LISTENER,
+#endif
 };
 
 
@@ -2212,6 +2233,12 @@ static int listen_bind(rad_listen_t *this)
 			break;
 #endif
 
+#ifdef WITH_METRICS
+		case RAD_LISTEN_METRICS:
+			sock->my_port = PW_METRICS_PORT;
+			break;
+#endif
+
 #ifdef WITH_COA
 		case RAD_LISTEN_COA:
 			svp = getservbyname ("radius-dynauth", "udp");
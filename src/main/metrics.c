@@ -0,0 +1,1025 @@
+/*
+ * metrics.c	OpenMetrics (Prometheus) exporter.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014 The FreeRADIUS server project
+ */
+
+/*
+ *	This file is included by listen.c, in the same way as
+ *	command.c.
+ *
+ *	"listen { type = metrics }" is a minimal HTTP/1.1 server.  It
+ *	answers "GET /metrics" with every statistic the server keeps,
+ *	in the OpenMetrics text format, and then closes the
+ *	connection.  Access is controlled by the "client" list, just
+ *	like TCP control sockets.
+ *
+ *	Everything runs in the main thread.  The statistics are copied
+ *	into a snapshot first, so the shard mutexes are only held for
+ *	as long as it takes to sum the counters.  Worker threads never
+ *	wait for a scrape.
+ *
+ *	The socket is non-blocking.  The response is rendered into a
+ *	buffer, and whatever the socket won't take immediately is
+ *	written when the event loop says it's writable, so a slow
+ *	scraper never stalls packet processing.
+ */
+#ifdef WITH_METRICS
+
+#define METRICS_BUFFER_SIZE (4096)
+
+/*
+ *	Times are exported in seconds.
+ */
+#define METRICS_USEC (1000000.0)
+
+/*
+ *	How long a client has to read the response, before we give
+ *	up and close the connection.
+ */
+#define METRICS_SEND_TIMEOUT (10)
+
+typedef struct fr_metrics_buffer_t {
+	size_t		offset;
+	char		buffer[METRICS_BUFFER_SIZE];
+
+	char		*out;		/* response not yet written */
+	size_t		out_len;
+	size_t		out_sent;
+	bool		writing;	/* waiting for the socket to be writable */
+	fr_event_t	*ev;		/* send timeout */
+} fr_metrics_buffer_t;
+
+/*
+ *	One set of counters, with the labels which identify it.
+ */
+typedef struct metrics_entry_t {
+	char const	*labels;
+	bool		auth;		/* Access-* counters apply */
+	fr_stats_t	stats;
+} metrics_entry_t;
+
+typedef struct metrics_snapshot_t {
+	int		num_entries;
+	metrics_entry_t	*entries;
+} metrics_snapshot_t;
+
+typedef struct metrics_counter_t {
+	char const	*name;
+	char const	*help;
+	size_t		offset;
+	bool		auth;		/* only for auth counters */
+} metrics_counter_t;
+
+static const metrics_counter_t metrics_counters[] = {
+	{ "requests", "Requests received.",
+	  offsetof(fr_stats_t, total_requests), false },
+	{ "invalid_requests", "Requests from unknown clients.",
+	  offsetof(fr_stats_t, total_invalid_requests), false },
+	{ "dup_requests", "Duplicate requests.",
+	  offsetof(fr_stats_t, total_dup_requests), false },
+	{ "responses", "Responses sent.",
+	  offsetof(fr_stats_t, total_responses), false },
+	{ "access_accepts", "Access-Accepts sent.",
+	  offsetof(fr_stats_t, total_access_accepts), true },
+	{ "access_rejects", "Access-Rejects sent.",
+	  offsetof(fr_stats_t, total_access_rejects), true },
+	{ "access_challenges", "Access-Challenges sent.",
+	  offsetof(fr_stats_t, total_access_challenges), true },
+	{ "malformed_requests", "Malformed requests.",
+	  offsetof(fr_stats_t, total_malformed_requests), false },
+	{ "bad_authenticators", "Requests with bad authenticators.",
+	  offsetof(fr_stats_t, total_bad_authenticators), false },
+	{ "packets_dropped", "Requests dropped.",
+	  offsetof(fr_stats_t, total_packets_dropped), false },
+	{ "unknown_types", "Packets of unknown type.",
+	  offsetof(fr_stats_t, total_unknown_types), false },
+	{ "timeouts", "Requests which timed out.",
+	  offsetof(fr_stats_t, total_timeouts), false },
+
+	{ NULL, NULL, 0, false }
+};
+
+/*
+ *	Upper bounds of fr_stats_t.elapsed[], in seconds.
+ */
+static char const *metrics_elapsed_le[8] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1.0", "10.0", "+Inf"
+};
+
+/*
+ *	Escape a label value.
+ */
+static char *metrics_escape(TALLOC_CTX *ctx, char const *in)
+{
+	char *out, *p;
+
+	out = p = talloc_array(ctx, char, (strlen(in) * 2) + 1);
+	if (!out) return NULL;
+
+	while (*in) {
+		switch (*in) {
+		case '\\':
+		case '"':
+			*(p++) = '\\';
+			*(p++) = *in;
+			break;
+
+		case '\n':
+			*(p++) = '\\';
+			*(p++) = 'n';
+			break;
+
+		default:
+			*(p++) = *in;
+			break;
+		}
+		in++;
+	}
+	*p = '\0';
+
+	return out;
+}
+
+static void metrics_add(metrics_snapshot_t *snap, bool auth, fr_stats_t const *stats,
+			char const *fmt, ...) PRINTF_LIKE(4);
+
+static void metrics_add(metrics_snapshot_t *snap, bool auth, fr_stats_t const *stats,
+			char const *fmt, ...)
+{
+	va_list ap;
+	metrics_entry_t *entries;
+
+	entries = talloc_realloc(snap, snap->entries, metrics_entry_t, snap->num_entries + 1);
+	if (!entries) return;
+	snap->entries = entries;
+
+	va_start(ap, fmt);
+	entries[snap->num_entries].labels = talloc_vasprintf(entries, fmt, ap);
+	va_end(ap);
+
+	entries[snap->num_entries].auth = auth;
+	entries[snap->num_entries].stats = *stats;
+	snap->num_entries++;
+}
+
+/*
+ *	Copy all of the counters.
+ */
+static void metrics_snapshot(metrics_snapshot_t *snap)
+{
+	int i;
+	fr_stats_t stats;
+	RADCLIENT *client;
+	rad_listen_t *this;
+	char buffer[256];
+
+	FR_STATS_GLOBAL(&stats, auth);
+	metrics_add(snap, true, &stats, "scope=\"global\",type=\"auth\"");
+#ifdef WITH_ACCOUNTING
+	FR_STATS_GLOBAL(&stats, acct);
+	metrics_add(snap, false, &stats, "scope=\"global\",type=\"acct\"");
+#endif
+#ifdef WITH_COA
+	FR_STATS_GLOBAL(&stats, coa);
+	metrics_add(snap, false, &stats, "scope=\"global\",type=\"coa\"");
+	FR_STATS_GLOBAL(&stats, dsc);
+	metrics_add(snap, false, &stats, "scope=\"global\",type=\"disconnect\"");
+#endif
+#ifdef WITH_PROXY
+	FR_STATS_GLOBAL(&stats, proxy_auth);
+	metrics_add(snap, true, &stats, "scope=\"proxy\",type=\"auth\"");
+#ifdef WITH_ACCOUNTING
+	FR_STATS_GLOBAL(&stats, proxy_acct);
+	metrics_add(snap, false, &stats, "scope=\"proxy\",type=\"acct\"");
+#endif
+#endif
+
+	for (i = 0; (client = client_findbynumber(NULL, i)) != NULL; i++) {
+		ip_ntoh(&client->ipaddr, buffer, sizeof(buffer));
+
+		metrics_add(snap, true, &client->auth,
+			    "scope=\"client\",client=\"%s/%d\",type=\"auth\"", buffer, client->prefix);
+#ifdef WITH_ACCOUNTING
+		metrics_add(snap, false, &client->acct,
+			    "scope=\"client\",client=\"%s/%d\",type=\"acct\"", buffer, client->prefix);
+#endif
+#ifdef WITH_COA
+		metrics_add(snap, false, &client->coa,
+			    "scope=\"client\",client=\"%s/%d\",type=\"coa\"", buffer, client->prefix);
+		metrics_add(snap, false, &client->dsc,
+			    "scope=\"client\",client=\"%s/%d\",type=\"disconnect\"", buffer, client->prefix);
+#endif
+	}
+
+	for (this = mainconfig.listen; this != NULL; this = this->next) {
+		char *name;
+
+		switch (this->type) {
+		case RAD_LISTEN_AUTH:
+#ifdef WITH_ACCOUNTING
+		case RAD_LISTEN_ACCT:
+#endif
+#ifdef WITH_PROXY
+		case RAD_LISTEN_PROXY:
+#endif
+#ifdef WITH_COA
+		case RAD_LISTEN_COA:
+#endif
+			break;
+
+		default:
+			continue;
+		}
+
+		this->print(this, buffer, sizeof(buffer));
+		name = metrics_escape(snap, buffer);
+		if (!name) continue;
+
+		metrics_add(snap, (this->type == RAD_LISTEN_AUTH), &this->stats,
+			    "scope=\"listener\",listener=\"%s\",type=\"%s\"", name,
+			    master_listen[this->type].name);
+		talloc_free(name);
+	}
+
+#ifdef WITH_PROXY
+	for (i = 0; ; i++) {
+		home_server_t *home;
+		char const *type;
+
+		home = home_server_bynumber(i);
+		if (!home) break;
+
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+
+		if (home->type == HOME_TYPE_AUTH) {
+			type = "auth";
+		} else if (home->type == HOME_TYPE_ACCT) {
+			type = "acct";
+#ifdef WITH_COA
+		} else if (home->type == HOME_TYPE_COA) {
+			type = "coa";
+#endif
+		} else continue;
+
+		metrics_add(snap, (home->type == HOME_TYPE_AUTH), &home->stats,
+			    "scope=\"home_server\",home_server=\"%s\",port=\"%d\",type=\"%s\"",
+			    ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)), home->port, type);
+	}
+#endif
+}
+
+static void metrics_counters_print(char **out, metrics_snapshot_t const *snap)
+{
+	int i, j, k;
+
+	for (i = 0; metrics_counters[i].name != NULL; i++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "# TYPE freeradius_%s counter\n"
+						     "# HELP freeradius_%s %s\n",
+						     metrics_counters[i].name,
+						     metrics_counters[i].name,
+						     metrics_counters[i].help);
+
+		for (j = 0; j < snap->num_entries; j++) {
+			fr_uint_t counter;
+
+			if (metrics_counters[i].auth && !snap->entries[j].auth) continue;
+
+			counter = *(fr_uint_t const *) (((uint8_t const *) &snap->entries[j].stats) +
+							metrics_counters[i].offset);
+
+			*out = talloc_asprintf_append_buffer(*out, "freeradius_%s_total{%s} %" PRIu64 "\n",
+							     metrics_counters[i].name,
+							     snap->entries[j].labels,
+							     (uint64_t) counter);
+		}
+	}
+
+	/*
+	 *	The response times are already bucketed.  OpenMetrics
+	 *	wants the buckets to be cumulative.
+	 */
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_response_time_seconds histogram\n"
+					     "# HELP freeradius_response_time_seconds Time taken to respond to requests.\n");
+
+	for (j = 0; j < snap->num_entries; j++) {
+		uint64_t total = 0;
+
+		for (k = 0; k < 8; k++) {
+			total += snap->entries[j].stats.elapsed[k];
+
+			*out = talloc_asprintf_append_buffer(*out,
+							     "freeradius_response_time_seconds_bucket{%s,le=\"%s\"} %" PRIu64 "\n",
+							     snap->entries[j].labels, metrics_elapsed_le[k], total);
+		}
+		*out = talloc_asprintf_append_buffer(*out, "freeradius_response_time_seconds_count{%s} %" PRIu64 "\n",
+						     snap->entries[j].labels, total);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_last_packet_timestamp_seconds gauge\n"
+					     "# HELP freeradius_last_packet_timestamp_seconds When the last request was received.\n");
+	for (j = 0; j < snap->num_entries; j++) {
+		if (!snap->entries[j].stats.last_packet) continue;
+
+		*out = talloc_asprintf_append_buffer(*out, "freeradius_last_packet_timestamp_seconds{%s} %" PRIu64 "\n",
+						     snap->entries[j].labels,
+						     (uint64_t) snap->entries[j].stats.last_packet);
+	}
+}
+
+#ifdef WITH_PROXY
+static void metrics_home_servers_print(char **out)
+{
+	int i;
+	char buffer[256];
+	home_server_t *home;
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_home_server_outstanding gauge\n"
+					     "# HELP freeradius_home_server_outstanding Requests sent to the home server which have not been answered.\n");
+	for (i = 0; (home = home_server_bynumber(i)) != NULL; i++) {
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_home_server_outstanding{home_server=\"%s\",port=\"%d\"} %d\n",
+						     ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)), home->port,
+						     home->currently_outstanding);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_home_server_state gauge\n"
+					     "# HELP freeradius_home_server_state Current state of the home server.\n");
+	for (i = 0; (home = home_server_bynumber(i)) != NULL; i++) {
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_home_server_state{home_server=\"%s\",port=\"%d\",state=\"%s\"} 1\n",
+						     ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)), home->port,
+						     (home->state == HOME_STATE_ALIVE) ? "alive" :
+						     (home->state == HOME_STATE_ZOMBIE) ? "zombie" :
+						     (home->state == HOME_STATE_IS_DEAD) ? "dead" : "unknown");
+	}
+
+	/*
+	 *	The EMA is kept in units of 1/EMA_SCALE microseconds.
+	 */
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_home_server_response_time_average_seconds gauge\n"
+					     "# HELP freeradius_home_server_response_time_average_seconds Moving average of the home server response time.\n");
+	for (i = 0; (home = home_server_bynumber(i)) != NULL; i++) {
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+		if (!home->ema.window) continue;
+
+		ip_ntoh(&home->ipaddr, buffer, sizeof(buffer));
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_home_server_response_time_average_seconds{home_server=\"%s\",port=\"%d\",window=\"%d\"} %.6f\n",
+						     buffer, home->port, home->ema.window,
+						     home->ema.ema1 / (100 * METRICS_USEC));
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_home_server_response_time_average_seconds{home_server=\"%s\",port=\"%d\",window=\"%d\"} %.6f\n",
+						     buffer, home->port, home->ema.window * 10,
+						     home->ema.ema10 / (100 * METRICS_USEC));
+	}
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+static void metrics_threads_print(char **out)
+{
+	int i, array[RAD_LISTEN_MAX], pps[2];
+	thread_pool_stats_t stats;
+
+	thread_pool_queue_stats(array, pps, &stats);
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_threads gauge\n"
+					     "# HELP freeradius_threads Threads in the thread pool.\n"
+					     "freeradius_threads{state=\"total\"} %d\n"
+					     "freeradius_threads{state=\"active\"} %d\n"
+					     "freeradius_threads{state=\"max\"} %d\n",
+					     stats.total_threads, stats.active_threads, stats.max_threads);
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_queue_length gauge\n"
+					     "# HELP freeradius_queue_length Requests waiting for a thread.\n");
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		/*
+		 *	Types which weren't built, or whose protocol
+		 *	wasn't loaded, are all called "undefined".
+		 */
+		if (!master_listen[i].recv) continue;
+
+		*out = talloc_asprintf_append_buffer(*out, "freeradius_queue_length{queue=\"%s\"} %d\n",
+						     master_listen[i].name, array[i]);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_queue_pps gauge\n"
+					     "# HELP freeradius_queue_pps Packets per second going into and out of the queue.\n"
+					     "freeradius_queue_pps{direction=\"in\"} %d\n"
+					     "freeradius_queue_pps{direction=\"out\"} %d\n",
+					     pps[0], pps[1]);
+
+	if (!stats.auto_scale) return;
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_queue_wait_seconds gauge\n"
+					     "# HELP freeradius_queue_wait_seconds Average time requests wait in the queue.\n"
+					     "freeradius_queue_wait_seconds %.6f\n"
+					     "# TYPE freeradius_threads_busy_ratio gauge\n"
+					     "# HELP freeradius_threads_busy_ratio Fraction of the time threads are processing requests.\n"
+					     "freeradius_threads_busy_ratio %.2f\n"
+					     "# TYPE freeradius_threads_blocked_ratio gauge\n"
+					     "# HELP freeradius_threads_blocked_ratio Fraction of the processing time threads are blocked.\n"
+					     "freeradius_threads_blocked_ratio %.2f\n"
+					     "# TYPE freeradius_threads_spawned counter\n"
+					     "# HELP freeradius_threads_spawned Threads started by auto-scaling.\n"
+					     "freeradius_threads_spawned_total %u\n"
+					     "# TYPE freeradius_threads_retired counter\n"
+					     "# HELP freeradius_threads_retired Threads stopped by auto-scaling.\n"
+					     "freeradius_threads_retired_total %u\n",
+					     stats.queue_wait / METRICS_USEC,
+					     ((double) stats.busy) / 100,
+					     ((double) stats.blocked) / 100,
+					     stats.spawned, stats.retired);
+}
+#endif
+
+#if defined(WITH_TLS) && defined(HAVE_PTHREAD_H)
+typedef struct metrics_tls_pool_t {
+	char const		*name;
+	fr_tls_pool_stats_t	stats;
+} metrics_tls_pool_t;
+
+typedef struct metrics_tls_pools_t {
+	int			num;
+	metrics_tls_pool_t	*pools;
+} metrics_tls_pools_t;
+
+static void metrics_tls_pool_copy(void *ctx, char const *name, fr_tls_pool_stats_t const *stats)
+{
+	metrics_tls_pools_t *mp = ctx;
+	metrics_tls_pool_t *pools;
+
+	pools = talloc_realloc(mp, mp->pools, metrics_tls_pool_t, mp->num + 1);
+	if (!pools) return;
+	mp->pools = pools;
+
+	pools[mp->num].name = talloc_typed_strdup(mp, name);
+	pools[mp->num].stats = *stats;
+	mp->num++;
+}
+
+/*
+ *	Each family's metadata and samples must be contiguous, so the
+ *	pools are copied first, and then printed one family at a time.
+ */
+static void metrics_tls_pools_print(char **out)
+{
+	int i;
+	metrics_tls_pools_t *mp;
+	metrics_tls_pool_t *p;
+
+	mp = talloc_zero(*out, metrics_tls_pools_t);
+	if (!mp) return;
+
+	tls_crypto_pool_walk(metrics_tls_pool_copy, mp);
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_threads gauge\n"
+					     "# HELP freeradius_tls_crypto_threads Threads in the TLS crypto pool.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_threads{pool=\"%s\",state=\"total\"} %d\n"
+						     "freeradius_tls_crypto_threads{pool=\"%s\",state=\"active\"} %d\n",
+						     p->name, p->stats.threads, p->name, p->stats.active);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_queue_length gauge\n"
+					     "# HELP freeradius_tls_crypto_queue_length Handshake steps waiting for a crypto thread.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_queue_length{pool=\"%s\"} %d\n",
+						     p->name, p->stats.queued);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_queue_max gauge\n"
+					     "# HELP freeradius_tls_crypto_queue_max Handshake steps which may wait before new ones are rejected.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_queue_max{pool=\"%s\"} %d\n",
+						     p->name, p->stats.max_queue);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_handshakes counter\n"
+					     "# HELP freeradius_tls_crypto_handshakes Handshake steps given to the crypto pool.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_handshakes_total{pool=\"%s\",result=\"processed\"} %" PRIu64 "\n"
+						     "freeradius_tls_crypto_handshakes_total{pool=\"%s\",result=\"rejected\"} %" PRIu64 "\n",
+						     p->name, p->stats.processed, p->name, p->stats.rejected);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_wait_seconds counter\n"
+					     "# HELP freeradius_tls_crypto_wait_seconds Time handshake steps spent waiting for a crypto thread.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_wait_seconds_total{pool=\"%s\"} %.6f\n",
+						     p->name, p->stats.wait_usec / METRICS_USEC);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_crypto_run_seconds counter\n"
+					     "# HELP freeradius_tls_crypto_run_seconds Time crypto threads spent processing handshake steps.\n");
+	for (i = 0, p = mp->pools; i < mp->num; i++, p++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_crypto_run_seconds_total{pool=\"%s\"} %.6f\n",
+						     p->name, p->stats.run_usec / METRICS_USEC);
+	}
+
+	talloc_free(mp);
+}
+#endif
+
+#if defined(WITH_TLS) && defined(HAVE_OPENSSL_OCSP_H)
+typedef struct metrics_ocsp_cache_t {
+	char const		*name;
+	fr_tls_ocsp_stats_t	stats;
+} metrics_ocsp_cache_t;
+
+typedef struct metrics_ocsp_caches_t {
+	int			num;
+	metrics_ocsp_cache_t	*caches;
+} metrics_ocsp_caches_t;
+
+static void metrics_ocsp_cache_copy(void *ctx, char const *name, fr_tls_ocsp_stats_t const *stats)
+{
+	metrics_ocsp_caches_t *mc = ctx;
+	metrics_ocsp_cache_t *caches;
+
+	caches = talloc_realloc(mc, mc->caches, metrics_ocsp_cache_t, mc->num + 1);
+	if (!caches) return;
+	mc->caches = caches;
+
+	caches[mc->num].name = talloc_typed_strdup(mc, name);
+	caches[mc->num].stats = *stats;
+	mc->num++;
+}
+
+/*
+ *	As with the TLS pools, copy the caches, and then print one
+ *	family at a time.
+ */
+static void metrics_ocsp_caches_print(char **out)
+{
+	int i;
+	metrics_ocsp_caches_t *mc;
+	metrics_ocsp_cache_t *c;
+
+	mc = talloc_zero(*out, metrics_ocsp_caches_t);
+	if (!mc) return;
+
+	tls_ocsp_cache_walk(metrics_ocsp_cache_copy, mc);
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_ocsp_cache_entries gauge\n"
+					     "# HELP freeradius_tls_ocsp_cache_entries OCSP responses in the cache.\n");
+	for (i = 0, c = mc->caches; i < mc->num; i++, c++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_ocsp_cache_entries{cache=\"%s\"} %d\n",
+						     c->name, c->stats.entries);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_ocsp_cache_lookups counter\n"
+					     "# HELP freeradius_tls_ocsp_cache_lookups OCSP cache lookups.  Stale lookups used an expired response, as the responder was unavailable.\n");
+	for (i = 0, c = mc->caches; i < mc->num; i++, c++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_ocsp_cache_lookups_total{cache=\"%s\",result=\"hit\"} %" PRIu64 "\n"
+						     "freeradius_tls_ocsp_cache_lookups_total{cache=\"%s\",result=\"miss\"} %" PRIu64 "\n"
+						     "freeradius_tls_ocsp_cache_lookups_total{cache=\"%s\",result=\"stale\"} %" PRIu64 "\n",
+						     c->name, c->stats.hits, c->name, c->stats.misses, c->name, c->stats.stale);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_ocsp_cache_refreshes counter\n"
+					     "# HELP freeradius_tls_ocsp_cache_refreshes OCSP responses refreshed before they expired.\n");
+	for (i = 0, c = mc->caches; i < mc->num; i++, c++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_ocsp_cache_refreshes_total{cache=\"%s\"} %" PRIu64 "\n",
+						     c->name, c->stats.refreshes);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_ocsp_queries counter\n"
+					     "# HELP freeradius_tls_ocsp_queries Queries sent to OCSP responders.\n");
+	for (i = 0, c = mc->caches; i < mc->num; i++, c++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_ocsp_queries_total{cache=\"%s\",result=\"ok\"} %" PRIu64 "\n"
+						     "freeradius_tls_ocsp_queries_total{cache=\"%s\",result=\"failed\"} %" PRIu64 "\n",
+						     c->name, c->stats.queries - c->stats.failures, c->name, c->stats.failures);
+	}
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_tls_ocsp_query_seconds counter\n"
+					     "# HELP freeradius_tls_ocsp_query_seconds Time spent waiting for OCSP responders.\n");
+	for (i = 0, c = mc->caches; i < mc->num; i++, c++) {
+		*out = talloc_asprintf_append_buffer(*out,
+						     "freeradius_tls_ocsp_query_seconds_total{cache=\"%s\"} %.6f\n",
+						     c->name, c->stats.query_usec / METRICS_USEC);
+	}
+
+	talloc_free(mc);
+}
+#endif
+
+typedef struct metrics_latency_ctx_t {
+	char		**out;
+	bool		modules;
+} metrics_latency_ctx_t;
+
+static void metrics_latency_print(void *ctx, char const *module, int component,
+				  fr_latency_stats_t const *stats)
+{
+	metrics_latency_ctx_t *mctx = ctx;
+	char const *family;
+	char labels[256];
+
+	if (mctx->modules != (module != NULL)) return;
+
+	if (module) {
+		family = "freeradius_module_latency_seconds";
+		snprintf(labels, sizeof(labels), "module=\"%s\",section=\"%s\"",
+			 module, section_type_value[component].section);
+	} else {
+		family = "freeradius_section_latency_seconds";
+		snprintf(labels, sizeof(labels), "section=\"%s\"",
+			 section_type_value[component].section);
+	}
+
+	*mctx->out = talloc_asprintf_append_buffer(*mctx->out,
+						   "%s{%s,quantile=\"0.5\"} %.6f\n"
+						   "%s{%s,quantile=\"0.9\"} %.6f\n"
+						   "%s{%s,quantile=\"0.99\"} %.6f\n"
+						   "%s{%s,quantile=\"0.999\"} %.6f\n"
+						   "%s_sum{%s} %.6f\n"
+						   "%s_count{%s} %" PRIu64 "\n",
+						   family, labels, stats->p50 / METRICS_USEC,
+						   family, labels, stats->p90 / METRICS_USEC,
+						   family, labels, stats->p99 / METRICS_USEC,
+						   family, labels, stats->p999 / METRICS_USEC,
+						   family, labels, stats->total / METRICS_USEC,
+						   family, labels, stats->count);
+}
+
+static void metrics_latencies_print(char **out)
+{
+	metrics_latency_ctx_t mctx;
+
+	mctx.out = out;
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_section_latency_seconds summary\n"
+					     "# HELP freeradius_section_latency_seconds Time taken to run each processing section.\n");
+	mctx.modules = false;
+	fr_latency_walk(metrics_latency_print, &mctx);
+
+	*out = talloc_asprintf_append_buffer(*out,
+					     "# TYPE freeradius_module_latency_seconds summary\n"
+					     "# HELP freeradius_module_latency_seconds Time taken by each module call.\n");
+	mctx.modules = true;
+	fr_latency_walk(metrics_latency_print, &mctx);
+}
+
+/*
+ *	Render all of the statistics.
+ */
+static char *metrics_render(TALLOC_CTX *ctx)
+{
+	char *out;
+	metrics_snapshot_t *snap;
+
+	snap = talloc_zero(ctx, metrics_snapshot_t);
+	if (!snap) return NULL;
+
+	metrics_snapshot(snap);
+
+	out = talloc_strdup(ctx, "");
+	metrics_counters_print(&out, snap);
+	talloc_free(snap);
+
+#ifdef WITH_PROXY
+	metrics_home_servers_print(&out);
+#endif
+#ifdef HAVE_PTHREAD_H
+	metrics_threads_print(&out);
+#endif
+#if defined(WITH_TLS) && defined(HAVE_PTHREAD_H)
+	metrics_tls_pools_print(&out);
+#endif
+#if defined(WITH_TLS) && defined(HAVE_OPENSSL_OCSP_H)
+	metrics_ocsp_caches_print(&out);
+#endif
+	metrics_latencies_print(&out);
+
+	out = talloc_asprintf_append_buffer(out, "# EOF\n");
+
+	return out;
+}
+
+static void metrics_close_socket(rad_listen_t *this)
+{
+	listen_socket_t *sock = this->data;
+	fr_metrics_buffer_t *mb = (void *) sock->packet;
+
+	if (mb) {
+		fr_event_list_t *el = radius_event_list_corral(EVENT_CORRAL_MAIN);
+
+		if (mb->writing) {
+			fr_event_fd_delete(el, FR_EVENT_FD_WRITE, this->fd);
+			mb->writing = false;
+		}
+		if (mb->ev) fr_event_delete(el, &mb->ev);
+
+		TALLOC_FREE(mb->out);
+	}
+
+	if (this->status == RAD_LISTEN_STATUS_EOL) return;
+
+	this->status = RAD_LISTEN_STATUS_EOL;
+
+	/*
+	 *	This removes the socket from the event fd, so no one
+	 *	will be calling us any more.
+	 */
+	event_new_fd(this);
+}
+
+static void metrics_send_timeout(void *ctx)
+{
+	rad_listen_t *this = ctx;
+
+	DEBUG2("Timed out writing to metrics socket");
+	metrics_close_socket(this);
+}
+
+/*
+ *	Write as much of the response as the socket will take.
+ *
+ *	Returns 1 when the whole response has been written, 0 if
+ *	we're waiting for the socket to become writable, and -1 on
+ *	error.
+ */
+static int metrics_flush(rad_listen_t *this)
+{
+	ssize_t r;
+	listen_socket_t *sock = this->data;
+	fr_metrics_buffer_t *mb = (void *) sock->packet;
+
+	while (mb->out_sent < mb->out_len) {
+		r = write(this->fd, mb->out + mb->out_sent, mb->out_len - mb->out_sent);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+
+			DEBUG2("Failed writing to metrics socket: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		mb->out_sent += r;
+	}
+
+	return 1;
+}
+
+static void metrics_write_handler(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	rad_listen_t *this = ctx;
+
+	if (metrics_flush(this) == 0) return;
+
+	metrics_close_socket(this);
+}
+
+/*
+ *	Send a response, and close the socket once it's been written.
+ */
+static void metrics_reply(rad_listen_t *this, char const *status, char const *type,
+			  char const *body, bool head)
+{
+	listen_socket_t *sock = this->data;
+	fr_metrics_buffer_t *mb = (void *) sock->packet;
+	fr_event_list_t *el;
+	struct timeval when;
+	size_t len = body ? strlen(body) : 0;
+
+	mb->out = talloc_asprintf(mb,
+				  "HTTP/1.1 %s\r\n"
+				  "Content-Type: %s\r\n"
+				  "Content-Length: %zu\r\n"
+				  "Connection: close\r\n"
+				  "\r\n", status, type, len);
+	if (mb->out && body && !head) mb->out = talloc_asprintf_append_buffer(mb->out, "%s", body);
+	if (!mb->out) goto close_socket;
+
+	mb->out_len = talloc_array_length(mb->out) - 1;
+	mb->out_sent = 0;
+
+	switch (metrics_flush(this)) {
+	case 0:
+		break;
+
+	default:
+		goto close_socket;
+	}
+
+	/*
+	 *	The client isn't reading fast enough.  Write the rest
+	 *	when the socket drains, but not forever.
+	 */
+	el = radius_event_list_corral(EVENT_CORRAL_MAIN);
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += METRICS_SEND_TIMEOUT;
+
+	if (!fr_event_insert(el, metrics_send_timeout, this, &when, &mb->ev) ||
+	    !fr_event_fd_insert(el, FR_EVENT_FD_WRITE, this->fd, metrics_write_handler, this)) {
+		ERROR("Failed waiting for metrics socket: %s", fr_strerror());
+		goto close_socket;
+	}
+	mb->writing = true;
+
+	return;
+
+close_socket:
+	metrics_close_socket(this);
+}
+
+/*
+ *	Read an HTTP request, and send the metrics.
+ */
+static int metrics_tcp_recv(rad_listen_t *this)
+{
+	ssize_t r;
+	bool head = false;
+	char *p, *body;
+	listen_socket_t *sock = this->data;
+	fr_metrics_buffer_t *mb = (void *) sock->packet;
+
+	if (!mb) {
+		mb = talloc_zero(sock, fr_metrics_buffer_t);
+		if (!mb) goto close_socket;
+		sock->packet = (void *) mb;
+
+		/*
+		 *	Don't let a slow client hold up the main thread.
+		 */
+		if (fr_nonblock(this->fd) < 0) {
+			ERROR("Failed setting metrics socket non-blocking: %s", fr_syserror(errno));
+			goto close_socket;
+		}
+	}
+
+	/*
+	 *	We've already answered.  Anything else the client
+	 *	sends is ignored, but we notice when it goes away.
+	 */
+	if (mb->out) {
+		char discard[256];
+
+		r = read(this->fd, discard, sizeof(discard));
+		if (r == 0) goto close_socket;
+		if ((r < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) goto close_socket;
+
+		return 0;
+	}
+
+	r = read(this->fd, mb->buffer + mb->offset, sizeof(mb->buffer) - mb->offset - 1);
+	if (r == 0) goto close_socket;
+
+	if (r < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+#ifdef ECONNRESET
+		if (errno == ECONNRESET) goto close_socket;
+#endif
+		ERROR("Failed reading from metrics socket: %s", fr_syserror(errno));
+		goto close_socket;
+	}
+
+	mb->offset += r;
+	mb->buffer[mb->offset] = '\0';
+
+	/*
+	 *	Wait for the end of the headers.  We don't care about
+	 *	any of them.
+	 */
+	if (!strstr(mb->buffer, "\r\n\r\n") && !strstr(mb->buffer, "\n\n")) {
+		if (mb->offset < (sizeof(mb->buffer) - 1)) return 0;
+
+		metrics_reply(this, "431 Request Header Fields Too Large", "text/plain", NULL, false);
+		return 0;
+	}
+
+	if (strncmp(mb->buffer, "GET ", 4) == 0) {
+		p = mb->buffer + 4;
+	} else if (strncmp(mb->buffer, "HEAD ", 5) == 0) {
+		p = mb->buffer + 5;
+		head = true;
+	} else {
+		metrics_reply(this, "405 Method Not Allowed", "text/plain", NULL, false);
+		return 0;
+	}
+
+	if ((strncmp(p, "/metrics", 8) != 0 || ((p[8] != ' ') && (p[8] != '?'))) &&
+	    (strncmp(p, "/ ", 2) != 0)) {
+		metrics_reply(this, "404 Not Found", "text/plain", NULL, false);
+		return 0;
+	}
+
+	body = metrics_render(this);
+	if (!body) {
+		metrics_reply(this, "500 Internal Server Error", "text/plain", NULL, false);
+		return 0;
+	}
+
+	metrics_reply(this, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8",
+		      body, head);
+	talloc_free(body);
+	return 0;
+
+close_socket:
+	metrics_close_socket(this);
+	return 0;
+}
+
+/*
+ *	Should never be called.  The functions should just call write().
+ */
+static int metrics_tcp_send(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
+{
+	int rcode;
+	listen_socket_t *sock;
+
+	rcode = common_socket_parse(cs, this);
+	if (rcode < 0) return -1;
+
+#ifdef WITH_TLS
+	if (this->tls) {
+		cf_log_err_cs(cs,
+			   "TLS is not supported for metrics sockets");
+		return -1;
+	}
+#endif
+
+	sock = this->data;
+	if (sock->proto != IPPROTO_TCP) {
+		cf_log_err_cs(cs,
+			   "Metrics sockets require \"proto = tcp\"");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int metrics_socket_encode(UNUSED rad_listen_t *listener,
+				 UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+
+static int metrics_socket_decode(UNUSED rad_listen_t *listener,
+				 UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+#endif /* WITH_METRICS */
@@ -82,6 +82,9 @@ typedef struct {
 typedef struct {
 	modcallable mc;
 	module_instance_t *modinst;
+#ifdef WITH_STATS
+	int latency_slot;	/* for fr_latency_record() */
+#endif
 } modsingle;
 
 typedef struct {
@@ -285,6 +288,9 @@ static rlm_rcode_t call_modsingle(rlm_components_t component, modsingle *sp, REQ
 {
 	rlm_rcode_t myresult;
 	int blocked;
+#ifdef WITH_STATS
+	uint64_t start;
+#endif
 
 	rad_assert(request != NULL);
 
@@ -303,6 +309,13 @@ static rlm_rcode_t call_modsingle(rlm_components_t component, modsingle *sp, REQ
 		goto fail;
 	}
 
+#ifdef WITH_STATS
+	/*
+	 *	Time spent waiting for the module mutex counts, too.
+	 */
+	start = fr_latency_now();
+#endif
+
 	safe_lock(sp->modinst);
 
 	/*
@@ -316,6 +329,10 @@ static rlm_rcode_t call_modsingle(rlm_components_t component, modsingle *sp, REQ
 	request->module = "";
 	safe_unlock(sp->modinst);
 
+#ifdef WITH_STATS
+	fr_latency_record(sp->latency_slot, fr_latency_now() - start);
+#endif
+
 	/*
 	 *	Wasn't blocked, and now is.  Complain!
 	 */
@@ -1098,6 +1115,10 @@ next_sibling:
 int modcall(rlm_components_t component, modcallable *c, REQUEST *request)
 {
 	modcall_stack_entry_t stack[MODCALL_STACK_MAX];
+#ifdef WITH_STATS
+	uint64_t start;
+	bool rcode;
+#endif
 
 	/*
 	 *	Set up the initial stack frame.
@@ -1110,9 +1131,17 @@ int modcall(rlm_components_t component, modcallable *c, REQUEST *request)
 	/*
 	 *	Call the main handler.
 	 */
+#ifdef WITH_STATS
+	start = fr_latency_now();
+	rcode = modcall_recurse(request, component, 0, &stack[0]);
+	fr_latency_record(component, fr_latency_now() - start);
+
+	if (!rcode) return RLM_MODULE_FAIL;
+#else
 	if (!modcall_recurse(request, component, 0, &stack[0])) {
 		return RLM_MODULE_FAIL;
 	}
+#endif
 
 	/*
 	 *	Return the result.
@@ -2399,6 +2428,9 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 	}
 
 	single->modinst = this;
+#ifdef WITH_STATS
+	single->latency_slot = fr_latency_register(this->name, component);
+#endif
 	*modname = this->entry->module->name;
 	return csingle;
 }
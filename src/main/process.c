@@ -1596,11 +1596,11 @@ static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
 	request->listener->stats.last_packet = request->packet->timestamp.tv_sec;
 	if (packet->code == PW_CODE_AUTHENTICATION_REQUEST) {
 		request->client->auth.last_packet = request->packet->timestamp.tv_sec;
-		radius_auth_stats.last_packet = request->packet->timestamp.tv_sec;
+		FR_STATS_LOCAL(auth).last_packet = request->packet->timestamp.tv_sec;
 #ifdef WITH_ACCOUNTING
 	} else if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
 		request->client->acct.last_packet = request->packet->timestamp.tv_sec;
-		radius_acct_stats.last_packet = request->packet->timestamp.tv_sec;
+		FR_STATS_LOCAL(acct).last_packet = request->packet->timestamp.tv_sec;
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -2187,10 +2187,10 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	request->proxy_listener->stats.last_packet = packet->timestamp.tv_sec;
 
 	if (request->proxy->code == PW_CODE_AUTHENTICATION_REQUEST) {
-		proxy_auth_stats.last_packet = packet->timestamp.tv_sec;
+		FR_STATS_LOCAL(proxy_auth).last_packet = packet->timestamp.tv_sec;
 #ifdef WITH_ACCOUNTING
 	} else if (request->proxy->code == PW_CODE_ACCOUNTING_REQUEST) {
-		proxy_acct_stats.last_packet = packet->timestamp.tv_sec;
+		FR_STATS_LOCAL(proxy_acct).last_packet = packet->timestamp.tv_sec;
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -3214,12 +3214,12 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 		FR_STATS_TYPE_INC(home->stats.total_timeouts);
 		if (home->type == HOME_TYPE_AUTH) {
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_auth_stats.total_timeouts);
+			FR_STATS_TYPE_INC(FR_STATS_LOCAL(proxy_auth).total_timeouts);
 		}
 #ifdef WITH_ACCT
 		else if (home->type == HOME_TYPE_ACCT) {
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_acct_stats.total_timeouts);
+			FR_STATS_TYPE_INC(FR_STATS_LOCAL(proxy_acct).total_timeouts);
 		}
 #endif
 
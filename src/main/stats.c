@@ -24,6 +24,8 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/threads.h>
 #include <freeradius-devel/rad_assert.h>
 
 #ifdef WITH_STATS
@@ -37,29 +39,47 @@ RCSID("$Id$")
 static struct timeval	start_time;
 static struct timeval	hup_time;
 
-#define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
-
-fr_stats_t radius_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t radius_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t radius_coa_stats = FR_STATS_INIT;
-fr_stats_t radius_dsc_stats = FR_STATS_INIT;
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
-#ifdef WITH_PROXY
-fr_stats_t proxy_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t proxy_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t proxy_coa_stats = FR_STATS_INIT;
-fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
-#endif
+/*
+ *	Big enough for any CPU we care about.
+ */
+#define STATS_CACHE_LINE (128)
+
+/*
+ *	One thread's copy of the server-wide counters.
+ *
+ *	The padding on either side means that no other allocation can
+ *	share a cache line with the counters, whatever alignment
+ *	malloc gives us.  "next" is only touched when threads start
+ *	and exit, or when the statistics are read.
+ */
+typedef struct stats_shard_t {
+	struct stats_shard_t	*next;
+	uint8_t			pad0[STATS_CACHE_LINE];
+	fr_stats_global_t	stats;
+	uint8_t			pad1[STATS_CACHE_LINE];
+} stats_shard_t;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
+static stats_shard_t	*stats_shards = NULL;
 
+/*
+ *	Totals from threads which have exited.  Also used by threads
+ *	which can't allocate their own shard, in which case the
+ *	counters may be slightly off.
+ */
+static stats_shard_t	stats_retired;
+
+fr_thread_local_setup(stats_shard_t *, stats_shard);	/* macro */
 
 static void tv_sub(struct timeval *end, struct timeval *start,
 		   struct timeval *elapsed)
@@ -110,8 +130,141 @@ static void stats_time(fr_stats_t *stats, struct timeval *start,
 	}
 }
 
+static void stats_add(fr_stats_t *out, fr_stats_t const *in)
+{
+	int i;
+
+	out->total_requests += in->total_requests;
+	out->total_invalid_requests += in->total_invalid_requests;
+	out->total_dup_requests += in->total_dup_requests;
+	out->total_responses += in->total_responses;
+	out->total_access_accepts += in->total_access_accepts;
+	out->total_access_rejects += in->total_access_rejects;
+	out->total_access_challenges += in->total_access_challenges;
+	out->total_malformed_requests += in->total_malformed_requests;
+	out->total_bad_authenticators += in->total_bad_authenticators;
+	out->total_packets_dropped += in->total_packets_dropped;
+	out->total_no_records += in->total_no_records;
+	out->total_unknown_types += in->total_unknown_types;
+	out->total_timeouts += in->total_timeouts;
+	if (in->last_packet > out->last_packet) out->last_packet = in->last_packet;
+
+	for (i = 0; i < 8; i++) {
+		out->elapsed[i] += in->elapsed[i];
+	}
+}
+
+/*
+ *	Merge a shard into the retired totals, and free it.
+ *
+ *	fr_stats_global_t is nothing but fr_stats_t's, so we can walk
+ *	it as an array.
+ */
+static void stats_shard_retire(stats_shard_t *shard)
+{
+	size_t i;
+	stats_shard_t **last;
+	fr_stats_t *in, *out;
+
+	if (!shard || (shard == &stats_retired)) return;
+
+	in = (fr_stats_t *) &shard->stats;
+	out = (fr_stats_t *) &stats_retired.stats;
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	for (last = &stats_shards; *last; last = &(*last)->next) {
+		if (*last == shard) {
+			*last = shard->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < (sizeof(fr_stats_global_t) / sizeof(fr_stats_t)); i++) {
+		stats_add(&out[i], &in[i]);
+	}
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	talloc_free(shard);
+}
+
+static void _stats_shard_free(void *arg)
+{
+	stats_shard_retire(arg);
+}
+
+/** Get the current thread's copy of the server-wide counters
+ *
+ * Never returns NULL.
+ */
+fr_stats_global_t *radius_stats_local(void)
+{
+	stats_shard_t *shard;
+
+	shard = fr_thread_local_init(stats_shard, _stats_shard_free);
+	if (shard) return &shard->stats;
+
+	shard = talloc_zero(NULL, stats_shard_t);
+	if (!shard) return &stats_retired.stats;
+
+	if (fr_thread_local_set(stats_shard, shard) != 0) {
+		talloc_free(shard);
+		return &stats_retired.stats;
+	}
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	shard->next = stats_shards;
+	stats_shards = shard;
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+
+	return &shard->stats;
+}
+
+/** Merge the current thread's counters into the totals
+ *
+ * Called by threads before they exit, so that their counters
+ * aren't lost.
+ */
+void radius_stats_thread_exit(void)
+{
+	stats_shard_t *shard;
+
+	shard = fr_thread_local_init(stats_shard, _stats_shard_free);
+	if (!shard) return;
+
+	(void) fr_thread_local_set(stats_shard, NULL);
+	stats_shard_retire(shard);
+}
+
+/** Sum one set of server-wide counters over all threads
+ *
+ * The owning threads may be updating their counters while we read
+ * them, which is fine.  We want a close approximation, not a
+ * perfect snapshot.
+ *
+ * @param[out] out where to write the totals.
+ * @param offset of the counters in fr_stats_global_t, see FR_STATS_GLOBAL().
+ */
+void radius_stats_global(fr_stats_t *out, size_t offset)
+{
+	stats_shard_t *shard;
+
+	rad_assert(offset <= (sizeof(fr_stats_global_t) - sizeof(fr_stats_t)));
+
+	memset(out, 0, sizeof(*out));
+
+	PTHREAD_MUTEX_LOCK(&stats_mutex);
+	stats_add(out, (fr_stats_t *) (((uint8_t *) &stats_retired.stats) + offset));
+
+	for (shard = stats_shards; shard; shard = shard->next) {
+		stats_add(out, (fr_stats_t *) (((uint8_t *) &shard->stats) + offset));
+	}
+	PTHREAD_MUTEX_UNLOCK(&stats_mutex);
+}
+
 void request_stats_final(REQUEST *request)
 {
+	fr_stats_global_t *local;
+
 	if (request->master_state == REQUEST_COUNTED) return;
 
 	if (!request->listener) return;
@@ -130,27 +283,29 @@ void request_stats_final(REQUEST *request)
 	if (request->packet->code == PW_CODE_STATUS_SERVER)
 		return;
 
+	local = radius_stats_local();
+
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) local->auth._x++;request->listener->stats._x++;request->client->auth._x++;
 
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) local->acct._x++;request->listener->stats._x++;request->client->acct._x++
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) local->coa._x++;request->listener->stats._x++;request->client->coa._x++
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) local->dsc._x++;request->listener->stats._x++;request->client->dsc._x++
 #else
 #define INC_DSC(_x)
 #endif
@@ -173,7 +328,7 @@ void request_stats_final(REQUEST *request)
 		/*
 		 *	FIXME: Do the time calculations once...
 		 */
-		stats_time(&radius_auth_stats,
+		stats_time(&local->auth,
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		stats_time(&request->client->auth,
@@ -195,7 +350,7 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
 		INC_ACCT(total_responses);
-		stats_time(&radius_acct_stats,
+		stats_time(&local->acct,
 			   &request->packet->timestamp,
 			   &request->reply->timestamp);
 		stats_time(&request->client->acct,
@@ -261,14 +416,14 @@ void request_stats_final(REQUEST *request)
 
 	switch (request->proxy->code) {
 	case PW_CODE_AUTHENTICATION_REQUEST:
-		proxy_auth_stats.total_requests += request->num_proxied_requests;
+		local->proxy_auth.total_requests += request->num_proxied_requests;
 		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
 		request->home_server->stats.total_requests += request->num_proxied_requests;
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.total_requests++;
+		local->proxy_acct.total_requests++;
 		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
 		request->home_server->stats.total_requests += request->num_proxied_requests;
 		break;
@@ -281,19 +436,22 @@ void request_stats_final(REQUEST *request)
 	if (!request->proxy_reply) goto done;	/* simplifies formatting */
 
 #undef INC
-#define INC(_x) proxy_auth_stats._x += request->num_proxied_responses; request->proxy_listener->stats._x += request->num_proxied_responses; request->home_server->stats._x += request->num_proxied_responses;
+#define INC(_x) local->proxy_auth._x += request->num_proxied_responses; request->proxy_listener->stats._x += request->num_proxied_responses; request->home_server->stats._x += request->num_proxied_responses;
 
 	switch (request->proxy_reply->code) {
 	case PW_CODE_AUTHENTICATION_ACK:
 		INC(total_access_accepts);
 	proxy_stats:
 		INC(total_responses);
-		stats_time(&proxy_auth_stats,
+		stats_time(&local->proxy_auth,
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
 		stats_time(&request->home_server->stats,
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
+		radius_stats_ema(&request->home_server->ema,
+				 &request->proxy->timestamp,
+				 &request->proxy_reply->timestamp);
 		break;
 
 	case PW_CODE_AUTHENTICATION_REJECT:
@@ -306,20 +464,23 @@ void request_stats_final(REQUEST *request)
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
-		proxy_acct_stats.total_responses++;
+		local->proxy_acct.total_responses++;
 		request->proxy_listener->stats.total_responses++;
 		request->home_server->stats.total_responses++;
-		stats_time(&proxy_acct_stats,
+		stats_time(&local->proxy_acct,
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
 		stats_time(&request->home_server->stats,
 			   &request->proxy->timestamp,
 			   &request->proxy_reply->timestamp);
+		radius_stats_ema(&request->home_server->ema,
+				 &request->proxy->timestamp,
+				 &request->proxy_reply->timestamp);
 		break;
 #endif
 
 	default:
-		proxy_auth_stats.total_unknown_types++;
+		local->proxy_auth.total_unknown_types++;
 		request->proxy_listener->stats.total_unknown_types++;
 		request->home_server->stats.total_unknown_types++;
 		break;
@@ -451,6 +612,7 @@ static void request_stats_addvp(REQUEST *request,
 void request_stats_reply(REQUEST *request)
 {
 	VALUE_PAIR *flag, *vp;
+	fr_stats_t stats;
 
 	/*
 	 *	Statistics are available ONLY on a "status" port.
@@ -466,7 +628,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x01) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, authvp, &radius_auth_stats);
+		FR_STATS_GLOBAL(&stats, auth);
+		request_stats_addvp(request, authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -475,7 +638,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x02) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, acctvp, &radius_acct_stats);
+		FR_STATS_GLOBAL(&stats, acct);
+		request_stats_addvp(request, acctvp, &stats);
 	}
 #endif
 
@@ -485,7 +649,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x04) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_authvp, &proxy_auth_stats);
+		FR_STATS_GLOBAL(&stats, proxy_auth);
+		request_stats_addvp(request, proxy_authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -494,7 +659,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x08) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_acctvp, &proxy_acct_stats);
+		FR_STATS_GLOBAL(&stats, proxy_acct);
+		request_stats_addvp(request, proxy_acctvp, &stats);
 	}
 #endif
 #endif
@@ -513,7 +679,7 @@ void request_stats_reply(REQUEST *request)
 #ifdef HAVE_PTHREAD_H
 		int i, array[RAD_LISTEN_MAX], pps[2];
 
-		thread_pool_queue_stats(array, pps);
+		thread_pool_queue_stats(array, pps, NULL);
 
 		for (i = 0; i <= 4; i++) {
 			vp = radius_paircreate(request->reply, &request->reply->vps,
@@ -533,6 +699,71 @@ void request_stats_reply(REQUEST *request)
 #endif
 	}
 
+	/*
+	 *	Latency of a particular module, or of the processing
+	 *	sections when no module name is given.  One set of
+	 *	attributes is returned for each section which has
+	 *	seen traffic.
+	 */
+	if ((flag->vp_integer & 0x100) != 0) {
+		int i, comp = -1;
+		char const *module = NULL;
+		VALUE_PAIR *name, *section;
+		fr_latency_stats_t latency;
+
+		name = pairfind(request->packet->vps, 186, VENDORPEC_FREERADIUS, TAG_ANY);
+		if (name) {
+			module = name->vp_strvalue;
+			pairadd(&request->reply->vps,
+				paircopyvp(request->reply, name));
+		}
+
+		section = pairfind(request->packet->vps, 187, VENDORPEC_FREERADIUS, TAG_ANY);
+		if (section) {
+			for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+				if (strcmp(section->vp_strvalue, section_type_value[i].section) == 0) {
+					comp = i;
+					break;
+				}
+			}
+		}
+
+		/*
+		 *	An unknown section gets no latency attributes,
+		 *	but doesn't stop the rest of the reply.
+		 */
+		for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+			if (section && (i != comp)) continue;
+
+			if (fr_latency_stats(&latency, module, i) <= 0) continue;
+			if (!latency.count) continue;
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       187, VENDORPEC_FREERADIUS);
+			if (vp) pairstrcpy(vp, section_type_value[i].section);
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       188, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_integer = latency.count;
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       189, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_integer = latency.p50;
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       190, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_integer = latency.p90;
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       191, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_integer = latency.p99;
+
+			vp = radius_paircreate(request->reply, &request->reply->vps,
+					       192, VENDORPEC_FREERADIUS);
+			if (vp) vp->vp_integer = latency.p999;
+		}
+	}
+
 	/*
 	 *	For a particular client.
 	 */
@@ -810,7 +1041,10 @@ void radius_stats_ema(fr_stats_ema_t *ema,
 #endif
 	if (ema->window == 0) return;
 
-	rad_assert(start->tv_sec <= end->tv_sec);
+	/*
+	 *	The clock went backwards.
+	 */
+	if (start->tv_sec > end->tv_sec) return;
 
 	/*
 	 *	Initialize it.
@@ -823,14 +1057,14 @@ void radius_stats_ema(fr_stats_ema_t *ema,
 	}
 
 
-	tdiff = start->tv_sec;
-	tdiff -= end->tv_sec;
+	tdiff = end->tv_sec;
+	tdiff -= start->tv_sec;
 
 	micro = (int) tdiff;
-	if (micro > 40) micro = 40; /* don't overflow 32-bit ints */
+	if (micro > 20) micro = 20; /* don't overflow 32-bit ints */
 	micro *= USEC;
-	micro += start->tv_usec;
-	micro -= end->tv_usec;
+	micro += end->tv_usec;
+	micro -= start->tv_usec;
 
 	micro *= EMA_SCALE;
 
@@ -57,6 +57,29 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+/*
+ *	We call set_mempolicy() directly, so that we don't need to
+ *	link against libnuma.
+ */
+#ifdef HAVE_NUMAIF_H
+#include <numaif.h>
+#include <sys/syscall.h>
+#  if defined(SYS_set_mempolicy) && defined(MPOL_INTERLEAVE)
+#    define WITH_NUMA
+#    ifndef MPOL_LOCAL
+#      define MPOL_LOCAL MPOL_DEFAULT
+#    endif
+#  endif
+#endif
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SETSIZE)
+#  define WITH_CPU_AFFINITY
+#endif
+
 #ifdef HAVE_PTHREAD_H
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -79,6 +102,12 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #define NUM_FIFOS	       RAD_LISTEN_MAX
 
+#define USEC			(1000000)
+
+#define THREAD_NUMA_NONE	(0)
+#define THREAD_NUMA_LOCAL	(1)
+#define THREAD_NUMA_INTERLEAVE	(2)
+
 /*
  *  A data structure which contains the information about
  *  the current thread.
@@ -89,6 +118,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
  *  status	is the thread running or exited?
  *  request_count the number of requests that this thread has handled
  *  timestamp     when the thread started executing.
+ *  busy_usec     wall clock time spent processing requests (written by the thread)
+ *  cpu_usec      CPU time spent processing requests (written by the thread)
+ *  busy_sampled  value of busy_usec at the last auto-scaling sample
+ *  cpu_sampled   value of cpu_usec at the last auto-scaling sample
  */
 typedef struct THREAD_HANDLE {
 	struct THREAD_HANDLE *prev;
@@ -99,6 +132,10 @@ typedef struct THREAD_HANDLE {
 	unsigned int	 request_count;
 	time_t	       timestamp;
 	REQUEST		     *request;
+	uint64_t	busy_usec;
+	uint64_t	cpu_usec;
+	uint64_t	busy_sampled;
+	uint64_t	cpu_sampled;
 } THREAD_HANDLE;
 
 #endif	/* WITH_GCD */
@@ -176,6 +213,43 @@ typedef struct THREAD_POOL {
 	int		max_queue_size;
 	int		num_queued;
 	fr_fifo_t	*fifo[NUM_FIFOS];
+
+	/*
+	 *	Latency driven auto-scaling.  The configuration is
+	 *	read from the "auto_scale" subsection.
+	 */
+	bool		auto_scale;
+	uint32_t	target_queue_wait;	/* milliseconds */
+	uint32_t	scale_interval;		/* milliseconds */
+	uint32_t	max_spawn;		/* threads per interval */
+	uint32_t	hysteresis;		/* percent of target_queue_wait */
+	uint32_t	max_memory;		/* megabytes, 0 is unlimited */
+	size_t		thread_memory;		/* estimated bytes per thread */
+
+	struct timeval	last_scaled;
+	time_t		time_last_busy;		/* last time we needed every thread */
+
+	uint64_t	queue_wait_total;	/* protected by queue_mutex */
+	uint32_t	queue_wait_count;	/* protected by queue_mutex */
+
+	uint32_t	queue_wait;		/* smoothed, microseconds */
+	uint32_t	busy_ratio;		/* percent */
+	uint32_t	blocked_ratio;		/* percent */
+	uint32_t	total_spawned;
+	uint32_t	total_retired;
+	int		num_cpus;
+	thread_pool_action_t last_action;
+
+	/*
+	 *	CPU and memory placement.
+	 */
+	char const	*cpu_set;
+	char const	*numa_name;
+	int		numa;
+#ifdef WITH_CPU_AFFINITY
+	int		cpu_count;
+	int		cpu_list[CPU_SETSIZE];
+#endif
 #endif	/* WITH_GCD */
 } THREAD_POOL;
 
@@ -186,9 +260,57 @@ static bool pool_initialized = false;
 static time_t last_cleaned = 0;
 
 static void thread_pool_manage(time_t now);
+
+/*
+ *	Microseconds between two timestamps, or zero if "end" is
+ *	before "start".
+ */
+static uint64_t tv_diff_usec(struct timeval const *end, struct timeval const *start)
+{
+	int64_t usec;
+
+	usec = (int64_t) (end->tv_sec - start->tv_sec) * USEC;
+	usec += end->tv_usec - start->tv_usec;
+
+	if (usec < 0) return 0;
+
+	return usec;
+}
+
+/*
+ *	CPU time consumed by the calling thread, in microseconds.
+ *
+ *	Where the OS can't tell us, we return zero, and all of the
+ *	time spent processing requests is counted as "blocked".
+ */
+static uint64_t thread_cpu_usec(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return ((uint64_t) ts.tv_sec * USEC) + (ts.tv_nsec / 1000);
+	}
+#endif
+
+	return 0;
+}
 #endif
 
 #ifndef WITH_GCD
+/*
+ *	Latency driven auto-scaling of the pool.
+ */
+static const CONF_PARSER auto_scale_config[] = {
+	{ "enable",		     PW_TYPE_BOOLEAN, 0, &thread_pool.auto_scale,	  "no" },
+	{ "target_queue_wait",	     PW_TYPE_INTEGER, 0, &thread_pool.target_queue_wait, "10" },
+	{ "interval",		     PW_TYPE_INTEGER, 0, &thread_pool.scale_interval,	  "100" },
+	{ "max_spawn",		     PW_TYPE_INTEGER, 0, &thread_pool.max_spawn,	  "4" },
+	{ "hysteresis",		     PW_TYPE_INTEGER, 0, &thread_pool.hysteresis,	  "50" },
+	{ "max_memory",		     PW_TYPE_INTEGER, 0, &thread_pool.max_memory,	  "0" },
+	{ NULL, -1, 0, NULL, NULL }
+};
+
 /*
  *	A mapping of configuration file names to internal integers
  */
@@ -205,8 +327,138 @@ static const CONF_PARSER thread_config[] = {
 	{ "auto_limit_acct",	     PW_TYPE_BOOLEAN, 0, &thread_pool.auto_limit_acct, NULL },
 #endif
 #endif
+	{ "auto_scale",		     PW_TYPE_SUBSECTION, 0, NULL, (void const *) auto_scale_config },
+	{ "cpu_set",		     PW_TYPE_STRING_PTR, 0, &thread_pool.cpu_set,	  NULL },
+	{ "numa",		     PW_TYPE_STRING_PTR, 0, &thread_pool.numa_name,	  NULL },
 	{ NULL, -1, 0, NULL, NULL }
 };
+
+static const FR_NAME_NUMBER thread_numa_names[] = {
+	{ "none",	THREAD_NUMA_NONE },
+	{ "local",	THREAD_NUMA_LOCAL },
+	{ "interleave",	THREAD_NUMA_INTERLEAVE },
+	{ NULL, 0 }
+};
+
+static const FR_NAME_NUMBER thread_pool_actions[] = {
+	{ "hold",	THREAD_POOL_HOLD },
+	{ "spawn",	THREAD_POOL_SPAWN },
+	{ "retire",	THREAD_POOL_RETIRE },
+	{ "cpu-bound",	THREAD_POOL_CPU_BOUND },
+	{ "memory-limit", THREAD_POOL_MEMORY_LIMIT },
+	{ NULL, 0 }
+};
+
+#ifdef WITH_CPU_AFFINITY
+/*
+ *	Parse a list of CPUs, e.g. "0-3,8,10-11", into the pool.
+ */
+static int cpu_set_parse(char const *str)
+{
+	char const *p = str;
+	char *q;
+	unsigned long first, last, i;
+	cpu_set_t seen;
+
+	CPU_ZERO(&seen);
+	thread_pool.cpu_count = 0;
+
+	while (*p) {
+		first = strtoul(p, &q, 10);
+		if (q == p) goto invalid;
+		last = first;
+
+		if (*q == '-') {
+			p = q + 1;
+			last = strtoul(p, &q, 10);
+			if ((q == p) || (last < first)) goto invalid;
+		}
+
+		if (last >= CPU_SETSIZE) {
+			ERROR("FATAL: cpu_set \"%s\" contains CPU %lu, the maximum is %d",
+			      str, last, CPU_SETSIZE - 1);
+			return -1;
+		}
+
+		for (i = first; i <= last; i++) {
+			if (CPU_ISSET(i, &seen)) continue;
+			CPU_SET(i, &seen);
+			thread_pool.cpu_list[thread_pool.cpu_count++] = i;
+		}
+
+		if (*q == ',') {
+			q++;
+		} else if (*q) {
+			goto invalid;
+		}
+		p = q;
+	}
+
+	if (thread_pool.cpu_count == 0) {
+	invalid:
+		ERROR("FATAL: Invalid cpu_set \"%s\", expected a list such as \"0-3,8\"", str);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ *	Pin the calling thread to a CPU from cpu_set, and set the
+ *	NUMA memory policy for its allocations.
+ *
+ *	Slot 0 is the main (event loop) thread, and worker threads
+ *	use their thread number, so the event loop gets the first CPU
+ *	in the set, and the workers are spread round-robin over it.
+ *
+ *	Worker threads always allocate from their local node.  Once
+ *	pinned, that means the malloc arena for the thread, and
+ *	everything it allocates while processing a request, lives
+ *	next to the CPU which uses it.  With "interleave" only the main
+ *	thread (which allocates the configuration, and the requests
+ *	that are passed between threads) spreads its pages over all
+ *	of the nodes.
+ */
+static void thread_bind(int slot)
+{
+#ifdef WITH_CPU_AFFINITY
+	if (thread_pool.cpu_count > 0) {
+		int rcode, cpu;
+		cpu_set_t set;
+
+		cpu = thread_pool.cpu_list[slot % thread_pool.cpu_count];
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		rcode = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (rcode != 0) {
+			ERROR("Failed binding thread %d to CPU %d: %s", slot, cpu, fr_syserror(rcode));
+		} else {
+			DEBUG2("Thread %d bound to CPU %d", slot, cpu);
+		}
+	}
+#endif
+
+#ifdef WITH_NUMA
+	if (thread_pool.numa != THREAD_NUMA_NONE) {
+		long rcode;
+
+		if ((slot == 0) && (thread_pool.numa == THREAD_NUMA_INTERLEAVE)) {
+			unsigned long mask = ~0UL;
+
+			rcode = syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &mask, sizeof(mask) * 8);
+		} else {
+			rcode = syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+		}
+
+		if (rcode < 0) {
+			ERROR("Failed setting NUMA policy for thread %d: %s", slot, fr_syserror(errno));
+		}
+	}
+#endif
+}
 #endif
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -314,12 +566,29 @@ static void reap_children(void)
  */
 int request_enqueue(REQUEST *request)
 {
+	bool manage = false;
+
+	/*
+	 *	The auto-scaling controller needs to know how long
+	 *	the request sat in the queue, and runs more often
+	 *	than once a second.
+	 */
+	if (thread_pool.auto_scale) {
+		gettimeofday(&request->queued, NULL);
+
+		if (tv_diff_usec(&request->queued, &thread_pool.last_scaled) >=
+		    ((uint64_t) thread_pool.scale_interval * 1000)) {
+			manage = true;
+		}
+	}
+
 	/*
 	 *	If we haven't checked the number of child threads
 	 *	in a while, OR if the thread pool appears to be full,
 	 *	go manage it.
 	 */
-	if ((last_cleaned < request->timestamp) ||
+	if (manage ||
+	    (last_cleaned < request->timestamp) ||
 	    (thread_pool.active_threads == thread_pool.total_threads) ||
 	    (thread_pool.exited_threads > 0)) {
 		thread_pool_manage(request->timestamp);
@@ -570,6 +839,18 @@ static int request_dequeue(REQUEST **prequest)
 		goto retry;
 	}
 
+	/*
+	 *	Record how long the request waited, for the
+	 *	auto-scaling controller.
+	 */
+	if (thread_pool.auto_scale) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		thread_pool.queue_wait_total += tv_diff_usec(&now, &request->queued);
+		thread_pool.queue_wait_count++;
+	}
+
 	/*
 	 *	The thread is currently processing a request.
 	 */
@@ -609,6 +890,10 @@ static int request_dequeue(REQUEST **prequest)
 static void *request_handler_thread(void *arg)
 {
 	THREAD_HANDLE	  *self = (THREAD_HANDLE *) arg;
+	struct timeval	  start, end;
+	uint64_t	  cpu_start = 0;
+
+	thread_bind(self->thread_num);
 
 	/*
 	 *	Loop forever, until told to exit.
@@ -689,9 +974,25 @@ static void *request_handler_thread(void *arg)
 		}
 #endif
 
+		/*
+		 *	Sample wall clock and CPU time, so that the
+		 *	auto-scaling controller can tell threads
+		 *	which are busy from threads which are blocked.
+		 */
+		if (thread_pool.auto_scale) {
+			gettimeofday(&start, NULL);
+			cpu_start = thread_cpu_usec();
+		}
+
 		self->request->process(self->request, FR_ACTION_RUN);
 		self->request = NULL;
 
+		if (thread_pool.auto_scale) {
+			gettimeofday(&end, NULL);
+			self->busy_usec += tv_diff_usec(&end, &start);
+			self->cpu_usec += thread_cpu_usec() - cpu_start;
+		}
+
 		/*
 		 *	Update the active threads.
 		 */
@@ -723,6 +1024,15 @@ static void *request_handler_thread(void *arg)
 	ERR_remove_state(0);
 #endif
 
+#ifdef WITH_STATS
+	/*
+	 *	Don't lose the counters or module timings for this
+	 *	thread.
+	 */
+	radius_stats_thread_exit();
+	fr_latency_thread_exit();
+#endif
+
 	pthread_mutex_lock(&thread_pool.queue_mutex);
 	thread_pool.exited_threads++;
 	pthread_mutex_unlock(&thread_pool.queue_mutex);
@@ -802,6 +1112,18 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 		return NULL;
 	}
 
+	/*
+	 *	Or more threads than we have memory for.
+	 */
+	if (thread_pool.max_memory &&
+	    ((thread_pool.total_threads + 1) * (uint64_t) thread_pool.thread_memory) >
+	    ((uint64_t) thread_pool.max_memory << 20)) {
+		DEBUG2("Thread spawn failed.  Memory budget (%u MB) would be exceeded.", thread_pool.max_memory);
+		thread_pool.last_action = THREAD_POOL_MEMORY_LIMIT;
+		exec_trigger(NULL, NULL, "server.thread.max_threads", true);
+		return NULL;
+	}
+
 	/*
 	 *	Allocate a new thread handle.
 	 */
@@ -969,6 +1291,67 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 		      thread_pool.start_threads, thread_pool.max_threads);
 		return -1;
 	}
+
+	/*
+	 *	The memory budget is counted in thread stacks, which
+	 *	are by far the largest per-thread allocation.
+	 */
+	{
+		pthread_attr_t attr;
+
+		thread_pool.thread_memory = 0;
+		if (pthread_attr_init(&attr) == 0) {
+			(void) pthread_attr_getstacksize(&attr, &thread_pool.thread_memory);
+			pthread_attr_destroy(&attr);
+		}
+		if (!thread_pool.thread_memory) thread_pool.thread_memory = 8 << 20;
+	}
+
+	if (thread_pool.max_memory &&
+	    ((thread_pool.start_threads * (uint64_t) thread_pool.thread_memory) >
+	     ((uint64_t) thread_pool.max_memory << 20))) {
+		ERROR("FATAL: start_servers (%i) need more than max_memory (%u MB)",
+		      thread_pool.start_threads, thread_pool.max_memory);
+		return -1;
+	}
+
+	if (thread_pool.auto_scale) {
+		if (thread_pool.target_queue_wait < 1) thread_pool.target_queue_wait = 1;
+		if (thread_pool.scale_interval < 10) thread_pool.scale_interval = 10;
+		if (thread_pool.scale_interval > 1000) thread_pool.scale_interval = 1000;
+		if (thread_pool.max_spawn < 1) thread_pool.max_spawn = 1;
+		if (thread_pool.hysteresis > 100) thread_pool.hysteresis = 100;
+
+#ifdef _SC_NPROCESSORS_ONLN
+		thread_pool.num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (thread_pool.num_cpus < 1) thread_pool.num_cpus = 1;
+
+		gettimeofday(&thread_pool.last_scaled, NULL);
+	}
+
+	if (thread_pool.cpu_set) {
+#ifdef WITH_CPU_AFFINITY
+		if (cpu_set_parse(thread_pool.cpu_set) < 0) return -1;
+#else
+		WARN("Ignoring \"cpu_set\", this system does not support binding threads to CPUs");
+#endif
+	}
+
+	if (thread_pool.numa_name) {
+		thread_pool.numa = fr_str2int(thread_numa_names, thread_pool.numa_name, -1);
+		if (thread_pool.numa < 0) {
+			ERROR("FATAL: Invalid value \"%s\" for numa, expected \"local\" or \"interleave\"",
+			      thread_pool.numa_name);
+			return -1;
+		}
+#ifndef WITH_NUMA
+		if (thread_pool.numa != THREAD_NUMA_NONE) {
+			WARN("Ignoring \"numa\", this system does not support NUMA memory policies");
+			thread_pool.numa = THREAD_NUMA_NONE;
+		}
+#endif
+	}
 #endif	/* WITH_GCD */
 
 	/*
@@ -980,6 +1363,13 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 	}
 
 #ifndef WITH_GCD
+	/*
+	 *	This is the thread which runs the event loop.  The
+	 *	workers inherit its memory policy, and then replace it
+	 *	with their own.
+	 */
+	thread_bind(0);
+
 	/*
 	 *	Initialize the queue of requests.
 	 */
@@ -1102,6 +1492,173 @@ int request_enqueue(REQUEST *request)
 #endif
 
 #ifndef WITH_GCD
+/*
+ *	Tell the first idle thread we come across to exit.
+ *
+ *	It will eventually wake up, and realize it's been told to
+ *	commit suicide.
+ */
+static bool thread_pool_retire(void)
+{
+	THREAD_HANDLE *handle;
+
+	for (handle = thread_pool.head; handle != NULL; handle = handle->next) {
+		if ((handle->request == NULL) &&
+		    (handle->status == THREAD_RUNNING)) {
+			handle->status = THREAD_CANCELLED;
+			/*
+			 *	Post an extra semaphore, as a
+			 *	signal to wake up, and exit.
+			 */
+			sem_post(&thread_pool.semaphore);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *	Latency driven auto-scaling.
+ *
+ *	Rather than counting spare threads once a second, look at how
+ *	long requests wait in the queue, and at what the threads do
+ *	while processing them.
+ *
+ *	If requests wait longer than target_queue_wait, spawn threads
+ *	in proportion to the overshoot, up to max_spawn per interval.
+ *	If the threads are burning CPU rather than waiting on I/O, and
+ *	there are already as many busy threads as CPUs, more threads
+ *	won't help, so we don't spawn any.
+ *
+ *	Threads are retired one per interval, and only once the
+ *	smoothed queue wait has stayed below the low water mark
+ *	(target_queue_wait less hysteresis percent) for cleanup_delay
+ *	seconds.
+ */
+static void thread_pool_auto_scale(time_t now)
+{
+	struct timeval	when;
+	uint64_t	elapsed, busy, cpu, wait_total;
+	uint32_t	wait_count, wait, target, low_water;
+	int		i, spawn, num_queued;
+	THREAD_HANDLE	*handle;
+
+	gettimeofday(&when, NULL);
+	elapsed = tv_diff_usec(&when, &thread_pool.last_scaled);
+	if (elapsed < ((uint64_t) thread_pool.scale_interval * 1000)) return;
+	thread_pool.last_scaled = when;
+
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+	wait_total = thread_pool.queue_wait_total;
+	wait_count = thread_pool.queue_wait_count;
+	num_queued = thread_pool.num_queued;
+	thread_pool.queue_wait_total = 0;
+	thread_pool.queue_wait_count = 0;
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+	/*
+	 *	If nothing left the queue, but there are requests in
+	 *	it, they've been waiting for at least the interval.
+	 */
+	if (wait_count > 0) {
+		wait = wait_total / wait_count;
+	} else if (num_queued > 0) {
+		wait = elapsed;
+	} else {
+		wait = 0;
+	}
+
+	/*
+	 *	Spawning reacts to the instantaneous wait, retiring
+	 *	to the smoothed one.
+	 */
+	thread_pool.queue_wait = ((thread_pool.queue_wait * 3) + wait) / 4;
+
+	/*
+	 *	Sample the threads.  We don't need a mutex, the
+	 *	counters are only ever written by their own thread,
+	 *	and a close approximation is good enough.
+	 */
+	busy = cpu = 0;
+	for (handle = thread_pool.head; handle; handle = handle->next) {
+		uint64_t busy_usec = handle->busy_usec;
+		uint64_t cpu_usec = handle->cpu_usec;
+
+		busy += busy_usec - handle->busy_sampled;
+		cpu += cpu_usec - handle->cpu_sampled;
+		handle->busy_sampled = busy_usec;
+		handle->cpu_sampled = cpu_usec;
+	}
+
+	thread_pool.busy_ratio = 0;
+	if (thread_pool.total_threads > 0) {
+		uint64_t ratio;
+
+		ratio = (busy * 100) / (elapsed * thread_pool.total_threads);
+		thread_pool.busy_ratio = (ratio > 100) ? 100 : ratio;
+	}
+
+	thread_pool.blocked_ratio = 0;
+	if (busy > cpu) thread_pool.blocked_ratio = ((busy - cpu) * 100) / busy;
+
+	target = thread_pool.target_queue_wait * 1000;
+	low_water = (target / 100) * (100 - thread_pool.hysteresis);
+
+	if (wait > target) {
+		thread_pool.time_last_busy = now;
+
+		if ((thread_pool.blocked_ratio < 50) &&
+		    (thread_pool.active_threads >= thread_pool.num_cpus)) {
+			thread_pool.last_action = THREAD_POOL_CPU_BOUND;
+			return;
+		}
+
+		spawn = ((uint64_t) (wait - target) * thread_pool.total_threads) / target;
+		if (spawn < 1) spawn = 1;
+		if (spawn > (int) thread_pool.max_spawn) spawn = thread_pool.max_spawn;
+		if ((spawn + thread_pool.total_threads) > thread_pool.max_threads) {
+			spawn = thread_pool.max_threads - thread_pool.total_threads;
+		}
+
+		DEBUG2("Threads: queue wait %uus > target %uus, spawning %d (busy %u%%, blocked %u%%)",
+		       wait, target, spawn, thread_pool.busy_ratio, thread_pool.blocked_ratio);
+
+		thread_pool.last_action = THREAD_POOL_HOLD;
+		for (i = 0; i < spawn; i++) {
+			if (!spawn_thread(now, 1)) break;
+			thread_pool.total_spawned++;
+			thread_pool.last_action = THREAD_POOL_SPAWN;
+		}
+		return;
+	}
+
+	/*
+	 *	Between the low water mark and the target, or the
+	 *	threads are still mostly busy.  Leave things alone.
+	 */
+	if ((thread_pool.queue_wait > low_water) ||
+	    (thread_pool.busy_ratio > (100 - thread_pool.hysteresis))) {
+		thread_pool.time_last_busy = now;
+		thread_pool.last_action = THREAD_POOL_HOLD;
+		return;
+	}
+
+	if (((now - thread_pool.time_last_busy) < thread_pool.cleanup_delay) ||
+	    ((now - thread_pool.time_last_spawned) < thread_pool.cleanup_delay) ||
+	    (thread_pool.total_threads <= thread_pool.start_threads)) {
+		thread_pool.last_action = THREAD_POOL_HOLD;
+		return;
+	}
+
+	if (thread_pool_retire()) {
+		DEBUG2("Threads: queue wait %uus < %uus, retiring 1 of %d",
+		       thread_pool.queue_wait, low_water, thread_pool.total_threads);
+		thread_pool.total_retired++;
+		thread_pool.last_action = THREAD_POOL_RETIRE;
+	}
+}
+
 /*
  *	Check the min_spare_threads and max_spare_threads.
  *
@@ -1134,6 +1691,20 @@ static void thread_pool_manage(time_t now)
 		}
 	}
 
+	/*
+	 *	The latency driven controller replaces the spare
+	 *	thread counts.
+	 */
+	if (thread_pool.auto_scale) {
+		/*
+		 *	Or request_enqueue() would call us for every
+		 *	request, instead of once a second.
+		 */
+		last_cleaned = now;
+		thread_pool_auto_scale(now);
+		return;
+	}
+
 	/*
 	 *	We don't need a mutex lock here, as we're reading
 	 *	active_threads, and not modifying it.  We want a close
@@ -1212,33 +1783,7 @@ static void thread_pool_manage(time_t now)
 
 		DEBUG2("Threads: deleting 1 spare out of %d spares", spare);
 
-		/*
-		 *	Walk through the thread pool, deleting the
-		 *	first idle thread we come across.
-		 */
-		for (handle = thread_pool.head; (handle != NULL) && (spare > 0) ; handle = next) {
-			next = handle->next;
-
-			/*
-			 *	If the thread is not handling a
-			 *	request, but still live, then tell it
-			 *	to exit.
-			 *
-			 *	It will eventually wake up, and realize
-			 *	it's been told to commit suicide.
-			 */
-			if ((handle->request == NULL) &&
-			    (handle->status == THREAD_RUNNING)) {
-				handle->status = THREAD_CANCELLED;
-				/*
-				 *	Post an extra semaphore, as a
-				 *	signal to wake up, and exit.
-				 */
-				sem_post(&thread_pool.semaphore);
-				spare--;
-				break;
-			}
-		}
+		(void) thread_pool_retire();
 	}
 
 	/*
@@ -1345,10 +1890,16 @@ pid_t rad_waitpid(pid_t pid, int *status)
  */
 #endif
 
-void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
+/*
+ *	Get the queue lengths and packet rates, and optionally the
+ *	state of the auto-scaling controller.
+ */
+void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2], thread_pool_stats_t *stats)
 {
 	int i;
 
+	if (stats) memset(stats, 0, sizeof(*stats));
+
 #ifndef WITH_GCD
 	if (pool_initialized) {
 		struct timeval now;
@@ -1368,6 +1919,21 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 				 &thread_pool.pps_out.time_old,
 				 &now);
 
+		if (stats) {
+			stats->auto_scale = thread_pool.auto_scale;
+			stats->total_threads = thread_pool.total_threads;
+			stats->active_threads = thread_pool.active_threads;
+			stats->max_threads = thread_pool.max_threads;
+			stats->queue_wait = thread_pool.queue_wait;
+			stats->target_queue_wait = thread_pool.target_queue_wait * 1000;
+			stats->busy = thread_pool.busy_ratio;
+			stats->blocked = thread_pool.blocked_ratio;
+			stats->memory = (uint64_t) thread_pool.total_threads * thread_pool.thread_memory;
+			stats->max_memory = (uint64_t) thread_pool.max_memory << 20;
+			stats->spawned = thread_pool.total_spawned;
+			stats->retired = thread_pool.total_retired;
+			stats->action = fr_int2str(thread_pool_actions, thread_pool.last_action, "?");
+		}
 	} else
 #endif	/* WITH_GCD */
 	{
@@ -1378,6 +1944,36 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		pps[0] = pps[1] = 0;
 	}
 }
+
+/*
+ *	The "max_servers" from the configuration, for modules which
+ *	size their own resources against the thread pool while they
+ *	are instantiated, before the pool is started.  Returns 0 if
+ *	there's no thread pool.
+ */
+int thread_pool_max_threads(CONF_SECTION *cs)
+{
+#ifndef WITH_GCD
+	CONF_SECTION *pool_cf;
+	CONF_PAIR *cp;
+	int max_threads = 32;
+
+	pool_cf = cf_subsection_find_next(cs, NULL, "thread");
+	if (!pool_cf) return 0;
+
+	/*
+	 *	The same default and corner case as thread_config,
+	 *	and thread_pool_init().
+	 */
+	cp = cf_pair_find(pool_cf, "max_servers");
+	if (cp && cf_pair_value(cp)) max_threads = atoi(cf_pair_value(cp));
+	if (max_threads == 0) max_threads = 256;
+
+	return max_threads;
+#else
+	return 0;
+#endif
+}
 #endif /* HAVE_PTHREAD_H */
 
 static void time_free(void *data)
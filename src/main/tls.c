@@ -37,9 +37,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <fcntl.h>
 #endif
 
-#ifdef HAVE_UTIME_H
-#include <utime.h>
-#endif
+#include <sys/mman.h>
 
 #ifdef WITH_TLS
 #ifdef HAVE_OPENSSL_RAND_H
@@ -50,6 +48,24 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <openssl/ocsp.h>
 #endif
 
+#include <openssl/hmac.h>
+
+/*
+ *	OpenSSL 1.1.1 lets us add our own data to session tickets.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#  define TLS_TICKET_APPDATA
+#endif
+
+/*
+ *	OpenSSL 1.1.0 passes a const session id to the session cache.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#  define TLS_SESSION_ID_CONST const
+#else
+#  define TLS_SESSION_ID_CONST
+#endif
+
 typedef struct libssl_defect {
 	uint64_t	high;
 	uint64_t	low;
@@ -79,6 +95,14 @@ static unsigned int 	record_plus(record_t *buf, void const *ptr,
 static unsigned int 	record_minus(record_t *buf, void *ptr,
 				     unsigned int size);
 
+/* session cache */
+#define TLS_CACHE_INTERVAL	(60)	/* how often sessions are expired */
+
+static void		tls_cache_remove(SSL_CTX *ctx, SSL_SESSION *sess);
+#ifndef HAVE_PTHREAD_H
+static void		tls_cache_maintain(fr_tls_server_conf_t *conf, time_t now);
+#endif
+
 #ifdef PSK_MAX_IDENTITY_LEN
 static unsigned int psk_server_callback(SSL *ssl, char const *identity,
 					unsigned char *psk,
@@ -183,21 +207,19 @@ tls_session_t *tls_new_session(fr_tls_server_conf_t *conf, REQUEST *request,
 	int		verify_mode = 0;
 	VALUE_PAIR	*vp;
 
+#ifndef HAVE_PTHREAD_H
 	/*
-	 *	Manually flush the sessions every so often.  If HALF
-	 *	of the session lifetime has passed since we last
-	 *	flushed, then flush it again.
-	 *
-	 *	FIXME: Also do it every N sessions?
+	 *	Without threads, nothing expires sessions in the
+	 *	background, so do it here every so often.
 	 */
 	if (conf->session_cache_enable &&
-	    ((conf->session_last_flushed + (conf->session_timeout * 1800)) <= request->timestamp)){
-		RDEBUG2("Flushing SSL sessions (of #%ld)",
-			SSL_CTX_sess_number(conf->ctx));
+	    ((conf->session_last_flushed + TLS_CACHE_INTERVAL) <= request->timestamp)) {
+		RDEBUG2("Flushing SSL sessions");
 
-		SSL_CTX_flush_sessions(conf->ctx, request->timestamp);
+		tls_cache_maintain(conf, request->timestamp);
 		conf->session_last_flushed = request->timestamp;
 	}
+#endif
 
 	if ((new_tls = SSL_new(conf->ctx)) == NULL) {
 		ERROR("SSL: Error creating new SSL: %s",
@@ -282,7 +304,7 @@ tls_session_t *tls_new_session(fr_tls_server_conf_t *conf, REQUEST *request,
 		state->offset = vp->vp_integer;
 	}
 
-	if (conf->session_cache_enable) {
+	if (conf->session_cache_enable || conf->session_tickets) {
 		state->allow_session_resumption = 1; /* otherwise it's zero */
 	}
 
@@ -291,6 +313,37 @@ tls_session_t *tls_new_session(fr_tls_server_conf_t *conf, REQUEST *request,
 	return state;
 }
 
+/** Mark a session as one where the user is authenticated inside the tunnel
+ *
+ * Session tickets are sealed during the handshake, before the user has been authenticated, and once issued they
+ * can't be revoked.  So tunnelled sessions don't issue tickets, and don't accept them.  They can still be resumed
+ * from the session cache, which only keeps sessions that tls_success() was called for.
+ *
+ * Must be called before the handshake starts.
+ *
+ * @param ssn to mark.
+ */
+void tls_session_tunnelled(tls_session_t *ssn)
+{
+	fr_tls_server_conf_t *conf;
+
+	ssn->tunnelled = true;
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_CONF);
+	if (!conf || !conf->session_tickets) return;
+
+#ifdef SSL_OP_NO_TICKET
+	/*
+	 *	With TLS 1.3 this makes the tickets refer to the
+	 *	session cache, instead of carrying the session.
+	 */
+	SSL_set_options(ssn->ssl, SSL_OP_NO_TICKET);
+#endif
+#ifdef TLS_TICKET_APPDATA
+	if (!conf->session_cache_enable) SSL_set_num_tickets(ssn->ssl, 0);
+#endif
+}
+
 /*
  *	Print out some text describing the error.
  */
@@ -355,6 +408,243 @@ static int int_ssl_check(REQUEST *request, SSL *s, int ret, char const *text)
 	return 1;
 }
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Crypto thread pool.
+ *
+ *	The public key operations in a full handshake are expensive.
+ *	When a "crypto_pool" is configured, handshake steps are run by
+ *	its own threads, instead of by the request threads.  At most
+ *	"threads" handshakes are processed at once, and at most
+ *	"max_queue" more wait for a thread.  Further handshakes fail
+ *	immediately.
+ *
+ *	The request thread still blocks while its handshake step is
+ *	queued or running, so the pool doesn't free request threads.
+ *	What it does is bound them: at most "threads" + "max_queue"
+ *	request threads are ever busy with handshakes, and the rest
+ *	are left for other traffic.  tls_server_conf_parse() keeps that
+ *	below half of the request threads.
+ *
+ *	Because the request thread waits, the SSL session and the
+ *	REQUEST are only ever used by one thread at a time.  But the
+ *	callbacks made during the step (cbtls_verify(), the OCSP
+ *	check, and the verify command) run in the crypto thread.
+ *	Anything they do which is per-thread, like the statistics
+ *	counters or the OpenSSL error queue, is the crypto thread's
+ *	own, which is set up on first use, and released when the
+ *	thread exits.  They mustn't rely on request->child_pid being
+ *	the current thread.
+ */
+typedef struct tls_crypto_job_t tls_crypto_job_t;
+
+struct tls_crypto_job_t {
+	REQUEST			*request;
+	tls_session_t		*ssn;
+	int			rcode;
+	bool			done;
+	uint64_t		queued;		//!< When the job was queued.
+	pthread_cond_t		cond;		//!< Signalled when done.
+	tls_crypto_job_t	*next;
+};
+
+struct fr_tls_crypto_pool_t {
+	char const		*name;
+	int			num_threads;
+	int			max_queue;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;		//!< Signalled when work is queued.
+	tls_crypto_job_t	*head;
+	tls_crypto_job_t	*tail;
+	pthread_t		*threads;
+	int			started;
+	bool			stop;
+
+	fr_tls_pool_stats_t	stats;
+
+	fr_tls_crypto_pool_t	*next;		//!< All pools, for the statistics.
+};
+
+static int tls_handshake_process(REQUEST *request, tls_session_t *ssn);
+
+static fr_tls_crypto_pool_t *crypto_pools = NULL;
+
+static void *tls_crypto_thread(void *arg)
+{
+	fr_tls_crypto_pool_t *pool = arg;
+	tls_crypto_job_t *job;
+	uint64_t start;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (!pool->head && !pool->stop) pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) break;
+
+		job = pool->head;
+		pool->head = job->next;
+		if (!pool->head) pool->tail = NULL;
+		pool->stats.queued--;
+		pool->stats.active++;
+
+		start = fr_latency_now();
+		pool->stats.wait_usec += start - job->queued;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->rcode = tls_handshake_process(job->request, job->ssn);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->stats.run_usec += fr_latency_now() - start;
+		pool->stats.active--;
+		pool->stats.processed++;
+		job->done = true;
+		pthread_cond_signal(&job->cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	/*
+	 *	As for the request threads, don't leak this thread's
+	 *	error queue, or lose any counters it's recorded.
+	 *	OpenSSL 1.1.0 and later free the queue themselves.
+	 */
+#if OPENSSL_VERSION_NUMBER < 0x10000000L
+	ERR_remove_state(0);
+#elif OPENSSL_VERSION_NUMBER < 0x10100000L
+	ERR_remove_thread_state(NULL);
+#endif
+#ifdef WITH_STATS
+	radius_stats_thread_exit();
+	fr_latency_thread_exit();
+#endif
+
+	return NULL;
+}
+
+/*
+ *	Run a handshake step in the pool, and wait for it to finish.
+ */
+static int tls_crypto_pool_run(fr_tls_crypto_pool_t *pool, REQUEST *request, tls_session_t *ssn)
+{
+	tls_crypto_job_t job;
+
+	memset(&job, 0, sizeof(job));
+	job.request = request;
+	job.ssn = ssn;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->stats.queued >= pool->max_queue) {
+		pool->stats.rejected++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		REDEBUG("TLS crypto pool is full (%d handshakes waiting), failing handshake",
+			pool->max_queue);
+		return 0;
+	}
+
+	pthread_cond_init(&job.cond, NULL);
+	job.queued = fr_latency_now();
+	if (pool->tail) {
+		pool->tail->next = &job;
+	} else {
+		pool->head = &job;
+	}
+	pool->tail = &job;
+	pool->stats.queued++;
+	pthread_cond_signal(&pool->cond);
+
+	while (!job.done) pthread_cond_wait(&job.cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_cond_destroy(&job.cond);
+
+	return job.rcode;
+}
+
+static void tls_crypto_pool_free(fr_tls_server_conf_t *conf)
+{
+	fr_tls_crypto_pool_t *pool = conf->crypto_pool;
+	fr_tls_crypto_pool_t **last;
+	int i;
+
+	if (!pool) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->started; i++) pthread_join(pool->threads[i], NULL);
+
+	for (last = &crypto_pools; *last; last = &(*last)->next) {
+		if (*last == pool) {
+			*last = pool->next;
+			break;
+		}
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	talloc_free(pool);
+	conf->crypto_pool = NULL;
+}
+
+static int tls_crypto_pool_init(fr_tls_server_conf_t *conf, CONF_SECTION *cs)
+{
+	fr_tls_crypto_pool_t *pool;
+	char const *name;
+	int i, rcode;
+
+	pool = conf->crypto_pool = talloc_zero(conf, fr_tls_crypto_pool_t);
+	if (!pool) return -1;
+
+	name = cf_section_name2(cs);
+	if (!name) name = cf_section_name1(cs);
+	pool->name = talloc_strdup(pool, name);
+	pool->num_threads = conf->crypto_threads;
+	pool->max_queue = conf->crypto_max_queue;
+	pool->stats.threads = pool->num_threads;
+	pool->stats.max_queue = pool->max_queue;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->next = crypto_pools;
+	crypto_pools = pool;
+
+	pool->threads = talloc_array(pool, pthread_t, pool->num_threads);
+	for (i = 0; i < pool->num_threads; i++) {
+		rcode = pthread_create(&pool->threads[i], NULL, tls_crypto_thread, pool);
+		if (rcode != 0) {
+			ERROR("tls: Failed creating crypto thread: %s", fr_syserror(rcode));
+			return -1;
+		}
+		pool->started++;
+	}
+
+	DEBUG("tls: Started %d crypto threads for %s", pool->num_threads, pool->name);
+
+	return 0;
+}
+
+/** Call a function with the statistics of every crypto pool
+ *
+ * Called from the main thread.
+ */
+void tls_crypto_pool_walk(fr_tls_pool_walk_t callback, void *ctx)
+{
+	fr_tls_crypto_pool_t *pool;
+	fr_tls_pool_stats_t stats;
+
+	for (pool = crypto_pools; pool; pool = pool->next) {
+		pthread_mutex_lock(&pool->mutex);
+		stats = pool->stats;
+		pthread_mutex_unlock(&pool->mutex);
+
+		callback(ctx, pool->name, &stats);
+	}
+}
+#endif
+
 /*
  * We are the server, we always get the dirty data
  * (Handshake data is also considered as dirty data)
@@ -369,6 +659,24 @@ static int int_ssl_check(REQUEST *request, SSL *s, int ret, char const *text)
  * Get the cleaned data from SSL, if it is not Handshake data
  */
 int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
+{
+#ifdef HAVE_PTHREAD_H
+	fr_tls_server_conf_t *conf;
+
+	/*
+	 *	Only the handshake is expensive.  Data in an
+	 *	established session is processed here.
+	 */
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_CONF);
+	if (conf && conf->crypto_pool && !SSL_is_init_finished(ssn->ssl)) {
+		return tls_crypto_pool_run(conf->crypto_pool, request, ssn);
+	}
+#endif
+
+	return tls_handshake_process(request, ssn);
+}
+
+static int tls_handshake_process(REQUEST *request, tls_session_t *ssn)
 {
 	int err;
 
@@ -788,15 +1096,58 @@ static CONF_PARSER cache_config[] = {
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
 
+static CONF_PARSER ticket_config[] = {
+	{ "enable", PW_TYPE_BOOLEAN,
+	  offsetof(fr_tls_server_conf_t, session_tickets), NULL, "no" },
+	{ "rotate", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, ticket_key_rotate), NULL, "28800" },
+	{ "key_file", PW_TYPE_STRING_PTR,
+	  offsetof(fr_tls_server_conf_t, ticket_key_file), NULL, NULL},
+	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
+static CONF_PARSER crypto_pool_config[] = {
+	{ "threads", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, crypto_threads), NULL, "0" },
+	{ "max_queue", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, crypto_max_queue), NULL, "8" },
+	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
+static CONF_PARSER verify_cache_config[] = {
+	{ "enable", PW_TYPE_BOOLEAN,
+	  offsetof(fr_tls_server_conf_t, verify_cache_enable), NULL, "no" },
+	{ "lifetime", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, verify_cache_lifetime), NULL, "3600" },
+	{ "max_entries", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, verify_cache_size), NULL, "16384" },
+	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
 static CONF_PARSER verify_config[] = {
 	{ "tmpdir", PW_TYPE_STRING_PTR,
 	  offsetof(fr_tls_server_conf_t, verify_tmp_dir), NULL, NULL},
 	{ "client", PW_TYPE_STRING_PTR,
 	  offsetof(fr_tls_server_conf_t, verify_client_cert_cmd), NULL, NULL},
+	{ "cache", PW_TYPE_SUBSECTION, 0, NULL, (void const *) verify_cache_config },
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
 
 #ifdef HAVE_OPENSSL_OCSP_H
+static CONF_PARSER ocsp_cache_config[] = {
+	{ "enable", PW_TYPE_BOOLEAN,
+	  offsetof(fr_tls_server_conf_t, ocsp_cache_enable), NULL, "no" },
+	{ "lifetime", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, ocsp_cache_lifetime), NULL, "3600" },
+	{ "max_entries", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, ocsp_cache_size), NULL, "16384" },
+	{ "refresh_before", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, ocsp_refresh_before), NULL, "300" },
+	{ "softfail_window", PW_TYPE_INTEGER,
+	  offsetof(fr_tls_server_conf_t, ocsp_softfail_window), NULL, "0" },
+	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
 static CONF_PARSER ocsp_config[] = {
 	{ "enable", PW_TYPE_BOOLEAN,
 	  offsetof(fr_tls_server_conf_t, ocsp_enable), NULL, "no"},
@@ -810,6 +1161,7 @@ static CONF_PARSER ocsp_config[] = {
 	  offsetof(fr_tls_server_conf_t, ocsp_timeout), NULL, "yes"},
 	{ "softfail", PW_TYPE_BOOLEAN,
 	  offsetof(fr_tls_server_conf_t, ocsp_softfail), NULL, "yes"},
+	{ "cache", PW_TYPE_SUBSECTION, 0, NULL, (void const *) ocsp_cache_config },
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
 #endif
@@ -877,6 +1229,10 @@ static CONF_PARSER tls_server_config[] = {
 
 	{ "cache", PW_TYPE_SUBSECTION, 0, NULL, (void const *) cache_config },
 
+	{ "session_tickets", PW_TYPE_SUBSECTION, 0, NULL, (void const *) ticket_config },
+
+	{ "crypto_pool", PW_TYPE_SUBSECTION, 0, NULL, (void const *) crypto_pool_config },
+
 	{ "verify", PW_TYPE_SUBSECTION, 0, NULL, (void const *) verify_config },
 
 #ifdef HAVE_OPENSSL_OCSP_H
@@ -995,274 +1351,1469 @@ static int generate_eph_rsa_key(SSL_CTX *ctx)
  */
 static int FR_TLS_EX_INDEX_VPS = -1;
 
-/*
- *	Print debugging messages, and free data.
- *
- *	FIXME: Write sessions to some long-term storage, so that
- *	       session resumption can still occur after the server
- *	       restarts.
- */
 #define MAX_SESSION_SIZE (256)
 
-static void cbtls_remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+/*
+ *	The attributes cached with a session, and restored when it is
+ *	resumed.
+ */
+static VALUE_PAIR *tls_session_vps(SSL *ssl, REQUEST *request)
 {
-	size_t size;
-	char buffer[2 * MAX_SESSION_SIZE + 1];
-	fr_tls_server_conf_t *conf;
+	VALUE_PAIR *vp, *vps = NULL;
+	VALUE_PAIR **certs;
 
-	size = sess->session_id_length;
-	if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
+	vp = paircopy2(NULL, request->reply->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (vp) pairadd(&vps, vp);
 
-	fr_bin2hex(buffer, sess->session_id, size);
+	vp = paircopy2(NULL, request->packet->vps, PW_STRIPPED_USER_NAME, 0, TAG_ANY);
+	if (vp) pairadd(&vps, vp);
 
-	DEBUG2("  SSL: Removing session %s from the cache", buffer);
-	conf = (fr_tls_server_conf_t *)SSL_CTX_get_app_data(ctx);
-	if (conf && conf->session_cache_path) {
-		int rv;
-		char filename[256];
+	vp = paircopy2(NULL, request->reply->vps, PW_CHARGEABLE_USER_IDENTITY, 0, TAG_ANY);
+	if (vp) pairadd(&vps, vp);
 
-		/* remove session and any cached VPs */
-		rv = snprintf(filename, sizeof(filename), "%s%c%s.asn1",
-			conf->session_cache_path, FR_DIR_SEP, buffer
-			);
-		rv = unlink(filename);
-		if (rv != 0) {
-			DEBUG2("  SSL: could not remove persisted session file %s: %s", filename, fr_syserror(errno));
-		}
-		/* VPs might be absent; might not have been written to disk yet */
-		rv = snprintf(filename, sizeof(filename), "%s%c%s.vps",
-			conf->session_cache_path, FR_DIR_SEP, buffer
-			);
-		rv = unlink(filename);
+	vp = paircopy2(NULL, request->reply->vps, PW_CACHED_SESSION_POLICY, 0, TAG_ANY);
+	if (vp) pairadd(&vps, vp);
+
+	certs = (VALUE_PAIR **)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CERTS);
+
+	/*
+	 *	Hmm... the certs should probably be session data.
+	 */
+	if (certs) {
+		/*
+		 *	@todo: some go into reply, others into
+		 *	request
+		 */
+		pairadd(&vps, paircopy(NULL, *certs));
 	}
 
-	return;
+	return vps;
 }
 
-static int cbtls_new_session(SSL *ssl, SSL_SESSION *sess)
+/*
+ *	Cached VPs are saved as text, as they would be written in the
+ *	"users" file.
+ */
+static char *tls_vps_to_text(TALLOC_CTX *ctx, VALUE_PAIR *vps)
 {
-	size_t size;
-	char buffer[2 * MAX_SESSION_SIZE + 1];
-	fr_tls_server_conf_t *conf;
-	unsigned char *sess_blob = NULL;
+	char *text;
+	char buffer[1024];
+	VALUE_PAIR *vp;
+	vp_cursor_t cursor;
+
+	text = talloc_strdup(ctx, "");
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp && text;
+	     vp = fr_cursor_next(&cursor)) {
+		vp_prints(buffer, sizeof(buffer), vp);
+		text = talloc_asprintf_append_buffer(text, "%s%s", *text ? ", " : "", buffer);
+	}
 
-	size = sess->session_id_length;
-	if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
+	return text;
+}
 
-	fr_bin2hex(buffer, sess->session_id, size);
+static VALUE_PAIR *tls_text_to_vps(uint8_t const *data, size_t len)
+{
+	char *text;
+	VALUE_PAIR *vps = NULL;
 
-	DEBUG2("  SSL: adding session %s to cache", buffer);
+	if (!len) return NULL;
 
-	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
-	if (conf && conf->session_cache_path) {
-		int fd, rv, todo, blob_len;
-		char filename[256];
-		unsigned char *p;
-
-		/* find out what length data we need */
-		blob_len = i2d_SSL_SESSION(sess, NULL);
-		if (blob_len < 1) {
-			/* something went wrong */
-			DEBUG2("  SSL: could not find buffer length to persist session");
-			return 0;
-		}
+	text = talloc_strndup(NULL, (char const *) data, len);
+	if (!text) return NULL;
 
-		/* alloc and convert to ASN.1 */
-		sess_blob = talloc_array(conf, unsigned char, blob_len);
-		if (!sess_blob) {
-			DEBUG2("  SSL: could not allocate buffer len=%d to persist session", blob_len);
-			return 0;
-		}
-		/* openssl mutates &p */
-		p = sess_blob;
-		rv = i2d_SSL_SESSION(sess, &p);
-		if (rv != blob_len) {
-			DEBUG2("  SSL: could not persist session");
-			goto error;
-		}
+	if (userparse(NULL, text, &vps) == T_OP_INVALID) pairfree(&vps);
+	talloc_free(text);
 
-		/* open output file */
-		rv = snprintf(filename, sizeof(filename), "%s%c%s.asn1",
-			      conf->session_cache_path, FR_DIR_SEP, buffer);
-		fd = open(filename, O_RDWR|O_CREAT|O_EXCL, 0600);
-		if (fd < 0) {
-			DEBUG2("  SSL: could not open session file %s: %s", filename, fr_syserror(errno));
-			goto error;
-		}
+	return vps;
+}
 
-		todo = blob_len;
-		p = sess_blob;
-		while (todo > 0) {
-			rv = write(fd, p, todo);
-			if (rv < 1) {
-				DEBUG2("  SSL: failed writing session: %s", fr_syserror(errno));
-				close(fd);
-				goto error;
-			}
-			p += rv;
-			todo -= rv;
-		}
-		close(fd);
-		DEBUG2("  SSL: wrote session %s to %s len=%d", buffer, filename, blob_len);
-	}
+/*
+ *	Session cache.
+ *
+ *	OpenSSL's own session cache is protected by a single lock on
+ *	the SSL_CTX.  We turn it off, and keep sessions in our own
+ *	cache instead.  It is split into shards, each with its own
+ *	lock, so resuming a session is a hash lookup which rarely
+ *	contends with other threads.
+ *
+ *	If "persist_dir" is set, sessions are also written to a
+ *	single append-only file, which is read back when the server
+ *	starts.  Removed sessions are recorded in the file, and it is
+ *	compacted periodically, in the background when we have
+ *	threads.
+ */
+#define TLS_CACHE_SHARDS	(16)
+#define TLS_CACHE_MAGIC		"FRTLSC01"
 
-error:
-	if (sess_blob) talloc_free(sess_blob);
+#define TLS_CACHE_ADD		(1)
+#define TLS_CACHE_DEL		(2)
 
-	return 0;
-}
+typedef struct tls_cache_entry_t tls_cache_entry_t;
 
-static SSL_SESSION *cbtls_get_session(SSL *ssl,
-				      unsigned char *data, int len,
-				      int *copy)
-{
-	size_t size;
-	char buffer[2 * MAX_SESSION_SIZE + 1];
-	fr_tls_server_conf_t *conf;
+struct tls_cache_entry_t {
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int		id_len;
+	uint32_t		hash;
+	time_t			expires;
+	SSL_SESSION		*sess;
 
-	SSL_SESSION *sess = NULL;
-	unsigned char *sess_data = NULL;
-	PAIR_LIST *pairlist = NULL;
+	tls_cache_entry_t	*prev;		//!< Oldest first.
+	tls_cache_entry_t	*next;
+};
 
-	size = len;
-	if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
+typedef struct tls_cache_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*sessions;
+	tls_cache_entry_t	*head;
+	tls_cache_entry_t	*tail;
+	int			max_entries;	//!< 0 for no limit.
+} tls_cache_shard_t;
+
+struct fr_tls_session_cache_t {
+	tls_cache_shard_t	shards[TLS_CACHE_SHARDS];
+
+	char			*filename;	//!< NULL if not persisting.
+	int			fd;
+	int			records;	//!< Number of records in the file.
+
+	bool			compacting;	//!< Keep copies of the records written.
+	uint8_t			*pending;	//!< Records written while compacting.
+	size_t			pending_len;
+	int			pending_records;
+	bool			pending_lost;	//!< Failed keeping a record.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		file_mutex;
+
+	pthread_t		thread;
+	pthread_mutex_t		thread_mutex;
+	pthread_cond_t		thread_cond;
+	bool			thread_running;
+	bool			thread_stop;
+#endif
+};
 
-	fr_bin2hex(buffer, data, size);
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
 
-	DEBUG2("  SSL: Client requested cached session %s", buffer);
+static void tls_session_up_ref(SSL_SESSION *sess)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_SESSION_up_ref(sess);
+#else
+	CRYPTO_add(&sess->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+}
 
-	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
-	if (conf && conf->session_cache_path) {
-		int rv, fd, todo;
-		char filename[256];
-		unsigned char *p;
-		struct stat st;
-		VALUE_PAIR *vp;
-
-		/* read in the cached VPs from the .vps file */
-		rv = snprintf(filename, sizeof(filename), "%s%c%s.vps",
-			conf->session_cache_path, FR_DIR_SEP, buffer
-			);
-		rv = pairlist_read(NULL, filename, &pairlist, 1);
-		if (rv < 0) {
-			/* not safe to un-persist a session w/o VPs */
-			DEBUG2("  SSL: could not load persisted VPs for session %s", buffer);
-			goto err;
-		}
-
-		/* load the actual SSL session */
-		rv = snprintf(filename, sizeof(filename), "%s%c%s.asn1",
-			conf->session_cache_path, FR_DIR_SEP, buffer
-			);
-		fd = open(filename, O_RDONLY);
-		if (fd == -1) {
-			DEBUG2("  SSL: could not find persisted session file %s: %s", filename, fr_syserror(errno));
-			goto err;
-		}
-
-		rv = fstat(fd, &st);
-		if (rv == -1) {
-			DEBUG2("  SSL: could not stat persisted session file %s: %s", filename, fr_syserror(errno));
-			close(fd);
-			goto err;
-		}
-
-		sess_data = talloc_array(NULL, unsigned char, st.st_size);
-		if (!sess_data) {
-		  DEBUG2("  SSL: could not alloc buffer for persisted session len=%d", (int) st.st_size);
-			close(fd);
-			goto err;
-		}
-
-		p = sess_data;
-		todo = st.st_size;
-		while (todo > 0) {
-			rv = read(fd, p, todo);
-			if (rv < 1) {
-				DEBUG2("  SSL: could not read from persisted session: %s", fr_syserror(errno));
-				close(fd);
-				goto err;
-			}
-			todo -= rv;
-			p += rv;
-		}
-		close(fd);
+/*
+ *	The low bits of the hash pick the shard.  Mix it again, or
+ *	the table would only use a fraction of its buckets.
+ */
+static uint32_t tls_cache_entry_hash(void const *data)
+{
+	tls_cache_entry_t const *e = data;
 
-		/* openssl mutates &p */
-		p = sess_data;
-		sess = d2i_SSL_SESSION(NULL, (unsigned char const **)(void **) &p, st.st_size);
+	return fr_hash(&e->hash, sizeof(e->hash));
+}
 
-		if (!sess) {
-			DEBUG2("  SSL: OpenSSL failed to load persisted session: %s", ERR_error_string(ERR_get_error(), NULL));
-			goto err;
-		}
+static int tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one;
+	tls_cache_entry_t const *b = two;
 
-		/* cache the VPs into the session */
-		vp = paircopy(NULL, pairlist->reply);
-		SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_VPS, vp);
-		DEBUG2("  SSL: Successfully restored session %s", buffer);
-	}
-err:
-	if (sess_data) talloc_free(sess_data);
-	if (pairlist) pairlist_free(&pairlist);
+	if (a->id_len != b->id_len) return a->id_len - b->id_len;
 
-	*copy = 0;
-	return sess;
+	return memcmp(a->id, b->id, a->id_len);
 }
 
-#ifdef HAVE_OPENSSL_OCSP_H
-/*
- * This function extracts the OCSP Responder URL
- * from an existing x509 certificate.
- */
-static int ocsp_parse_cert_url(X509 *cert, char **phost, char **pport,
-			       char **ppath, int *pssl)
+static void tls_cache_entry_free(void *data)
 {
-	int i;
+	tls_cache_entry_t *e = data;
 
-	AUTHORITY_INFO_ACCESS *aia;
-	ACCESS_DESCRIPTION *ad;
+	SSL_SESSION_free(e->sess);
+	talloc_free(e);
+}
 
-	aia = X509_get_ext_d2i(cert, NID_info_access, NULL, NULL);
+static int tls_cache_key(tls_cache_entry_t *e, uint8_t const *id, unsigned int len)
+{
+	if (!len || (len > sizeof(e->id))) return -1;
+
+	memcpy(e->id, id, len);
+	e->id_len = len;
+	e->hash = fr_hash(id, len);
 
-	for (i = 0; i < sk_ACCESS_DESCRIPTION_num(aia); i++) {
-		ad = sk_ACCESS_DESCRIPTION_value(aia, 0);
-		if (OBJ_obj2nid(ad->method) == NID_ad_OCSP) {
-			if (ad->location->type == GEN_URI) {
-			  if(OCSP_parse_url((char *) ad->location->d.ia5->data,
-						  phost, pport, ppath, pssl))
-					return 1;
-			}
-		}
-	}
 	return 0;
 }
 
+static tls_cache_shard_t *tls_cache_shard(fr_tls_session_cache_t *cache, uint32_t hash)
+{
+	return &cache->shards[hash % TLS_CACHE_SHARDS];
+}
+
 /*
- * This function sends a OCSP request to a defined OCSP responder
- * and checks the OCSP response for correctness.
+ *	Remove an entry from its shard, and free it.  The shard must
+ *	be locked.
  */
-
-/* Maximum leeway in validity period: default 5 minutes */
+static void tls_cache_unlink(tls_cache_shard_t *shard, tls_cache_entry_t *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		shard->head = e->next;
+	}
+
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		shard->tail = e->prev;
+	}
+
+	fr_hash_table_delete(shard->sessions, e);
+}
+
+/*
+ *	Add an entry to its shard, replacing any entry for the same
+ *	session, and evicting the oldest sessions if the shard is
+ *	full.  The shard must be locked.
+ */
+static void tls_cache_insert(tls_cache_shard_t *shard, tls_cache_entry_t *e)
+{
+	tls_cache_entry_t *old;
+
+	old = fr_hash_table_finddata(shard->sessions, e);
+	if (old) tls_cache_unlink(shard, old);
+
+	while (shard->max_entries && shard->head &&
+	       (fr_hash_table_num_elements(shard->sessions) >= shard->max_entries)) {
+		tls_cache_unlink(shard, shard->head);
+	}
+
+	if (!fr_hash_table_insert(shard->sessions, e)) {
+		tls_cache_entry_free(e);
+		return;
+	}
+
+	e->next = NULL;
+	e->prev = shard->tail;
+	if (shard->tail) {
+		shard->tail->next = e;
+	} else {
+		shard->head = e;
+	}
+	shard->tail = e;
+}
+
+/*
+ *	Records in the persistence file are:
+ *
+ *	length (4), type (1), id length (1), id,
+ *	expires (8), session length (4), session, VPs length (4), VPs
+ *
+ *	in host byte order.  "length" is the length of everything
+ *	after it.  The session is in ASN.1, and the VPs are text, as
+ *	they would be written in the "users" file.
+ *
+ *	Deleted sessions are recorded with a TLS_CACHE_DEL record,
+ *	which stops after the id.
+ */
+static uint8_t *tls_cache_record_add(TALLOC_CTX *ctx, SSL_SESSION *sess, time_t expires, size_t *outlen)
+{
+	unsigned int	id_len;
+	uint8_t const	*id;
+	uint8_t		*record, *p;
+	uint32_t	len;
+	int64_t		when = expires;
+	int		sess_len;
+	size_t		vps_len;
+	char		*vps;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if (!id_len || (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)) return NULL;
+
+	sess_len = i2d_SSL_SESSION(sess, NULL);
+	if (sess_len < 1) return NULL;
+
+	vps = tls_vps_to_text(ctx, SSL_SESSION_get_ex_data(sess, FR_TLS_EX_INDEX_VPS));
+	if (!vps) return NULL;
+	vps_len = strlen(vps);
+
+	len = 1 + 1 + id_len + 8 + 4 + sess_len + 4 + vps_len;
+	record = talloc_array(ctx, uint8_t, 4 + len);
+	if (!record) {
+		talloc_free(vps);
+		return NULL;
+	}
+
+	p = record;
+	memcpy(p, &len, 4);
+	p += 4;
+	*p++ = TLS_CACHE_ADD;
+	*p++ = id_len;
+	memcpy(p, id, id_len);
+	p += id_len;
+	memcpy(p, &when, 8);
+	p += 8;
+
+	memcpy(p, &sess_len, 4);
+	p += 4;
+	i2d_SSL_SESSION(sess, &p);	/* advances p */
+
+	len = vps_len;
+	memcpy(p, &len, 4);
+	memcpy(p + 4, vps, vps_len);
+	talloc_free(vps);
+
+	*outlen = 4 + 1 + 1 + id_len + 8 + 4 + sess_len + 4 + vps_len;
+	return record;
+}
+
+/*
+ *	Append a record to the persistence file.  While the file is
+ *	being compacted, also keep a copy for the new file.
+ */
+static void tls_cache_write(fr_tls_session_cache_t *cache, uint8_t const *record, size_t len)
+{
+	uint8_t *pending;
+
+	PTHREAD_MUTEX_LOCK(&cache->file_mutex);
+	if (cache->fd >= 0) {
+		if (write(cache->fd, record, len) != (ssize_t) len) {
+			DEBUG2("  SSL: Failed writing to %s: %s", cache->filename, fr_syserror(errno));
+		} else {
+			cache->records++;
+		}
+	}
+
+	if (cache->compacting && !cache->pending_lost) {
+		pending = talloc_realloc(cache, cache->pending, uint8_t, cache->pending_len + len);
+		if (!pending) {
+			cache->pending_lost = true;
+		} else {
+			memcpy(pending + cache->pending_len, record, len);
+			cache->pending = pending;
+			cache->pending_len += len;
+			cache->pending_records++;
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->file_mutex);
+}
+
+/*
+ *	Save a session, with its cached VPs.
+ */
+static void tls_cache_persist(fr_tls_server_conf_t *conf, SSL_SESSION *sess)
+{
+	fr_tls_session_cache_t *cache = conf->session_cache;
+	uint8_t *record;
+	size_t len;
+
+	if (!cache || !cache->filename) return;
+
+	record = tls_cache_record_add(NULL, sess, SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess), &len);
+	if (!record) {
+		DEBUG2("  SSL: Could not persist session");
+		return;
+	}
+
+	tls_cache_write(cache, record, len);
+	talloc_free(record);
+}
+
+/*
+ *	Remove a session from the cache.
+ *
+ *	OpenSSL only calls the remove callback for sessions in its own
+ *	cache, which we don't use.  So we call this directly whenever
+ *	a session must not be resumed.
+ */
+static void tls_cache_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	fr_tls_server_conf_t *conf;
+	fr_tls_session_cache_t *cache;
+	tls_cache_shard_t *shard;
+	tls_cache_entry_t *e, my_e;
+	unsigned int len;
+	uint8_t const *id;
+	uint8_t record[4 + 1 + 1 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint32_t record_len;
+	char buffer[2 * MAX_SESSION_SIZE + 1];
+
+	if (!sess) return;
+
+	conf = (fr_tls_server_conf_t *)SSL_CTX_get_app_data(ctx);
+	if (!conf || !conf->session_cache) return;
+	cache = conf->session_cache;
+
+	id = SSL_SESSION_get_id(sess, &len);
+	if (tls_cache_key(&my_e, id, len) < 0) return;
+
+	fr_bin2hex(buffer, id, len);
+	DEBUG2("  SSL: Removing session %s from the cache", buffer);
+
+	shard = tls_cache_shard(cache, my_e.hash);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	e = fr_hash_table_finddata(shard->sessions, &my_e);
+	if (e) tls_cache_unlink(shard, e);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (!e || !cache->filename) return;
+
+	record_len = 1 + 1 + len;
+	memcpy(record, &record_len, 4);
+	record[4] = TLS_CACHE_DEL;
+	record[5] = len;
+	memcpy(record + 6, id, len);
+
+	tls_cache_write(cache, record, 4 + record_len);
+}
+
+static void cbtls_remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	tls_cache_remove(ctx, sess);
+}
+
+/*
+ *	Called by OpenSSL when a full handshake has created a new
+ *	session.  We keep the reference OpenSSL gives us.
+ *
+ *	The session isn't persisted until tls_success() has added the
+ *	VPs to it, as it can't be resumed without them.
+ */
+static int cbtls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+	fr_tls_server_conf_t *conf;
+	tls_cache_shard_t *shard;
+	tls_cache_entry_t *e;
+	unsigned int len;
+	uint8_t const *id;
+	char buffer[2 * MAX_SESSION_SIZE + 1];
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	if (!conf || !conf->session_cache) return 0;
+
+	id = SSL_SESSION_get_id(sess, &len);
+
+	e = talloc_zero(NULL, tls_cache_entry_t);
+	if (!e) return 0;
+
+	if (tls_cache_key(e, id, len) < 0) {
+		talloc_free(e);
+		return 0;
+	}
+	e->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	e->sess = sess;
+
+	fr_bin2hex(buffer, id, len);
+	DEBUG2("  SSL: adding session %s to cache", buffer);
+
+	shard = tls_cache_shard(conf->session_cache, e->hash);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	tls_cache_insert(shard, e);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return 1;
+}
+
+static SSL_SESSION *cbtls_get_session(SSL *ssl,
+				      TLS_SESSION_ID_CONST unsigned char *data, int len,
+				      int *copy)
+{
+	fr_tls_server_conf_t *conf;
+	tls_cache_shard_t *shard;
+	tls_cache_entry_t *e, my_e;
+	SSL_SESSION *sess = NULL;
+	size_t size;
+	char buffer[2 * MAX_SESSION_SIZE + 1];
+
+	*copy = 0;
+
+	size = len;
+	if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
+
+	fr_bin2hex(buffer, data, size);
+
+	DEBUG2("  SSL: Client requested cached session %s", buffer);
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	if (!conf || !conf->session_cache) return NULL;
+
+	if (tls_cache_key(&my_e, data, len) < 0) return NULL;
+
+	/*
+	 *	Take our own reference while the shard is locked, as
+	 *	another thread may remove the session as soon as we
+	 *	unlock it.
+	 */
+	shard = tls_cache_shard(conf->session_cache, my_e.hash);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	e = fr_hash_table_finddata(shard->sessions, &my_e);
+	if (e) {
+		if (e->expires <= time(NULL)) {
+			tls_cache_unlink(shard, e);
+		} else {
+			sess = e->sess;
+			tls_session_up_ref(sess);
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (!sess) DEBUG2("  SSL: Session %s not found", buffer);
+
+	return sess;
+}
+
+/*
+ *	Drop expired sessions.  Entries are kept oldest first, so we
+ *	can stop at the first one which hasn't expired.
+ */
+static int tls_cache_expire(fr_tls_session_cache_t *cache, time_t now)
+{
+	int i, live = 0;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		while (shard->head && (shard->head->expires <= now)) {
+			tls_cache_unlink(shard, shard->head);
+		}
+		live += fr_hash_table_num_elements(shard->sessions);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return live;
+}
+
+/*
+ *	Stop keeping copies of the records written.
+ */
+static void tls_cache_compact_end(fr_tls_session_cache_t *cache)
+{
+	cache->compacting = false;
+	TALLOC_FREE(cache->pending);
+	cache->pending_len = 0;
+	cache->pending_records = 0;
+	cache->pending_lost = false;
+}
+
+/*
+ *	Rewrite the persistence file with only the live sessions.
+ *
+ *	The live sessions are written to a new file without holding
+ *	the file lock, so persisting sessions isn't blocked while we
+ *	work.  The shard locks are only held long enough to take
+ *	references to the sessions.  Records written in the meantime
+ *	are kept in memory, and appended to the new file under the
+ *	file lock, before it replaces the old one.
+ */
+static int tls_cache_compact(fr_tls_session_cache_t *cache)
+{
+	int i, fd, records = 0;
+	char tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache->filename);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		ERROR("tls: Failed creating %s: %s", tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Sessions persisted after this point may be missing
+	 *	from the snapshot below, so keep their records.
+	 */
+	PTHREAD_MUTEX_LOCK(&cache->file_mutex);
+	cache->compacting = true;
+	PTHREAD_MUTEX_UNLOCK(&cache->file_mutex);
+
+	if (write(fd, TLS_CACHE_MAGIC, 8) != 8) goto write_error;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+		tls_cache_entry_t *e;
+		SSL_SESSION **sessions;
+		time_t *expires;
+		int j, num = 0;
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		sessions = talloc_array(NULL, SSL_SESSION *, fr_hash_table_num_elements(shard->sessions) + 1);
+		expires = talloc_array(sessions, time_t, fr_hash_table_num_elements(shard->sessions) + 1);
+		for (e = shard->head; e; e = e->next) {
+			tls_session_up_ref(e->sess);
+			sessions[num] = e->sess;
+			expires[num++] = e->expires;
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+		for (j = 0; j < num; j++) {
+			uint8_t *record;
+			size_t len;
+
+			record = tls_cache_record_add(sessions, sessions[j], expires[j], &len);
+			if (record) {
+				if (write(fd, record, len) != (ssize_t) len) {
+					while (j < num) SSL_SESSION_free(sessions[j++]);
+					talloc_free(sessions);
+					goto write_error;
+				}
+				records++;
+				talloc_free(record);
+			}
+			SSL_SESSION_free(sessions[j]);
+		}
+		talloc_free(sessions);
+	}
+
+	PTHREAD_MUTEX_LOCK(&cache->file_mutex);
+	if (cache->pending_lost) {
+		ERROR("tls: Failed compacting %s: Out of memory", cache->filename);
+		goto error;
+	}
+
+	if (cache->pending_len &&
+	    (write(fd, cache->pending, cache->pending_len) != (ssize_t) cache->pending_len)) {
+		ERROR("tls: Failed writing %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, cache->filename) < 0) {
+		ERROR("tls: Failed renaming %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (cache->fd >= 0) close(cache->fd);
+	cache->fd = fd;
+	cache->records = records + cache->pending_records;
+	records = cache->records;
+	tls_cache_compact_end(cache);
+	PTHREAD_MUTEX_UNLOCK(&cache->file_mutex);
+
+	DEBUG2("  SSL: Compacted %s to %d sessions", cache->filename, records);
+	return 0;
+
+write_error:
+	ERROR("tls: Failed writing %s: %s", tmp, fr_syserror(errno));
+	PTHREAD_MUTEX_LOCK(&cache->file_mutex);
+
+error:
+	tls_cache_compact_end(cache);
+	PTHREAD_MUTEX_UNLOCK(&cache->file_mutex);
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/*
+ *	Expire sessions, and compact the file once most of its
+ *	records are for sessions we no longer have.
+ */
+static void tls_cache_maintain(fr_tls_server_conf_t *conf, time_t now)
+{
+	fr_tls_session_cache_t *cache = conf->session_cache;
+	int live;
+
+	if (!cache) return;
+
+	live = tls_cache_expire(cache, now);
+
+	if (cache->filename && (cache->records > ((2 * live) + 1024))) {
+		(void) tls_cache_compact(cache);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *tls_cache_thread(void *arg)
+{
+	fr_tls_server_conf_t *conf = arg;
+	fr_tls_session_cache_t *cache = conf->session_cache;
+	struct timespec when;
+
+	pthread_mutex_lock(&cache->thread_mutex);
+	while (!cache->thread_stop) {
+		when.tv_sec = time(NULL) + TLS_CACHE_INTERVAL;
+		when.tv_nsec = 0;
+		pthread_cond_timedwait(&cache->thread_cond, &cache->thread_mutex, &when);
+		if (cache->thread_stop) break;
+
+		pthread_mutex_unlock(&cache->thread_mutex);
+		tls_cache_maintain(conf, time(NULL));
+		pthread_mutex_lock(&cache->thread_mutex);
+	}
+	pthread_mutex_unlock(&cache->thread_mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Read the sessions back from the persistence file.
+ */
+static void tls_cache_load(fr_tls_server_conf_t *conf)
+{
+	fr_tls_session_cache_t *cache = conf->session_cache;
+	struct stat buf;
+	uint8_t *map;
+	uint8_t const *p, *end;
+	time_t now = time(NULL);
+	int fd, loaded = 0;
+
+	fd = open(cache->filename, O_RDONLY);
+	if (fd < 0) return;
+
+	if ((fstat(fd, &buf) < 0) || (buf.st_size < 8)) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		WARN("tls: Failed reading %s: %s", cache->filename, fr_syserror(errno));
+		return;
+	}
+
+	if (memcmp(map, TLS_CACHE_MAGIC, 8) != 0) {
+		WARN("tls: Ignoring %s, which is not a session cache", cache->filename);
+		goto done;
+	}
+
+	p = map + 8;
+	end = map + buf.st_size;
+	while ((end - p) >= 4) {
+		tls_cache_shard_t *shard;
+		tls_cache_entry_t *e, my_e;
+		uint8_t const *q, *next;
+		uint32_t len, sess_len, vps_len;
+		int64_t expires;
+		SSL_SESSION *sess;
+		VALUE_PAIR *vps;
+
+		memcpy(&len, p, 4);
+		if ((len < 2) || ((uint32_t) (end - p - 4) < len)) break;	/* truncated by a crash */
+		q = p + 4;
+		next = q + len;
+		p = next;
+
+		if (((uint32_t) q[1] + 2) > len) continue;
+		if (tls_cache_key(&my_e, q + 2, q[1]) < 0) continue;
+
+		shard = tls_cache_shard(cache, my_e.hash);
+
+		if (q[0] == TLS_CACHE_DEL) {
+			e = fr_hash_table_finddata(shard->sessions, &my_e);
+			if (e) tls_cache_unlink(shard, e);
+			continue;
+		}
+
+		if (q[0] != TLS_CACHE_ADD) continue;
+
+		q += 2 + q[1];
+		if ((next - q) < (8 + 4)) continue;
+		memcpy(&expires, q, 8);
+		memcpy(&sess_len, q + 8, 4);
+		q += 8 + 4;
+		if (expires <= now) continue;
+		if ((uint32_t) (next - q) < (sess_len + 4)) continue;
+
+		sess = d2i_SSL_SESSION(NULL, &q, sess_len);
+		if (!sess) continue;
+
+		memcpy(&vps_len, q, 4);
+		q += 4;
+		if ((uint32_t) (next - q) < vps_len) {
+			SSL_SESSION_free(sess);
+			continue;
+		}
+
+		vps = tls_text_to_vps(q, vps_len);
+
+		/*
+		 *	Not safe to resume a session without its VPs.
+		 */
+		if (!vps) {
+			SSL_SESSION_free(sess);
+			continue;
+		}
+		SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_VPS, vps);
+
+		e = talloc_zero(NULL, tls_cache_entry_t);
+		if (!e) {
+			SSL_SESSION_free(sess);
+			break;
+		}
+		memcpy(e, &my_e, sizeof(*e));
+		e->expires = expires;
+		e->sess = sess;
+		tls_cache_insert(shard, e);
+		loaded++;
+	}
+
+	DEBUG("tls: Loaded %d sessions from %s", loaded, cache->filename);
+
+done:
+	munmap(map, buf.st_size);
+}
+
+static int tls_cache_init(fr_tls_server_conf_t *conf)
+{
+	fr_tls_session_cache_t *cache;
+	int i;
+
+	cache = conf->session_cache = talloc_zero(conf, fr_tls_session_cache_t);
+	if (!cache) return -1;
+	cache->fd = -1;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("tls: Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+#endif
+
+		shard->sessions = fr_hash_table_create(tls_cache_entry_hash, tls_cache_entry_cmp,
+						       tls_cache_entry_free);
+		if (!shard->sessions) {
+			ERROR("tls: Failed creating session cache");
+			return -1;
+		}
+
+		if (conf->session_cache_size > 0) {
+			shard->max_entries = (conf->session_cache_size + TLS_CACHE_SHARDS - 1) / TLS_CACHE_SHARDS;
+		}
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->file_mutex, NULL) < 0) {
+		ERROR("tls: Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	if (conf->session_cache_path) {
+		if (!conf->session_id_name) {
+			WARN("tls: Ignoring \"persist_dir\", as the cache has no \"name\"");
+		} else {
+			cache->filename = talloc_asprintf(cache, "%s%c%s.sessions", conf->session_cache_path,
+							  FR_DIR_SEP, conf->session_id_name);
+
+			/*
+			 *	Start with a file holding only the
+			 *	sessions we loaded.
+			 */
+			tls_cache_load(conf);
+			if (tls_cache_compact(cache) < 0) return -1;
+		}
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&cache->thread_mutex, NULL);
+	pthread_cond_init(&cache->thread_cond, NULL);
+	if (pthread_create(&cache->thread, NULL, tls_cache_thread, conf) != 0) {
+		ERROR("tls: Failed creating session cache thread: %s", fr_syserror(errno));
+		return -1;
+	}
+	cache->thread_running = true;
+#endif
+
+	return 0;
+}
+
+static void tls_cache_free(fr_tls_server_conf_t *conf)
+{
+	fr_tls_session_cache_t *cache = conf->session_cache;
+	int i;
+
+	if (!cache) return;
+
+#ifdef HAVE_PTHREAD_H
+	if (cache->thread_running) {
+		pthread_mutex_lock(&cache->thread_mutex);
+		cache->thread_stop = true;
+		pthread_cond_signal(&cache->thread_cond);
+		pthread_mutex_unlock(&cache->thread_mutex);
+		pthread_join(cache->thread, NULL);
+	}
+#endif
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		if (cache->shards[i].sessions) fr_hash_table_free(cache->shards[i].sessions);
+	}
+
+	if (cache->fd >= 0) close(cache->fd);
+	talloc_free(cache);
+	conf->session_cache = NULL;
+}
+
+/*
+ *	Session tickets (RFC 5077).
+ *
+ *	The session, and the attributes cached with it, are encrypted
+ *	into a ticket which the client sends back when it resumes.  No
+ *	server needs to remember anything, so a session started on one
+ *	server can be resumed on any other which has the same keys.
+ *
+ *	Keys are rotated every "rotate" seconds.  Tickets encrypted
+ *	with one of the TLS_TICKET_KEYS most recent keys are accepted,
+ *	and those using an old key are renewed.  If "key_file" is set,
+ *	the keys are shared through it: whichever server first sees
+ *	that the current key is too old writes a new one, and the
+ *	others pick it up when the file changes.
+ */
+#define TLS_TICKET_KEYS		(3)
+#define TLS_TICKET_NAME_LEN	(16)
+#define TLS_TICKET_SECRET_LEN	(32)
+
+typedef struct tls_ticket_key_t {
+	uint8_t			name[TLS_TICKET_NAME_LEN];
+	uint8_t			aes_key[TLS_TICKET_SECRET_LEN];
+	uint8_t			hmac_key[TLS_TICKET_SECRET_LEN];
+	time_t			created;
+} tls_ticket_key_t;
+
+struct fr_tls_ticket_keys_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	tls_ticket_key_t	keys[TLS_TICKET_KEYS];	//!< Newest first.
+	int			num_keys;
+	time_t			checked;	//!< When we last looked at the keys.
+	time_t			mtime;		//!< Of key_file, when we read it.
+};
+
+static int tls_ticket_key_generate(fr_tls_ticket_keys_t *ring, time_t now)
+{
+	tls_ticket_key_t key;
+
+	if ((RAND_bytes(key.name, sizeof(key.name)) <= 0) ||
+	    (RAND_bytes(key.aes_key, sizeof(key.aes_key)) <= 0) ||
+	    (RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) <= 0)) {
+		ERROR("tls: Failed generating session ticket key: %s", ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+	key.created = now;
+
+	memmove(&ring->keys[1], &ring->keys[0], sizeof(ring->keys[0]) * (TLS_TICKET_KEYS - 1));
+	ring->keys[0] = key;
+	if (ring->num_keys < TLS_TICKET_KEYS) ring->num_keys++;
+
+	return 0;
+}
+
+/*
+ *	The key file has one key per line, newest first:
+ *
+ *	<created> <name> <AES key> <HMAC key>
+ *
+ *	with the keys in hex.
+ */
+static int tls_ticket_keys_read(fr_tls_server_conf_t *conf, fr_tls_ticket_keys_t *ring)
+{
+	FILE *fp;
+	struct stat buf;
+	char line[256];
+	char name[(TLS_TICKET_NAME_LEN * 2) + 1];
+	char aes_key[(TLS_TICKET_SECRET_LEN * 2) + 1];
+	char hmac_key[(TLS_TICKET_SECRET_LEN * 2) + 1];
+	long created;
+	int num = 0;
+
+	fp = fopen(conf->ticket_key_file, "r");
+	if (!fp) return (errno == ENOENT) ? 0 : -1;
+
+	if (fstat(fileno(fp), &buf) < 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	while ((num < TLS_TICKET_KEYS) && fgets(line, sizeof(line), fp)) {
+		tls_ticket_key_t *key = &ring->keys[num];
+
+		if (sscanf(line, "%ld %32s %64s %64s", &created, name, aes_key, hmac_key) != 4) continue;
+
+		if ((fr_hex2bin(key->name, name, sizeof(key->name)) != sizeof(key->name)) ||
+		    (fr_hex2bin(key->aes_key, aes_key, sizeof(key->aes_key)) != sizeof(key->aes_key)) ||
+		    (fr_hex2bin(key->hmac_key, hmac_key, sizeof(key->hmac_key)) != sizeof(key->hmac_key))) {
+			continue;
+		}
+		key->created = created;
+		num++;
+	}
+	fclose(fp);
+
+	ring->num_keys = num;
+	ring->mtime = buf.st_mtime;
+
+	return 0;
+}
+
+static int tls_ticket_keys_write(fr_tls_server_conf_t *conf, fr_tls_ticket_keys_t *ring)
+{
+	FILE *fp;
+	int i, fd;
+	struct stat buf;
+	char tmp[PATH_MAX];
+	char name[(TLS_TICKET_NAME_LEN * 2) + 1];
+	char aes_key[(TLS_TICKET_SECRET_LEN * 2) + 1];
+	char hmac_key[(TLS_TICKET_SECRET_LEN * 2) + 1];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", conf->ticket_key_file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) return -1;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < ring->num_keys; i++) {
+		tls_ticket_key_t *key = &ring->keys[i];
+
+		fr_bin2hex(name, key->name, sizeof(key->name));
+		fr_bin2hex(aes_key, key->aes_key, sizeof(key->aes_key));
+		fr_bin2hex(hmac_key, key->hmac_key, sizeof(key->hmac_key));
+		fprintf(fp, "%ld %s %s %s\n", (long) key->created, name, aes_key, hmac_key);
+	}
+
+	if ((fclose(fp) != 0) || (rename(tmp, conf->ticket_key_file) < 0)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	if (stat(conf->ticket_key_file, &buf) == 0) ring->mtime = buf.st_mtime;
+
+	return 0;
+}
+
+/*
+ *	Rotate the keys in the key file.  The file is locked, and
+ *	re-read, so that only one server rotates them.
+ */
+static int tls_ticket_keys_rotate(fr_tls_server_conf_t *conf, fr_tls_ticket_keys_t *ring, time_t now)
+{
+	int fd, rcode = 0;
+	char lock[PATH_MAX];
+
+	snprintf(lock, sizeof(lock), "%s.lock", conf->ticket_key_file);
+	fd = open(lock, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) return -1;
+
+	if (rad_lockfd(fd, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (tls_ticket_keys_read(conf, ring) < 0) {
+		rcode = -1;
+		goto done;
+	}
+
+	/*
+	 *	Another server got here first.
+	 */
+	if ((ring->num_keys > 0) && ((now - ring->keys[0].created) < conf->ticket_key_rotate)) goto done;
+
+	if ((tls_ticket_key_generate(ring, now) < 0) ||
+	    (tls_ticket_keys_write(conf, ring) < 0)) {
+		rcode = -1;
+		goto done;
+	}
+
+	DEBUG2("  SSL: Rotated session ticket keys in %s", conf->ticket_key_file);
+
+done:
+	rad_unlockfd(fd, 0);
+	close(fd);
+
+	return rcode;
+}
+
+/*
+ *	Pick up new keys, and rotate them if it's time.  The ring must
+ *	be locked.
+ */
+static int tls_ticket_keys_refresh(fr_tls_server_conf_t *conf, fr_tls_ticket_keys_t *ring, time_t now)
+{
+	struct stat buf;
+
+	if (ring->checked == now) return 0;
+	ring->checked = now;
+
+	if (conf->ticket_key_file &&
+	    (stat(conf->ticket_key_file, &buf) == 0) && (buf.st_mtime != ring->mtime)) {
+		if (tls_ticket_keys_read(conf, ring) < 0) {
+			ERROR("tls: Failed reading %s: %s", conf->ticket_key_file, fr_syserror(errno));
+		}
+	}
+
+	if ((ring->num_keys > 0) && ((now - ring->keys[0].created) < conf->ticket_key_rotate)) return 0;
+
+	if (!conf->ticket_key_file) return tls_ticket_key_generate(ring, now);
+
+	if (tls_ticket_keys_rotate(conf, ring, now) < 0) {
+		ERROR("tls: Failed rotating keys in %s: %s", conf->ticket_key_file, fr_syserror(errno));
+
+		/*
+		 *	Keep issuing tickets with a key of our own,
+		 *	rather than using a stale one forever.
+		 */
+		if (ring->num_keys == 0) return tls_ticket_key_generate(ring, now);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Called by OpenSSL to get the keys to encrypt a new ticket, or
+ *	to decrypt one sent by the client.
+ *
+ *	Returns -1 on error, 0 if we don't have the key (so a full
+ *	handshake is done), 1 on success, and 2 if the ticket should
+ *	be replaced with one using the current key.
+ */
+static int cbtls_ticket_key(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+			    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	fr_tls_server_conf_t *conf;
+	fr_tls_ticket_keys_t *ring;
+	tls_ticket_key_t *key = NULL;
+	int i, rcode;
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	if (!conf || !conf->ticket_keys) return -1;
+	ring = conf->ticket_keys;
+
+	PTHREAD_MUTEX_LOCK(&ring->mutex);
+	(void) tls_ticket_keys_refresh(conf, ring, time(NULL));
+
+	if (enc) {
+		if (ring->num_keys == 0) goto error;
+		key = &ring->keys[0];
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0) goto error;
+		memcpy(key_name, key->name, TLS_TICKET_NAME_LEN);
+
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) ||
+		    !HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL)) goto error;
+
+		PTHREAD_MUTEX_UNLOCK(&ring->mutex);
+		return 1;
+	}
+
+	for (i = 0; i < ring->num_keys; i++) {
+		if (memcmp(ring->keys[i].name, key_name, TLS_TICKET_NAME_LEN) == 0) {
+			key = &ring->keys[i];
+			break;
+		}
+	}
+
+	if (!key) {
+		PTHREAD_MUTEX_UNLOCK(&ring->mutex);
+		DEBUG2("  SSL: Session ticket key not found, doing a full handshake");
+		return 0;
+	}
+
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL) ||
+	    !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes_key, iv)) goto error;
+
+	rcode = (key == &ring->keys[0]) ? 1 : 2;
+	PTHREAD_MUTEX_UNLOCK(&ring->mutex);
+
+	return rcode;
+
+error:
+	PTHREAD_MUTEX_UNLOCK(&ring->mutex);
+	return -1;
+}
+
+#ifdef TLS_TICKET_APPDATA
+/*
+ *	Starts the data of tickets which may be used to resume a
+ *	session.  Anything else gets a full handshake.
+ */
+#define TLS_TICKET_AUTHENTICATED	"authenticated\n"
+#define TLS_TICKET_AUTHENTICATED_LEN	(sizeof(TLS_TICKET_AUTHENTICATED) - 1)
+
+/*
+ *	Whether the client presented a certificate, and it was
+ *	verified.
+ */
+static bool tls_peer_verified(SSL *ssl)
+{
+	X509 *cert;
+
+	cert = SSL_get_peer_certificate(ssl);
+	if (!cert) return false;
+	X509_free(cert);
+
+	return (SSL_get_verify_result(ssl) == X509_V_OK);
+}
+
+/*
+ *	Put the cached attributes into a ticket we're about to issue.
+ *
+ *	The ticket is issued at the end of the handshake, so only
+ *	attributes known by then are in it.  These are the
+ *	certificate attributes, and any added before EAP started.
+ *
+ *	Only a verified client certificate has authenticated the
+ *	client by then, so only those tickets are marked as usable.
+ *	If the certificate is rejected later, by the EAP-TLS virtual
+ *	server, the check is made again when the session is resumed.
+ *	Tunnelled sessions don't issue tickets at all, see
+ *	tls_session_tunnelled().
+ */
+static int cbtls_ticket_gen(SSL *ssl, UNUSED void *arg)
+{
+	REQUEST *request;
+	tls_session_t *ssn;
+	VALUE_PAIR *vps;
+	char *text, *marked;
+	int rcode;
+
+	request = (REQUEST *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	ssn = (tls_session_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_SSN);
+	if (!request || !ssn || ssn->tunnelled || !tls_peer_verified(ssl)) return 1;
+
+	vps = tls_session_vps(ssl, request);
+	text = tls_vps_to_text(NULL, vps);
+	pairfree(&vps);
+	if (!text) return 0;
+
+	marked = talloc_asprintf(NULL, "%s%s", TLS_TICKET_AUTHENTICATED, text);
+	talloc_free(text);
+	if (!marked) return 0;
+	text = marked;
+
+	rcode = SSL_SESSION_set1_ticket_appdata(SSL_get_session(ssl), text, strlen(text));
+	talloc_free(text);
+
+	return rcode;
+}
+
+/*
+ *	Restore the cached attributes from a ticket sent by the client.
+ *	Tickets which weren't marked as usable, or without any
+ *	attributes, are refused, as the session can't be resumed
+ *	safely without them.  So are all tickets for tunnelled
+ *	sessions.
+ */
+static SSL_TICKET_RETURN cbtls_ticket_dec(SSL *ssl, SSL_SESSION *sess,
+					  UNUSED unsigned char const *keyname, UNUSED size_t keyname_len,
+					  SSL_TICKET_STATUS status, UNUSED void *arg)
+{
+	void *data;
+	size_t len;
+	VALUE_PAIR *vps;
+	tls_session_t *ssn;
+
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		break;
+
+	case SSL_TICKET_FATAL_ERR_MALLOC:
+	case SSL_TICKET_FATAL_ERR_OTHER:
+		return SSL_TICKET_RETURN_ABORT;
+
+	default:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	ssn = (tls_session_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_SSN);
+	if (!ssn || ssn->tunnelled) return SSL_TICKET_RETURN_IGNORE;
+
+	if (!SSL_SESSION_get0_ticket_appdata(sess, &data, &len) ||
+	    (len < TLS_TICKET_AUTHENTICATED_LEN) ||
+	    (memcmp(data, TLS_TICKET_AUTHENTICATED, TLS_TICKET_AUTHENTICATED_LEN) != 0)) {
+		DEBUG2("  SSL: Session ticket wasn't issued to an authenticated client, doing a full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	vps = tls_text_to_vps(((uint8_t const *) data) + TLS_TICKET_AUTHENTICATED_LEN,
+			      len - TLS_TICKET_AUTHENTICATED_LEN);
+	if (!vps) {
+		DEBUG2("  SSL: Session ticket has no cached attributes, doing a full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_VPS, vps);
+
+	return (status == SSL_TICKET_SUCCESS) ? SSL_TICKET_RETURN_USE : SSL_TICKET_RETURN_USE_RENEW;
+}
+#endif
+
+static int tls_ticket_init(fr_tls_server_conf_t *conf)
+{
+	fr_tls_ticket_keys_t *ring;
+	int rcode;
+
+	ring = conf->ticket_keys = talloc_zero(conf, fr_tls_ticket_keys_t);
+	if (!ring) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&ring->mutex, NULL) < 0) {
+		ERROR("tls: Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	ring->checked = -1;
+	rcode = tls_ticket_keys_refresh(conf, ring, time(NULL));
+	if ((rcode < 0) || (ring->num_keys == 0)) {
+		ERROR("tls: Failed initializing session ticket keys");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Convert an ASN.1 time to a time_t.  Returns 0 if the time
+ *	can't be converted.
+ */
+static time_t tls_asn1_time(ASN1_TIME const *when)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	int days, secs;
+
+	if (!when || !ASN1_TIME_diff(&days, &secs, NULL, when)) return 0;
+
+	return time(NULL) + ((time_t) days * 86400) + secs;
+#else
+	return 0;
+#endif
+}
+
+#ifdef HAVE_OPENSSL_OCSP_H
+/*
+ * This function extracts the OCSP Responder URL
+ * from an existing x509 certificate.
+ */
+static int ocsp_parse_cert_url(X509 *cert, char **phost, char **pport,
+			       char **ppath, int *pssl)
+{
+	int i;
+
+	AUTHORITY_INFO_ACCESS *aia;
+	ACCESS_DESCRIPTION *ad;
+
+	aia = X509_get_ext_d2i(cert, NID_info_access, NULL, NULL);
+
+	for (i = 0; i < sk_ACCESS_DESCRIPTION_num(aia); i++) {
+		ad = sk_ACCESS_DESCRIPTION_value(aia, 0);
+		if (OBJ_obj2nid(ad->method) == NID_ad_OCSP) {
+			if (ad->location->type == GEN_URI) {
+			  if(OCSP_parse_url((char *) ad->location->d.ia5->data,
+						  phost, pport, ppath, pssl))
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * This function sends a OCSP request to a defined OCSP responder
+ * and checks the OCSP response for correctness.
+ */
+
+/* Maximum leeway in validity period: default 5 minutes */
 #define MAX_VALIDITY_PERIOD     (5 * 60)
 
-static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
-		      fr_tls_server_conf_t *conf)
+#define OCSP_CACHE_INTERVAL	(10)	/* how often hot responses are refreshed */
+
+/*
+ *	OCSP response cache.
+ *
+ *	Responses are cached by certificate id (the hashes of the
+ *	issuer's name and key, and the serial number), until the
+ *	"nextUpdate" time given by the responder, or for "lifetime"
+ *	seconds, whichever comes first.
+ *
+ *	Responses which have been used since they were fetched are
+ *	refreshed by a background thread, "refresh_before" seconds
+ *	before they expire, so that busy certificates never wait for
+ *	the responder.  If the responder can't be reached, a response
+ *	which expired less than "softfail_window" seconds ago is used
+ *	instead.
+ */
+typedef struct ocsp_cache_entry_t ocsp_cache_entry_t;
+
+struct ocsp_cache_entry_t {
+	uint8_t			*key;		//!< DER encoded certificate id.
+	size_t			key_len;
+	uint32_t		hash;
+	OCSP_CERTID		*certid;
+	char			*host;		//!< Where the response came from.
+	char			*port;
+	char			*path;
+
+	int			status;		//!< V_OCSP_CERTSTATUS_*
+	time_t			expires;
+	int			hits;		//!< Since the response was fetched.
+	bool			refreshing;
+
+	ocsp_cache_entry_t	*prev;		//!< Oldest first.
+	ocsp_cache_entry_t	*next;
+};
+
+struct fr_tls_ocsp_cache_t {
+	char const		*name;
+	fr_tls_server_conf_t	*conf;
+
+	fr_hash_table_t		*entries;
+	ocsp_cache_entry_t	*head;
+	ocsp_cache_entry_t	*tail;
+	fr_tls_ocsp_stats_t	stats;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		thread_cond;
+	pthread_t		thread;
+	bool			thread_running;
+	bool			thread_stop;
+#else
+	time_t			next_expire;
+#endif
+
+	fr_tls_ocsp_cache_t	*next;		//!< All caches, for the statistics.
+};
+
+static fr_tls_ocsp_cache_t *ocsp_caches = NULL;
+
+/*
+ *	Ask the OCSP responder for the status of a certificate.
+ *
+ *	Returns 1 if the responder told us the status of the
+ *	certificate, 0 if its response was invalid, and 2 if we
+ *	couldn't get a response.
+ */
+static int ocsp_query(fr_tls_server_conf_t *conf, X509_STORE *store, OCSP_CERTID *certid,
+		      char *host, char *port, char *path, int *pstatus, time_t *pnext_update)
 {
-	OCSP_CERTID *certid;
 	OCSP_REQUEST *req;
 	OCSP_RESPONSE *resp = NULL;
 	OCSP_BASICRESP *bresp = NULL;
-	char *host = NULL;
-	char *port = NULL;
-	char *path = NULL;
-	int use_ssl = -1;
 	long nsec = MAX_VALIDITY_PERIOD, maxage = -1;
 	BIO *cbio, *bio_out;
 	int ocsp_ok = 0;
 	int status ;
 	ASN1_GENERALIZEDTIME *rev, *thisupd, *nextupd;
 	int reason;
+	uint64_t start;
 #if OPENSSL_VERSION_NUMBER >= 0x1000003f
 	OCSP_REQ_CTX *ctx;
 	int rc;
@@ -1270,12 +2821,13 @@ static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
 	struct timeval when;
 #endif
 
+	start = fr_latency_now();
+
 	/*
 	 * Create OCSP Request
 	 */
-	certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
 	req = OCSP_REQUEST_new();
-	OCSP_request_add0_id(req, certid);
+	OCSP_request_add0_id(req, OCSP_CERTID_dup(certid));
 	if(conf->ocsp_use_nonce) {
 		OCSP_request_add1_nonce(req, NULL, 8);
 	}
@@ -1283,21 +2835,6 @@ static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
 	/*
 	 * Send OCSP Request and get OCSP Response
 	 */
-
-	/* Get OCSP responder URL */
-	if(conf->ocsp_override_url) {
-		OCSP_parse_url(conf->ocsp_url, &host, &port, &path, &use_ssl);
-	}
-	else {
-		ocsp_parse_cert_url(client_cert, &host, &port, &path, &use_ssl);
-	}
-
-	if (!host || !port || !path) {
-		DEBUG2("[ocsp] - Host / port / path missing.  Not doing OCSP");
-		ocsp_ok = 2;
-		goto ocsp_skip;
-	}
-
 	DEBUG2("[ocsp] --> Responder URL = http://%s:%s%s", host, port, path);
 
 	/* Setup BIO socket to OCSP responder */
@@ -1378,53 +2915,518 @@ static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
 		goto ocsp_end;
 	}
 
-	/*	Verify OCSP cert status */
-	if(!OCSP_resp_find_status(bresp, certid, &status, &reason,
-						      &rev, &thisupd, &nextupd)) {
-		ERROR("No Status found.\n");
-		goto ocsp_end;
+	/*	Verify OCSP cert status */
+	if(!OCSP_resp_find_status(bresp, certid, &status, &reason,
+						      &rev, &thisupd, &nextupd)) {
+		ERROR("No Status found.\n");
+		goto ocsp_end;
+	}
+
+	if (!OCSP_check_validity(thisupd, nextupd, nsec, maxage)) {
+		BIO_puts(bio_out, "WARNING: Status times invalid.\n");
+		ERR_print_errors(bio_out);
+		goto ocsp_end;
+	}
+	BIO_puts(bio_out, "\tThis Update: ");
+	ASN1_GENERALIZEDTIME_print(bio_out, thisupd);
+	BIO_puts(bio_out, "\n");
+	if (nextupd) {
+		BIO_puts(bio_out, "\tNext Update: ");
+		ASN1_GENERALIZEDTIME_print(bio_out, nextupd);
+		BIO_puts(bio_out, "\n");
+	}
+
+	switch (status) {
+	case V_OCSP_CERTSTATUS_GOOD:
+		DEBUG2("[oscp] --> Cert status: good");
+		break;
+
+	default:
+		/* REVOKED / UNKNOWN */
+		DEBUG2("[ocsp] --> Cert status: %s",OCSP_cert_status_str(status));
+		if (reason != -1)
+			DEBUG2("[ocsp] --> Reason: %s", OCSP_crl_reason_str(reason));
+		BIO_puts(bio_out, "\tRevocation Time: ");
+		ASN1_GENERALIZEDTIME_print(bio_out, rev);
+		BIO_puts(bio_out, "\n");
+		break;
+	}
+
+	*pstatus = status;
+	*pnext_update = tls_asn1_time(nextupd);
+	ocsp_ok = 1;
+
+ocsp_end:
+	/* Free OCSP Stuff */
+	OCSP_REQUEST_free(req);
+	OCSP_RESPONSE_free(resp);
+	BIO_free_all(cbio);
+	BIO_free(bio_out);
+	OCSP_BASICRESP_free(bresp);
+
+	if (conf->ocsp_cache) {
+		fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+
+		PTHREAD_MUTEX_LOCK(&cache->mutex);
+		cache->stats.queries++;
+		if (ocsp_ok != 1) cache->stats.failures++;
+		cache->stats.query_usec += fr_latency_now() - start;
+		PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+	}
+
+	return ocsp_ok;
+}
+
+static uint32_t ocsp_cache_entry_hash(void const *data)
+{
+	ocsp_cache_entry_t const *e = data;
+
+	return e->hash;
+}
+
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one;
+	ocsp_cache_entry_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static void ocsp_cache_entry_free(void *data)
+{
+	ocsp_cache_entry_t *e = data;
+
+	OCSP_CERTID_free(e->certid);
+	talloc_free(e);
+}
+
+static void ocsp_cache_unlink(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		cache->head = e->next;
+	}
+
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		cache->tail = e->prev;
+	}
+
+	e->prev = e->next = NULL;
+}
+
+static void ocsp_cache_append(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *e)
+{
+	e->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = e;
+	} else {
+		cache->head = e;
+	}
+	cache->tail = e;
+}
+
+/*
+ *	Must be called with the mutex held.
+ */
+static ocsp_cache_entry_t *ocsp_cache_lookup(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len)
+{
+	ocsp_cache_entry_t my_e;
+
+	memset(&my_e, 0, sizeof(my_e));
+	memcpy(&my_e.key, &key, sizeof(my_e.key));
+	my_e.key_len = key_len;
+	my_e.hash = fr_hash(key, key_len);
+
+	return fr_hash_table_finddata(cache->entries, &my_e);
+}
+
+/*
+ *	Find a cached response.  Expired responses are returned only
+ *	if "stale" is set, and then only if they expired less than
+ *	"softfail_window" seconds ago.
+ */
+static bool ocsp_cache_find(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len,
+			    bool stale, int *pstatus)
+{
+	ocsp_cache_entry_t *e;
+	time_t now = time(NULL);
+	bool found = false;
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	e = ocsp_cache_lookup(cache, key, key_len);
+	if (!stale) {
+		if (e && (e->expires > now)) {
+			e->hits++;
+			cache->stats.hits++;
+			*pstatus = e->status;
+			found = true;
+		} else {
+			cache->stats.misses++;
+		}
+
+	} else if (e && ((e->expires + cache->conf->ocsp_softfail_window) > now)) {
+		cache->stats.stale++;
+		*pstatus = e->status;
+		found = true;
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	return found;
+}
+
+/*
+ *	Add or update a response.
+ */
+static void ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, uint8_t const *key, size_t key_len,
+			      OCSP_CERTID *certid, char const *host, char const *port, char const *path,
+			      int status, time_t next_update)
+{
+	fr_tls_server_conf_t *conf = cache->conf;
+	ocsp_cache_entry_t *e;
+	time_t now = time(NULL);
+	time_t expires;
+
+	expires = now + conf->ocsp_cache_lifetime;
+	if (next_update && (next_update < expires)) expires = next_update;
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	e = ocsp_cache_lookup(cache, key, key_len);
+	if (e) {
+		ocsp_cache_unlink(cache, e);
+
+		/*
+		 *	Don't keep serving a response which the
+		 *	responder says is already out of date.
+		 */
+		if (expires <= now) {
+			fr_hash_table_delete(cache->entries, e);
+			goto done;
+		}
+
+	} else {
+		if (expires <= now) goto done;
+
+		e = talloc_zero(NULL, ocsp_cache_entry_t);
+		if (!e) goto done;
+
+		e->key = talloc_memdup(e, key, key_len);
+		e->key_len = key_len;
+		e->hash = fr_hash(key, key_len);
+		e->certid = OCSP_CERTID_dup(certid);
+		e->host = talloc_strdup(e, host);
+		e->port = talloc_strdup(e, port);
+		e->path = talloc_strdup(e, path);
+
+		if (!e->key || !e->certid || !e->host || !e->port || !e->path ||
+		    !fr_hash_table_insert(cache->entries, e)) {
+			ocsp_cache_entry_free(e);
+			goto done;
+		}
+
+		/*
+		 *	Make room by dropping the oldest response.
+		 */
+		if (conf->ocsp_cache_size &&
+		    (fr_hash_table_num_elements(cache->entries) > conf->ocsp_cache_size)) {
+			ocsp_cache_entry_t *old = cache->head;
+
+			ocsp_cache_unlink(cache, old);
+			fr_hash_table_delete(cache->entries, old);
+		}
+	}
+
+	e->status = status;
+	e->expires = expires;
+	e->hits = 0;
+	e->refreshing = false;
+	ocsp_cache_append(cache, e);
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+}
+
+/*
+ *	Drop responses which are too old to be used, even when the
+ *	responder is down.  Must be called with the mutex held.
+ */
+static void ocsp_cache_expire(fr_tls_ocsp_cache_t *cache, time_t now)
+{
+	ocsp_cache_entry_t *e, *next;
+
+	for (e = cache->head; e; e = next) {
+		next = e->next;
+
+		if ((e->expires + cache->conf->ocsp_softfail_window) > now) continue;
+
+		ocsp_cache_unlink(cache, e);
+		fr_hash_table_delete(cache->entries, e);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct ocsp_refresh_t ocsp_refresh_t;
+
+struct ocsp_refresh_t {
+	uint8_t			*key;
+	size_t			key_len;
+	OCSP_CERTID		*certid;
+	char			*host;
+	char			*port;
+	char			*path;
+	ocsp_refresh_t		*next;
+};
+
+/*
+ *	Fetch new responses for the hot entries which are about to
+ *	expire.  The details of each entry are copied, so that the
+ *	responder can be queried without holding the mutex.
+ */
+static void ocsp_cache_refresh(fr_tls_ocsp_cache_t *cache)
+{
+	fr_tls_server_conf_t *conf = cache->conf;
+	ocsp_cache_entry_t *e;
+	ocsp_refresh_t *list = NULL, *r;
+	TALLOC_CTX *ctx;
+	time_t now = time(NULL);
+	int status;
+	time_t next_update;
+
+	ctx = talloc_new(NULL);
+	if (!ctx) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	ocsp_cache_expire(cache, now);
+
+	for (e = cache->head; e; e = e->next) {
+		if (e->refreshing || !e->hits) continue;
+		if ((e->expires - now) > conf->ocsp_refresh_before) continue;
+
+		r = talloc_zero(ctx, ocsp_refresh_t);
+		if (!r) break;
+
+		r->key = talloc_memdup(r, e->key, e->key_len);
+		r->key_len = e->key_len;
+		r->host = talloc_strdup(r, e->host);
+		r->port = talloc_strdup(r, e->port);
+		r->path = talloc_strdup(r, e->path);
+		r->certid = OCSP_CERTID_dup(e->certid);
+		if (!r->certid) break;
+
+		e->refreshing = true;
+		r->next = list;
+		list = r;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	for (r = list; r; r = r->next) {
+		if (ocsp_query(conf, conf->ocsp_store, r->certid, r->host, r->port, r->path,
+			       &status, &next_update) == 1) {
+			ocsp_cache_insert(cache, r->key, r->key_len, r->certid, r->host, r->port, r->path,
+					  status, next_update);
+
+			pthread_mutex_lock(&cache->mutex);
+			cache->stats.refreshes++;
+			pthread_mutex_unlock(&cache->mutex);
+		} else {
+			pthread_mutex_lock(&cache->mutex);
+			e = ocsp_cache_lookup(cache, r->key, r->key_len);
+			if (e) e->refreshing = false;
+			pthread_mutex_unlock(&cache->mutex);
+		}
+	}
+
+	for (r = list; r; r = r->next) OCSP_CERTID_free(r->certid);
+	talloc_free(ctx);
+}
+
+static void *ocsp_cache_thread(void *arg)
+{
+	fr_tls_ocsp_cache_t *cache = arg;
+	struct timespec when;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->thread_stop) {
+		when.tv_sec = time(NULL) + OCSP_CACHE_INTERVAL;
+		when.tv_nsec = 0;
+		pthread_cond_timedwait(&cache->thread_cond, &cache->mutex, &when);
+		if (cache->thread_stop) break;
+
+		pthread_mutex_unlock(&cache->mutex);
+		ocsp_cache_refresh(cache);
+		pthread_mutex_lock(&cache->mutex);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+#endif
+
+static int ocsp_cache_init(fr_tls_server_conf_t *conf, CONF_SECTION *cs)
+{
+	fr_tls_ocsp_cache_t *cache;
+	char const *name;
+
+	cache = conf->ocsp_cache = talloc_zero(conf, fr_tls_ocsp_cache_t);
+	if (!cache) return -1;
+
+	name = cf_section_name2(cs);
+	if (!name) name = cf_section_name1(cs);
+	cache->name = talloc_strdup(cache, name);
+	cache->conf = conf;
+
+	cache->entries = fr_hash_table_create(ocsp_cache_entry_hash, ocsp_cache_entry_cmp,
+					      ocsp_cache_entry_free);
+	if (!cache->entries) {
+		ERROR("tls: Failed creating OCSP cache");
+		return -1;
+	}
+
+	cache->next = ocsp_caches;
+	ocsp_caches = cache;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->thread_cond, NULL);
+	if (pthread_create(&cache->thread, NULL, ocsp_cache_thread, cache) != 0) {
+		ERROR("tls: Failed creating OCSP cache thread: %s", fr_syserror(errno));
+		return -1;
+	}
+	cache->thread_running = true;
+#endif
+
+	return 0;
+}
+
+static void ocsp_cache_free(fr_tls_server_conf_t *conf)
+{
+	fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+	fr_tls_ocsp_cache_t **last;
+
+	if (!cache) return;
+
+#ifdef HAVE_PTHREAD_H
+	if (cache->thread_running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->thread_stop = true;
+		pthread_cond_signal(&cache->thread_cond);
+		pthread_mutex_unlock(&cache->mutex);
+		pthread_join(cache->thread, NULL);
+	}
+#endif
+
+	for (last = &ocsp_caches; *last; last = &(*last)->next) {
+		if (*last == cache) {
+			*last = cache->next;
+			break;
+		}
+	}
+
+	if (cache->entries) fr_hash_table_free(cache->entries);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&cache->thread_cond);
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	talloc_free(cache);
+	conf->ocsp_cache = NULL;
+}
+
+/** Call a function with the statistics of every OCSP cache
+ *
+ * Called from the main thread.
+ */
+void tls_ocsp_cache_walk(fr_tls_ocsp_walk_t callback, void *ctx)
+{
+	fr_tls_ocsp_cache_t *cache;
+	fr_tls_ocsp_stats_t stats;
+
+	for (cache = ocsp_caches; cache; cache = cache->next) {
+		PTHREAD_MUTEX_LOCK(&cache->mutex);
+		stats = cache->stats;
+		stats.entries = fr_hash_table_num_elements(cache->entries);
+		PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+		callback(ctx, cache->name, &stats);
+	}
+}
+
+static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		      fr_tls_server_conf_t *conf)
+{
+	fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+	OCSP_CERTID *certid;
+	uint8_t *key = NULL;
+	int key_len = 0;
+	char *host = NULL;
+	char *port = NULL;
+	char *path = NULL;
+	int use_ssl = -1;
+	int ocsp_ok = 0;
+	int status = V_OCSP_CERTSTATUS_UNKNOWN;
+	time_t next_update = 0;
+
+	certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+	if (!certid) {
+		ERROR("Couldn't create OCSP certificate id");
+		ocsp_ok = 2;
+		goto ocsp_skip;
+	}
+
+	if (cache) {
+#ifndef HAVE_PTHREAD_H
+		time_t now = time(NULL);
+
+		if (now >= cache->next_expire) {
+			ocsp_cache_expire(cache, now);
+			cache->next_expire = now + OCSP_CACHE_INTERVAL;
+		}
+#endif
+		key_len = i2d_OCSP_CERTID(certid, &key);
+		if (key_len <= 0) key = NULL;
+
+		if (key && ocsp_cache_find(cache, key, key_len, false, &status)) {
+			DEBUG2("[ocsp] --> Using cached response");
+			ocsp_ok = (status == V_OCSP_CERTSTATUS_GOOD) ? 1 : 0;
+			goto ocsp_end;
+		}
+	}
+
+	/* Get OCSP responder URL */
+	if(conf->ocsp_override_url) {
+		OCSP_parse_url(conf->ocsp_url, &host, &port, &path, &use_ssl);
+	}
+	else {
+		ocsp_parse_cert_url(client_cert, &host, &port, &path, &use_ssl);
 	}
 
-	if (!OCSP_check_validity(thisupd, nextupd, nsec, maxage)) {
-		BIO_puts(bio_out, "WARNING: Status times invalid.\n");
-		ERR_print_errors(bio_out);
+	if (!host || !port || !path) {
+		DEBUG2("[ocsp] - Host / port / path missing.  Not doing OCSP");
+		ocsp_ok = 2;
 		goto ocsp_end;
 	}
-	BIO_puts(bio_out, "\tThis Update: ");
-	ASN1_GENERALIZEDTIME_print(bio_out, thisupd);
-	BIO_puts(bio_out, "\n");
-	if (nextupd) {
-		BIO_puts(bio_out, "\tNext Update: ");
-		ASN1_GENERALIZEDTIME_print(bio_out, nextupd);
-		BIO_puts(bio_out, "\n");
-	}
 
-	switch (status) {
-	case V_OCSP_CERTSTATUS_GOOD:
-		DEBUG2("[oscp] --> Cert status: good");
-		ocsp_ok = 1;
-		break;
+	ocsp_ok = ocsp_query(conf, store, certid, host, port, path, &status, &next_update);
+	if (ocsp_ok == 1) {
+		if (key) ocsp_cache_insert(cache, key, key_len, certid, host, port, path, status, next_update);
+		if (status != V_OCSP_CERTSTATUS_GOOD) ocsp_ok = 0;
 
-	default:
-		/* REVOKED / UNKNOWN */
-		DEBUG2("[ocsp] --> Cert status: %s",OCSP_cert_status_str(status));
-		if (reason != -1)
-			DEBUG2("[ocsp] --> Reason: %s", OCSP_crl_reason_str(reason));
-		BIO_puts(bio_out, "\tRevocation Time: ");
-		ASN1_GENERALIZEDTIME_print(bio_out, rev);
-		BIO_puts(bio_out, "\n");
-		break;
+	} else if ((ocsp_ok == 2) && key && ocsp_cache_find(cache, key, key_len, true, &status)) {
+		DEBUG2("[ocsp] --> Responder unavailable, using expired response");
+		ocsp_ok = (status == V_OCSP_CERTSTATUS_GOOD) ? 1 : 0;
 	}
 
 ocsp_end:
-	/* Free OCSP Stuff */
-	OCSP_REQUEST_free(req);
-	OCSP_RESPONSE_free(resp);
+	OCSP_CERTID_free(certid);
+	if (key) OPENSSL_free(key);
 	free(host);
 	free(port);
 	free(path);
-	BIO_free_all(cbio);
-	OCSP_BASICRESP_free(bresp);
 
  ocsp_skip:
 	switch (ocsp_ok) {
@@ -1504,8 +3506,7 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 	char cn_str[1024];
 	char buf[64];
 	X509 *client_cert;
-	X509_CINF *client_inf;
-	STACK_OF(X509_EXTENSION) *ext_list;
+	int ext_count;
 	SSL *ssl;
 	int err, depth, lookup, loc;
 	fr_tls_server_conf_t *conf;
@@ -1600,7 +3601,7 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 		pairmake(NULL, certs, cert_attr_names[FR_TLS_SUBJECT][lookup], subject, T_OP_SET);
 	}
 
-	X509_NAME_oneline(X509_get_issuer_name(ctx->current_cert), issuer,
+	X509_NAME_oneline(X509_get_issuer_name(client_cert), issuer,
 			  sizeof(issuer));
 	issuer[sizeof(issuer) - 1] = '\0';
 	if (identity && (lookup <= 1) && issuer[0]) {
@@ -1666,17 +3667,16 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 	}
 
 	if (lookup == 0) {
-		client_inf = client_cert->cert_info;
-		ext_list = client_inf->extensions;
+		ext_count = X509_get_ext_count(client_cert);
 	} else {
-		ext_list = NULL;
+		ext_count = 0;
 	}
 
 	/*
 	 *	Grab the X509 extensions, and create attributes out of them.
 	 *	For laziness, we re-use the OpenSSL names
 	 */
-	if (sk_X509_EXTENSION_num(ext_list) > 0) {
+	if (ext_count > 0) {
 		int i, len;
 		char *p;
 		BIO *out;
@@ -1684,12 +3684,12 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 		out = BIO_new(BIO_s_mem());
 		strlcpy(attribute, "TLS-Client-Cert-", sizeof(attribute));
 
-		for (i = 0; i < sk_X509_EXTENSION_num(ext_list); i++) {
+		for (i = 0; i < ext_count; i++) {
 			ASN1_OBJECT *obj;
 			X509_EXTENSION *ext;
 			VALUE_PAIR *vp;
 
-			ext = sk_X509_EXTENSION_value(ext_list, i);
+			ext = X509_get_ext(client_cert, i);
 
 			obj = X509_EXTENSION_get_object(ext);
 			i2a_ASN1_OBJECT(out, obj);
@@ -1719,7 +3719,7 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 		BIO_free_all(out);
 	}
 
-	switch (ctx->error) {
+	switch (X509_STORE_CTX_get_error(ctx)) {
 
 	case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
 		ERROR("issuer= %s\n", issuer);
@@ -1849,6 +3849,374 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 	return my_ok;
 }
 
+/*
+ *	Certificate verification cache.
+ *
+ *	Building and checking the chain of a client certificate,
+ *	including the CRL lookups, is repeated every time a device
+ *	reconnects.  When the verify "cache" is enabled, the chain of
+ *	a certificate which passed verification is cached, keyed by
+ *	the SHA-256 fingerprint of the certificate.  The next time the
+ *	certificate is seen, the cached chain is handed to
+ *	cbtls_verify() as if OpenSSL had just built it, so that the
+ *	certificate attributes are created, and the per-request checks
+ *	(check_cert_cn, OCSP, the external command) are still done.
+ *
+ *	Entries expire after "lifetime" seconds, or when any of the
+ *	certificates in the chain, or the CRL of any of the issuers,
+ *	does.  When the CA file or directory changes, the cache is
+ *	emptied, and its generation is incremented, so that
+ *	verifications which were in progress are not cached.
+ */
+#define TLS_VERIFY_CHECK_INTERVAL	(5)	/* how often the CA files are checked */
+#define TLS_VERIFY_FINGERPRINT_LEN	(32)
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_STORE_CTX_get0_cert(_ctx)			((_ctx)->cert)
+#define X509_STORE_CTX_set_current_cert(_ctx, _cert)	((_ctx)->current_cert = (_cert))
+#define X509_STORE_CTX_set_error_depth(_ctx, _depth)	((_ctx)->error_depth = (_depth))
+#define X509_STORE_CTX_get1_crls			X509_STORE_get1_crls
+#define X509_CRL_get0_nextUpdate			X509_CRL_get_nextUpdate
+#endif
+
+typedef struct tls_verify_entry_t tls_verify_entry_t;
+
+struct tls_verify_entry_t {
+	uint8_t			fingerprint[TLS_VERIFY_FINGERPRINT_LEN];
+	uint32_t		hash;
+	uint32_t		generation;
+	time_t			expires;
+	STACK_OF(X509)		*chain;		//!< Client certificate first.
+
+	tls_verify_entry_t	*prev;		//!< Oldest first.
+	tls_verify_entry_t	*next;
+};
+
+typedef struct tls_verify_file_t {
+	time_t			mtime;
+	ino_t			ino;
+	off_t			size;
+} tls_verify_file_t;
+
+struct fr_tls_verify_cache_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*entries;
+	tls_verify_entry_t	*head;
+	tls_verify_entry_t	*tail;
+
+	uint32_t		generation;
+	time_t			checked;	//!< When the CA files were last looked at.
+	tls_verify_file_t	ca_file;
+	tls_verify_file_t	ca_path;
+};
+
+static uint32_t tls_verify_entry_hash(void const *data)
+{
+	tls_verify_entry_t const *e = data;
+
+	return e->hash;
+}
+
+static int tls_verify_entry_cmp(void const *one, void const *two)
+{
+	tls_verify_entry_t const *a = one;
+	tls_verify_entry_t const *b = two;
+
+	if (a->generation != b->generation) return (a->generation < b->generation) ? -1 : +1;
+
+	return memcmp(a->fingerprint, b->fingerprint, sizeof(a->fingerprint));
+}
+
+static void tls_verify_entry_free(void *data)
+{
+	tls_verify_entry_t *e = data;
+
+	if (e->chain) sk_X509_pop_free(e->chain, X509_free);
+	talloc_free(e);
+}
+
+static void tls_verify_unlink(fr_tls_verify_cache_t *cache, tls_verify_entry_t *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		cache->head = e->next;
+	}
+
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		cache->tail = e->prev;
+	}
+
+	e->prev = e->next = NULL;
+}
+
+/*
+ *	Returns true if the file has changed since we last looked.
+ */
+static bool tls_verify_file_changed(char const *filename, tls_verify_file_t *file)
+{
+	struct stat buf;
+	tls_verify_file_t now;
+
+	if (!filename) return false;
+
+	memset(&now, 0, sizeof(now));
+	if (stat(filename, &buf) == 0) {
+		now.mtime = buf.st_mtime;
+		now.ino = buf.st_ino;
+		now.size = buf.st_size;
+	}
+
+	if (memcmp(&now, file, sizeof(now)) == 0) return false;
+
+	*file = now;
+	return true;
+}
+
+/*
+ *	Empty the cache if the CA files have changed.  Must be called
+ *	with the mutex held.
+ */
+static void tls_verify_check_ca(fr_tls_server_conf_t *conf, time_t now)
+{
+	fr_tls_verify_cache_t *cache = conf->verify_cache;
+	tls_verify_entry_t *e, *next;
+	bool changed;
+
+	if (now < (cache->checked + TLS_VERIFY_CHECK_INTERVAL)) return;
+	cache->checked = now;
+
+	changed = tls_verify_file_changed(conf->ca_file, &cache->ca_file);
+	if (tls_verify_file_changed(conf->ca_path, &cache->ca_path)) changed = true;
+	if (!changed) return;
+
+	DEBUG("tls: CA certificates have changed, emptying the verification cache");
+
+	for (e = cache->head; e; e = next) {
+		next = e->next;
+		fr_hash_table_delete(cache->entries, e);
+	}
+	cache->head = cache->tail = NULL;
+	cache->generation++;
+}
+
+/*
+ *	Work out when a verified chain stops being valid.  Returns 0
+ *	if it shouldn't be cached.
+ */
+static time_t tls_verify_expires(fr_tls_server_conf_t *conf, X509_STORE_CTX *ctx,
+				 STACK_OF(X509) *chain, time_t now)
+{
+	time_t expires, when;
+	int i, j;
+
+	expires = now + conf->verify_cache_lifetime;
+
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		X509 *cert = sk_X509_value(chain, i);
+
+		when = tls_asn1_time(X509_get_notAfter(cert));
+		if (!when) return 0;
+		if (when < expires) expires = when;
+
+		/*
+		 *	The CRLs issued by this certificate.
+		 */
+		if (conf->check_crl && (i > 0)) {
+			STACK_OF(X509_CRL) *crls;
+
+			crls = X509_STORE_CTX_get1_crls(ctx, X509_get_subject_name(cert));
+			for (j = 0; j < sk_X509_CRL_num(crls); j++) {
+				ASN1_TIME const *next_update;
+
+				next_update = X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, j));
+				if (!next_update) continue;
+
+				when = tls_asn1_time(next_update);
+				if (!when) {
+					expires = 0;
+					break;
+				}
+				if (when < expires) expires = when;
+			}
+			if (crls) sk_X509_CRL_pop_free(crls, X509_CRL_free);
+		}
+	}
+
+	if (expires <= now) return 0;
+
+	return expires;
+}
+
+/*
+ *	Called by OpenSSL instead of X509_verify_cert().
+ */
+static int cbtls_cert_verify(X509_STORE_CTX *ctx, void *arg)
+{
+	fr_tls_server_conf_t *conf = arg;
+	fr_tls_verify_cache_t *cache = conf->verify_cache;
+	tls_verify_entry_t my_e, *e;
+	STACK_OF(X509) *chain = NULL;
+	X509 *cert;
+	unsigned int len;
+	time_t now;
+	int depth, rcode;
+
+	cert = X509_STORE_CTX_get0_cert(ctx);
+	if (!cache || !cert) return X509_verify_cert(ctx);
+
+	memset(&my_e, 0, sizeof(my_e));
+	if (!X509_digest(cert, EVP_sha256(), my_e.fingerprint, &len) ||
+	    (len != sizeof(my_e.fingerprint))) {
+		return X509_verify_cert(ctx);
+	}
+	my_e.hash = fr_hash(my_e.fingerprint, sizeof(my_e.fingerprint));
+
+	now = time(NULL);
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	tls_verify_check_ca(conf, now);
+	my_e.generation = cache->generation;
+
+	e = fr_hash_table_finddata(cache->entries, &my_e);
+	if (e && (e->expires <= now)) {
+		tls_verify_unlink(cache, e);
+		fr_hash_table_delete(cache->entries, e);
+		e = NULL;
+	}
+	if (e) chain = X509_chain_up_ref(e->chain);
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	/*
+	 *	Verified recently.  Walk down the cached chain, as
+	 *	X509_verify_cert() would have done.
+	 */
+	if (chain) {
+		DEBUG2("tls: Using cached verification of the certificate chain");
+
+		rcode = 1;
+		for (depth = sk_X509_num(chain) - 1; depth >= 0; depth--) {
+			X509_STORE_CTX_set_current_cert(ctx, sk_X509_value(chain, depth));
+			X509_STORE_CTX_set_error_depth(ctx, depth);
+			X509_STORE_CTX_set_error(ctx, X509_V_OK);
+
+			if (!cbtls_verify(1, ctx)) {
+				X509_STORE_CTX_set_error(ctx, X509_V_ERR_APPLICATION_VERIFICATION);
+				rcode = 0;
+				break;
+			}
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		if (rcode == 1) {
+			X509_STORE_CTX_set0_verified_chain(ctx, chain);
+			chain = NULL;
+		}
+#endif
+		if (chain) sk_X509_pop_free(chain, X509_free);
+
+		return rcode;
+	}
+
+	rcode = X509_verify_cert(ctx);
+	if (rcode != 1) return rcode;
+
+	chain = X509_STORE_CTX_get1_chain(ctx);
+	if (!chain) return rcode;
+
+	my_e.expires = tls_verify_expires(conf, ctx, chain, now);
+	if (!my_e.expires) {
+		sk_X509_pop_free(chain, X509_free);
+		return rcode;
+	}
+
+	e = talloc_zero(NULL, tls_verify_entry_t);
+	if (!e) {
+		sk_X509_pop_free(chain, X509_free);
+		return rcode;
+	}
+	*e = my_e;
+	e->chain = chain;
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+
+	/*
+	 *	The CA files changed while we were verifying, or
+	 *	another thread beat us to it.
+	 */
+	if ((e->generation != cache->generation) ||
+	    !fr_hash_table_insert(cache->entries, e)) {
+		PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+		tls_verify_entry_free(e);
+		return rcode;
+	}
+
+	e->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = e;
+	} else {
+		cache->head = e;
+	}
+	cache->tail = e;
+
+	/*
+	 *	Make room by dropping the oldest entry.
+	 */
+	if (conf->verify_cache_size &&
+	    (fr_hash_table_num_elements(cache->entries) > conf->verify_cache_size)) {
+		tls_verify_entry_t *old = cache->head;
+
+		tls_verify_unlink(cache, old);
+		fr_hash_table_delete(cache->entries, old);
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	return rcode;
+}
+
+static int tls_verify_cache_init(fr_tls_server_conf_t *conf)
+{
+	fr_tls_verify_cache_t *cache;
+
+	cache = conf->verify_cache = talloc_zero(conf, fr_tls_verify_cache_t);
+	if (!cache) return -1;
+
+	cache->entries = fr_hash_table_create(tls_verify_entry_hash, tls_verify_entry_cmp,
+					      tls_verify_entry_free);
+	if (!cache->entries) {
+		ERROR("tls: Failed creating verification cache");
+		return -1;
+	}
+
+	(void) tls_verify_file_changed(conf->ca_file, &cache->ca_file);
+	(void) tls_verify_file_changed(conf->ca_path, &cache->ca_path);
+	cache->checked = time(NULL);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&cache->mutex, NULL);
+#endif
+
+	return 0;
+}
+
+static void tls_verify_cache_free(fr_tls_server_conf_t *conf)
+{
+	fr_tls_verify_cache_t *cache = conf->verify_cache;
+
+	if (!cache) return;
+
+	if (cache->entries) fr_hash_table_free(cache->entries);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	talloc_free(cache);
+	conf->verify_cache = NULL;
+}
 
 #ifdef HAVE_OPENSSL_OCSP_H
 /*
@@ -2182,7 +4550,7 @@ post_ca:
 	ctx_options |= SSL_OP_NO_SSLv2;
 	ctx_options |= SSL_OP_NO_SSLv3;
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET ;
+	if (!conf->session_tickets) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	/*
@@ -2243,8 +4611,17 @@ post_ca:
 		SSL_CTX_sess_set_remove_cb(ctx, cbtls_remove_session);
 
 		SSL_CTX_set_quiet_shutdown(ctx, 1);
-		if (FR_TLS_EX_INDEX_VPS < 0)
-			FR_TLS_EX_INDEX_VPS = SSL_SESSION_get_ex_new_index(0, NULL, NULL, NULL, sess_free_vps);
+	}
+
+	if (conf->session_tickets) {
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, cbtls_ticket_key);
+#ifdef TLS_TICKET_APPDATA
+		SSL_CTX_set_session_ticket_cb(ctx, cbtls_ticket_gen, cbtls_ticket_dec, NULL);
+#endif
+	}
+
+	if ((conf->session_cache_enable || conf->session_tickets) && (FR_TLS_EX_INDEX_VPS < 0)) {
+		FR_TLS_EX_INDEX_VPS = SSL_SESSION_get_ex_new_index(0, NULL, NULL, NULL, sess_free_vps);
 	}
 
 	/*
@@ -2271,6 +4648,13 @@ post_ca:
 	verify_mode |= SSL_VERIFY_CLIENT_ONCE;
 	SSL_CTX_set_verify(ctx, verify_mode, cbtls_verify);
 
+	/*
+	 *	Verified chains are cached by cbtls_cert_verify().
+	 */
+	if (!client && conf->verify_cache_enable) {
+		SSL_CTX_set_cert_verify_callback(ctx, cbtls_cert_verify, conf);
+	}
+
 	if (conf->verify_depth) {
 		SSL_CTX_set_verify_depth(ctx, conf->verify_depth);
 	}
@@ -2297,7 +4681,7 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	if (conf->session_cache_enable) {
+	if (conf->session_cache_enable || conf->session_tickets) {
 		/*
 		 *	Create a unique context Id per EAP-TLS configuration.
 		 */
@@ -2313,9 +4697,15 @@ post_ca:
 		}
 
 		/*
-		 *	Cache it, and DON'T auto-clear it.
+		 *	Cache it, and DON'T auto-clear it.  Sessions
+		 *	are kept in our own cache, not OpenSSL's.
 		 */
-		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+		if (conf->session_cache_enable) {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_AUTO_CLEAR |
+						       SSL_SESS_CACHE_NO_INTERNAL);
+		} else {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+		}
 
 		SSL_CTX_set_session_id_context(ctx,
 					       (unsigned char *) conf->session_context_id,
@@ -2326,12 +4716,6 @@ post_ca:
 		 */
 		SSL_CTX_set_timeout(ctx, conf->session_timeout * 3600);
 
-		/*
-		 *	Set the maximum number of entries in the
-		 *	session cache.
-		 */
-		SSL_CTX_sess_set_cache_size(ctx, conf->session_cache_size);
-
 	} else {
 		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
 	}
@@ -2348,9 +4732,16 @@ post_ca:
  */
 static int tls_server_conf_free(fr_tls_server_conf_t *conf)
 {
+#ifdef HAVE_PTHREAD_H
+	tls_crypto_pool_free(conf);
+#endif
+	tls_cache_free(conf);
+	tls_verify_cache_free(conf);
+
 	if (conf->ctx) SSL_CTX_free(conf->ctx);
 
 #ifdef HAVE_OPENSSL_OCSP_H
+	ocsp_cache_free(conf);
 	if (conf->ocsp_store) X509_STORE_free(conf->ocsp_store);
 	conf->ocsp_store = NULL;
 #endif
@@ -2405,6 +4796,22 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 		goto error;
 	}
 
+	if (conf->session_tickets) {
+#ifndef TLS_TICKET_APPDATA
+		ERROR("Session tickets require OpenSSL 1.1.1 or later, to carry the cached attributes");
+		goto error;
+#endif
+		if (conf->ticket_key_rotate < 60) {
+			ERROR("Session ticket keys must be rotated no more often than every 60 seconds");
+			goto error;
+		}
+
+		if (!conf->session_id_name) {
+			WARN("Session tickets can only be used by the server which issued them, "
+			     "unless the cache \"name\" is set");
+		}
+	}
+
 	/*
 	 *	Initialize TLS
 	 */
@@ -2413,6 +4820,62 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 		goto error;
 	}
 
+	if (conf->session_cache_enable && (tls_cache_init(conf) < 0)) {
+		goto error;
+	}
+
+	if (conf->session_tickets && (tls_ticket_init(conf) < 0)) {
+		goto error;
+	}
+
+	if (conf->verify_cache_enable) {
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+		ERROR("The verification cache requires OpenSSL 1.0.2 or later");
+		goto error;
+#endif
+		if (conf->verify_cache_lifetime < 1) {
+			ERROR("Verification cache \"lifetime\" must be at least 1 second");
+			goto error;
+		}
+		if (conf->verify_cache_size < 0) conf->verify_cache_size = 0;
+
+		if (tls_verify_cache_init(conf) < 0) goto error;
+	}
+
+	if (conf->crypto_threads > 0) {
+#ifdef HAVE_PTHREAD_H
+		int max_threads, limit;
+
+		if (conf->crypto_max_queue < 0) conf->crypto_max_queue = 0;
+
+		/*
+		 *	Every handshake in the pool, running or
+		 *	waiting, holds a request thread.  Leave at
+		 *	least half of them for everything else.
+		 *
+		 *	The thread pool isn't started until after the
+		 *	modules are instantiated, so read its size
+		 *	from the configuration.
+		 */
+		max_threads = thread_pool_max_threads(cf_top_section(cs));
+		limit = max_threads / 2;
+		if ((limit > 0) && (conf->crypto_threads >= limit)) {
+			WARN("crypto_pool: %d threads can hold more than half of the %d request threads, "
+			     "setting max_queue to 0", conf->crypto_threads, max_threads);
+			conf->crypto_max_queue = 0;
+
+		} else if ((limit > 0) && ((conf->crypto_threads + conf->crypto_max_queue) > limit)) {
+			conf->crypto_max_queue = limit - conf->crypto_threads;
+			WARN("crypto_pool: Reducing max_queue to %d, so that handshakes can't hold more than half "
+			     "of the %d request threads", conf->crypto_max_queue, max_threads);
+		}
+
+		if (tls_crypto_pool_init(conf, cs) < 0) goto error;
+#else
+		WARN("Ignoring \"crypto_pool\", as the server was built without threads");
+#endif
+	}
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	/*
 	 * 	Initialize OCSP Revocation Store
@@ -2420,6 +4883,18 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 	if (conf->ocsp_enable) {
 		conf->ocsp_store = init_revocation_store(conf);
 		if (conf->ocsp_store == NULL) goto error;
+
+		if (conf->ocsp_cache_enable) {
+			if (conf->ocsp_cache_lifetime < 1) {
+				ERROR("OCSP cache \"lifetime\" must be at least 1 second");
+				goto error;
+			}
+			if (conf->ocsp_cache_size < 0) conf->ocsp_cache_size = 0;
+			if (conf->ocsp_refresh_before < 0) conf->ocsp_refresh_before = 0;
+			if (conf->ocsp_softfail_window < 0) conf->ocsp_softfail_window = 0;
+
+			if (ocsp_cache_init(conf, cs) < 0) goto error;
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
@@ -2505,10 +4980,13 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 {
 	VALUE_PAIR *vp, *vps = NULL;
 	fr_tls_server_conf_t *conf;
+	SSL_SESSION *sess;
 
 	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_CONF);
 	rad_assert(conf != NULL);
 
+	sess = SSL_get_session(ssn->ssl);
+
 	/*
 	 *	If there's no session resumption, delete the entry
 	 *	from the cache.  This means either it's disabled
@@ -2521,8 +4999,7 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 	if ((!ssn->allow_session_resumption) ||
 	    (((vp = pairfind(request->config_items, 1127, 0, TAG_ANY)) != NULL) &&
 	     (vp->vp_integer == 0))) {
-		SSL_CTX_remove_session(ssn->ctx,
-				       ssn->ssl->session);
+		tls_cache_remove(ssn->ctx, sess);
 		ssn->allow_session_resumption = 0;
 
 		/*
@@ -2539,73 +5016,23 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 		 *	user data in the cache.
 		 */
 	} else if (!SSL_session_reused(ssn->ssl)) {
-		size_t size;
-		VALUE_PAIR **certs;
+		unsigned int size;
+		uint8_t const *id;
 		char buffer[2 * MAX_SESSION_SIZE + 1];
 
-		size = ssn->ssl->session->session_id_length;
+		id = SSL_SESSION_get_id(sess, &size);
 		if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
 
-		fr_bin2hex(buffer, ssn->ssl->session->session_id, size);
-
-		vp = paircopy2(NULL, request->reply->vps, PW_USER_NAME, 0, TAG_ANY);
-		if (vp) pairadd(&vps, vp);
-
-		vp = paircopy2(NULL, request->packet->vps, PW_STRIPPED_USER_NAME, 0, TAG_ANY);
-		if (vp) pairadd(&vps, vp);
-
-		vp = paircopy2(NULL, request->reply->vps, PW_CHARGEABLE_USER_IDENTITY, 0, TAG_ANY);
-		if (vp) pairadd(&vps, vp);
-
-		vp = paircopy2(NULL, request->reply->vps, PW_CACHED_SESSION_POLICY, 0, TAG_ANY);
-		if (vp) pairadd(&vps, vp);
-
-		certs = (VALUE_PAIR **)SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_CERTS);
-
-		/*
-		 *	Hmm... the certs should probably be session data.
-		 */
-		if (certs) {
-			/*
-			 *	@todo: some go into reply, others into
-			 *	request
-			 */
-			pairadd(&vps, paircopy(NULL, *certs));
-		}
+		fr_bin2hex(buffer, id, size);
 
+		vps = tls_session_vps(ssn->ssl, request);
 		if (vps) {
 			RDEBUG2("Saving session %s vps %p in the cache", buffer, vps);
-			SSL_SESSION_set_ex_data(ssn->ssl->session,
-						FR_TLS_EX_INDEX_VPS, vps);
-			if (conf->session_cache_path) {
-				/* write the VPs to the cache file */
-				char filename[256], buf[1024];
-				FILE *vp_file;
-
-				snprintf(filename, sizeof(filename), "%s%c%s.vps",
-					conf->session_cache_path, FR_DIR_SEP, buffer
-					);
-				vp_file = fopen(filename, "w");
-				if (vp_file == NULL) {
-					RDEBUG2("Could not write session VPs to persistent cache: %s", fr_syserror(errno));
-				} else {
-					vp_cursor_t cursor;
-					/* generate a dummy user-style entry which is easy to read back */
-					fprintf(vp_file, "# SSL cached session\n");
-					fprintf(vp_file, "%s\n", buffer);
-					for (vp = fr_cursor_init(&cursor, &vps);
-					     vp;
-					     vp = fr_cursor_next(&cursor)) {
-						vp_prints(buf, sizeof(buf), vp);
-						fprintf(vp_file, "\t%s,\n", buf);
-					}
-					fclose(vp_file);
-				}
-			}
+			SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_VPS, vps);
+			tls_cache_persist(conf, sess);
 		} else {
 			RWDEBUG2("No information to cache: session caching will be disabled for session %s", buffer);
-			SSL_CTX_remove_session(ssn->ctx,
-					       ssn->ssl->session);
+			tls_cache_remove(ssn->ctx, sess);
 		}
 
 		/*
@@ -2613,16 +5040,16 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 		 *	reply.
 		 */
 	} else {
-		size_t size;
+		unsigned int size;
+		uint8_t const *id;
 		char buffer[2 * MAX_SESSION_SIZE + 1];
 
-		size = ssn->ssl->session->session_id_length;
+		id = SSL_SESSION_get_id(sess, &size);
 		if (size > MAX_SESSION_SIZE) size = MAX_SESSION_SIZE;
 
-		fr_bin2hex(buffer, ssn->ssl->session->session_id, size);
+		fr_bin2hex(buffer, id, size);
 
-		vps = SSL_SESSION_get_ex_data(ssn->ssl->session,
-					     FR_TLS_EX_INDEX_VPS);
+		vps = SSL_SESSION_get_ex_data(sess, FR_TLS_EX_INDEX_VPS);
 		if (!vps) {
 			RWDEBUG("No information in cached session %s", buffer);
 			return -1;
@@ -2651,20 +5078,6 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 				}
 			}
 
-			if (conf->session_cache_path) {
-				/* "touch" the cached session/vp file */
-				char filename[256];
-
-				snprintf(filename, sizeof(filename), "%s%c%s.asn1",
-					conf->session_cache_path, FR_DIR_SEP, buffer
-					);
-				utime(filename, NULL);
-				snprintf(filename, sizeof(filename), "%s%c%s.vps",
-					conf->session_cache_path, FR_DIR_SEP, buffer
-					);
-				utime(filename, NULL);
-			}
-
 			/*
 			 *	Mark the request as resumed.
 			 */
@@ -2681,7 +5094,7 @@ void tls_fail(tls_session_t *ssn)
 	/*
 	 *	Force the session to NOT be cached.
 	 */
-	SSL_CTX_remove_session(ssn->ctx, ssn->ssl->session);
+	tls_cache_remove(ssn->ctx, SSL_get_session(ssn->ssl));
 }
 
 fr_tls_status_t tls_application_data(tls_session_t *ssn,
@@ -70,6 +70,13 @@ void listen_free(UNUSED rad_listen_t **head)
 	/* do nothing */
 }
 
+#ifdef WITH_STATS
+void radius_stats_thread_exit(void)
+{
+	/* do nothing */
+}
+#endif
+
 
 static rad_listen_t *listen_alloc(void *ctx)
 {
@@ -2,7 +2,7 @@ TARGET	:= unittest
 SOURCES := acct.c auth.c client.c crypt.c files.c \
 		  mainconfig.c modules.c modcall.c \
 		  unittest.c soh.c connection.c \
-		  session.c threads.c version.c  \
+		  session.c threads.c version.c latency.c \
 		  realms.c
 
 ifneq ($(OPENSSL_LIBS),)
@@ -1,5 +1,5 @@
 TARGET		:= rlm_cache.a
-SOURCES		:= rlm_cache.c
+SOURCES		:= rlm_cache.c cache_memory.c cache_mmap.c
 
 TGT_LDLIBS	:= $(LIBS)
 
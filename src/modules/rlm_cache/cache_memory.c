@@ -0,0 +1,247 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache_memory.c
+ * @brief In memory storage backend for rlm_cache.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_cache.h"
+
+/*
+ *	One stripe of the cache.  Each shard has its own lock, hash
+ *	table and CLOCK ring, so requests for different keys rarely
+ *	contend with each other.
+ */
+typedef struct cache_memory_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*cache;
+	rlm_cache_entry_t	*hand;		//!< CLOCK hand, NULL if empty.
+	int			max_entries;	//!< Share of the global limit.
+} cache_memory_shard_t;
+
+/*
+ *	The low bits of the key hash pick the shard, so every entry in
+ *	a shard shares them.  Mix the hash again, or the table would
+ *	only ever use a fraction of its buckets.
+ */
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_entry_t const *c = data;
+
+	return fr_hash(&c->hash, sizeof(c->hash));
+}
+
+/*
+ *	Compare two entries by key.  There may only be one entry with
+ *	the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/*
+ *	Unlink an entry from the CLOCK ring of its shard, and free it.
+ */
+static void cache_delete(cache_memory_shard_t *shard, rlm_cache_entry_t *c)
+{
+	if (c->next == c) {
+		shard->hand = NULL;
+	} else {
+		if (shard->hand == c) shard->hand = c->next;
+		c->prev->next = c->next;
+		c->next->prev = c->prev;
+	}
+
+	fr_hash_table_delete(shard->cache, c);
+}
+
+/*
+ *	Make room for one more entry in a full shard.  Expired entries
+ *	are reclaimed first, then the CLOCK hand sweeps the ring giving
+ *	each recently used entry a second chance.  Two passes around
+ *	the ring are always enough to find a victim.
+ */
+static void cache_evict(rlm_cache_t *inst, cache_memory_shard_t *shard, REQUEST *request)
+{
+	rlm_cache_entry_t *c;
+	int i, num;
+
+	num = fr_hash_table_num_elements(shard->cache);
+	for (i = 0; (i < (2 * num)) && shard->hand; i++) {
+		c = shard->hand;
+
+		if (cache_entry_expired(inst, request, c) || !c->referenced) {
+			RDEBUG3("Evicting entry for \"%s\"", c->key);
+			cache_delete(shard, c);
+			return;
+		}
+
+		c->referenced = false;
+		shard->hand = c->next;
+	}
+}
+
+static int memory_instantiate(rlm_cache_t *inst)
+{
+	cache_memory_shard_t *shards;
+	int i;
+
+	shards = talloc_zero_array(inst, cache_memory_shard_t, inst->num_shards);
+	if (!shards) return -1;
+	inst->driver_inst = shards;
+
+	for (i = 0; i < inst->num_shards; i++) {
+		cache_memory_shard_t *shard = &shards[i];
+
+		shard->max_entries = (inst->max_entries + inst->num_shards - 1) / inst->num_shards;
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			EDEBUG("Failed initializing mutex: %s",
+			       fr_syserror(errno));
+			return -1;
+		}
+#endif
+
+		shard->cache = fr_hash_table_create(cache_entry_hash, cache_entry_cmp, cache_entry_free);
+		if (!shard->cache) {
+			EDEBUG("Failed to create cache");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void memory_detach(rlm_cache_t *inst)
+{
+	cache_memory_shard_t *shards = inst->driver_inst;
+	int i;
+
+	if (!shards) return;
+
+	for (i = 0; i < inst->num_shards; i++) {
+		fr_hash_table_free(shards[i].cache);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&shards[i].mutex);
+#endif
+	}
+	talloc_free(shards);
+	inst->driver_inst = NULL;
+}
+
+static void *memory_acquire(rlm_cache_t *inst, uint32_t hash)
+{
+	cache_memory_shard_t *shard;
+
+	shard = &((cache_memory_shard_t *) inst->driver_inst)[hash % inst->num_shards];
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	return shard;
+}
+
+static void memory_release(UNUSED rlm_cache_t *inst, void *handle)
+{
+	cache_memory_shard_t *shard = handle;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+static rlm_cache_entry_t *memory_find(UNUSED rlm_cache_t *inst, UNUSED REQUEST *request, void *handle,
+				   char const *key, uint32_t hash)
+{
+	cache_memory_shard_t *shard = handle;
+	rlm_cache_entry_t *c, my_c;
+
+	my_c.key = key;
+	my_c.hash = hash;
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (c) c->referenced = true;
+
+	return c;
+}
+
+/*
+ *	Add a new entry to its shard, evicting an old one if the shard
+ *	is full.
+ *
+ *	Another request may have added an entry for the same key while
+ *	we were building ours, in which case the existing one is kept.
+ */
+static int memory_insert(rlm_cache_t *inst, REQUEST *request, void *handle, rlm_cache_entry_t *c)
+{
+	cache_memory_shard_t *shard = handle;
+
+	if (fr_hash_table_num_elements(shard->cache) >= shard->max_entries) {
+		RDEBUG2("Cache shard is full: %d entries", shard->max_entries);
+		cache_evict(inst, shard, request);
+	}
+
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		RDEBUG("Entry for \"%s\" was added by another request", c->key);
+		cache_entry_free(c);
+		return -1;
+	}
+
+	/*
+	 *	New entries go just behind the hand, so they're the
+	 *	last to be considered for eviction.
+	 */
+	if (!shard->hand) {
+		c->prev = c->next = c;
+		shard->hand = c;
+	} else {
+		c->next = shard->hand;
+		c->prev = shard->hand->prev;
+		c->prev->next = c;
+		shard->hand->prev = c;
+	}
+
+	return 0;
+}
+
+static void memory_expire(UNUSED rlm_cache_t *inst, UNUSED REQUEST *request, void *handle,
+		       rlm_cache_entry_t *c)
+{
+	cache_delete(handle, c);
+}
+
+/*
+ *	Entries are updated in place, so there's nothing to write back.
+ */
+rlm_cache_driver_t const rlm_cache_memory = {
+	"memory",
+	memory_instantiate,
+	memory_detach,
+	memory_acquire,
+	memory_release,
+	memory_find,
+	memory_insert,
+	memory_expire,
+	NULL				/* update */
+};
@@ -0,0 +1,560 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache_mmap.c
+ * @brief Persistent, memory mapped storage backend for rlm_cache.
+ *
+ * The store is a file of fixed size slots, split into one region per
+ * shard.  A key may live in any of the CACHE_MMAP_PROBE slots following
+ * its home slot, wrapping around within the region of its shard.
+ *
+ * Each slot carries a checksum over its contents, and is checked every
+ * time it's read.  A slot which was only partially written when the
+ * server died is simply treated as empty, so the store never needs
+ * repairing.  The file is in host byte order, and isn't portable
+ * between architectures.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rlm_cache.h"
+
+#define CACHE_MMAP_MAGIC	"FRCACHE1"
+#define CACHE_MMAP_HDR_SIZE	(64)
+#define CACHE_MMAP_PROBE	(8)
+
+typedef struct cache_mmap_header_t {
+	char		magic[8];
+	uint32_t	slot_size;
+	uint32_t	num_slots;
+	uint32_t	num_shards;
+} cache_mmap_header_t;
+
+typedef struct cache_mmap_slot_t {
+	uint32_t	checksum;	//!< Over everything after this field.
+	uint32_t	length;		//!< Of the data, 0 if the slot is free.
+	uint32_t	hash;
+	uint32_t	pad;
+	int64_t		created;
+	int64_t		expires;
+	int64_t		hits;
+	uint8_t		data[];
+} cache_mmap_slot_t;
+
+typedef struct cache_mmap_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	uint8_t			*slots;		//!< First slot in this shard.
+	int			num_slots;
+
+	rlm_cache_entry_t	*found;		//!< Decoded copy of found_slot.
+	cache_mmap_slot_t	*found_slot;
+} cache_mmap_shard_t;
+
+typedef struct cache_mmap_t {
+	int			fd;
+	uint8_t			*map;
+	size_t			len;
+	cache_mmap_shard_t	*shards;
+} cache_mmap_t;
+
+#define SLOT(_shard, _i) ((cache_mmap_slot_t *) ((_shard)->slots + ((size_t) (_i) * inst->slot_size)))
+#define SLOT_ROOM (inst->slot_size - sizeof(cache_mmap_slot_t))
+
+static uint32_t slot_checksum(cache_mmap_slot_t const *slot)
+{
+	return fr_hash(&slot->length, (sizeof(*slot) - sizeof(slot->checksum)) + slot->length);
+}
+
+static bool slot_valid(rlm_cache_t *inst, cache_mmap_slot_t const *slot)
+{
+	if ((slot->length == 0) || (slot->length > SLOT_ROOM)) return false;
+
+	return (slot->checksum == slot_checksum(slot));
+}
+
+/*
+ *	Write a VALUE_PAIR list as:
+ *
+ *	count (2), then for each pair:
+ *	attr (4), vendor (4), tag (1), op (1), length (2), value
+ *
+ *	Values are in network byte order, as produced by rad_vp2data().
+ */
+static ssize_t cache_encode_list(uint8_t *start, uint8_t const *end, VALUE_PAIR *head)
+{
+	uint8_t *p = start + 2;
+	uint16_t count = 0;
+	uint32_t num;
+	uint16_t len;
+	ssize_t ret;
+	uint8_t const *value;
+	VALUE_PAIR *vp;
+	vp_cursor_t cursor;
+
+	if ((end - start) < 2) return -1;
+
+	for (vp = fr_cursor_init(&cursor, &head);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		/*
+		 *	Zero length values can't be decoded again.
+		 */
+		ret = rad_vp2data(&value, vp);
+		if (ret <= 0) continue;
+		if ((ret > UINT16_MAX) || ((end - p) < (12 + ret))) return -1;
+
+		num = vp->da->attr;
+		memcpy(p, &num, 4);
+		num = vp->da->vendor;
+		memcpy(p + 4, &num, 4);
+		p[8] = (uint8_t) vp->tag;
+		p[9] = (uint8_t) vp->op;
+		len = ret;
+		memcpy(p + 10, &len, 2);
+		memcpy(p + 12, value, len);
+
+		p += 12 + len;
+		count++;
+	}
+	memcpy(start, &count, 2);
+
+	return p - start;
+}
+
+static ssize_t cache_decode_list(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *start, uint8_t const *end)
+{
+	uint8_t const *p = start + 2;
+	uint16_t count, len;
+	uint32_t attr, vendor;
+	VALUE_PAIR *vp, *head;
+	vp_cursor_t cursor;
+
+	if ((end - start) < 2) return -1;
+	memcpy(&count, start, 2);
+
+	while (count--) {
+		if ((end - p) < 12) return -1;
+
+		memcpy(&attr, p, 4);
+		memcpy(&vendor, p + 4, 4);
+		memcpy(&len, p + 10, 2);
+		if ((end - p) < (12 + len)) return -1;
+
+		head = NULL;
+		if (rad_data2vp(attr, vendor, p + 12, len, &head) < 0) return -1;
+
+		for (vp = fr_cursor_init(&cursor, &head);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			(void) talloc_steal(ctx, vp);
+			vp->tag = (int8_t) p[8];
+			vp->op = (FR_TOKEN) p[9];
+		}
+		pairadd(out, head);
+
+		p += 12 + len;
+	}
+
+	return p - start;
+}
+
+/*
+ *	Decode a slot into a new entry.
+ */
+static rlm_cache_entry_t *cache_decode(rlm_cache_t *inst, cache_mmap_slot_t const *slot)
+{
+	rlm_cache_entry_t *c;
+	uint8_t const *p = slot->data, *end = slot->data + slot->length;
+	uint16_t keylen;
+	ssize_t ret;
+
+	if (slot->length < 2) return NULL;
+	memcpy(&keylen, p, 2);
+	p += 2;
+	if ((end - p) < keylen) return NULL;
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	if (!c) return NULL;
+
+	c->key = talloc_strndup(c, (char const *) p, keylen);
+	p += keylen;
+	c->hash = slot->hash;
+	c->created = slot->created;
+	c->expires = slot->expires;
+	c->hits = slot->hits;
+
+	ret = cache_decode_list(c, &c->control, p, end);
+	if (ret < 0) goto error;
+	p += ret;
+
+	ret = cache_decode_list(c, &c->packet, p, end);
+	if (ret < 0) goto error;
+	p += ret;
+
+	ret = cache_decode_list(c, &c->reply, p, end);
+	if (ret < 0) goto error;
+
+	return c;
+
+error:
+	DEBUG("rlm_cache (%s): Discarding undecodable entry for \"%s\"", inst->xlat_name, c->key);
+	cache_entry_free(c);
+	return NULL;
+}
+
+/*
+ *	Write an entry into a slot.  The checksum is written last, so
+ *	the slot is invalid until it's complete.
+ */
+static int cache_encode(rlm_cache_t *inst, cache_mmap_slot_t *slot, rlm_cache_entry_t const *c)
+{
+	uint8_t *p = slot->data, *end = slot->data + SLOT_ROOM;
+	size_t keylen = strlen(c->key);
+	uint16_t len;
+	ssize_t ret;
+
+	slot->checksum = 0;
+	slot->length = 0;
+
+	if ((keylen > UINT16_MAX) || ((size_t) (end - p) < (2 + keylen))) return -1;
+
+	len = keylen;
+	memcpy(p, &len, 2);
+	memcpy(p + 2, c->key, keylen);
+	p += 2 + keylen;
+
+	ret = cache_encode_list(p, end, c->control);
+	if (ret < 0) return -1;
+	p += ret;
+
+	ret = cache_encode_list(p, end, c->packet);
+	if (ret < 0) return -1;
+	p += ret;
+
+	ret = cache_encode_list(p, end, c->reply);
+	if (ret < 0) return -1;
+	p += ret;
+
+	slot->hash = c->hash;
+	slot->pad = 0;
+	slot->created = c->created;
+	slot->expires = c->expires;
+	slot->hits = c->hits;
+	slot->length = p - slot->data;
+	slot->checksum = slot_checksum(slot);
+
+	return 0;
+}
+
+/*
+ *	Does the slot hold the given key?
+ */
+static bool slot_matches(rlm_cache_t *inst, cache_mmap_slot_t const *slot, char const *key, uint32_t hash)
+{
+	uint16_t keylen;
+
+	if (!slot_valid(inst, slot) || (slot->hash != hash)) return false;
+
+	memcpy(&keylen, slot->data, 2);
+	if ((keylen != strlen(key)) || ((size_t) (keylen + 2) > slot->length)) return false;
+
+	return (memcmp(slot->data + 2, key, keylen) == 0);
+}
+
+static int mmap_instantiate(rlm_cache_t *inst)
+{
+	cache_mmap_t *mm;
+	cache_mmap_header_t *hdr;
+	struct stat buf;
+	uint32_t per_shard, num_slots;
+	int i;
+
+	if (!inst->filename || !*inst->filename) {
+		cf_log_err_cs(inst->cs, "Must set 'filename' for the mmap driver");
+		return -1;
+	}
+
+	if (inst->slot_size < 256) {
+		cf_log_err_cs(inst->cs, "'slot_size' must be at least 256");
+		return -1;
+	}
+	inst->slot_size = (inst->slot_size + 7) & ~7;
+
+	per_shard = (inst->max_entries + inst->num_shards - 1) / inst->num_shards;
+	if (per_shard < CACHE_MMAP_PROBE) per_shard = CACHE_MMAP_PROBE;
+	num_slots = per_shard * inst->num_shards;
+
+	mm = talloc_zero(inst, cache_mmap_t);
+	if (!mm) return -1;
+	mm->fd = -1;
+	inst->driver_inst = mm;
+
+	mm->len = CACHE_MMAP_HDR_SIZE + ((size_t) num_slots * inst->slot_size);
+
+	mm->fd = open(inst->filename, O_RDWR | O_CREAT, 0600);
+	if (mm->fd < 0) {
+		ERROR("rlm_cache (%s): Failed opening %s: %s",
+		      inst->xlat_name, inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(mm->fd, &buf) < 0) {
+		ERROR("rlm_cache (%s): Failed reading %s: %s",
+		      inst->xlat_name, inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((size_t) buf.st_size != mm->len) {
+		if ((buf.st_size != 0) &&
+		    (ftruncate(mm->fd, 0) < 0)) goto truncate_error;
+
+		if (ftruncate(mm->fd, mm->len) < 0) {
+		truncate_error:
+			ERROR("rlm_cache (%s): Failed resizing %s: %s",
+			      inst->xlat_name, inst->filename, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	mm->map = mmap(NULL, mm->len, PROT_READ | PROT_WRITE, MAP_SHARED, mm->fd, 0);
+	if (mm->map == MAP_FAILED) {
+		mm->map = NULL;
+		ERROR("rlm_cache (%s): Failed mapping %s: %s",
+		      inst->xlat_name, inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	If the layout has changed, the old entries would be in
+	 *	the wrong slots.  Start again with an empty store.
+	 */
+	hdr = (cache_mmap_header_t *) mm->map;
+	if ((memcmp(hdr->magic, CACHE_MMAP_MAGIC, sizeof(hdr->magic)) != 0) ||
+	    (hdr->slot_size != (uint32_t) inst->slot_size) ||
+	    (hdr->num_slots != num_slots) ||
+	    (hdr->num_shards != (uint32_t) inst->num_shards)) {
+		if (buf.st_size != 0) {
+			WARN("rlm_cache (%s): %s has a different layout, discarding its contents",
+			     inst->xlat_name, inst->filename);
+		}
+		memset(mm->map, 0, mm->len);
+		hdr->slot_size = inst->slot_size;
+		hdr->num_slots = num_slots;
+		hdr->num_shards = inst->num_shards;
+		memcpy(hdr->magic, CACHE_MMAP_MAGIC, sizeof(hdr->magic));
+	}
+
+	mm->shards = talloc_zero_array(mm, cache_mmap_shard_t, inst->num_shards);
+	if (!mm->shards) return -1;
+
+	for (i = 0; i < inst->num_shards; i++) {
+		cache_mmap_shard_t *shard = &mm->shards[i];
+
+		shard->slots = mm->map + CACHE_MMAP_HDR_SIZE + ((size_t) i * per_shard * inst->slot_size);
+		shard->num_slots = per_shard;
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			EDEBUG("Failed initializing mutex: %s",
+			       fr_syserror(errno));
+			return -1;
+		}
+#endif
+	}
+
+	return 0;
+}
+
+static void mmap_detach(rlm_cache_t *inst)
+{
+	cache_mmap_t *mm = inst->driver_inst;
+	int i;
+
+	if (!mm) return;
+
+	if (mm->shards) for (i = 0; i < inst->num_shards; i++) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&mm->shards[i].mutex);
+#endif
+	}
+
+	if (mm->map) {
+		msync(mm->map, mm->len, MS_ASYNC);
+		munmap(mm->map, mm->len);
+	}
+	if (mm->fd >= 0) close(mm->fd);
+
+	talloc_free(mm);
+	inst->driver_inst = NULL;
+}
+
+static void *mmap_acquire(rlm_cache_t *inst, uint32_t hash)
+{
+	cache_mmap_t *mm = inst->driver_inst;
+	cache_mmap_shard_t *shard;
+
+	shard = &mm->shards[hash % inst->num_shards];
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	return shard;
+}
+
+static void mmap_release(UNUSED rlm_cache_t *inst, void *handle)
+{
+	cache_mmap_shard_t *shard = handle;
+
+	if (shard->found) {
+		cache_entry_free(shard->found);
+		shard->found = NULL;
+		shard->found_slot = NULL;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+/*
+ *	The home slot is picked with different bits of the hash to the
+ *	ones which picked the shard.
+ */
+static int slot_home(cache_mmap_shard_t *shard, uint32_t hash)
+{
+	return fr_hash(&hash, sizeof(hash)) % shard->num_slots;
+}
+
+static rlm_cache_entry_t *mmap_find(rlm_cache_t *inst, REQUEST *request, void *handle,
+				    char const *key, uint32_t hash)
+{
+	cache_mmap_shard_t *shard = handle;
+	cache_mmap_slot_t *slot;
+	int i, home;
+
+	rad_assert(!shard->found);
+
+	home = slot_home(shard, hash);
+	for (i = 0; i < CACHE_MMAP_PROBE; i++) {
+		slot = SLOT(shard, (home + i) % shard->num_slots);
+		if (!slot_matches(inst, slot, key, hash)) continue;
+
+		shard->found = cache_decode(inst, slot);
+		if (!shard->found) {
+			RWDEBUG("Failed decoding entry for \"%s\", removing it", key);
+			slot->length = 0;
+			slot->checksum = 0;
+			return NULL;
+		}
+		shard->found_slot = slot;
+
+		return shard->found;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Use the first free, corrupt or expired slot in the probe
+ *	window, or else evict the entry closest to expiry.
+ *
+ *	Another request may have added an entry for the same key while
+ *	we were building ours, in which case the existing one is kept.
+ */
+static int mmap_insert(rlm_cache_t *inst, REQUEST *request, void *handle, rlm_cache_entry_t *c)
+{
+	cache_mmap_shard_t *shard = handle;
+	cache_mmap_slot_t *slot, *victim = NULL;
+	int i, home;
+
+	home = slot_home(shard, c->hash);
+	for (i = 0; i < CACHE_MMAP_PROBE; i++) {
+		slot = SLOT(shard, (home + i) % shard->num_slots);
+
+		if (!slot_valid(inst, slot) ||
+		    (slot->expires < request->timestamp) ||
+		    (slot->created < inst->epoch)) {
+			if (!victim || slot_valid(inst, victim)) victim = slot;
+			continue;
+		}
+
+		if (slot_matches(inst, slot, c->key, c->hash)) {
+			RDEBUG("Entry for \"%s\" was added by another request", c->key);
+			cache_entry_free(c);
+			return -1;
+		}
+
+		if (!victim || (slot_valid(inst, victim) && (slot->expires < victim->expires))) {
+			victim = slot;
+		}
+	}
+
+	rad_assert(victim != NULL);
+
+	if (cache_encode(inst, victim, c) < 0) {
+		RWDEBUG("Entry for \"%s\" is larger than 'slot_size', not caching it", c->key);
+		cache_entry_free(c);
+		return -1;
+	}
+
+	cache_entry_free(c);
+	return 0;
+}
+
+static void mmap_expire(UNUSED rlm_cache_t *inst, UNUSED REQUEST *request, void *handle,
+			rlm_cache_entry_t *c)
+{
+	cache_mmap_shard_t *shard = handle;
+
+	rad_assert(c == shard->found);
+
+	shard->found_slot->checksum = 0;
+	shard->found_slot->length = 0;
+}
+
+/*
+ *	Write back the new expiry time and hit count.
+ */
+static void mmap_update(UNUSED rlm_cache_t *inst, UNUSED REQUEST *request, void *handle,
+			rlm_cache_entry_t *c)
+{
+	cache_mmap_shard_t *shard = handle;
+	cache_mmap_slot_t *slot = shard->found_slot;
+
+	rad_assert(c == shard->found);
+
+	slot->expires = c->expires;
+	slot->hits = c->hits;
+	slot->checksum = slot_checksum(slot);
+}
+
+rlm_cache_driver_t const rlm_cache_mmap = {
+	"mmap",
+	mmap_instantiate,
+	mmap_detach,
+	mmap_acquire,
+	mmap_release,
+	mmap_find,
+	mmap_insert,
+	mmap_expire,
+	mmap_update
+};
@@ -22,99 +22,190 @@
  */
 RCSID("$Id$")
 
-#include <freeradius-devel/radiusd.h>
-#include <freeradius-devel/modules.h>
-#include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include "rlm_cache.h"
+
 #define PW_CACHE_TTL		1140
 #define PW_CACHE_STATUS_ONLY	1141
 #define PW_CACHE_MERGE		1142
 #define PW_CACHE_ENTRY_HITS	1143
 
+#define MAX_ATTRMAP	128
+
 /*
- *	Define a structure for our module configuration.
- *
- *	These variables do not need to be in a structure, but it's
- *	a lot cleaner to do so, and a pointer to the structure can
- *	be used as the instance handle.
+ *	The available storage backends.
  */
-typedef struct rlm_cache_t {
-	char const		*xlat_name;
-	char			*key;
-	int			ttl;
-	int			max_entries;
-	int			epoch;
-	bool			stats;
-	CONF_SECTION		*cs;
-	rbtree_t		*cache;
-	fr_heap_t		*heap;
-
-	value_pair_map_t	*maps;	//!< Attribute map applied to users
-					//!< and profiles.
-#ifdef HAVE_PTHREAD_H
-	pthread_mutex_t	cache_mutex;
-#endif
-} rlm_cache_t;
-
-typedef struct rlm_cache_entry_t {
-	char const	*key;
-	int		offset;
-	long long int	hits;
-	time_t		created;
-	time_t		expires;
-	VALUE_PAIR	*control;
-	VALUE_PAIR	*packet;
-	VALUE_PAIR	*reply;
-} rlm_cache_entry_t;
+static rlm_cache_driver_t const *cache_drivers[] = {
+	&rlm_cache_memory,
+	&rlm_cache_mmap,
+	NULL
+};
 
-#ifdef HAVE_PTHREAD_H
-#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
-#else
-#define PTHREAD_MUTEX_LOCK(_x)
-#define PTHREAD_MUTEX_UNLOCK(_x)
-#endif
+void cache_entry_free(void *data)
+{
+	rlm_cache_entry_t *c = data;
 
-#define MAX_ATTRMAP	128
+	pairfree(&c->control);
+	pairfree(&c->packet);
+	pairfree(&c->reply);
+
+	talloc_free(c);
+}
 
 /*
- *	Compare two entries by key.  There may only be one entry with
- *	the same key.
+ *	Has the entry expired, or has the "forget all" epoch passed?
  */
-static int cache_entry_cmp(void const *one, void const *two)
+bool cache_entry_expired(rlm_cache_t *inst, REQUEST *request, rlm_cache_entry_t const *c)
 {
-	rlm_cache_entry_t const *a = one;
-	rlm_cache_entry_t const *b = two;
+	return ((c->expires < request->timestamp) ||
+		(c->created < inst->epoch));
+}
 
-	return strcmp(a->key, b->key);
+/*
+ *	Is this a negative entry, i.e. one which cached nothing?
+ */
+static bool cache_entry_negative(rlm_cache_t *inst, rlm_cache_entry_t const *c)
+{
+	return ((inst->negative_ttl > 0) &&
+		!c->control && !c->packet && !c->reply);
 }
 
-static void cache_entry_free(void *data)
+/*
+ *	Keys which are currently being built by a request.  Other
+ *	requests which miss on the same key can wait for its result,
+ *	rather than all running the same expensive expansions.
+ */
+typedef struct cache_flight_t cache_flight_t;
+
+struct cache_flight_t {
+	char const		*key;
+	uint32_t		hash;
+	int			refs;		//!< The builder and its waiters.
+	bool			done;
+	cache_flight_t		*next;
+};
+
+struct cache_flight_stripe_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+#endif
+	cache_flight_t		*head;
+};
+
+typedef enum {
+	CACHE_FLIGHT_LEADER = 0,	//!< We build the entry.
+	CACHE_FLIGHT_BUSY,		//!< Someone else is building it.
+	CACHE_FLIGHT_WAITED		//!< Someone else built it, or we gave up.
+} cache_flight_rcode_t;
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Claim a key for building.  If another request already has, and
+ *	"wait" is set, wait for it to finish (or for the timeout).
+ */
+static cache_flight_rcode_t cache_flight_begin(rlm_cache_t *inst, REQUEST *request,
+					       char const *key, uint32_t hash, bool wait,
+					       cache_flight_t **out)
 {
-	rlm_cache_entry_t *c = data;
+	cache_flight_stripe_t *stripe = &inst->flights[hash % inst->num_shards];
+	cache_flight_t *f;
+	struct timeval now;
+	struct timespec when;
+	uint64_t usec;
 
-	pairfree(&c->control);
-	pairfree(&c->packet);
-	pairfree(&c->reply);
+	*out = NULL;
 
-	talloc_free(c);
+	pthread_mutex_lock(&stripe->mutex);
+	for (f = stripe->head; f != NULL; f = f->next) {
+		if ((f->hash == hash) && (strcmp(f->key, key) == 0)) break;
+	}
+
+	if (!f) {
+		f = talloc_zero(NULL, cache_flight_t);
+		if (!f) {
+			pthread_mutex_unlock(&stripe->mutex);
+			return CACHE_FLIGHT_LEADER;
+		}
+		f->key = talloc_typed_strdup(f, key);
+		f->hash = hash;
+		f->refs = 1;
+		f->next = stripe->head;
+		stripe->head = f;
+		pthread_mutex_unlock(&stripe->mutex);
+
+		*out = f;
+		return CACHE_FLIGHT_LEADER;
+	}
+
+	if (!wait) {
+		pthread_mutex_unlock(&stripe->mutex);
+		return CACHE_FLIGHT_BUSY;
+	}
+
+	RDEBUG2("Waiting for another request to create entry for \"%s\"", key);
+
+	gettimeofday(&now, NULL);
+	usec = now.tv_usec + ((uint64_t) inst->single_flight_timeout * 1000);
+	when.tv_sec = now.tv_sec + (usec / 1000000);
+	when.tv_nsec = (usec % 1000000) * 1000;
+
+	f->refs++;
+	while (!f->done) {
+		if (pthread_cond_timedwait(&stripe->cond, &stripe->mutex, &when) == ETIMEDOUT) break;
+	}
+	if (!f->done) RWDEBUG("Timed out waiting for entry \"%s\"", key);
+
+	if (--f->refs == 0) talloc_free(f);
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return CACHE_FLIGHT_WAITED;
 }
 
 /*
- *	Compare two entries by expiry time.  There may be multiple
- *	entries with the same expiry time.
+ *	Release a key claimed by cache_flight_begin(), and wake anyone
+ *	waiting for it.
  */
-static int cache_heap_cmp(void const *one, void const *two)
+static void cache_flight_end(rlm_cache_t *inst, cache_flight_t *f)
 {
-	rlm_cache_entry_t const *a = one;
-	rlm_cache_entry_t const *b = two;
+	cache_flight_stripe_t *stripe;
+	cache_flight_t **last;
 
-	if (a->expires < b->expires) return -1;
-	if (a->expires > b->expires) return +1;
+	if (!f) return;
 
-	return 0;
+	stripe = &inst->flights[f->hash % inst->num_shards];
+
+	pthread_mutex_lock(&stripe->mutex);
+	for (last = &stripe->head; *last != NULL; last = &(*last)->next) {
+		if (*last == f) {
+			*last = f->next;
+			break;
+		}
+	}
+
+	f->done = true;
+	pthread_cond_broadcast(&stripe->cond);
+
+	if (--f->refs == 0) talloc_free(f);
+	pthread_mutex_unlock(&stripe->mutex);
 }
+#else
+/*
+ *	With only one thread there's never anyone to wait for.
+ */
+static cache_flight_rcode_t cache_flight_begin(UNUSED rlm_cache_t *inst, UNUSED REQUEST *request,
+					       UNUSED char const *key, UNUSED uint32_t hash,
+					       UNUSED bool wait, cache_flight_t **out)
+{
+	*out = NULL;
+	return CACHE_FLIGHT_LEADER;
+}
+
+static void cache_flight_end(UNUSED rlm_cache_t *inst, UNUSED cache_flight_t *f)
+{
+}
+#endif
 
 /*
  *	Merge a cached entry into a REQUEST.
@@ -168,50 +259,47 @@ static void cache_merge(rlm_cache_t *inst, REQUEST *request,
 
 
 /*
- *	Find a cached entry.
+ *	Find a cached entry.  The shard holding the key must have been
+ *	acquired.
+ *
+ *	Entries which expired less than "stale_ttl" seconds ago are
+ *	returned with "stale" set, and are left in the cache.
  */
-static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
-				     char const *key)
+static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request, void *handle,
+				     char const *key, uint32_t hash, bool *stale)
 {
 	int ttl;
-	rlm_cache_entry_t *c, my_c;
+	rlm_cache_entry_t *c;
 	VALUE_PAIR *vp;
 
 	/*
-	 *	Look at the expiry heap.
+	 *	Is there an entry for this key?
 	 */
-	c = fr_heap_peek(inst->heap);
-	if (!c) {
-		rad_assert(rbtree_num_elements(inst->cache) == 0);
-		return NULL;
-	}
+	*stale = false;
+	c = inst->driver->find(inst, request, handle, key, hash);
+	if (!c) return NULL;
 
 	/*
-	 *	If it's time to expire an old entry, do so now.
+	 *	Expired recently enough that it can still be used,
+	 *	while it's refreshed.
 	 */
-	if (c->expires < request->timestamp) {
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
+	if ((inst->stale_ttl > 0) && (c->created >= inst->epoch) &&
+	    (c->expires < request->timestamp) &&
+	    ((c->expires + inst->stale_ttl) >= request->timestamp)) {
+		RDEBUG("Found stale entry for \"%s\"", key);
+		*stale = true;
+		return c;
 	}
 
-	/*
-	 *	Is there an entry for this key?
-	 */
-	my_c.key = key;
-	c = rbtree_finddata(inst->cache, &my_c);
-	if (!c) return NULL;
-
 	/*
 	 *	Yes, but it expired, OR the "forget all" epoch has
 	 *	passed.  Delete it, and pretend it doesn't exist.
 	 */
-	if ((c->expires < request->timestamp) ||
-	    (c->created < inst->epoch)) {
+	if (cache_entry_expired(inst, request, c)) {
 	delete:
 		RDEBUG("Entry has expired, removing");
 
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
+		inst->driver->expire(inst, request, handle, c);
 
 		return NULL;
 	}
@@ -232,22 +320,28 @@ static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
 		RDEBUG("Adding %d to the TTL", ttl);
 	}
 	c->hits++;
+	if (inst->driver->update) inst->driver->update(inst, request, handle, c);
 
 	return c;
 }
 
 
 /*
- *	Add an entry to the cache.
+ *	Create an entry for the cache.
+ *
+ *	This runs without any shard locked, as the map may need xlat
+ *	expansions.  The entry is added to the cache by the driver's
+ *	insert() method.
  */
 static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
-				    char const *key)
+				    char const *key, uint32_t hash)
 {
 	int ttl;
 	VALUE_PAIR *vp, *found, **to_req, **to_cache, **from;
 	DICT_ATTR const *da;
 
 	bool merge = true;
+	bool ttl_set = false;
 	REQUEST *context;
 
 	value_pair_map_t const *map;
@@ -255,19 +349,20 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 	rlm_cache_entry_t *c;
 	char buffer[1024];
 
-	if (rbtree_num_elements(inst->cache) >= inst->max_entries) {
-		RDEBUG("Cache is full: %d entries", inst->max_entries);
-		return NULL;
-	}
-
 	/*
 	 *	TTL of 0 means "don't cache this entry"
 	 */
 	vp = pairfind(request->config_items, PW_CACHE_TTL, 0, TAG_ANY);
 	if (vp && (vp->vp_signed == 0)) return NULL;
 
-	c = talloc_zero(inst, rlm_cache_entry_t);
+	/*
+	 *	Entries aren't parented by the instance, as talloc
+	 *	contexts must not be shared between threads.
+	 */
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	if (!c) return NULL;
 	c->key = talloc_typed_strdup(c, key);
+	c->hash = hash;
 	c->created = c->expires = request->timestamp;
 
 	/*
@@ -275,6 +370,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 	 */
 	if (vp && (vp->vp_signed > 0)) {
 		ttl = vp->vp_signed;
+		ttl_set = true;
 	} else {
 		ttl = inst->ttl;
 	}
@@ -313,6 +409,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 
 		default:
 			rad_assert(0);
+			cache_entry_free(c);
 			return NULL;
 		}
 
@@ -457,6 +554,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 				     	vp = paircopyvp(c, i);
 				     	if (!vp) {
 				     		pairfree(&found);
+				     		cache_entry_free(c);
 				     		return NULL;
 				     	}
 					RDEBUG("\t%s %s %s (%s)", map->dst->name,
@@ -487,7 +585,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 			       fr_int2str(fr_tokens, map->op, "<INVALID>"),
 			       buffer);
 
-			vp = pairalloc(map->dst, map->dst->da);
+			vp = pairalloc(c, map->dst->da);
 			if (!vp) continue;
 
 			vp->op = map->op;
@@ -512,7 +610,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 			       fr_int2str(fr_tokens, map->op, "<INVALID>"),
 			       map->src->name);
 
-			vp = pairalloc(map->dst, map->dst->da);
+			vp = pairalloc(c, map->dst->da);
 			if (!vp) continue;
 
 			vp->op = map->op;
@@ -532,23 +630,21 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 
 		default:
 			rad_assert(0);
+			cache_entry_free(c);
 			return NULL;
 		}
 	}
 
-	if (!rbtree_insert(inst->cache, c)) {
-		REDEBUG("FAILED adding entry for key %s", key);
-		cache_entry_free(c);
-		return NULL;
-	}
-
-	if (!fr_heap_insert(inst->heap, c)) {
-		REDEBUG("FAILED adding entry for key %s", key);
-		rbtree_deletebydata(inst->cache, c);
-		return NULL;
+	/*
+	 *	Nothing was cached.  Remember that, but not for as
+	 *	long as a normal entry.
+	 */
+	if (!ttl_set && cache_entry_negative(inst, c)) {
+		ttl = inst->negative_ttl;
+		c->expires = c->created + ttl;
 	}
 
-	RDEBUG("Inserted entry, TTL %d seconds", ttl);
+	RDEBUG("Created entry, TTL %d seconds", ttl);
 
 	return c;
 }
@@ -669,6 +765,9 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 	char const		*p = fmt;
 	size_t			len;
 	int			ret = 0;
+	uint32_t		hash;
+	void			*handle;
+	bool			stale;
 
 	list = radius_list_name(&p, PAIR_LIST_REQUEST);
 
@@ -678,8 +777,10 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 		return -1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
-	c = cache_find(inst, request, fmt);
+	hash = fr_hash_string(fmt);
+
+	handle = inst->driver->acquire(inst, hash);
+	c = cache_find(inst, request, handle, fmt, hash, &stale);
 
 	if (!c) {
 		RDEBUG("No cache entry for key \"%s\"", fmt);
@@ -701,12 +802,12 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 		break;
 
 	case PAIR_LIST_UNKNOWN:
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		inst->driver->release(inst, handle);
 		REDEBUG("Unknown list qualifier in \"%s\"", fmt);
 		return -1;
 
 	default:
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		inst->driver->release(inst, handle);
 		REDEBUG("Unsupported list \"%s\"",
 		        fr_int2str(pair_lists, list, "¿Unknown?"));
 		return -1;
@@ -721,12 +822,12 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 
 	len = vp_prints_value(out, freespace, vp, 0);
 	if (is_truncated(len, freespace)) {
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		inst->driver->release(inst, handle);
 		REDEBUG("Insufficient buffer space to write cached value");
 		return -1;
 	}
 done:
-	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+	inst->driver->release(inst, handle);
 
 	return ret;
 }
@@ -747,10 +848,26 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(rlm_cache_t, ttl), NULL, "500" },
 	{ "max_entries", PW_TYPE_INTEGER,
 	  offsetof(rlm_cache_t, max_entries), NULL, "16384" },
+	{ "shards", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, num_shards), NULL, "16" },
+	{ "driver", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_cache_t, driver_name), NULL, "memory" },
+	{ "filename", PW_TYPE_FILE_OUTPUT,
+	  offsetof(rlm_cache_t, filename), NULL, NULL },
+	{ "slot_size", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, slot_size), NULL, "1024" },
 	{ "epoch", PW_TYPE_INTEGER,
 	  offsetof(rlm_cache_t, epoch), NULL, "0" },
 	{ "add_stats", PW_TYPE_BOOLEAN,
 	  offsetof(rlm_cache_t, stats), NULL, "no" },
+	{ "single_flight", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_cache_t, single_flight), NULL, "no" },
+	{ "single_flight_timeout", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, single_flight_timeout), NULL, "1000" },
+	{ "stale_ttl", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, stale_ttl), NULL, "0" },
+	{ "negative_ttl", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, negative_ttl), NULL, "0" },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -764,14 +881,23 @@ static int mod_detach(void *instance)
 {
 	rlm_cache_t *inst = instance;
 
+
 	talloc_free(inst->maps);
 
-	fr_heap_delete(inst->heap);
-	rbtree_free(inst->cache);
+	if (inst->driver) inst->driver->detach(inst);
 
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_destroy(&inst->cache_mutex);
+	if (inst->flights) {
+		int i;
+
+		for (i = 0; i < inst->num_shards; i++) {
+			pthread_mutex_destroy(&inst->flights[i].mutex);
+			pthread_cond_destroy(&inst->flights[i].cond);
+		}
+	}
 #endif
+	talloc_free(inst->flights);
+
 	return 0;
 }
 
@@ -782,6 +908,7 @@ static int mod_detach(void *instance)
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_cache_t *inst = instance;
+	int i;
 
 	inst->cs = conf;
 
@@ -807,33 +934,63 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (pthread_mutex_init(&inst->cache_mutex, NULL) < 0) {
-		EDEBUG("Failed initializing mutex: %s",
-		       fr_syserror(errno));
+	if (inst->max_entries <= 0) {
+		cf_log_err_cs(conf, "Must set 'max_entries' to a positive value");
+		return -1;
+	}
+
+	if ((inst->num_shards <= 0) || (inst->num_shards > MAX_SHARDS)) {
+		cf_log_err_cs(conf, "'shards' must be between 1 and %d", MAX_SHARDS);
 		return -1;
 	}
-#endif
 
 	/*
-	 *	The cache.
+	 *	Every shard must be able to hold at least one entry.
 	 */
-	inst->cache = rbtree_create(cache_entry_cmp, cache_entry_free, 0);
-	if (!inst->cache) {
-		EDEBUG("Failed to create cache");
+	if (inst->num_shards > inst->max_entries) inst->num_shards = inst->max_entries;
+
+	for (i = 0; cache_drivers[i] != NULL; i++) {
+		if (strcmp(cache_drivers[i]->name, inst->driver_name) == 0) {
+			inst->driver = cache_drivers[i];
+			break;
+		}
+	}
+
+	if (!inst->driver) {
+		cf_log_err_cs(conf, "Unknown driver \"%s\"", inst->driver_name);
 		return -1;
 	}
 
 	/*
-	 *	The heap of entries to expire.
+	 *	The cache.
 	 */
-	inst->heap = fr_heap_create(cache_heap_cmp,
-				    offsetof(rlm_cache_entry_t, offset));
-	if (!inst->heap) {
-		EDEBUG("Failed to create heap for the cache");
+	if (inst->driver->instantiate(inst) < 0) return -1;
+
+	if ((inst->single_flight_timeout <= 0) || (inst->stale_ttl < 0) ||
+	    (inst->negative_ttl < 0)) {
+		cf_log_err_cs(conf, "'single_flight_timeout' must be positive, and "
+			      "'stale_ttl' and 'negative_ttl' must not be negative");
 		return -1;
 	}
 
+	/*
+	 *	Keys being built, for single-flight and refreshing
+	 *	stale entries.
+	 */
+	inst->flights = talloc_zero_array(inst, cache_flight_stripe_t, inst->num_shards);
+	if (!inst->flights) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < inst->num_shards; i++) {
+		if ((pthread_mutex_init(&inst->flights[i].mutex, NULL) != 0) ||
+		    (pthread_cond_init(&inst->flights[i].cond, NULL) != 0)) {
+			EDEBUG("Failed initializing mutex: %s",
+			       fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Make sure the users don't screw up too badly.
 	 */
@@ -853,47 +1010,93 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
  */
 static rlm_rcode_t cache_it(void *instance, REQUEST *request)
 {
-	rlm_cache_entry_t *c;
+	rlm_cache_entry_t *c, *old;
 	rlm_cache_t *inst = instance;
 	VALUE_PAIR *vp;
 	char buffer[1024];
+	uint32_t hash;
+	void *handle;
+	bool stale;
+	cache_flight_t *flight = NULL;
 	rlm_rcode_t rcode;
 
 	if (radius_xlat(buffer, sizeof(buffer), request, inst->key, NULL, NULL) < 0) {
 		return RLM_MODULE_FAIL;
 	}
 
-	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
-	c = cache_find(inst, request, buffer);
+	hash = fr_hash_string(buffer);
+
+	handle = inst->driver->acquire(inst, hash);
+	c = cache_find(inst, request, handle, buffer, hash, &stale);
 
 	/*
 	 *	If yes, only return whether we found a valid cache entry
 	 */
 	vp = pairfind(request->config_items, PW_CACHE_STATUS_ONLY, 0, TAG_ANY);
 	if (vp && vp->vp_integer) {
-		rcode = c ? RLM_MODULE_OK:
-			    RLM_MODULE_NOTFOUND;
-		goto done;
+		inst->driver->release(inst, handle);
+		return (c && !stale) ? RLM_MODULE_OK:
+				       RLM_MODULE_NOTFOUND;
+	}
+
+	/*
+	 *	A stale entry is used as-is, unless we're the request
+	 *	which gets to refresh it.
+	 */
+	if (c && stale &&
+	    (cache_flight_begin(inst, request, buffer, hash, false, &flight) == CACHE_FLIGHT_BUSY)) {
+		RDEBUG("Entry is being refreshed by another request, using stale entry");
+		stale = false;
 	}
 
-	if (c) {
+	if (c && !stale) {
+	found:
 		cache_merge(inst, request, c);
+		rcode = cache_entry_negative(inst, c) ? RLM_MODULE_NOTFOUND :
+							RLM_MODULE_OK;
+		inst->driver->release(inst, handle);
 
-		rcode = RLM_MODULE_OK;
-		goto done;
+		return rcode;
 	}
+	inst->driver->release(inst, handle);
 
-	c = cache_add(inst, request, buffer);
+	/*
+	 *	Wait for any other request which is already building
+	 *	this entry, and use its result.
+	 */
+	if (!c && inst->single_flight &&
+	    (cache_flight_begin(inst, request, buffer, hash, true, &flight) == CACHE_FLIGHT_WAITED)) {
+		handle = inst->driver->acquire(inst, hash);
+		c = cache_find(inst, request, handle, buffer, hash, &stale);
+		if (c && !stale) goto found;
+		inst->driver->release(inst, handle);
+
+		RDEBUG2("No entry was created by the other request");
+	}
+
+	/*
+	 *	Build the new entry without holding the lock, then
+	 *	add it to the cache, replacing any stale entry.
+	 */
+	c = cache_add(inst, request, buffer, hash);
 	if (!c) {
-		rcode = RLM_MODULE_NOOP;
-		goto done;
+		cache_flight_end(inst, flight);
+		return RLM_MODULE_NOOP;
 	}
 
-	rcode = RLM_MODULE_UPDATED;
+	handle = inst->driver->acquire(inst, hash);
+	old = inst->driver->find(inst, request, handle, buffer, hash);
+	if (old && cache_entry_expired(inst, request, old)) {
+		inst->driver->expire(inst, request, handle, old);
+	}
 
-done:
-	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
-	return rcode;
+	if (inst->driver->insert(inst, request, handle, c) == 0) {
+		RDEBUG("Inserted entry for \"%s\"", buffer);
+	}
+	inst->driver->release(inst, handle);
+	cache_flight_end(inst, flight);
+
+	return RLM_MODULE_UPDATED;
 }
 
 
@@ -0,0 +1,133 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _RLM_CACHE_H
+#define _RLM_CACHE_H
+/**
+ * $Id$
+ * @file rlm_cache.h
+ * @brief Cache values and merge them back into future requests.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSIDH(rlm_cache_h, "$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define MAX_SHARDS	256
+
+typedef struct rlm_cache_driver_t rlm_cache_driver_t;
+typedef struct cache_flight_stripe_t cache_flight_stripe_t;
+
+/*
+ *	Define a structure for our module configuration.
+ *
+ *	These variables do not need to be in a structure, but it's
+ *	a lot cleaner to do so, and a pointer to the structure can
+ *	be used as the instance handle.
+ */
+typedef struct rlm_cache_t {
+	char const		*xlat_name;
+	char			*key;
+	int			ttl;
+	int			max_entries;
+	int			num_shards;
+	int			epoch;
+	bool			stats;
+	CONF_SECTION		*cs;
+
+	bool			single_flight;	//!< Coalesce concurrent misses.
+	int			single_flight_timeout;	//!< Max wait, in ms.
+	int			stale_ttl;	//!< Serve expired entries for this
+						//!< long while one request refreshes.
+	int			negative_ttl;	//!< TTL of entries with no attributes.
+	cache_flight_stripe_t	*flights;	//!< Keys being built.
+
+	char const		*driver_name;	//!< Storage backend to use.
+	rlm_cache_driver_t const *driver;
+	void			*driver_inst;	//!< Backend specific data.
+
+	char const		*filename;	//!< mmap backend: the store.
+	int			slot_size;	//!< mmap backend: bytes per entry.
+
+	value_pair_map_t	*maps;	//!< Attribute map applied to users
+					//!< and profiles.
+} rlm_cache_t;
+
+typedef struct rlm_cache_entry_t rlm_cache_entry_t;
+
+struct rlm_cache_entry_t {
+	char const		*key;
+	uint32_t		hash;
+	long long int		hits;
+	time_t			created;
+	time_t			expires;
+	VALUE_PAIR		*control;
+	VALUE_PAIR		*packet;
+	VALUE_PAIR		*reply;
+
+	/*
+	 *	Used by the memory backend only.
+	 */
+	bool			referenced;	//!< CLOCK reference bit.
+	rlm_cache_entry_t	*prev;		//!< CLOCK ring.
+	rlm_cache_entry_t	*next;
+};
+
+/** Storage backend for the cache
+ *
+ * Every backend splits its store into inst->num_shards shards, selected
+ * by the hash of the key.  acquire() locks the shard holding a key, and
+ * the other calls may only be made between acquire() and release().
+ *
+ * Entries returned by find() remain valid until release() is called.
+ * They may be modified in place, with update() being called to write
+ * the changes back to the store.  insert() takes ownership of the
+ * entry, even if it fails.
+ */
+struct rlm_cache_driver_t {
+	char const	*name;
+
+	int		(*instantiate)(rlm_cache_t *inst);
+	void		(*detach)(rlm_cache_t *inst);
+
+	void		*(*acquire)(rlm_cache_t *inst, uint32_t hash);
+	void		(*release)(rlm_cache_t *inst, void *handle);
+
+	rlm_cache_entry_t *(*find)(rlm_cache_t *inst, REQUEST *request, void *handle,
+				   char const *key, uint32_t hash);
+
+	int		(*insert)(rlm_cache_t *inst, REQUEST *request, void *handle,
+				  rlm_cache_entry_t *c);
+	void		(*expire)(rlm_cache_t *inst, REQUEST *request, void *handle,
+				  rlm_cache_entry_t *c);
+	void		(*update)(rlm_cache_t *inst, REQUEST *request, void *handle,
+				  rlm_cache_entry_t *c);
+};
+
+extern rlm_cache_driver_t const rlm_cache_memory;
+extern rlm_cache_driver_t const rlm_cache_mmap;
+
+void cache_entry_free(void *data);
+bool cache_entry_expired(rlm_cache_t *inst, REQUEST *request, rlm_cache_entry_t const *c);
+#endif
@@ -69,7 +69,9 @@ typedef enum operation_t {
  * It is also a list of EAP-request handlers waiting for EAP-response
  * eap_id = copy of the eap packet we sent to the
  *
- * next = pointer to next
+ * prev, next = the other handlers in the same session store timer
+ *	      wheel slot.
+ * wheel_slot = timer wheel slot this handler is in.
  * state = state attribute from the reply we sent
  * state_len = length of data in the state attribute.
  * src_ipaddr = client which sent us the RADIUS request containing
@@ -93,6 +95,7 @@ typedef enum operation_t {
 #define EAP_STATE_LEN (AUTH_VECTOR_LEN)
 typedef struct _eap_handler {
 	struct _eap_handler *prev, *next;
+	int		wheel_slot;
 	uint8_t		state[EAP_STATE_LEN];
 	fr_ipaddr_t	src_ipaddr;
 
@@ -122,10 +125,17 @@ typedef struct _eap_handler {
 	int		tls;
 	int		finished;
 	VALUE_PAIR	*certs;
+
+	bool		exported;	//!< Written to the session store this round.
 } eap_handler_t;
 
 /*
  * Interface to call EAP sub mdoules
+ *
+ * export_state and import_state are optional.  They save and restore
+ * the handler's opaque data, so that the session can be continued by
+ * another server.  Methods which have opaque data, but no
+ * export_state, keep their sessions on the server which started them.
  */
 typedef struct rlm_eap_module {
 	char const *name;
@@ -134,6 +144,8 @@ typedef struct rlm_eap_module {
 	int (*authorize)(void *instance, eap_handler_t *handler);
 	int (*authenticate)(void *instance, eap_handler_t *handler);
 	int (*detach)(void *instance);
+	ssize_t (*export_state)(void *instance, eap_handler_t *handler, uint8_t *out, size_t outlen);
+	int (*import_state)(void *instance, eap_handler_t *handler, uint8_t const *data, size_t len);
 } rlm_eap_module_t;
 
 #define REQUEST_DATA_EAP_HANDLER	 (1)
@@ -163,6 +163,8 @@ extern int eap_wireformat(eap_packet_t *reply);
 extern int eap_basic_compose(RADIUS_PACKET *packet, eap_packet_t *reply);
 extern VALUE_PAIR *eap_packet2vp(RADIUS_PACKET *packet, eap_packet_raw_t const *reply);
 extern eap_packet_raw_t *eap_vp2packet(TALLOC_CTX *ctx, VALUE_PAIR *vps);
+extern ssize_t eap_pairs_export(uint8_t *out, size_t outlen, VALUE_PAIR *vps);
+extern ssize_t eap_pairs_import(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *data, size_t len);
 void eap_add_reply(REQUEST *request,
 		   char const *name, uint8_t const *value, int len);
 
@@ -396,3 +396,104 @@ void eap_add_reply(REQUEST *request,
 
 	pairmemcpy(vp, value, len);
 }
+
+/*
+ *	Write a VALUE_PAIR list to a buffer, so that it can be saved
+ *	with an exported EAP session.  The format is:
+ *
+ *	count (2), then for each pair:
+ *	attr (4), vendor (4), tag (1), op (1), length (2), value
+ *
+ *	All fields are in network byte order, so that the session can be
+ *	continued by a server on a different architecture.
+ *
+ *	Returns the number of bytes written, or -1 if there isn't room.
+ */
+ssize_t eap_pairs_export(uint8_t *out, size_t outlen, VALUE_PAIR *vps)
+{
+	uint8_t *p = out, *end = out + outlen;
+	uint16_t count = 0, len;
+	uint32_t num;
+	ssize_t ret;
+	uint8_t const *value;
+	VALUE_PAIR *vp;
+	vp_cursor_t cursor;
+
+	if (outlen < 2) return -1;
+	p += 2;
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		/*
+		 *	Zero length values can't be imported again.
+		 */
+		ret = rad_vp2data(&value, vp);
+		if (ret <= 0) continue;
+		if ((ret > UINT16_MAX) || ((end - p) < (12 + ret))) return -1;
+
+		num = htonl(vp->da->attr);
+		memcpy(p, &num, 4);
+		num = htonl(vp->da->vendor);
+		memcpy(p + 4, &num, 4);
+		p[8] = (uint8_t) vp->tag;
+		p[9] = (uint8_t) vp->op;
+		len = htons(ret);
+		memcpy(p + 10, &len, 2);
+		memcpy(p + 12, value, ret);
+
+		p += 12 + ret;
+		count++;
+	}
+	count = htons(count);
+	memcpy(out, &count, 2);
+
+	return p - out;
+}
+
+/*
+ *	Read a VALUE_PAIR list written by eap_pairs_export().
+ *
+ *	Returns the number of bytes read, or -1 on error.
+ */
+ssize_t eap_pairs_import(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *data, size_t len)
+{
+	uint8_t const *p = data, *end = data + len;
+	uint16_t count, vplen;
+	uint32_t attr, vendor;
+	VALUE_PAIR *vp, *head;
+	vp_cursor_t cursor;
+
+	if (len < 2) return -1;
+	memcpy(&count, p, 2);
+	count = ntohs(count);
+	p += 2;
+
+	while (count--) {
+		if ((end - p) < 12) return -1;
+
+		memcpy(&attr, p, 4);
+		attr = ntohl(attr);
+		memcpy(&vendor, p + 4, 4);
+		vendor = ntohl(vendor);
+		memcpy(&vplen, p + 10, 2);
+		vplen = ntohs(vplen);
+		if ((end - p) < (12 + vplen)) return -1;
+
+		head = NULL;
+		if (rad_data2vp(attr, vendor, p + 12, vplen, &head) < 0) return -1;
+
+		for (vp = fr_cursor_init(&cursor, &head);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			(void) talloc_steal(ctx, vp);
+			vp->tag = (int8_t) p[8];
+			vp->op = (FR_TOKEN) p[9];
+		}
+		pairadd(out, head);
+
+		p += 12 + vplen;
+	}
+
+	return p - data;
+}
@@ -110,8 +110,13 @@ eap_handler_t *eap_handler_alloc(rlm_eap_t *inst)
 {
 	eap_handler_t	*handler;
 
+	/*
+	 *	Handlers aren't parented by the instance, as the
+	 *	session expiry thread frees them while other threads
+	 *	are allocating new ones.
+	 */
 	PTHREAD_MUTEX_LOCK(&(inst->handler_mutex));
-	handler = talloc_zero(inst, eap_handler_t);
+	handler = talloc_zero(NULL, eap_handler_t);
 
 	if (inst->handler_tree) {
 		rbtree_insert(inst->handler_tree, handler);
@@ -190,123 +195,331 @@ done:
 	return 0;
 }
 
-void eaplist_free(rlm_eap_t *inst)
+/*
+ *	Compare two handlers.
+ */
+static int eap_handler_cmp(void const *a, void const *b)
 {
-	eap_handler_t *node, *next;
+	int rcode;
+	eap_handler_t const *one = a;
+	eap_handler_t const *two = b;
+
+	if (one->eap_id < two->eap_id) return -1;
+	if (one->eap_id > two->eap_id) return +1;
 
-       	for (node = inst->session_head; node != NULL; node = next) {
-		next = node->next;
-		talloc_free(node);
+	rcode = memcmp(one->state, two->state, sizeof(one->state));
+	if (rcode != 0) return rcode;
+
+	/*
+	 *	As of 2.1.8, we don't key off of source IP.  This
+	 *	a NAS to send packets load-balanced (or fail-over)
+	 *	across multiple intermediate proxies, and still have
+	 *	EAP work.
+	 */
+	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
+		WDEBUG("EAP packets are arriving from two different upstream "
+		       "servers.  Has there been a proxy fail-over?");
 	}
 
-	inst->session_head = inst->session_tail = NULL;
+	return 0;
+}
+
+static uint32_t eap_handler_hash(void const *data)
+{
+	eap_handler_t const *handler = data;
+
+	return fr_hash(handler->state, sizeof(handler->state));
 }
 
 /*
- *	Return a 32-bit random number.
+ *	Bytes 8 to 15 of the State are random, so they're used as-is
+ *	to pick the shard.  The hash table uses all of it.
  */
-static uint32_t eap_rand(fr_randctx *ctx)
+static eap_session_shard_t *eap_session_shard(rlm_eap_t *inst, uint8_t const *state)
 {
 	uint32_t num;
 
-	num = ctx->randrsl[ctx->randcnt++];
-	if (ctx->randcnt >= 256) {
-		ctx->randcnt = 0;
-		fr_isaac(ctx);
-	}
+	memcpy(&num, state + 8, sizeof(num));
 
-	return num;
+	return &inst->shards[num % inst->num_shards];
 }
 
-
-static eap_handler_t *eaplist_delete(rlm_eap_t *inst, REQUEST *request,
-				   eap_handler_t *handler)
+static void wheel_insert(rlm_eap_t *inst, eap_session_shard_t *shard, eap_handler_t *handler)
 {
-	rbnode_t *node;
-
-	node = rbtree_find(inst->session_tree, handler);
-	if (!node) return NULL;
+	int slot;
 
-	handler = rbtree_node2data(inst->session_tree, node);
+	slot = (handler->timestamp + inst->timer_limit + 1) % inst->wheel_slots;
 
-	RDEBUG("Finished EAP session with state "
-	       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
-	       handler->state[0], handler->state[1],
-	       handler->state[2], handler->state[3],
-	       handler->state[4], handler->state[5],
-	       handler->state[6], handler->state[7]);
-	/*
-	 *	Delete old handler from the tree.
-	 */
-	rbtree_delete(inst->session_tree, node);
+	handler->wheel_slot = slot;
+	handler->prev = NULL;
+	handler->next = shard->wheel[slot];
+	if (handler->next) handler->next->prev = handler;
+	shard->wheel[slot] = handler;
+}
 
-	/*
-	 *	And unsplice it from the linked list.
-	 */
+static void wheel_remove(eap_session_shard_t *shard, eap_handler_t *handler)
+{
 	if (handler->prev) {
 		handler->prev->next = handler->next;
 	} else {
-		inst->session_head = handler->next;
-	}
-	if (handler->next) {
-		handler->next->prev = handler->prev;
-	} else {
-		inst->session_tail = handler->prev;
+		shard->wheel[handler->wheel_slot] = handler->next;
 	}
-	handler->prev = handler->next = NULL;
+	if (handler->next) handler->next->prev = handler->prev;
 
-	return handler;
+	handler->prev = handler->next = NULL;
 }
 
+/*
+ *	Advance the timer wheel of a shard to "now", removing the
+ *	sessions which have expired.  They're returned as a list, to
+ *	be freed by eap_session_free_list() once the shard is unlocked.
+ *
+ *	Each slot holds the sessions expiring in one second, so this
+ *	only looks at the slots for the seconds since the last call.
+ *	A session which isn't due yet is left where it is, which only
+ *	happens if timer_expire has been increased at run time.
+ */
+static eap_handler_t *eap_session_reap(rlm_eap_t *inst, eap_session_shard_t *shard, time_t now)
+{
+	time_t when;
+	eap_handler_t *handler, *next, *expired = NULL;
+
+	if (now <= shard->last_tick) return NULL;
+
+	when = shard->last_tick + 1;
+	if ((now - when) >= inst->wheel_slots) when = now - inst->wheel_slots + 1;
+
+	for (; when <= now; when++) {
+		for (handler = shard->wheel[when % inst->wheel_slots];
+		     handler != NULL;
+		     handler = next) {
+			next = handler->next;
+
+			if ((now - handler->timestamp) <= inst->timer_limit) continue;
+
+			wheel_remove(shard, handler);
+			fr_hash_table_yank(shard->sessions, handler);
+
+			handler->next = expired;
+			expired = handler;
+		}
+	}
+	shard->last_tick = now;
+
+	return expired;
+}
 
-static void eaplist_expire(rlm_eap_t *inst, REQUEST *request, time_t timestamp)
+static void eap_session_free_list(rlm_eap_t *inst, eap_handler_t *handler)
 {
-	int i;
-	eap_handler_t *handler;
+	eap_handler_t *next;
 
-	/*
-	 *	Check the first few handlers in the list, and delete
-	 *	them if they're too old.  We don't need to check them
-	 *	all, as incoming requests will quickly cause older
-	 *	handlers to be deleted.
-	 *
-	 */
-	for (i = 0; i < 3; i++) {
-		handler = inst->session_head;
-		if (!handler) break;
+	for (; handler != NULL; handler = next) {
+		next = handler->next;
 
-		RDEBUG("Expiring EAP session with state "
+		DEBUG2("rlm_eap (%s): Expiring EAP session with state "
 		       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
+		       inst->xlat_name,
 		       handler->state[0], handler->state[1],
 		       handler->state[2], handler->state[3],
 		       handler->state[4], handler->state[5],
 		       handler->state[6], handler->state[7]);
 
+		talloc_free(handler);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Expire sessions once a second, so that idle shards don't keep
+ *	their sessions until the next request arrives.
+ */
+static void *eap_session_reaper(void *arg)
+{
+	rlm_eap_t *inst = arg;
+	struct timespec when;
+	eap_handler_t *expired;
+	int i;
+
+	pthread_mutex_lock(&inst->reaper_mutex);
+	while (!inst->reaper_stop) {
+		when.tv_sec = time(NULL) + 1;
+		when.tv_nsec = 0;
+
+		pthread_cond_timedwait(&inst->reaper_cond, &inst->reaper_mutex, &when);
+		if (inst->reaper_stop) break;
+		pthread_mutex_unlock(&inst->reaper_mutex);
+
+		for (i = 0; i < inst->num_shards; i++) {
+			eap_session_shard_t *shard = &inst->shards[i];
+
+			pthread_mutex_lock(&shard->mutex);
+			expired = eap_session_reap(inst, shard, time(NULL));
+			pthread_mutex_unlock(&shard->mutex);
+
+			eap_session_free_list(inst, expired);
+		}
+
+		if (inst->store) eap_store_purge(inst, time(NULL));
+
+		pthread_mutex_lock(&inst->reaper_mutex);
+	}
+	pthread_mutex_unlock(&inst->reaper_mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Create the session store.
+ */
+int eaplist_init(rlm_eap_t *inst)
+{
+	int i;
+	time_t now = time(NULL);
+
+	/*
+	 *	Every session in a slot must expire in the same second.
+	 */
+	inst->wheel_slots = inst->timer_limit + 2;
+
+	inst->shards = talloc_zero_array(inst, eap_session_shard_t, inst->num_shards);
+	if (!inst->shards) return -1;
+
+	for (i = 0; i < inst->num_shards; i++) {
+		eap_session_shard_t *shard = &inst->shards[i];
+
 		/*
-		 *	Expire entries from the start of the list.
-		 *	They should be the oldest ones.
+		 *	We don't free sessions in the table, as that's
+		 *	taken care of elsewhere...
 		 */
-		if ((timestamp - handler->timestamp) > inst->timer_limit) {
-			rbnode_t *node;
-			node = rbtree_find(inst->session_tree, handler);
-			rad_assert(node != NULL);
-			rbtree_delete(inst->session_tree, node);
-
-			/*
-			 *	handler == inst->session_head
-			 */
-			inst->session_head = handler->next;
-			if (handler->next) {
-				handler->next->prev = NULL;
-			} else {
-				inst->session_head = NULL;
-				inst->session_tail = NULL;
+		shard->sessions = fr_hash_table_create(eap_handler_hash, eap_handler_cmp, NULL);
+		shard->wheel = talloc_zero_array(inst->shards, eap_handler_t *, inst->wheel_slots);
+		if (!shard->sessions || !shard->wheel) {
+			ERROR("rlm_eap (%s): Cannot initialize session store", inst->xlat_name);
+			return -1;
+		}
+		shard->last_tick = now;
+		shard->max_sessions = (inst->max_sessions + inst->num_shards - 1) / inst->num_shards;
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
+			return -1;
+		}
+		shard->initialised = true;
+#endif
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->reaper_mutex, NULL) != 0) {
+		ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+
+	if (pthread_cond_init(&inst->reaper_cond, NULL) != 0) {
+		pthread_mutex_destroy(&inst->reaper_mutex);
+		ERROR("rlm_eap (%s): Failed initializing condition variable: %s", inst->xlat_name,
+		      fr_syserror(errno));
+		return -1;
+	}
+	inst->reaper_initialised = true;
+
+	i = pthread_create(&inst->reaper, NULL, eap_session_reaper, inst);
+	if (i != 0) {
+		ERROR("rlm_eap (%s): Failed creating session expiry thread: %s",
+		      inst->xlat_name, fr_syserror(i));
+		return -1;
+	}
+	inst->reaper_running = true;
+#endif
+
+	return 0;
+}
+
+void eaplist_free(rlm_eap_t *inst)
+{
+	eap_handler_t *node, *next;
+	int i, j;
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->reaper_running) {
+		pthread_mutex_lock(&inst->reaper_mutex);
+		inst->reaper_stop = true;
+		pthread_cond_signal(&inst->reaper_cond);
+		pthread_mutex_unlock(&inst->reaper_mutex);
+
+		pthread_join(inst->reaper, NULL);
+		inst->reaper_running = false;
+	}
+
+	if (inst->reaper_initialised) {
+		pthread_mutex_destroy(&inst->reaper_mutex);
+		pthread_cond_destroy(&inst->reaper_cond);
+		inst->reaper_initialised = false;
+	}
+#endif
+
+	if (!inst->shards) return;
+
+	for (i = 0; i < inst->num_shards; i++) {
+		eap_session_shard_t *shard = &inst->shards[i];
+
+		if (shard->wheel) for (j = 0; j < inst->wheel_slots; j++) {
+			for (node = shard->wheel[j]; node != NULL; node = next) {
+				next = node->next;
+				talloc_free(node);
 			}
-			talloc_free(handler);
-		} else {
-			break;
 		}
+
+		fr_hash_table_free(shard->sessions);
+#ifdef HAVE_PTHREAD_H
+		if (shard->initialised) pthread_mutex_destroy(&shard->mutex);
+#endif
+	}
+
+	talloc_free(inst->shards);
+	inst->shards = NULL;
+}
+
+/*
+ *	Each thread has its own random pool, so creating a State
+ *	doesn't need a lock.
+ */
+fr_thread_local_setup(fr_randctx *, eap_rand_pool);
+
+/*
+ *	Return a 32-bit random number.
+ */
+static uint32_t eap_rand(void)
+{
+	int i;
+	uint32_t num;
+	fr_randctx *ctx;
+
+	ctx = fr_thread_local_init(eap_rand_pool, free);
+	if (!ctx) {
+		ctx = malloc(sizeof(*ctx));
+		if (!ctx) return fr_rand();
+
+		for (i = 0; i < 256; i++) {
+			ctx->randrsl[i] = fr_rand();
+		}
+		fr_randinit(ctx, 1);
+		ctx->randcnt = 0;
+
+		if (fr_thread_local_set(eap_rand_pool, ctx) != 0) {
+			free(ctx);
+			return fr_rand();
+		}
+	}
+
+	num = ctx->randrsl[ctx->randcnt++];
+	if (ctx->randcnt >= 256) {
+		ctx->randcnt = 0;
+		fr_isaac(ctx);
 	}
+
+	return num;
 }
 
 /*
@@ -320,6 +533,8 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	int		status = 0;
 	VALUE_PAIR	*state;
 	REQUEST		*request = handler->request;
+	eap_session_shard_t *shard;
+	eap_handler_t	*expired;
 
 	rad_assert(handler != NULL);
 	rad_assert(request != NULL);
@@ -332,30 +547,18 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	if (!state) return 0;
 
 	/*
-	 *	The time at which this request was made was the time
-	 *	at which it was received by the RADIUS server.
+	 *	The wheel and the reaper both use the current time.
+	 *	request->timestamp is when the packet was received,
+	 *	which may be well before now if it sat in the queue,
+	 *	and would put the session in a slot the wheel has
+	 *	already passed.
 	 */
-	handler->timestamp = request->timestamp;
+	handler->timestamp = time(NULL);
 	handler->status = 1;
 
 	handler->src_ipaddr = request->packet->src_ipaddr;
 	handler->eap_id = handler->eap_ds->request->id;
 
-	/*
-	 *	Playing with a data structure shared among threads
-	 *	means that we need a lock, to avoid conflict.
-	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
-
-	/*
-	 *	If we have a DoS attack, discard new sessions.
-	 */
-	if (rbtree_num_elements(inst->session_tree) >= inst->max_sessions) {
-		status = -1;
-		eaplist_expire(inst, request, handler->timestamp);
-		goto done;
-	}
-
 	/*
 	 *	Create a unique content for the State variable.
 	 *	It will be modified slightly per round trip, but less so
@@ -367,7 +570,7 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 		for (i = 0; i < 4; i++) {
 			uint32_t lvalue;
 
-			lvalue = eap_rand(&inst->rand_pool);
+			lvalue = eap_rand();
 
 			memcpy(handler->state + i * 4, &lvalue,
 			       sizeof(lvalue));
@@ -383,10 +586,32 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 
 	pairmemcpy(state, handler->state, sizeof(handler->state));
 
+	/*
+	 *	Let other servers continue the session.
+	 */
+	if (inst->store) eap_store_export(inst, handler);
+
+	/*
+	 *	Playing with a data structure shared among threads
+	 *	means that we need a lock, to avoid conflict.
+	 */
+	shard = eap_session_shard(inst, handler->state);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	expired = eap_session_reap(inst, shard, handler->timestamp);
+
+	/*
+	 *	If we have a DoS attack, discard new sessions.
+	 */
+	if (fr_hash_table_num_elements(shard->sessions) >= shard->max_sessions) {
+		status = -1;
+		goto done;
+	}
+
 	/*
 	 *	Big-time failure.
 	 */
-	status = rbtree_insert(inst->session_tree, handler);
+	status = fr_hash_table_insert(shard->sessions, handler);
 
 	/*
 	 *	Catch Access-Challenge without response.
@@ -402,20 +627,7 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 		request_data_add(request, inst, 0, check, true);
 	}
 
-	if (status) {
-		eap_handler_t *prev;
-
-		prev = inst->session_tail;
-		if (prev) {
-			prev->next = handler;
-			handler->prev = prev;
-			handler->next = NULL;
-			inst->session_tail = handler;
-		} else {
-			inst->session_head = inst->session_tail = handler;
-			handler->next = handler->prev = NULL;
-		}
-	}
+	if (status) wheel_insert(inst, shard, handler);
 
 	/*
 	 *	Now that we've finished mucking with the list,
@@ -428,7 +640,9 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	 */
 	if (status > 0) handler->request = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	eap_session_free_list(inst, expired);
 
 	if (status <= 0) {
 		pairfree(&state);
@@ -468,7 +682,8 @@ eap_handler_t *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 			  eap_packet_raw_t *eap_packet)
 {
 	VALUE_PAIR	*state;
-	eap_handler_t	*handler, myHandler;
+	eap_handler_t	*handler, myHandler, *expired;
+	eap_session_shard_t *shard;
 
 	/*
 	 *	We key the sessions off of the 'state' attribute, so it
@@ -488,12 +703,38 @@ eap_handler_t *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 	 *	Playing with a data structure shared among threads
 	 *	means that we need a lock, to avoid conflict.
 	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
+	shard = eap_session_shard(inst, myHandler.state);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	expired = eap_session_reap(inst, shard, time(NULL));
+
+	handler = fr_hash_table_finddata(shard->sessions, &myHandler);
+	if (handler) {
+		RDEBUG("Finished EAP session with state "
+		       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
+		       handler->state[0], handler->state[1],
+		       handler->state[2], handler->state[3],
+		       handler->state[4], handler->state[5],
+		       handler->state[6], handler->state[7]);
+
+		fr_hash_table_yank(shard->sessions, handler);
+		wheel_remove(shard, handler);
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	eaplist_expire(inst, request, request->timestamp);
+	eap_session_free_list(inst, expired);
 
-	handler = eaplist_delete(inst, request, &myHandler);
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	/*
+	 *	If we have the session, any exported copy is stale.
+	 *	If we don't, another server may have started it.
+	 */
+	if (inst->store) {
+		if (handler) {
+			if (handler->exported) eap_store_remove(inst, &myHandler);
+		} else {
+			handler = eap_store_import(inst, request, &myHandler);
+		}
+	}
 
 	/*
 	 *	Might not have been there.
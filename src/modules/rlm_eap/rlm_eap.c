@@ -29,6 +29,15 @@ RCSID("$Id$")
 
 #include "rlm_eap.h"
 
+static const CONF_PARSER session_store_config[] = {
+	{ "driver", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_eap_t, store_name), NULL, "none" },
+	{ "directory", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_eap_t, store_directory), NULL, NULL },
+
+ 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
 static const CONF_PARSER module_config[] = {
 	{ "default_eap_type", PW_TYPE_STRING_PTR,
 	  offsetof(rlm_eap_t, default_method_name), NULL, "md5" },
@@ -40,6 +49,9 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(rlm_eap_t, mod_accounting_username_bug), NULL, "no" },
 	{ "max_sessions", PW_TYPE_INTEGER,
 	  offsetof(rlm_eap_t, max_sessions), NULL, "2048"},
+	{ "shards", PW_TYPE_INTEGER,
+	  offsetof(rlm_eap_t, num_shards), NULL, "16"},
+	{ "session_store", PW_TYPE_SUBSECTION, 0, NULL, (void const *) session_store_config },
 
  	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
@@ -53,45 +65,13 @@ static int mod_detach(void *instance)
 
 	inst = (rlm_eap_t *)instance;
 
+	eaplist_free(inst);
+
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_destroy(&(inst->session_mutex));
 	if (inst->handler_tree) pthread_mutex_destroy(&(inst->handler_mutex));
 #endif
 
-	rbtree_free(inst->session_tree);
 	if (inst->handler_tree) rbtree_free(inst->handler_tree);
-	inst->session_tree = NULL;
-	eaplist_free(inst);
-
-	return 0;
-}
-
-
-/*
- *	Compare two handlers.
- */
-static int eap_handler_cmp(void const *a, void const *b)
-{
-	int rcode;
-	eap_handler_t const *one = a;
-	eap_handler_t const *two = b;
-
-	if (one->eap_id < two->eap_id) return -1;
-	if (one->eap_id > two->eap_id) return +1;
-
-	rcode = memcmp(one->state, two->state, sizeof(one->state));
-	if (rcode != 0) return rcode;
-
-	/*
-	 *	As of 2.1.8, we don't key off of source IP.  This
-	 *	a NAS to send packets load-balanced (or fail-over)
-	 *	across multiple intermediate proxies, and still have
-	 *	EAP work.
-	 */
-	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
-		WDEBUG("EAP packets are arriving from two different upstream "
-		       "servers.  Has there been a proxy fail-over?");
-	}
 
 	return 0;
 }
@@ -113,21 +93,12 @@ static int eap_handler_ptr_cmp(void const *a, void const *b)
  */
 static int mod_instantiate(CONF_SECTION *cs, void *instance)
 {
-	int		i, ret;
+	int		ret;
 	eap_type_t	method;
 	int		num_methods;
 	CONF_SECTION 	*scs;
 	rlm_eap_t	*inst = instance;
 
-	/*
-	 *	Create our own random pool.
-	 */
-	for (i = 0; i < 256; i++) {
-		inst->rand_pool.randrsl[i] = fr_rand();
-	}
-	fr_randinit(&inst->rand_pool, 1);
-	inst->rand_pool.randcnt = 0;
-
 	inst->xlat_name = cf_section_name2(cs);
 	if (!inst->xlat_name) inst->xlat_name = "EAP";
 
@@ -215,18 +186,13 @@ static int mod_instantiate(CONF_SECTION *cs, void *instance)
 	}
 	inst->default_method = method; /* save the numerical method */
 
-	/*
-	 *	List of sessions are set to NULL by the memset
-	 *	of 'inst', above.
-	 */
+	if ((inst->num_shards <= 0) || (inst->num_shards > 256)) {
+		cf_log_err_cs(cs, "'shards' must be between 1 and 256");
+		return -1;
+	}
 
-	/*
-	 *	Lookup sessions in the tree.  We don't free them in
-	 *	the tree, as that's taken care of elsewhere...
-	 */
-	inst->session_tree = rbtree_create(eap_handler_cmp, NULL, 0);
-	if (!inst->session_tree) {
-		ERROR("rlm_eap (%s): Cannot initialize tree", inst->xlat_name);
+	if (inst->timer_limit <= 0) {
+		cf_log_err_cs(cs, "'timer_expire' must be positive");
 		return -1;
 	}
 
@@ -245,12 +211,11 @@ static int mod_instantiate(CONF_SECTION *cs, void *instance)
 #endif
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (pthread_mutex_init(&(inst->session_mutex), NULL) < 0) {
-		ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
-		return -1;
-	}
-#endif
+	/*
+	 *	The sessions.
+	 */
+	if (eap_store_init(inst) < 0) return -1;
+	if (eaplist_init(inst) < 0) return -1;
 
 	return 0;
 }
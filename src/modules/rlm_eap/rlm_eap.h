@@ -41,15 +41,33 @@ typedef struct eap_module {
 	void			*instance;
 } eap_module_t;
 
+/*
+ * One stripe of the session store.  Sessions are keyed by State, and
+ * each one is also on the timer wheel slot for the second in which it
+ * expires.
+ */
+typedef struct eap_session_shard {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	bool		initialised;	//!< mutex has been initialised.
+#endif
+	fr_hash_table_t	*sessions;
+	eap_handler_t	**wheel;	//!< One list of handlers per second.
+	time_t		last_tick;	//!< When the wheel was last advanced.
+	int		max_sessions;	//!< Share of max_sessions.
+} eap_session_shard_t;
+
+typedef struct eap_store_driver eap_store_driver_t;
+
 /*
  * This structure contains eap's persistent data.
- * sessions = remembered sessions, in a tree for speed.
+ * shards = remembered sessions, split by State into independently
+ *	    locked hash tables.
  * types = All supported EAP-Types
- * mutex = ensure only one thread is updating the sessions[] struct
  */
 typedef struct rlm_eap {
-	rbtree_t	*session_tree;
-	eap_handler_t	*session_head, *session_tail;
+	eap_session_shard_t *shards;
+	int		wheel_slots;
 	rbtree_t	*handler_tree; /* for debugging only */
 	eap_module_t 	*methods[PW_EAP_MAX_TYPES];
 
@@ -65,14 +83,32 @@ typedef struct rlm_eap {
 	bool		mod_accounting_username_bug;
 
 	int		max_sessions;
+	int		num_shards;
 
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t	session_mutex;
 	pthread_mutex_t	handler_mutex;
+
+	/*
+	 *	Expires sessions once a second, even when there are
+	 *	no requests.
+	 */
+	pthread_t	reaper;
+	pthread_mutex_t	reaper_mutex;
+	pthread_cond_t	reaper_cond;
+	bool		reaper_initialised;
+	bool		reaper_running;
+	bool		reaper_stop;
 #endif
 
+	/*
+	 *	Store shared with other servers, for exported sessions.
+	 */
+	char const	*store_name;
+	char const	*store_directory;
+	eap_store_driver_t const *store;
+	time_t		store_purged;
+
 	char const	*xlat_name; /* no xlat's yet */
-	fr_randctx	rand_pool;
 } rlm_eap_t;
 
 /*
@@ -105,11 +141,19 @@ eap_handler_t 	*eap_handler(rlm_eap_t *inst, eap_packet_raw_t **eap_msg, REQUEST
 EAP_DS      	*eap_ds_alloc(eap_handler_t *handler);
 eap_handler_t 	*eap_handler_alloc(rlm_eap_t *inst);
 void	    	eap_ds_free(EAP_DS **eap_ds);
+int		eaplist_init(rlm_eap_t *inst);
 int 	    	eaplist_add(rlm_eap_t *inst, eap_handler_t *handler);
 eap_handler_t 	*eaplist_find(rlm_eap_t *inst, REQUEST *request,
 			      eap_packet_raw_t *eap_packet);
 void		eaplist_free(rlm_eap_t *inst);
 
+/* Session store */
+int		eap_store_init(rlm_eap_t *inst);
+void		eap_store_export(rlm_eap_t *inst, eap_handler_t *handler);
+eap_handler_t	*eap_store_import(rlm_eap_t *inst, REQUEST *request, eap_handler_t const *match);
+void		eap_store_remove(rlm_eap_t *inst, eap_handler_t const *handler);
+void		eap_store_purge(rlm_eap_t *inst, time_t now);
+
 /* State */
 void	    	generate_key(void);
 VALUE_PAIR  	*generate_state(time_t timestamp);
@@ -0,0 +1,487 @@
+/*
+ * store.c  Export EAP sessions to a store shared between servers.
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/*
+ *	When a session store is configured, every handler added to the
+ *	local session list is also written to the store.  A server which
+ *	receives a response for a session it doesn't have takes the
+ *	session from the store, and continues the conversation.
+ *
+ *	Only the generic handler data, and the method data of methods
+ *	which implement export_state, can be exported.  The TLS based
+ *	methods can't be, as OpenSSL can't save an SSL connection in the
+ *	middle of a handshake.  Their sessions stay on the server which
+ *	started them.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "rlm_eap.h"
+
+#define EAP_STORE_MAGIC		"FREAPS02"
+#define EAP_STORE_MAX		(4096)
+
+/*
+ *	Sessions are keyed by State and EAP Id, the same as the local
+ *	session list.
+ */
+#define EAP_STORE_KEY_LEN	(EAP_STATE_LEN + 1)
+
+/*
+ *	Interface to the session stores.
+ *
+ *	take() must be atomic: if two servers try to take the same
+ *	session, only one of them may succeed.
+ */
+struct eap_store_driver {
+	char const	*name;
+	int		(*init)(rlm_eap_t *inst);
+	int		(*put)(rlm_eap_t *inst, uint8_t const *key, uint8_t const *data, size_t len);
+	ssize_t		(*take)(rlm_eap_t *inst, uint8_t const *key, uint8_t *out, size_t outlen);
+	void		(*remove)(rlm_eap_t *inst, uint8_t const *key);
+	void		(*purge)(rlm_eap_t *inst, time_t now);
+};
+
+/*
+ *	The "file" store keeps one file per session in a directory.
+ *	Pointing it at a tmpfs such as /dev/shm gives a store in shared
+ *	memory.  Pointing it at a shared file system lets a cluster of
+ *	servers share sessions.
+ */
+static void store_file_name(rlm_eap_t *inst, uint8_t const *key, char *out, size_t outlen)
+{
+	char hex[(EAP_STORE_KEY_LEN * 2) + 1];
+
+	fr_bin2hex(hex, key, EAP_STORE_KEY_LEN);
+	snprintf(out, outlen, "%s/%s", inst->store_directory, hex);
+}
+
+static int store_file_init(rlm_eap_t *inst)
+{
+	char dir[PATH_MAX];
+
+	if (!inst->store_directory || !*inst->store_directory) {
+		ERROR("rlm_eap (%s): The \"file\" session store needs a \"directory\"", inst->xlat_name);
+		return -1;
+	}
+
+	strlcpy(dir, inst->store_directory, sizeof(dir));
+	if (rad_mkdir(dir, S_IRWXU) < 0) {
+		ERROR("rlm_eap (%s): Failed creating %s: %s",
+		      inst->xlat_name, inst->store_directory, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Write to a temporary file, and rename it into place, so that
+ *	other servers never see a partial session.
+ */
+static int store_file_put(rlm_eap_t *inst, uint8_t const *key, uint8_t const *data, size_t len)
+{
+	int fd;
+	char tmp[PATH_MAX], path[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", inst->store_directory);
+	fd = mkstemp(tmp);
+	if (fd < 0) return -1;
+
+	if (write(fd, data, len) != (ssize_t) len) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	store_file_name(inst, key, path, sizeof(path));
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Rename the file to one only we know, so that no other server
+ *	can take the same session.  Then read it.
+ *
+ *	Returns -1 with errno set to EMSGSIZE if the session doesn't
+ *	fit in the buffer.
+ */
+static ssize_t store_file_take(rlm_eap_t *inst, uint8_t const *key, uint8_t *out, size_t outlen)
+{
+	int fd;
+	ssize_t len;
+	size_t total = 0;
+	struct stat buf;
+	char path[PATH_MAX], mine[PATH_MAX];
+
+	store_file_name(inst, key, path, sizeof(path));
+	snprintf(mine, sizeof(mine), "%s/.taken.%08x%08x", inst->store_directory, fr_rand(), fr_rand());
+
+	if (rename(path, mine) < 0) return -1;
+
+	fd = open(mine, O_RDONLY);
+	unlink(mine);
+	if (fd < 0) return -1;
+
+	if (fstat(fd, &buf) < 0) {
+	error:
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t) buf.st_size > outlen) {
+		errno = EMSGSIZE;
+		goto error;
+	}
+
+	while (total < (size_t) buf.st_size) {
+		len = read(fd, out + total, buf.st_size - total);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			goto error;
+		}
+		if (len == 0) break;
+
+		total += len;
+	}
+	close(fd);
+
+	return total;
+}
+
+static void store_file_remove(rlm_eap_t *inst, uint8_t const *key)
+{
+	char path[PATH_MAX];
+
+	store_file_name(inst, key, path, sizeof(path));
+	unlink(path);
+}
+
+/*
+ *	Delete sessions which no server continued.
+ */
+static void store_file_purge(rlm_eap_t *inst, time_t now)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct stat buf;
+	char path[PATH_MAX];
+
+	dir = opendir(inst->store_directory);
+	if (!dir) return;
+
+	while ((dp = readdir(dir)) != NULL) {
+		if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0)) continue;
+
+		snprintf(path, sizeof(path), "%s/%s", inst->store_directory, dp->d_name);
+		if (stat(path, &buf) < 0) continue;
+		if (!S_ISREG(buf.st_mode)) continue;
+
+		if ((now - buf.st_mtime) > inst->timer_limit) unlink(path);
+	}
+	closedir(dir);
+}
+
+static eap_store_driver_t const eap_store_file = {
+	"file",
+	store_file_init,
+	store_file_put,
+	store_file_take,
+	store_file_remove,
+	store_file_purge
+};
+
+static eap_store_driver_t const *eap_store_drivers[] = {
+	&eap_store_file,
+	NULL
+};
+
+int eap_store_init(rlm_eap_t *inst)
+{
+	int i;
+
+	if (!inst->store_name || (strcmp(inst->store_name, "none") == 0)) return 0;
+
+	for (i = 0; eap_store_drivers[i] != NULL; i++) {
+		if (strcmp(eap_store_drivers[i]->name, inst->store_name) == 0) {
+			inst->store = eap_store_drivers[i];
+			break;
+		}
+	}
+
+	if (!inst->store) {
+		ERROR("rlm_eap (%s): Unknown session store \"%s\"", inst->xlat_name, inst->store_name);
+		return -1;
+	}
+
+	/*
+	 *	Say which methods won't benefit, so nobody expects
+	 *	their PEAP or TTLS sessions to move between servers.
+	 */
+	for (i = PW_EAP_MD5; i < PW_EAP_MAX_TYPES; i++) {
+		if (!inst->methods[i] || inst->methods[i]->type->export_state) continue;
+		if (i == PW_EAP_GTC) continue;	/* keeps no state */
+
+		WARN("rlm_eap (%s): EAP-%s sessions can't be exported, and will stay on the server which "
+		     "started them", inst->xlat_name, eap_type2name(i));
+	}
+
+	return inst->store->init(inst);
+}
+
+static void eap_store_key(uint8_t *key, eap_handler_t const *handler)
+{
+	memcpy(key, handler->state, EAP_STATE_LEN);
+	key[EAP_STATE_LEN] = handler->eap_id;
+}
+
+/*
+ *	Serialised handlers are:
+ *
+ *	magic (8), state (16), eap_id (1), type (1), timestamp (8),
+ *	status (4), stage (4), trips (4), tls (4), finished (4),
+ *	identity length (2), identity, opaque length (4), opaque
+ *
+ *	in network byte order.
+ */
+#define EAP_STORE_HDR_LEN (8 + EAP_STATE_LEN + 1 + 1 + 8 + (5 * 4))
+
+static uint8_t *store_int(uint8_t *p, int value)
+{
+	uint32_t num = htonl((uint32_t) value);
+
+	memcpy(p, &num, 4);
+	return p + 4;
+}
+
+static uint8_t const *load_int(uint8_t const *p, int *value)
+{
+	uint32_t num;
+
+	memcpy(&num, p, 4);
+	*value = (int32_t) ntohl(num);
+	return p + 4;
+}
+
+/*
+ *	Save a handler which is about to be added to the local session
+ *	list.
+ */
+void eap_store_export(rlm_eap_t *inst, eap_handler_t *handler)
+{
+	REQUEST		*request = handler->request;
+	eap_module_t	*method = NULL;
+	uint8_t		buffer[EAP_STORE_MAX];
+	uint8_t		key[EAP_STORE_KEY_LEN];
+	uint8_t		*p = buffer, *end = buffer + sizeof(buffer);
+	uint16_t	len;
+	uint32_t	opaque_len = 0, num;
+	uint64_t	timestamp;
+	size_t		identity_len;
+	ssize_t		ret;
+
+	handler->exported = false;
+
+	if ((handler->type > PW_EAP_INVALID) && (handler->type < PW_EAP_MAX_TYPES)) {
+		method = inst->methods[handler->type];
+	}
+
+	if (handler->opaque && (!method || !method->type->export_state)) {
+		RDEBUG3("EAP-%s sessions can't be exported, keeping session local",
+			eap_type2name(handler->type));
+		return;
+	}
+
+	identity_len = handler->identity ? strlen(handler->identity) : 0;
+	if ((EAP_STORE_HDR_LEN + 2 + identity_len + 4) > sizeof(buffer)) {
+		RWDEBUG("Identity is too long to export, keeping session local");
+		return;
+	}
+
+	memcpy(p, EAP_STORE_MAGIC, 8);
+	p += 8;
+	memcpy(p, handler->state, EAP_STATE_LEN);
+	p += EAP_STATE_LEN;
+	*p++ = handler->eap_id;
+	*p++ = handler->type;
+	timestamp = htonll((uint64_t) handler->timestamp);
+	memcpy(p, &timestamp, 8);
+	p += 8;
+	p = store_int(p, handler->status);
+	p = store_int(p, handler->stage);
+	p = store_int(p, handler->trips);
+	p = store_int(p, handler->tls);
+	p = store_int(p, handler->finished);
+
+	len = htons(identity_len);
+	memcpy(p, &len, 2);
+	memcpy(p + 2, handler->identity, identity_len);
+	p += 2 + identity_len;
+
+	if (handler->opaque) {
+		ret = method->type->export_state(method->instance, handler, p + 4, (end - p) - 4);
+		if (ret < 0) {
+			RWDEBUG("Failed exporting EAP-%s session (larger than %i bytes?), keeping session local",
+				eap_type2name(handler->type), EAP_STORE_MAX);
+			return;
+		}
+		opaque_len = ret;
+	}
+	num = htonl(opaque_len);
+	memcpy(p, &num, 4);
+	p += 4 + opaque_len;
+
+	eap_store_key(key, handler);
+	if (inst->store->put(inst, key, buffer, p - buffer) < 0) {
+		RWDEBUG("Failed writing session to the session store: %s", fr_syserror(errno));
+		return;
+	}
+	handler->exported = true;
+
+	RDEBUG2("Exported EAP session to the \"%s\" session store", inst->store->name);
+}
+
+/*
+ *	Take a session which another server exported.
+ */
+eap_handler_t *eap_store_import(rlm_eap_t *inst, REQUEST *request, eap_handler_t const *match)
+{
+	uint8_t		buffer[EAP_STORE_MAX];
+	uint8_t		key[EAP_STORE_KEY_LEN];
+	uint8_t const	*p = buffer, *end;
+	uint16_t	identity_len;
+	uint32_t	opaque_len;
+	uint64_t	timestamp;
+	ssize_t		len;
+	eap_module_t	*method;
+	eap_handler_t	*handler;
+
+	eap_store_key(key, match);
+	len = inst->store->take(inst, key, buffer, sizeof(buffer));
+	if (len < 0) {
+		if (errno != ENOENT) RWDEBUG("Failed reading session from the session store: %s",
+					     fr_syserror(errno));
+		return NULL;
+	}
+	if (len == 0) return NULL;
+	end = buffer + len;
+
+	if ((len < (EAP_STORE_HDR_LEN + 2)) ||
+	    (memcmp(p, EAP_STORE_MAGIC, 8) != 0) ||
+	    (memcmp(p + 8, match->state, EAP_STATE_LEN) != 0) ||
+	    (p[8 + EAP_STATE_LEN] != match->eap_id)) {
+	invalid:
+		RWDEBUG("Ignoring invalid session from the session store");
+		return NULL;
+	}
+	p += 8 + EAP_STATE_LEN + 1;
+
+	if ((*p <= PW_EAP_INVALID) || (*p >= PW_EAP_MAX_TYPES) ||
+	    !inst->methods[*p]) {
+		RWDEBUG("Ignoring exported session for EAP type %u, which isn't configured", *p);
+		return NULL;
+	}
+	method = inst->methods[*p];
+
+	memcpy(&timestamp, p + 1, 8);
+	timestamp = ntohll(timestamp);
+	if ((time(NULL) - (time_t) timestamp) > inst->timer_limit) {
+		RDEBUG2("Exported session has expired");
+		return NULL;
+	}
+
+	handler = eap_handler_alloc(inst);
+	if (!handler) return NULL;
+
+	memcpy(handler->state, match->state, EAP_STATE_LEN);
+	handler->eap_id = match->eap_id;
+	handler->src_ipaddr = match->src_ipaddr;
+	handler->type = *p;
+	handler->timestamp = timestamp;
+	p += 1 + 8;
+
+	p = load_int(p, &handler->status);
+	p = load_int(p, &handler->stage);
+	p = load_int(p, &handler->trips);
+	p = load_int(p, &handler->tls);
+	p = load_int(p, &handler->finished);
+
+	memcpy(&identity_len, p, 2);
+	identity_len = ntohs(identity_len);
+	p += 2;
+	if ((end - p) < (identity_len + 4)) goto error;
+
+	if (identity_len) handler->identity = talloc_strndup(handler, (char const *) p, identity_len);
+	p += identity_len;
+
+	memcpy(&opaque_len, p, 4);
+	opaque_len = ntohl(opaque_len);
+	p += 4;
+	if ((size_t) (end - p) < opaque_len) goto error;
+
+	if (opaque_len > 0) {
+		if (!method->type->import_state ||
+		    (method->type->import_state(method->instance, handler, p, opaque_len) < 0)) goto error;
+	}
+
+	RDEBUG("Continuing EAP session exported by another server");
+
+	return handler;
+
+error:
+	talloc_free(handler);
+	goto invalid;
+}
+
+/*
+ *	We continued the session locally, so the exported copy is
+ *	stale.
+ */
+void eap_store_remove(rlm_eap_t *inst, eap_handler_t const *handler)
+{
+	uint8_t key[EAP_STORE_KEY_LEN];
+
+	eap_store_key(key, handler);
+	inst->store->remove(inst, key);
+}
+
+/*
+ *	Called once a second.  Sessions abandoned by the client are
+ *	removed every timer_expire seconds.
+ */
+void eap_store_purge(rlm_eap_t *inst, time_t now)
+{
+	if ((now - inst->store_purged) < inst->timer_limit) return;
+	inst->store_purged = now;
+
+	inst->store->purge(inst, now);
+}
@@ -256,5 +256,7 @@ rlm_eap_module_t rlm_eap_gtc = {
 	gtc_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL     			/* detach */
+	NULL,     			/* detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
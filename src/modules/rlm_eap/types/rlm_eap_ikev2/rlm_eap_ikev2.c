@@ -512,5 +512,7 @@ rlm_eap_module_t rlm_eap_ikev2 = {
 	ikev2_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	ikev2_authenticate,		/* authentication */
-	ikev2_detach 			/* detach */
+	ikev2_detach, 			/* detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
@@ -194,6 +194,45 @@ static int mod_authenticate(UNUSED void *instance, eap_handler_t *handler)
 	return 1;
 }
 
+static ssize_t leap_export_state(UNUSED void *instance, eap_handler_t *handler,
+				 uint8_t *out, size_t outlen)
+{
+	leap_session_t *session = talloc_get_type_abort(handler->opaque, leap_session_t);
+	uint32_t stage = htonl((uint32_t) session->stage);
+
+	if (outlen < (4 + sizeof(session->peer_challenge) + sizeof(session->peer_response))) return -1;
+
+	memcpy(out, &stage, 4);
+	memcpy(out + 4, session->peer_challenge, sizeof(session->peer_challenge));
+	memcpy(out + 4 + sizeof(session->peer_challenge), session->peer_response,
+	       sizeof(session->peer_response));
+
+	return 4 + sizeof(session->peer_challenge) + sizeof(session->peer_response);
+}
+
+static int leap_import_state(UNUSED void *instance, eap_handler_t *handler,
+			     uint8_t const *data, size_t len)
+{
+	leap_session_t *session;
+	uint32_t stage;
+
+	if (len != (4 + sizeof(session->peer_challenge) + sizeof(session->peer_response))) return -1;
+
+	session = talloc(handler, leap_session_t);
+	if (!session) return -1;
+
+	memcpy(&stage, data, 4);
+	session->stage = (int32_t) ntohl(stage);
+	memcpy(session->peer_challenge, data + 4, sizeof(session->peer_challenge));
+	memcpy(session->peer_response, data + 4 + sizeof(session->peer_challenge),
+	       sizeof(session->peer_response));
+
+	handler->opaque = session;
+	handler->free_opaque = NULL;
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -205,4 +244,6 @@ rlm_eap_module_t rlm_eap_leap = {
 	NULL,			/* authorization */
 	mod_authenticate,	/* authentication */
 	NULL,			/* detach */
+	leap_export_state,	/* export session */
+	leap_import_state	/* import session */
 };
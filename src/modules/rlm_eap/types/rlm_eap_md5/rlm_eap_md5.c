@@ -156,6 +156,30 @@ static int md5_authenticate(UNUSED void *arg, eap_handler_t *handler)
 	return 1;
 }
 
+/*
+ *	The only state is the challenge we sent.
+ */
+static ssize_t md5_export_state(UNUSED void *instance, eap_handler_t *handler,
+				uint8_t *out, size_t outlen)
+{
+	if (outlen < MD5_CHALLENGE_LEN) return -1;
+
+	memcpy(out, handler->opaque, MD5_CHALLENGE_LEN);
+	return MD5_CHALLENGE_LEN;
+}
+
+static int md5_import_state(UNUSED void *instance, eap_handler_t *handler,
+			    uint8_t const *data, size_t len)
+{
+	if (len != MD5_CHALLENGE_LEN) return -1;
+
+	handler->opaque = talloc_memdup(handler, data, len);
+	if (!handler->opaque) return -1;
+	handler->free_opaque = NULL;
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -166,5 +190,7 @@ rlm_eap_module_t rlm_eap_md5 = {
 	md5_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	md5_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	md5_export_state,		/* export session */
+	md5_import_state		/* import session */
 };
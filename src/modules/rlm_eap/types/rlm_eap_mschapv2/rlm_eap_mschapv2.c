@@ -749,6 +749,70 @@ packet_ready:
 	return 1;
 }
 
+/*
+ *	Save the stage, the challenge, and the MPPE keys and reply
+ *	attributes kept until the client acknowledges our success.
+ */
+static ssize_t mschapv2_export_state(UNUSED void *instance, eap_handler_t *handler,
+				     uint8_t *out, size_t outlen)
+{
+	mschapv2_opaque_t *data = handler->opaque;
+	uint8_t *p = out, *end = out + outlen;
+	uint32_t code = htonl((uint32_t) data->code);
+	ssize_t ret;
+
+	if (outlen < (4 + MSCHAPV2_CHALLENGE_LEN)) return -1;
+
+	memcpy(p, &code, 4);
+	memcpy(p + 4, data->challenge, MSCHAPV2_CHALLENGE_LEN);
+	p += 4 + MSCHAPV2_CHALLENGE_LEN;
+
+	ret = eap_pairs_export(p, end - p, data->mppe_keys);
+	if (ret < 0) return -1;
+	p += ret;
+
+	ret = eap_pairs_export(p, end - p, data->reply);
+	if (ret < 0) return -1;
+	p += ret;
+
+	return p - out;
+}
+
+static int mschapv2_import_state(UNUSED void *instance, eap_handler_t *handler,
+				 uint8_t const *in, size_t len)
+{
+	mschapv2_opaque_t *data;
+	uint8_t const *p = in, *end = in + len;
+	uint32_t code;
+	ssize_t ret;
+
+	if (len < (4 + MSCHAPV2_CHALLENGE_LEN)) return -1;
+
+	data = talloc_zero(handler, mschapv2_opaque_t);
+	if (!data) return -1;
+
+	memcpy(&code, p, 4);
+	data->code = (int32_t) ntohl(code);
+	memcpy(data->challenge, p + 4, MSCHAPV2_CHALLENGE_LEN);
+	p += 4 + MSCHAPV2_CHALLENGE_LEN;
+
+	ret = eap_pairs_import(data, &data->mppe_keys, p, end - p);
+	if (ret < 0) goto error;
+	p += ret;
+
+	ret = eap_pairs_import(data, &data->reply, p, end - p);
+	if (ret < 0) goto error;
+
+	handler->opaque = data;
+	handler->free_opaque = free_data;
+
+	return 0;
+
+error:
+	free_data(data);
+	return -1;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -759,5 +823,7 @@ rlm_eap_module_t rlm_eap_mschapv2 = {
 	mschapv2_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mschapv2_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	mschapv2_export_state,		/* export session */
+	mschapv2_import_state		/* import session */
 };
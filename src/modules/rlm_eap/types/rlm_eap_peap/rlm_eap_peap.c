@@ -237,6 +237,12 @@ static int eappeap_initiate(void *type_arg, eap_handler_t *handler)
 	 */
 	ssn->prf_label = "client EAP encryption";
 
+	/*
+	 *	The user is authenticated inside the tunnel, after
+	 *	the handshake, so session tickets can't be trusted.
+	 */
+	tls_session_tunnelled(ssn);
+
 	/*
 	 *	As it is a poorly designed protocol, PEAP uses
 	 *	bits in the TLS header to indicate PEAP
@@ -425,5 +431,7 @@ rlm_eap_module_t rlm_eap_peap = {
 	eappeap_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
@@ -618,6 +618,8 @@ rlm_eap_module_t rlm_eap_pwd = {
     eap_pwd_initiate,		   /* initiate to a client */
     NULL,			       /* no authorization */
     mod_authenticate,	       /* pwd authentication */
-    mod_detach		      /* detach */
+    mod_detach,		      /* detach */
+    NULL,			       /* export session */
+    NULL			       /* import session */
 };
 
@@ -682,5 +682,7 @@ rlm_eap_module_t rlm_eap_sim = {
 	eap_sim_initiate,		/* Start the initial request */
 	NULL,				/* XXX authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* XXX detach */
+	NULL,				/* XXX detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
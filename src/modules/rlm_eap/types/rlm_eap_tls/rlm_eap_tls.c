@@ -263,5 +263,7 @@ rlm_eap_module_t rlm_eap_tls = {
 	eaptls_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
@@ -364,5 +364,7 @@ rlm_eap_module_t rlm_eap_tnc = {
 		tnc_initiate,		/* Start the initial request */
 		NULL,			/* authorization */
 		mod_authenticate,	/* authentication */
-		mod_detach		/* detach */
+		mod_detach,		/* detach */
+		NULL,			/* export session */
+		NULL			/* import session */
 };
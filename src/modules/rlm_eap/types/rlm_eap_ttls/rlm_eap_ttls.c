@@ -228,6 +228,12 @@ static int eapttls_initiate(void *type_arg, eap_handler_t *handler)
 	 */
 	ssn->prf_label = "ttls keying material";
 
+	/*
+	 *	The user is authenticated inside the tunnel, after
+	 *	the handshake, so session tickets can't be trusted.
+	 */
+	tls_session_tunnelled(ssn);
+
 	/*
 	 *	TLS session initialization is over.  Now handle TLS
 	 *	related handshaking or application data.
@@ -391,5 +397,7 @@ rlm_eap_module_t rlm_eap_ttls = {
 	eapttls_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	NULL,				/* export session */
+	NULL				/* import session */
 };
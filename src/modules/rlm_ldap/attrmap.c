@@ -335,9 +335,11 @@ int rlm_ldap_map_xlat(REQUEST *request, value_pair_map_t const *maps, rlm_ldap_m
  * list they need to go into.
  *
  * This is *NOT* atomic, but there's no condition for which we should error out...
+ *
+ * The values are taken from replica instead of entry if it's not NULL.
  */
 void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP *handle,
-		     rlm_ldap_map_xlat_t const *expanded, LDAPMessage *entry)
+		     rlm_ldap_map_xlat_t const *expanded, LDAPMessage *entry, ldap_sync_entry_t const *replica)
 {
 	value_pair_map_t const 	*map;
 	unsigned int		total = 0;
@@ -348,7 +350,7 @@ void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP
 	for (map = expanded->maps; map != NULL; map = map->next) {
 		name = expanded->attrs[total++];
 
-		result.values = ldap_get_values(handle, entry, name);
+		result.values = rlm_ldap_sync_get_values(handle, entry, replica, name);
 		if (!result.values) {
 			RDEBUG3("Attribute \"%s\" not found in LDAP object", name);
 
@@ -372,7 +374,7 @@ void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP
 
 		next:
 
-		ldap_value_free(result.values);
+		rlm_ldap_sync_free_values(replica, result.values);
 	}
 
 	/*
@@ -383,8 +385,8 @@ void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP
 		char 		**values;
 		int		count, i;
 
-		values = ldap_get_values(handle, entry, inst->valuepair_attr);
-		count = ldap_count_values(values);
+		values = rlm_ldap_sync_get_values(handle, entry, replica, inst->valuepair_attr);
+		count = values ? ldap_count_values(values) : 0;
 
 		for (i = 0; i < count; i++) {
 			value_pair_map_t *attr;
@@ -403,7 +405,7 @@ void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP
 			talloc_free(attr);
 		}
 
-		ldap_value_free(values);
+		rlm_ldap_sync_free_values(replica, values);
 	}
 }
 
@@ -466,7 +468,7 @@ rlm_rcode_t rlm_ldap_map_profile(ldap_instance_t const *inst, REQUEST *request,
 	}
 
 	RDEBUG("Processing profile attributes");
-	rlm_ldap_map_do(inst, request, handle, expanded, entry);
+	rlm_ldap_map_do(inst, request, handle, expanded, entry, NULL);
 
 free_result:
 	ldap_msgfree(result);
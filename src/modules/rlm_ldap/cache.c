@@ -0,0 +1,254 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache.c
+ * @brief Cache the results of user and group lookups.
+ *
+ * Finding the user's DN, their group memberships, and converting between group names and DNs, each need a
+ * search.  The same searches are made over and over again for the same users and groups, so when the cache
+ * is enabled the values each one produced are kept for "lifetime" seconds.
+ *
+ * Each entry is a list of strings, keyed by the type of lookup and what it was looking for (a DN, a group
+ * name, or an expanded base DN and filter).  A lookup which found nothing is cached as an empty list.
+ *
+ * @copyright 2014 The FreeRADIUS Server Project.
+ */
+#include	"ldap.h"
+
+FR_NAME_NUMBER const ldap_cache_type[] = {
+	{ "user_dn",		LDAP_CACHE_USER_DN },
+	{ "membership",		LDAP_CACHE_MEMBERSHIP },
+	{ "group_search",	LDAP_CACHE_GROUP_SEARCH },
+	{ "group_member",	LDAP_CACHE_GROUP_MEMBER },
+	{ "group_dn",		LDAP_CACHE_GROUP_DN },
+	{ "group_name",		LDAP_CACHE_GROUP_NAME },
+
+	{  NULL , -1 }
+};
+
+typedef struct ldap_cache_entry {
+	fr_cache_entry_t	entry;		//!< Must be first.
+
+	ldap_cache_type_t	type;
+	char const		*key;
+
+	int			count;		//!< Number of values.
+	char			**values;
+} ldap_cache_entry_t;
+
+/** Where to copy cached values to
+ *
+ */
+typedef struct ldap_cache_copy {
+	TALLOC_CTX		*ctx;
+	char			***out;
+} ldap_cache_copy_t;
+
+static uint32_t ldap_cache_key_hash(ldap_cache_type_t type, char const *key)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&type, sizeof(type));
+
+	return fr_hash_update(key, strlen(key), hash);
+}
+
+static int ldap_cache_entry_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	if (a->type != b->type) return a->type - b->type;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Copy a list of values
+ *
+ * @return a NULL terminated array, allocated in ctx, with the values allocated in the array.
+ */
+static char **ldap_cache_values_copy(TALLOC_CTX *ctx, char * const *values, int count)
+{
+	char **out;
+	int i;
+
+	out = talloc_array(ctx, char *, count + 1);
+	if (!out) return NULL;
+
+	for (i = 0; i < count; i++) {
+		out[i] = talloc_typed_strdup(out, values[i]);
+	}
+	out[count] = NULL;
+
+	return out;
+}
+
+/** Copy the values of an entry, called with the entry's shard locked
+ *
+ * @return the number of values, or -1 on error.
+ */
+static int ldap_cache_copy(void *ctx, void const *entry)
+{
+	ldap_cache_copy_t		*copy = ctx;
+	ldap_cache_entry_t const	*c = entry;
+
+	if (!copy->out) return c->count;
+
+	*copy->out = ldap_cache_values_copy(copy->ctx, c->values, c->count);
+	if (!*copy->out) return -1;
+
+	return c->count;
+}
+
+/** Create the cache
+ *
+ * @param inst rlm_ldap configuration.
+ * @return 0 on success, -1 on failure.
+ */
+int rlm_ldap_cache_init(ldap_instance_t *inst)
+{
+	inst->cache = fr_cache_create(inst, inst->cache_max_entries, ldap_cache_entry_cmp, LDAP_CACHE_MAX);
+	if (!inst->cache) {
+		LDAP_ERR("Failed creating cache: %s", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free the cache
+ *
+ * @param inst rlm_ldap configuration.
+ */
+void rlm_ldap_cache_free(ldap_instance_t *inst)
+{
+	fr_cache_free(inst->cache);
+	inst->cache = NULL;
+}
+
+/** Look up the result of a previous search
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] type of lookup.
+ * @param[in] key what was looked up.
+ * @param[in] ctx to allocate the values in.
+ * @param[out] out Where to write a NULL terminated copy of the cached values, may be NULL.
+ * @return the number of values, or -1 if there's no (unexpired) entry, or the cache is disabled.
+ */
+int rlm_ldap_cache_find(ldap_instance_t const *inst, REQUEST *request, ldap_cache_type_t type, char const *key,
+			TALLOC_CTX *ctx, char ***out)
+{
+	ldap_cache_entry_t	my_c;
+	ldap_cache_copy_t	copy;
+	int			count;
+
+	if (out) *out = NULL;
+
+	if (!inst->cache) return -1;
+
+	my_c.type = type;
+	my_c.key = key;
+	my_c.entry.hash = ldap_cache_key_hash(type, key);
+
+	copy.ctx = ctx;
+	copy.out = out;
+
+	count = fr_cache_find(inst->cache, &my_c, request->timestamp, type, ldap_cache_copy, &copy);
+	if (count >= 0) {
+		RDEBUG2("Using cached %s for \"%s\" (%i value(s))", fr_int2str(ldap_cache_type, type, "<INVALID>"),
+			key, count);
+	}
+
+	return count;
+}
+
+/** Add the result of a search
+ *
+ * The values are copied, and remain owned by the caller.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] type of lookup.
+ * @param[in] key what was looked up.
+ * @param[in] values the search produced.
+ * @param[in] count of values, may be 0.
+ */
+void rlm_ldap_cache_add(ldap_instance_t const *inst, REQUEST *request, ldap_cache_type_t type, char const *key,
+			char * const *values, int count)
+{
+	ldap_cache_entry_t	*c;
+
+	if (!inst->cache) return;
+
+	c = talloc_zero(NULL, ldap_cache_entry_t);
+	if (!c) return;
+
+	c->type = type;
+	c->key = talloc_typed_strdup(c, key);
+	c->entry.hash = ldap_cache_key_hash(type, key);
+	c->entry.expires = request->timestamp + inst->cache_lifetime;
+	c->count = count;
+	c->values = ldap_cache_values_copy(c, values, count);
+
+	fr_cache_insert(inst->cache, c, request->timestamp);
+}
+
+/** Remove all entries
+ *
+ * @param inst rlm_ldap configuration.
+ * @return the number of entries removed.
+ */
+int rlm_ldap_cache_flush(ldap_instance_t const *inst)
+{
+	if (!inst->cache) return 0;
+
+	return fr_cache_flush(inst->cache, NULL, NULL);
+}
+
+/** Print the hit rate for each type of lookup
+ *
+ * Writes "<type>=<hits>/<lookups>" for each type, then "entries=<num>".
+ *
+ * @param inst rlm_ldap configuration.
+ * @param out Where to write the statistics.
+ * @param outlen Size of out.
+ * @return the length of the string written to out.
+ */
+size_t rlm_ldap_cache_stats(ldap_instance_t const *inst, char *out, size_t outlen)
+{
+	uint64_t	hits[LDAP_CACHE_MAX], misses[LDAP_CACHE_MAX];
+	int		entries;
+	int		i;
+	size_t		len = 0;
+
+	*out = '\0';
+	if (!inst->cache) return 0;
+
+	entries = fr_cache_stats(inst->cache, hits, misses);
+
+	for (i = 0; i < LDAP_CACHE_MAX; i++) {
+		len += snprintf(out + len, outlen - len, "%s=%" PRIu64 "/%" PRIu64 " ",
+				fr_int2str(ldap_cache_type, i, "<INVALID>"), hits[i], hits[i] + misses[i]);
+		if (len >= outlen) return outlen - 1;
+	}
+
+	len += snprintf(out + len, outlen - len, "entries=%i", entries);
+	if (len >= outlen) return outlen - 1;
+
+	return len;
+}
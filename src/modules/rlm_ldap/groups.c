@@ -30,13 +30,13 @@
 /** Convert multiple group names into a DNs
  *
  * Given an array of group names, builds a filter matching all names, then retrieves all group objects
- * and stores the DN associated with each group object.
+ * and stores the DN associated with each group object.  Names whose DNs are cached aren't searched for.
  *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
  * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
  * @param[in] names to covert to DNs (NULL terminated).
- * @param[out] out Where to write the DNs. DNs must be freed with ldap_memfree(). Will be NULL terminated.
+ * @param[out] out Where to write the DNs. DNs must be freed with talloc_free(). Will be NULL terminated.
  * @param[in] outlen Size of out.
  * @return One of the RLM_MODULE_* values.
  */
@@ -49,15 +49,19 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 
 	unsigned int name_cnt = 0;
 	unsigned int entry_cnt;
-	char const *attrs[] = { NULL };
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
 
 	LDAPMessage *result = NULL, *entry;
 
 	char **name = names;
 	char **dn = out;
+	char *missing[LDAP_MAX_CACHEABLE + 1];
+	char **cached, **vals, *entry_dn;
 	char buffer[LDAP_MAX_GROUP_NAME_LEN + 1];
 
-	char *filter;
+	char *filter = NULL;
+	unsigned int i;
+	int j;
 
 	*dn = NULL;
 
@@ -73,6 +77,26 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 
 	RDEBUG("Converting group name(s) to group DN(s)");
 
+	while (*name) {
+		if (((size_t) (dn - out) < (outlen - 1)) &&
+		    (rlm_ldap_cache_find(inst, request, LDAP_CACHE_GROUP_DN, *name, request, &cached) > 0)) {
+			*dn++ = talloc_steal(request, cached[0]);
+			talloc_free(cached);
+			name++;
+
+			continue;
+		}
+
+		if (name_cnt >= LDAP_MAX_CACHEABLE) break;
+		missing[name_cnt++] = *name++;
+	}
+	missing[name_cnt] = NULL;
+	*dn = NULL;
+
+	if (!name_cnt) {
+		return RLM_MODULE_OK;
+	}
+
 	/*
 	 *	It'll probably only save a few ms in network latency, but it means we can send a query
 	 *	for the entire group list at once.
@@ -80,16 +104,14 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 	filter = talloc_typed_asprintf(request, "%s%s%s",
 				 inst->groupobj_filter ? "(&" : "",
 				 inst->groupobj_filter ? inst->groupobj_filter : "",
-				 names[0] && names[1] ? "(|" : "");
-	while (*name) {
-		rlm_ldap_escape_func(request, buffer, sizeof(buffer), *name++, NULL);
+				 name_cnt > 1 ? "(|" : "");
+	for (i = 0; i < name_cnt; i++) {
+		rlm_ldap_escape_func(request, buffer, sizeof(buffer), missing[i], NULL);
 		filter = talloc_asprintf_append_buffer(filter, "(%s=%s)", inst->groupobj_name_attr, buffer);
-
-		name_cnt++;
 	}
 	filter = talloc_asprintf_append_buffer(filter, "%s%s",
 					       inst->groupobj_filter ? ")" : "",
-					       names[0] && names[1] ? ")" : "");
+					       name_cnt > 1 ? ")" : "");
 
 	status = rlm_ldap_search(inst, request, pconn, inst->groupobj_base_dn, inst->groupobj_scope,
 				 filter, attrs, &result);
@@ -112,7 +134,7 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 		goto finish;
 	}
 
-	if (entry_cnt > (outlen - 1)) {
+	if (entry_cnt > (outlen - 1 - (dn - out))) {
 		REDEBUG("Number of DNs exceeds limit (%zu)", outlen - 1);
 		rcode = RLM_MODULE_INVALID;
 
@@ -134,8 +156,27 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 	}
 
 	do {
-		*dn = ldap_get_dn((*pconn)->handle, entry);
+		entry_dn = ldap_get_dn((*pconn)->handle, entry);
+		*dn = talloc_typed_strdup(request, entry_dn);
+		ldap_memfree(entry_dn);
 		RDEBUG("Got group DN \"%s\"", *dn);
+
+		/*
+		 *	Remember which of the names this group had.  The
+		 *	directory may not have matched them exactly.
+		 */
+		vals = ldap_get_values((*pconn)->handle, entry, inst->groupobj_name_attr);
+		if (vals) {
+			for (j = 0; vals[j]; j++) {
+				for (i = 0; i < name_cnt; i++) {
+					if (strcasecmp(vals[j], missing[i]) != 0) continue;
+
+					rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_DN, missing[i], dn, 1);
+				}
+			}
+			ldap_value_free(vals);
+		}
+
 		dn++;
 	} while((entry = ldap_next_entry((*pconn)->handle, entry)));
 
@@ -152,8 +193,8 @@ static rlm_rcode_t rlm_ldap_group_name2dn(ldap_instance_t const *inst, REQUEST *
 	 */
 	if (rcode != RLM_MODULE_OK) {
 		dn = out;
-		while(*dn) ldap_memfree(*dn++);
-		*dn = NULL;
+		while(*dn) talloc_free(*dn++);
+		*out = NULL;
 	}
 
 	return rcode;
@@ -178,7 +219,7 @@ static rlm_rcode_t rlm_ldap_group_dn2name(ldap_instance_t const *inst, REQUEST *
 	ldap_rcode_t status;
 	int ldap_errno;
 
-	char **vals = NULL;
+	char **vals = NULL, **cached;
 	char const *attrs[] = { inst->groupobj_name_attr, NULL };
 	LDAPMessage *result = NULL, *entry;
 
@@ -190,6 +231,13 @@ static rlm_rcode_t rlm_ldap_group_dn2name(ldap_instance_t const *inst, REQUEST *
 		return RLM_MODULE_INVALID;
 	}
 
+	if (rlm_ldap_cache_find(inst, request, LDAP_CACHE_GROUP_NAME, dn, request, &cached) > 0) {
+		*out = talloc_steal(request, cached[0]);
+		talloc_free(cached);
+
+		return RLM_MODULE_OK;
+	}
+
 	RDEBUG("Converting group DN to group Name");
 
 	status = rlm_ldap_search(inst, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs,
@@ -226,6 +274,7 @@ static rlm_rcode_t rlm_ldap_group_dn2name(ldap_instance_t const *inst, REQUEST *
 	RDEBUG("Group name is \"%s\"", vals[0]);
 
 	*out = talloc_typed_strdup(request, vals[0]);
+	rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_NAME, dn, vals, 1);
 
 	finish:
 	if (result) {
@@ -245,11 +294,12 @@ static rlm_rcode_t rlm_ldap_group_dn2name(ldap_instance_t const *inst, REQUEST *
  * @param[in] request Current request.
  * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
  * @param[in] entry retrieved by rlm_ldap_find_user or rlm_ldap_search.
+ * @param[in] replica entry from the local replica, used instead of entry if not NULL.
  * @param[in] attr membership attribute to look for in the entry.
  * @return One of the RLM_MODULE_* values.
  */
 rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t **pconn,
-				       LDAPMessage *entry, char const *attr)
+				       LDAPMessage *entry, ldap_sync_entry_t const *replica, char const *attr)
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
 
@@ -265,13 +315,13 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *req
 
 	int is_dn, i;
 
-	rad_assert(entry);
+	rad_assert(entry || replica);
 	rad_assert(attr);
 
 	/*
 	 *	Parse the membership information we got in the initial user query.
 	 */
-	vals = ldap_get_values((*pconn)->handle, entry, attr);
+	vals = rlm_ldap_sync_get_values(replica ? NULL : (*pconn)->handle, entry, replica, attr);
 	if (!vals) {
 		RDEBUG2("No cacheable group memberships found in user object");
 
@@ -314,7 +364,7 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *req
 			} else {
 				rcode = rlm_ldap_group_dn2name(inst, request, pconn, vals[i], &name);
 				if (rcode != RLM_MODULE_OK) {
-					ldap_value_free(vals);
+					rlm_ldap_sync_free_values(replica, vals);
 
 					return rcode;
 				}
@@ -327,9 +377,10 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *req
 	}
 	*name_p = NULL;
 
-	rcode = rlm_ldap_group_name2dn(inst, request, pconn, group_name, group_dn, sizeof(group_dn));
+	rcode = rlm_ldap_group_name2dn(inst, request, pconn, group_name, group_dn,
+				       sizeof(group_dn) / sizeof(*group_dn));
 
-	ldap_value_free(vals);
+	rlm_ldap_sync_free_values(replica, vals);
 
 	if (rcode != RLM_MODULE_OK) {
 		return rcode;
@@ -339,7 +390,7 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *req
 	while(*dn_p) {
 		pairmake(request, &request->config_items, inst->cache_da->name, *dn_p, T_OP_ADD);
 		RDEBUG("Added %s with value \"%s\" to control list", inst->cache_da->name, *dn_p);
-		ldap_memfree(*dn_p);
+		talloc_free(*dn_p);
 
 		dn_p++;
 	}
@@ -374,6 +425,12 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(ldap_instance_t const *inst, REQUEST *re
 
 	char *dn;
 
+	char key[LDAP_MAX_DN_STR_LEN + LDAP_MAX_FILTER_STR_LEN + 1];
+	char *found[LDAP_MAX_CACHEABLE * 2];
+	char **cached;
+	int count = 0, i;
+	bool cacheable = true;
+
 	rad_assert(inst->groupobj_base_dn);
 
 	if (!inst->groupobj_membership_filter) {
@@ -394,12 +451,29 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(ldap_instance_t const *inst, REQUEST *re
 		return RLM_MODULE_INVALID;
 	}
 
+	/*
+	 *	The values we added last time.
+	 */
+	snprintf(key, sizeof(key), "%s\n%s", base_dn, filter);
+	count = rlm_ldap_cache_find(inst, request, LDAP_CACHE_GROUP_SEARCH, key, request, &cached);
+	if (count >= 0) {
+		for (i = 0; i < count; i++) {
+			pairmake(request, &request->config_items, inst->cache_da->name, cached[i], T_OP_ADD);
+			RDEBUG("Added %s with value \"%s\" to control list", inst->cache_da->name, cached[i]);
+		}
+		talloc_free(cached);
+
+		return RLM_MODULE_OK;
+	}
+	count = 0;
+
 	status = rlm_ldap_search(inst, request, pconn, base_dn, inst->groupobj_scope, filter, attrs, &result);
 	switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
 		case LDAP_PROC_NO_RESULT:
 			RDEBUG2("No cacheable group memberships found in group objects");
+			rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_SEARCH, key, found, 0);
 		default:
 			goto finish;
 	}
@@ -417,6 +491,12 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(ldap_instance_t const *inst, REQUEST *re
 			dn = ldap_get_dn((*pconn)->handle, entry);
 			pairmake(request, &request->config_items, inst->cache_da->name, dn, T_OP_ADD);
 			RDEBUG("Added %s with value \"%s\" to control list", inst->cache_da->name, dn);
+
+			if (count < (int) (sizeof(found) / sizeof(*found))) {
+				found[count++] = talloc_typed_strdup(request, dn);
+			} else {
+				cacheable = false;
+			}
 			ldap_memfree(dn);
 		}
 
@@ -429,11 +509,25 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(ldap_instance_t const *inst, REQUEST *re
 			pairmake(request, &request->config_items, inst->cache_da->name, *vals, T_OP_ADD);
 			RDEBUG("Added %s with value \"%s\" to control list", inst->cache_da->name, *vals);
 
+			if (count < (int) (sizeof(found) / sizeof(*found))) {
+				found[count++] = talloc_typed_strdup(request, *vals);
+			} else {
+				cacheable = false;
+			}
 			ldap_value_free(vals);
 		}
 	} while((entry = ldap_next_entry((*pconn)->handle, entry)));
 
+	/*
+	 *	Too many groups to cache.  They're looked up every time.
+	 */
+	if (cacheable) rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_SEARCH, key, found, count);
+
 	finish:
+	for (i = 0; i < count; i++) {
+		talloc_free(found[i]);
+	}
+
 	if (result) {
 		ldap_msgfree(result);
 	}
@@ -461,6 +555,13 @@ rlm_rcode_t rlm_ldap_check_groupobj_dynamic(ldap_instance_t const *inst, REQUEST
 
 	char const     	*name = check->vp_strvalue;
 
+	char		key[LDAP_MAX_DN_STR_LEN + LDAP_MAX_FILTER_STR_LEN + 2];
+	char		*group_dn;
+	int		count;
+
+	LDAPMessage	*result = NULL;
+	LDAPMessage	*entry;
+
 	rad_assert(inst->groupobj_base_dn);
 
 	RDEBUG2("Checking for user in group objects");
@@ -504,7 +605,24 @@ rlm_rcode_t rlm_ldap_check_groupobj_dynamic(ldap_instance_t const *inst, REQUEST
 		}
 	}
 
-	status = rlm_ldap_search(inst, request, pconn, dn, inst->groupobj_scope, filter, NULL, NULL);
+	/*
+	 *	The DNs of the groups the search found last time.
+	 */
+	snprintf(key, sizeof(key), "%s\n%s", dn, filter);
+	count = rlm_ldap_cache_find(inst, request, LDAP_CACHE_GROUP_MEMBER, key, NULL, NULL);
+	if (count >= 0) {
+		if (count > 0) {
+			RDEBUG("User found in group object");
+
+			return RLM_MODULE_OK;
+		}
+
+		RDEBUG("Search returned not found");
+
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	status = rlm_ldap_search(inst, request, pconn, dn, inst->groupobj_scope, filter, NULL, &result);
 	switch (status) {
 		case LDAP_PROC_SUCCESS:
 			RDEBUG("User found in group object");
@@ -512,12 +630,23 @@ rlm_rcode_t rlm_ldap_check_groupobj_dynamic(ldap_instance_t const *inst, REQUEST
 			break;
 		case LDAP_PROC_NO_RESULT:
 			RDEBUG("Search returned not found");
+			rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_MEMBER, key, NULL, 0);
 
 			return RLM_MODULE_NOTFOUND;
 		default:
 			return RLM_MODULE_FAIL;
 	}
 
+	entry = ldap_first_entry((*pconn)->handle, result);
+	if (entry) {
+		group_dn = ldap_get_dn((*pconn)->handle, entry);
+		if (group_dn) {
+			rlm_ldap_cache_add(inst, request, LDAP_CACHE_GROUP_MEMBER, key, &group_dn, 1);
+			ldap_memfree(group_dn);
+		}
+	}
+	ldap_msgfree(result);
+
 	return RLM_MODULE_OK;
 }
 
@@ -540,6 +669,7 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 	LDAPMessage     *result = NULL;
 	LDAPMessage     *entry = NULL;
 	char		**vals = NULL;
+	char		**cached = NULL;
 
 	char const     	*name = check->vp_strvalue;
 
@@ -548,6 +678,12 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 
 	RDEBUG2("Checking user object membership (%s) attributes", inst->userobj_membership_attr);
 
+	count = rlm_ldap_cache_find(inst, request, LDAP_CACHE_MEMBERSHIP, dn, request, &cached);
+	if (count >= 0) {
+		vals = cached;
+		goto compare;
+	}
+
 	status = rlm_ldap_search(inst, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, &result);
 	switch (status) {
 		case LDAP_PROC_SUCCESS:
@@ -573,7 +709,11 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 	}
 
 	vals = ldap_get_values((*pconn)->handle, entry, inst->userobj_membership_attr);
-	if (!vals) {
+	count = vals ? ldap_count_values(vals) : 0;
+	rlm_ldap_cache_add(inst, request, LDAP_CACHE_MEMBERSHIP, dn, vals, count);
+
+compare:
+	if (!count) {
 		RDEBUG("No group membership attribute(s) found in user object");
 
 		goto finish;
@@ -584,7 +724,6 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 	 *	looking for a match.
 	 */
 	name_is_dn = rlm_ldap_is_dn(name);
-	count = ldap_count_values(vals);
 	for (i = 0; i < count; i++) {
 		value_is_dn = rlm_ldap_is_dn(vals[i]);
 
@@ -677,7 +816,9 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 
 	finish:
 
-	if (vals) {
+	if (cached) {
+		talloc_free(cached);
+	} else if (vals) {
 		ldap_value_free(vals);
 	}
 
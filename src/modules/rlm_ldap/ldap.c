@@ -250,7 +250,7 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
  * @param[out] result Where to write result, if NULL result will be freed.
  * @param[out] error Where to write the error string, may be NULL, must not be freed.
  * @param[out] extra Where to write additional error string to, may be NULL (faster) or must be freed
- *	(with talloc_free).
+ *	(with talloc_free).  It's not parented by conn, which may be shared with other threads.
  * @return One of the LDAP_PROC_* codes.
  */
 static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t const *conn, int msgid, char const *dn,
@@ -295,12 +295,15 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	*result = NULL;
 
 	/*
-	 *	Check if there was an error sending the request
+	 *	Check if there was an error sending the request.  Errors
+	 *	sending on a shared connection were reported by the sender.
 	 */
-	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
-			&lib_errno);
-	if (lib_errno != LDAP_SUCCESS) {
-		goto process_error;
+	if (!conn->mux) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
+				&lib_errno);
+		if (lib_errno != LDAP_SUCCESS) {
+			goto process_error;
+		}
 	}
 
 	memset(&tv, 0, sizeof(tv));
@@ -310,7 +313,11 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	 *	Now retrieve the result and check for errors
 	 *	ldap_result returns -1 on error, and 0 on timeout
 	 */
-	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (conn->mux) {
+		lib_errno = rlm_ldap_mux_result(conn, msgid, &tv, result);
+	} else {
+		lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	}
 	if (lib_errno == 0) {
 		lib_errno = LDAP_TIMEOUT;
 
@@ -318,24 +325,36 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	}
 
 	if (lib_errno == -1) {
-		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
-				&lib_errno);
+		if (conn->mux) {
+			lib_errno = LDAP_SERVER_DOWN;
+		} else {
+			ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
+					&lib_errno);
+		}
 		goto process_error;
 	}
 
 	/*
 	 *	Parse the result and check for errors sent by the server
 	 */
-	lib_errno = ldap_parse_result(conn->handle, *result,
-				      &srv_errno,
-				      extra ? &part_dn : NULL,
-				      extra ? &srv_err : NULL,
-				      NULL, NULL, freeit);
+	if (conn->mux) {
+		lib_errno = rlm_ldap_mux_parse_result(conn, *result,
+						      &srv_errno,
+						      extra ? &part_dn : NULL,
+						      extra ? &srv_err : NULL,
+						      freeit);
+	} else {
+		lib_errno = ldap_parse_result(conn->handle, *result,
+					      &srv_errno,
+					      extra ? &part_dn : NULL,
+					      extra ? &srv_err : NULL,
+					      NULL, NULL, freeit);
+	}
 	if (freeit) {
 		*result = NULL;
 	}
 
-	if (lib_errno != LDAP_SUCCESS) {
+	if ((lib_errno != LDAP_SUCCESS) && !conn->mux) {
 		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
 				&lib_errno);
 		goto process_error;
@@ -368,7 +387,7 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 		len = rlm_ldap_common_dn(dn, part_dn);
 		if (len < 0) break;
 
-		our_err = talloc_typed_asprintf(conn, "Match stopped here: [%.*s]%s", len, dn, part_dn ? part_dn : "");
+		our_err = talloc_typed_asprintf(NULL, "Match stopped here: [%.*s]%s", len, dn, part_dn ? part_dn : "");
 
 		goto error_string;
 
@@ -438,7 +457,7 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 		/*
 		 *	Output the error codes from the library and server
 		 */
-		p = talloc_zero_array(conn, char, 1);
+		p = talloc_zero_array(NULL, char, 1);
 		if (!p) break;
 
 		if (lib_errno != srv_errno) {
@@ -671,15 +690,26 @@ ldap_rcode_t rlm_ldap_search(ldap_instance_t const *inst, REQUEST *request, ldap
 	memset(&tv, 0, sizeof(tv));
 	tv.tv_sec = inst->res_timeout;
 retry:
-	(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs, 0, NULL, NULL, &tv, 0, &msgid);
+	if ((*pconn)->mux) {
+		status = rlm_ldap_mux_search(*pconn, dn, scope, filter, search_attrs, &tv, &msgid, &error);
+	} else {
+		(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs, 0, NULL, NULL, &tv, 0, &msgid);
+		status = LDAP_PROC_SUCCESS;
+	}
 
-	LDAP_DBG_REQ("Waiting for search result...");
-	status = rlm_ldap_result(inst, *pconn, msgid, dn, &our_result, &error, &extra);
+	if (status == LDAP_PROC_SUCCESS) {
+		LDAP_DBG_REQ("Waiting for search result...");
+		status = rlm_ldap_result(inst, *pconn, msgid, dn, &our_result, &error, &extra);
+	}
 	switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
 		case LDAP_PROC_RETRY:
-			*pconn = fr_connection_reconnect(inst->pool, *pconn);
+			if ((*pconn)->mux) {
+				*pconn = rlm_ldap_mux_reconnect(inst, request, *pconn);
+			} else {
+				*pconn = fr_connection_reconnect(inst->pool, *pconn);
+			}
 			if (*pconn) {
 				LDAP_DBGW_REQ("Search failed: %s. Got new socket, retrying...", error);
 
@@ -837,6 +867,8 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 	char		*dn = NULL;
 	char	    	filter[LDAP_MAX_FILTER_STR_LEN];
 	char	    	base_dn[LDAP_MAX_DN_STR_LEN];
+	char		key[LDAP_MAX_DN_STR_LEN + LDAP_MAX_FILTER_STR_LEN + 1];
+	char		**cached;
 
 	bool freeit = false;					//!< Whether the message should
 								//!< be freed after being processed.
@@ -865,6 +897,34 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 		}
 	}
 
+	if (radius_xlat(filter, sizeof(filter), request, inst->userobj_filter, rlm_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create filter");
+
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
+
+	if (radius_xlat(base_dn, sizeof(base_dn), request, inst->userobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+
+		*rcode = RLM_MODULE_INVALID;
+		return NULL;
+	}
+
+	/*
+	 *	Or a DN found by a previous search for the same user.
+	 */
+	snprintf(key, sizeof(key), "%s\n%s", base_dn, filter);
+	if (!force && (rlm_ldap_cache_find(inst, request, LDAP_CACHE_USER_DN, key, request, &cached) > 0)) {
+		vp = pairmake(request, &request->config_items, "LDAP-UserDN", cached[0], T_OP_EQ);
+		talloc_free(cached);
+		if (vp) {
+			*rcode = RLM_MODULE_OK;
+		}
+
+		return vp ? vp->vp_strvalue : NULL;
+	}
+
 	/*
 	 *	Perform all searches as the admin user.
 	 */
@@ -880,20 +940,6 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 		(*pconn)->rebound = false;
 	}
 
-	if (radius_xlat(filter, sizeof(filter), request, inst->userobj_filter, rlm_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create filter");
-
-		*rcode = RLM_MODULE_INVALID;
-		return NULL;
-	}
-
-	if (radius_xlat(base_dn, sizeof(base_dn), request, inst->userobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
-
-		*rcode = RLM_MODULE_INVALID;
-		return NULL;
-	}
-
 	status = rlm_ldap_search(inst, request, pconn, base_dn, inst->userobj_scope, filter, attrs, result);
 	switch (status) {
 		case LDAP_PROC_SUCCESS:
@@ -933,6 +979,8 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 		*rcode = RLM_MODULE_OK;
 	}
 
+	rlm_ldap_cache_add(inst, request, LDAP_CACHE_USER_DN, key, &dn, 1);
+
 	finish:
 	ldap_memfree(dn);
 
@@ -950,15 +998,16 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
  * @param[in] request Current request.
  * @param[in] conn used to retrieve access attributes.
  * @param[in] entry retrieved by rlm_ldap_find_user or rlm_ldap_search.
+ * @param[in] replica entry from the local replica, used instead of conn and entry if not NULL.
  * @return RLM_MODULE_USERLOCK if the user was denied access, else RLM_MODULE_OK.
  */
 rlm_rcode_t rlm_ldap_check_access(ldap_instance_t const *inst, REQUEST *request,
-				  ldap_handle_t const *conn, LDAPMessage *entry)
+				  ldap_handle_t const *conn, LDAPMessage *entry, ldap_sync_entry_t const *replica)
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
 	char **vals = NULL;
 
-	vals = ldap_get_values(conn->handle, entry, inst->userobj_access_attr);
+	vals = rlm_ldap_sync_get_values(replica ? NULL : conn->handle, entry, replica, inst->userobj_access_attr);
 	if (vals) {
 		if (inst->access_positive) {
 			if (strncasecmp(vals[0], "false", 5) == 0) {
@@ -972,7 +1021,7 @@ rlm_rcode_t rlm_ldap_check_access(ldap_instance_t const *inst, REQUEST *request,
 			rcode = RLM_MODULE_USERLOCK;
 		}
 
-		ldap_value_free(vals);
+		rlm_ldap_sync_free_values(replica, vals);
 	} else if (inst->access_positive) {
 		RDEBUG("No \"%s\" attribute - user locked out", inst->userobj_access_attr);
 		rcode = RLM_MODULE_USERLOCK;
@@ -1065,9 +1114,10 @@ void *mod_conn_create(void *instance)
 	ldap_handle_t *conn;
 
 	/*
-	 *	Allocate memory for the handle.
+	 *	Allocate memory for the handle.  It's not parented by the
+	 *	instance, as connections are opened by many threads.
 	 */
-	conn = talloc_zero(instance, ldap_handle_t);
+	conn = talloc_zero(NULL, ldap_handle_t);
 	if (!conn) return NULL;
 
 	conn->inst = inst;
@@ -1272,6 +1322,22 @@ ldap_handle_t *rlm_ldap_get_socket(ldap_instance_t const *inst, REQUEST *request
 }
 
 
+/** Gets an LDAP socket for searches made as the admin user
+ *
+ * If the shared connections are enabled, one of those is used, else a socket is retrieved from the
+ * connection pool.  The socket must only be used with rlm_ldap_search, and the functions which call it.
+ *
+ * @param inst rlm_ldap configuration.
+ * @param request Current request (may be NULL).
+ */
+ldap_handle_t *rlm_ldap_get_search_socket(ldap_instance_t const *inst, REQUEST *request)
+{
+	if (inst->mux) return rlm_ldap_mux_get(inst, request);
+
+	return rlm_ldap_get_socket(inst, request);
+}
+
+
 /** Frees an LDAP socket back to the connection pool
  *
  * If the socket was rebound chasing a referral onto another server then we destroy it.
@@ -1287,6 +1353,11 @@ void rlm_ldap_release_socket(ldap_instance_t const *inst, ldap_handle_t *conn)
 	 */
 	if (!conn) return;
 
+	if (conn->mux) {
+		rlm_ldap_mux_release(inst, conn);
+		return;
+	}
+
 	/*
 	 *	We chased a referral to another server.
 	 *
@@ -30,6 +30,25 @@
 #define LDAP_MAX_FILTER_STR_LEN		1024		//!< Maximum length of an xlat expanded filter.
 #define LDAP_MAX_DN_STR_LEN		2048		//!< Maximum length of an xlat expanded DN.
 
+typedef struct ldap_mux ldap_mux_t;
+typedef struct ldap_mux_conn ldap_mux_conn_t;
+typedef struct ldap_sync ldap_sync_t;
+typedef struct ldap_sync_entry ldap_sync_entry_t;
+
+/** Lookups whose results may be cached
+ *
+ */
+typedef enum {
+	LDAP_CACHE_USER_DN = 0,				//!< User base DN and filter to user DN.
+	LDAP_CACHE_MEMBERSHIP,				//!< User DN to the values of its membership attribute.
+	LDAP_CACHE_GROUP_SEARCH,			//!< Group base DN and filter to the names and/or DNs
+							//!< of the matching groups, as added to the control list.
+	LDAP_CACHE_GROUP_MEMBER,			//!< Group base DN and filter to the DN of a matching group.
+	LDAP_CACHE_GROUP_DN,				//!< Group name to group DN.
+	LDAP_CACHE_GROUP_NAME,				//!< Group DN to group name.
+	LDAP_CACHE_MAX
+} ldap_cache_type_t;
+
 typedef struct ldap_acct_section {
 	CONF_SECTION	*cs;				//!< Section configuration.
 
@@ -120,6 +139,28 @@ typedef struct ldap_instance {
 	DICT_ATTR const	*group_da;			//!< The DA associated with this specific version of the
 							//!< rlm_ldap module.
 
+	/*
+	 *	Cache of user and group lookups
+	 */
+	bool		cache_enable;			//!< If true, cache the results of user DN, group membership
+							//!< and group name/DN lookups.
+	int		cache_lifetime;			//!< How long results are cached for.
+	int		cache_max_entries;		//!< Maximum number of results cached.
+	fr_cache_t	*cache;				//!< The cached results.
+	char const	*cache_xlat_name;		//!< Name of the xlat which prints statistics, and flushes
+							//!< the cache.
+
+	/*
+	 *	Local replica of user objects
+	 */
+	bool		sync_enable;			//!< If true, keep a local replica of the user objects, and
+							//!< authorize users from it.
+	char const	*sync_filter;			//!< Filter for the user objects to replicate.
+	char const	*sync_key_attr;			//!< Attribute the replica is indexed by.
+	char const	*sync_key;			//!< Value of sync_key_attr to look for (xlat expanded).
+	int		sync_retry_interval;		//!< How long to wait before reconnecting.
+	ldap_sync_t	*sync;				//!< The replica.
+
 	/*
 	 *	Dynamic clients
 	 */
@@ -192,6 +233,10 @@ typedef struct ldap_instance {
 	int		srv_timelimit;			//!< How long the server should spent on a single request
 							//!< (also bounded by value on the server).
 
+	int		multiplex;			//!< Number of connections shared by all authorization
+							//!< searches, or 0 to use a pooled connection for each.
+	ldap_mux_t	*mux;				//!< The shared connections.
+
 #ifdef WITH_EDIR
  	/*
 	 *	eDir support
@@ -225,6 +270,8 @@ typedef struct ldap_handle {
 	int		referred;			//!< Whether the connection is now established a server
 							//!< other than the configured one.
 	ldap_instance_t	*inst;				//!< rlm_ldap configuration.
+	ldap_mux_conn_t	*mux;				//!< Set if this connection is shared, and many searches
+							//!< may be outstanding on it.
 } ldap_handle_t;
 
 typedef struct rlm_ldap_map_xlat {
@@ -286,6 +333,7 @@ typedef enum {
 
 extern FR_NAME_NUMBER const ldap_scope[];
 extern FR_NAME_NUMBER const ldap_tls_require_cert[];
+extern FR_NAME_NUMBER const ldap_cache_type[];
 
 /*
  *	ldap.c - Wrappers arounds OpenLDAP functions.
@@ -312,7 +360,7 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 			       char const *attrs[], int force, LDAPMessage **result, rlm_rcode_t *rcode);
 
 rlm_rcode_t rlm_ldap_check_access(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t const *conn,
-				  LDAPMessage *entry);
+				  LDAPMessage *entry, ldap_sync_entry_t const *replica);
 
 void rlm_ldap_check_reply(ldap_instance_t const *inst, REQUEST *request);
 
@@ -325,14 +373,37 @@ int mod_conn_delete(UNUSED void *instance, void *handle);
 
 ldap_handle_t *rlm_ldap_get_socket(ldap_instance_t const *inst, REQUEST *request);
 
+ldap_handle_t *rlm_ldap_get_search_socket(ldap_instance_t const *inst, REQUEST *request);
+
 void rlm_ldap_release_socket(ldap_instance_t const *inst, ldap_handle_t *conn);
 
+/*
+ *	mux.c - Connections shared between many outstanding searches.
+ */
+int rlm_ldap_mux_init(ldap_instance_t *inst);
+
+void rlm_ldap_mux_free(ldap_instance_t *inst);
+
+ldap_handle_t *rlm_ldap_mux_get(ldap_instance_t const *inst, REQUEST *request);
+
+ldap_handle_t *rlm_ldap_mux_reconnect(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t *conn);
+
+void rlm_ldap_mux_release(ldap_instance_t const *inst, ldap_handle_t *conn);
+
+ldap_rcode_t rlm_ldap_mux_search(ldap_handle_t const *conn, char const *dn, int scope, char const *filter,
+				 char **attrs, struct timeval *timeout, int *msgid, char const **error);
+
+int rlm_ldap_mux_result(ldap_handle_t const *conn, int msgid, struct timeval const *timeout, LDAPMessage **result);
+
+int rlm_ldap_mux_parse_result(ldap_handle_t const *conn, LDAPMessage *result, int *srv_errno, char **part_dn,
+			      char **srv_err, int freeit);
+
 /*
  *	groups.c - Group membership functions.
  */
 
 rlm_rcode_t rlm_ldap_cacheable_userobj(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t **pconn,
-				       LDAPMessage *entry, char const *attr);
+				       LDAPMessage *entry, ldap_sync_entry_t const *replica, char const *attr);
 
 rlm_rcode_t rlm_ldap_cacheable_groupobj(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t **pconn);
 
@@ -344,6 +415,38 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 
 rlm_rcode_t rlm_ldap_check_cached(ldap_instance_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+/*
+ *	cache.c - Cache of user and group lookups.
+ */
+int rlm_ldap_cache_init(ldap_instance_t *inst);
+
+void rlm_ldap_cache_free(ldap_instance_t *inst);
+
+int rlm_ldap_cache_find(ldap_instance_t const *inst, REQUEST *request, ldap_cache_type_t type, char const *key,
+			TALLOC_CTX *ctx, char ***out);
+
+void rlm_ldap_cache_add(ldap_instance_t const *inst, REQUEST *request, ldap_cache_type_t type, char const *key,
+			char * const *values, int count);
+
+int rlm_ldap_cache_flush(ldap_instance_t const *inst);
+
+size_t rlm_ldap_cache_stats(ldap_instance_t const *inst, char *out, size_t outlen);
+
+/*
+ *	sync.c - Local replica of user objects.
+ */
+int rlm_ldap_sync_init(ldap_instance_t *inst);
+
+void rlm_ldap_sync_free(ldap_instance_t *inst);
+
+int rlm_ldap_sync_find(ldap_instance_t const *inst, REQUEST *request, char const *key, ldap_sync_entry_t **out);
+
+char const *rlm_ldap_sync_dn(ldap_sync_entry_t const *entry);
+
+char **rlm_ldap_sync_get_values(LDAP *handle, LDAPMessage *entry, ldap_sync_entry_t const *replica, char const *attr);
+
+void rlm_ldap_sync_free_values(ldap_sync_entry_t const *replica, char **values);
+
 /*
  *	attrmap.c - Attribute mapping code.
  */
@@ -354,7 +457,7 @@ void rlm_ldap_map_xlat_free(rlm_ldap_map_xlat_t const *expanded);
 int rlm_ldap_map_xlat(REQUEST *request, value_pair_map_t const *maps, rlm_ldap_map_xlat_t *expanded);
 
 void rlm_ldap_map_do(ldap_instance_t const *inst, REQUEST *request, LDAP *handle,
-		     rlm_ldap_map_xlat_t const *expanded, LDAPMessage *entry);
+		     rlm_ldap_map_xlat_t const *expanded, LDAPMessage *entry, ldap_sync_entry_t const *replica);
 
 rlm_rcode_t rlm_ldap_map_profile(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 			    	 char const *profile, rlm_ldap_map_xlat_t const *expanded);
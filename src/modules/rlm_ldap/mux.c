@@ -0,0 +1,523 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mux.c
+ * @brief Share a few LDAP connections between many outstanding searches.
+ *
+ * With a pooled connection each search holds the connection until its result arrives, so the number of
+ * searches in progress is limited by the number of connections.  Here, a small number of connections are
+ * bound as the admin user, and never rebound.  Any number of requests send searches on them, and wait for
+ * their results.
+ *
+ * Whichever waiting thread finds nobody reading the connection becomes the reader.  It waits for the socket
+ * to become readable without holding the lock, then reads every complete result, handing each to the thread
+ * waiting for that message ID.  When its own result has arrived it stops reading, and another waiting thread
+ * takes over.
+ *
+ * @copyright 2014 The FreeRADIUS Server Project.
+ */
+#include	<freeradius-devel/rad_assert.h>
+
+#include	"ldap.h"
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	The reader wakes up at least this often, in case the library
+ *	has buffered data the socket doesn't know about (e.g. TLS).
+ */
+#define LDAP_MUX_READ_USEC	(100000)
+
+/** A search waiting for its result
+ *
+ */
+typedef struct ldap_mux_op {
+	int			msgid;		//!< Of the search.
+	LDAPMessage		*result;	//!< The complete result, once it's been read.
+	bool			done;		//!< The result has been read.
+	struct ldap_mux_op	*next;
+} ldap_mux_op_t;
+
+/** One shared connection
+ *
+ */
+struct ldap_mux_conn {
+	ldap_mux_t		*mux;		//!< The slot the connection was opened for.
+	ldap_handle_t		*conn;		//!< The connection.
+	int			refs;		//!< Number of requests using the connection.
+	bool			dead;		//!< The connection failed, and is freed when the last
+						//!< request stops using it.
+	bool			reading;	//!< A thread is reading results from the connection.
+	ldap_mux_op_t		*ops;		//!< Searches waiting for results.
+};
+
+/** A slot for a shared connection
+ *
+ * When the connection in a slot fails, a new one replaces it.
+ */
+struct ldap_mux {
+	ldap_instance_t		*inst;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the slot, and its connections.
+	pthread_cond_t		cond;		//!< Signalled when a reader has finished reading.
+#endif
+	ldap_mux_conn_t		*current;	//!< New searches are sent here.
+};
+
+/** Open a new connection for a slot, if it doesn't have one
+ *
+ * Must be called with the slot locked.
+ *
+ * @param mux slot to get the connection for.
+ * @return the connection, with a reference added, or NULL on error.
+ */
+static ldap_handle_t *rlm_ldap_mux_connect(ldap_mux_t *mux)
+{
+	ldap_instance_t	*inst = mux->inst;
+	ldap_handle_t	*conn;
+	ldap_mux_conn_t	*mc;
+
+	if (mux->current) {
+		mux->current->refs++;
+
+		return mux->current->conn;
+	}
+
+	conn = mod_conn_create(inst);
+	if (!conn) return NULL;
+
+	/*
+	 *	Chasing a referral would rebind the connection from
+	 *	inside ldap_result(), while other searches are waiting
+	 *	on it.  Referrals are returned as errors instead.
+	 */
+	if (ldap_set_option(conn->handle, LDAP_OPT_REFERRALS, LDAP_OPT_OFF) != LDAP_OPT_SUCCESS) {
+		LDAP_ERR("Could not disable referrals on shared connection");
+		mod_conn_delete(inst, conn);
+
+		return NULL;
+	}
+
+	mc = talloc_zero(conn, ldap_mux_conn_t);
+	if (!mc) {
+		mod_conn_delete(inst, conn);
+
+		return NULL;
+	}
+
+	mc->mux = mux;
+	mc->conn = conn;
+	mc->refs = 1;
+	conn->mux = mc;
+
+	mux->current = mc;
+
+	return conn;
+}
+
+/** Mark a connection as failed
+ *
+ * Must be called with the slot locked.  Waiting searches are woken, and fail.
+ */
+static void rlm_ldap_mux_dead(ldap_mux_conn_t *mc)
+{
+	ldap_mux_t *mux = mc->mux;
+
+	mc->dead = true;
+	if (mux->current == mc) mux->current = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&mux->cond);
+#endif
+}
+
+/** Initialise the shared connections
+ *
+ * @param inst rlm_ldap configuration.
+ * @return 0 on success, -1 if any of the connections couldn't be opened.
+ */
+int rlm_ldap_mux_init(ldap_instance_t *inst)
+{
+	int i;
+
+	inst->mux = talloc_zero_array(inst, ldap_mux_t, inst->multiplex);
+	if (!inst->mux) return -1;
+
+	for (i = 0; i < inst->multiplex; i++) {
+		inst->mux[i].inst = inst;
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&inst->mux[i].mutex, NULL) < 0) {
+			LDAP_ERR("Failed initializing mutex: %s", fr_syserror(errno));
+			goto error;
+		}
+
+		if (pthread_cond_init(&inst->mux[i].cond, NULL) < 0) {
+			pthread_mutex_destroy(&inst->mux[i].mutex);
+			LDAP_ERR("Failed initializing condition variable: %s", fr_syserror(errno));
+			goto error;
+		}
+#endif
+	}
+
+	for (i = 0; i < inst->multiplex; i++) {
+		if (!rlm_ldap_mux_connect(&inst->mux[i])) {
+			LDAP_ERR("Failed opening shared connection %i", i);
+			return -1;
+		}
+		inst->mux[i].current->refs--;
+	}
+
+	LDAP_INFO("Opened %i shared connection(s) for searches", inst->multiplex);
+
+	return 0;
+
+error:
+#ifdef HAVE_PTHREAD_H
+	while (--i >= 0) {
+		pthread_cond_destroy(&inst->mux[i].cond);
+		pthread_mutex_destroy(&inst->mux[i].mutex);
+	}
+#endif
+	talloc_free(inst->mux);
+	inst->mux = NULL;
+
+	return -1;
+}
+
+/** Close the shared connections
+ *
+ * @param inst rlm_ldap configuration.
+ */
+void rlm_ldap_mux_free(ldap_instance_t *inst)
+{
+	int i;
+
+	if (!inst->mux) return;
+
+	for (i = 0; i < inst->multiplex; i++) {
+		ldap_mux_t *mux = &inst->mux[i];
+
+		if (mux->current) mod_conn_delete(inst, mux->current->conn);
+
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&mux->cond);
+		pthread_mutex_destroy(&mux->mutex);
+#endif
+	}
+
+	talloc_free(inst->mux);
+	inst->mux = NULL;
+}
+
+/** Get a shared connection
+ *
+ * Slots are tried in a random order, until one has, or can open, a connection.
+ *
+ * @param inst rlm_ldap configuration.
+ * @param request Current request (may be NULL).
+ * @return a connection, which must be released with rlm_ldap_release_socket, or NULL on error.
+ */
+ldap_handle_t *rlm_ldap_mux_get(ldap_instance_t const *inst, REQUEST *request)
+{
+	ldap_handle_t	*conn = NULL;
+	int		i, start;
+
+	start = fr_rand() % inst->multiplex;
+	for (i = 0; i < inst->multiplex; i++) {
+		ldap_mux_t *mux = &inst->mux[(start + i) % inst->multiplex];
+
+		PTHREAD_MUTEX_LOCK(&mux->mutex);
+		conn = rlm_ldap_mux_connect(mux);
+		PTHREAD_MUTEX_UNLOCK(&mux->mutex);
+
+		if (conn) return conn;
+	}
+
+	LDAP_ERR_REQ("No shared connections available");
+
+	return NULL;
+}
+
+/** Replace a shared connection which has failed
+ *
+ * @param inst rlm_ldap configuration.
+ * @param request Current request (may be NULL).
+ * @param conn which failed.  The reference to it is released.
+ * @return a new connection from the same slot, or NULL on error.
+ */
+ldap_handle_t *rlm_ldap_mux_reconnect(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t *conn)
+{
+	ldap_mux_t	*mux = conn->mux->mux;
+	ldap_handle_t	*new;
+
+	PTHREAD_MUTEX_LOCK(&mux->mutex);
+	if (!conn->mux->dead) rlm_ldap_mux_dead(conn->mux);
+
+	/*
+	 *	Another request may have already replaced it.
+	 */
+	new = rlm_ldap_mux_connect(mux);
+	PTHREAD_MUTEX_UNLOCK(&mux->mutex);
+
+	rlm_ldap_mux_release(inst, conn);
+
+	if (!new) LDAP_ERR_REQ("Failed reopening shared connection");
+
+	return new;
+}
+
+/** Stop using a shared connection
+ *
+ * @param inst rlm_ldap configuration.
+ * @param conn to release.  If it has failed, and nobody else is using it, it's closed.
+ */
+void rlm_ldap_mux_release(UNUSED ldap_instance_t const *inst, ldap_handle_t *conn)
+{
+	ldap_mux_conn_t	*mc = conn->mux;
+	bool		unused;
+
+	PTHREAD_MUTEX_LOCK(&mc->mux->mutex);
+	rad_assert(mc->refs > 0);
+	unused = (--mc->refs == 0) && mc->dead;
+	PTHREAD_MUTEX_UNLOCK(&mc->mux->mutex);
+
+	if (unused) mod_conn_delete(mc->mux->inst, conn);
+}
+
+/** Send a search on a shared connection
+ *
+ * @param[in] conn to send the search on.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] timeout for the search.
+ * @param[out] msgid of the search.
+ * @param[out] error Where to write the error string.
+ * @return LDAP_PROC_SUCCESS, LDAP_PROC_RETRY if the connection has failed, or LDAP_PROC_ERROR.
+ */
+ldap_rcode_t rlm_ldap_mux_search(ldap_handle_t const *conn, char const *dn, int scope, char const *filter,
+				 char **attrs, struct timeval *timeout, int *msgid, char const **error)
+{
+	ldap_mux_conn_t	*mc = conn->mux;
+	int		lib_errno;
+
+	PTHREAD_MUTEX_LOCK(&mc->mux->mutex);
+	if (mc->dead) {
+		lib_errno = LDAP_SERVER_DOWN;
+	} else {
+		lib_errno = ldap_search_ext(conn->handle, dn, scope, filter, attrs, 0, NULL, NULL, timeout, 0, msgid);
+		if (lib_errno == LDAP_SERVER_DOWN) rlm_ldap_mux_dead(mc);
+	}
+	PTHREAD_MUTEX_UNLOCK(&mc->mux->mutex);
+
+	switch (lib_errno) {
+	case LDAP_SUCCESS:
+		return LDAP_PROC_SUCCESS;
+
+	case LDAP_SERVER_DOWN:
+		*error = ldap_err2string(lib_errno);
+		return LDAP_PROC_RETRY;
+
+	default:
+		*error = ldap_err2string(lib_errno);
+		return LDAP_PROC_ERROR;
+	}
+}
+
+/** Read results from a shared connection
+ *
+ * Must be called with the slot locked, which is released while waiting for the socket.
+ *
+ * @param mc connection to read from.
+ * @param when to give up waiting.
+ */
+static void rlm_ldap_mux_read(ldap_mux_conn_t *mc, struct timeval const *when)
+{
+	ldap_mux_t	*mux = mc->mux;
+	ldap_mux_op_t	*op;
+	LDAPMessage	*msg;
+	struct timeval	now, wake, zero;
+	fd_set		fds;
+	int		fd = -1, rcode, msgid;
+
+	if ((ldap_get_option(mc->conn->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+		rlm_ldap_mux_dead(mc);
+		return;
+	}
+
+	mc->reading = true;
+	PTHREAD_MUTEX_UNLOCK(&mux->mutex);
+
+	gettimeofday(&now, NULL);
+	wake.tv_sec = when->tv_sec - now.tv_sec;
+	wake.tv_usec = when->tv_usec - now.tv_usec;
+	if (wake.tv_usec < 0) {
+		wake.tv_sec--;
+		wake.tv_usec += 1000000;
+	}
+	if (wake.tv_sec < 0) {
+		wake.tv_sec = 0;
+		wake.tv_usec = 0;
+	} else if ((wake.tv_sec > 0) || (wake.tv_usec > LDAP_MUX_READ_USEC)) {
+		wake.tv_sec = 0;
+		wake.tv_usec = LDAP_MUX_READ_USEC;
+	}
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	(void) select(fd + 1, &fds, NULL, NULL, &wake);
+
+	PTHREAD_MUTEX_LOCK(&mux->mutex);
+	mc->reading = false;
+
+	/*
+	 *	Read every complete result, not just ours.
+	 */
+	for (;;) {
+		memset(&zero, 0, sizeof(zero));
+		msg = NULL;
+
+		rcode = ldap_result(mc->conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &zero, &msg);
+		if (rcode == 0) break;
+		if (rcode < 0) {
+			rlm_ldap_mux_dead(mc);
+			break;
+		}
+
+		msgid = ldap_msgid(msg);
+		for (op = mc->ops; op; op = op->next) {
+			if (op->msgid == msgid) break;
+		}
+
+		/*
+		 *	The search timed out, and nobody is waiting
+		 *	for it any more.
+		 */
+		if (!op || op->done) {
+			ldap_msgfree(msg);
+			continue;
+		}
+
+		op->result = msg;
+		op->done = true;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&mux->cond);
+#endif
+}
+
+/** Wait for the result of a search sent on a shared connection
+ *
+ * @param[in] conn the search was sent on.
+ * @param[in] msgid of the search.
+ * @param[in] timeout how long to wait.
+ * @param[out] result the complete result.
+ * @return as for ldap_result, -1 if the connection failed, 0 on timeout, else the type of the result.
+ */
+int rlm_ldap_mux_result(ldap_handle_t const *conn, int msgid, struct timeval const *timeout, LDAPMessage **result)
+{
+	ldap_mux_conn_t	*mc = conn->mux;
+	ldap_mux_t	*mux = mc->mux;
+	ldap_mux_op_t	op, **last;
+	struct timeval	now, when;
+#ifdef HAVE_PTHREAD_H
+	struct timespec	deadline;
+#endif
+	int		rcode;
+
+	memset(&op, 0, sizeof(op));
+	op.msgid = msgid;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += timeout->tv_sec;
+	when.tv_usec += timeout->tv_usec;
+	if (when.tv_usec >= 1000000) {
+		when.tv_sec++;
+		when.tv_usec -= 1000000;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	deadline.tv_sec = when.tv_sec;
+	deadline.tv_nsec = when.tv_usec * 1000;
+#endif
+
+	PTHREAD_MUTEX_LOCK(&mux->mutex);
+	op.next = mc->ops;
+	mc->ops = &op;
+
+	while (!op.done && !mc->dead) {
+		if (!mc->reading) {
+			rlm_ldap_mux_read(mc, &when);
+		}
+#ifdef HAVE_PTHREAD_H
+		else if (pthread_cond_timedwait(&mux->cond, &mux->mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+#endif
+
+		gettimeofday(&now, NULL);
+		if (!op.done && timercmp(&now, &when, >=)) break;
+	}
+
+	for (last = &mc->ops; *last; last = &(*last)->next) {
+		if (*last == &op) {
+			*last = op.next;
+			break;
+		}
+	}
+
+	if (op.done) {
+		*result = op.result;
+		rcode = ldap_msgtype(op.result);
+	} else if (mc->dead) {
+		rcode = -1;
+	} else {
+		(void) ldap_abandon_ext(conn->handle, msgid, NULL, NULL);
+		rcode = 0;
+	}
+	PTHREAD_MUTEX_UNLOCK(&mux->mutex);
+
+	return rcode;
+}
+
+/** Parse a result read from a shared connection
+ *
+ * ldap_parse_result() records the error in the connection, so it's serialised with the other users.
+ *
+ * @return as for ldap_parse_result.
+ */
+int rlm_ldap_mux_parse_result(ldap_handle_t const *conn, LDAPMessage *result, int *srv_errno, char **part_dn,
+			      char **srv_err, int freeit)
+{
+	ldap_mux_t	*mux = conn->mux->mux;
+	int		rcode;
+
+	PTHREAD_MUTEX_LOCK(&mux->mutex);
+	rcode = ldap_parse_result(conn->handle, result, srv_errno, part_dn, srv_err, NULL, NULL, freeit);
+	PTHREAD_MUTEX_UNLOCK(&mux->mutex);
+
+	return rcode;
+}
@@ -190,6 +190,9 @@ static CONF_PARSER option_config[] = {
 	/* allow server unlimited time for search (server-side limit) */
 	{"srv_timelimit", PW_TYPE_INTEGER, offsetof(ldap_instance_t,srv_timelimit), NULL, "20"},
 
+	/* connections shared by all searches, instead of one from the pool for each */
+	{"multiplex", PW_TYPE_INTEGER, offsetof(ldap_instance_t,multiplex), NULL, "0"},
+
 #ifdef LDAP_OPT_X_KEEPALIVE_IDLE
 	{"idle", PW_TYPE_INTEGER, offsetof(ldap_instance_t,keepalive_idle), NULL, "60"},
 #endif
@@ -203,6 +206,29 @@ static CONF_PARSER option_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+/*
+ *	Cache of user DN and group lookups
+ */
+static const CONF_PARSER cache_config[] = {
+	{"enable", PW_TYPE_BOOLEAN, offsetof(ldap_instance_t, cache_enable), NULL, "no"},
+	{"lifetime", PW_TYPE_INTEGER, offsetof(ldap_instance_t, cache_lifetime), NULL, "300"},
+	{"max_entries", PW_TYPE_INTEGER, offsetof(ldap_instance_t, cache_max_entries), NULL, "65536"},
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
+/*
+ *	Local replica of user objects
+ */
+static const CONF_PARSER sync_config[] = {
+	{"enable", PW_TYPE_BOOLEAN, offsetof(ldap_instance_t, sync_enable), NULL, "no"},
+	{"filter", PW_TYPE_STRING_PTR, offsetof(ldap_instance_t, sync_filter), NULL, "(objectClass=*)"},
+	{"key_attribute", PW_TYPE_STRING_PTR, offsetof(ldap_instance_t, sync_key_attr), NULL, "uid"},
+	{"key", PW_TYPE_STRING_PTR, offsetof(ldap_instance_t, sync_key), NULL, "%{%{Stripped-User-Name}:-%{User-Name}}"},
+	{"retry_interval", PW_TYPE_INTEGER, offsetof(ldap_instance_t, sync_retry_interval), NULL, "10"},
+
+	{ NULL, -1, 0, NULL, NULL }
+};
 
 static const CONF_PARSER module_config[] = {
 	{"server", PW_TYPE_STRING_PTR | PW_TYPE_REQUIRED, offsetof(ldap_instance_t,server), NULL, "localhost"},
@@ -236,11 +262,42 @@ static const CONF_PARSER module_config[] = {
 
 	{ "options", PW_TYPE_SUBSECTION, 0, NULL, (void const *) option_config },
 
+	{ "cache", PW_TYPE_SUBSECTION, 0, NULL, (void const *) cache_config },
+
+	{ "sync", PW_TYPE_SUBSECTION, 0, NULL, (void const *) sync_config },
+
 	{ "tls", PW_TYPE_SUBSECTION, 0, NULL, (void const *) tls_config },
 
 	{NULL, -1, 0, NULL, NULL}
 };
 
+/** Report on, or empty, the cache of user and group lookups
+ *
+ * %{ldap-cache:stats} returns the hits and lookups for each type of lookup, and the number of entries.
+ * %{ldap-cache:flush} removes every entry, and returns the number removed.
+ */
+static ssize_t ldap_cache_xlat(void *instance, REQUEST *request, char const *fmt, char *out, size_t freespace)
+{
+	ldap_instance_t *inst = instance;
+	int removed;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (strcmp(fmt, "stats") == 0) return rlm_ldap_cache_stats(inst, out, freespace);
+
+	if (strcmp(fmt, "flush") == 0) {
+		removed = rlm_ldap_cache_flush(inst);
+		RDEBUG2("Removed %i cached lookups", removed);
+
+		return snprintf(out, freespace, "%i", removed);
+	}
+
+	REDEBUG("Unknown cache command \"%s\", expected \"stats\" or \"flush\"", fmt);
+	*out = '\0';
+
+	return -1;
+}
+
 /** Expand an LDAP URL into a query, and return a string result from that query.
  *
  */
@@ -290,7 +347,7 @@ static ssize_t ldap_xlat(void *instance, REQUEST *request, char const *fmt, char
 		goto free_urldesc;
 	}
 
-	conn = rlm_ldap_get_socket(inst, request);
+	conn = rlm_ldap_get_search_socket(inst, request);
 	if (!conn) goto free_urldesc;
 
 	memcpy(&attrs, &ldap_url->lud_attrs, sizeof(attrs));
@@ -397,7 +454,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 		}
 	}
 
-	conn = rlm_ldap_get_socket(inst, request);
+	conn = rlm_ldap_get_search_socket(inst, request);
 	if (!conn) return 1;
 
 	/*
@@ -464,6 +521,12 @@ static int mod_detach(void *instance)
 {
 	ldap_instance_t *inst = instance;
 
+	rlm_ldap_sync_free(inst);
+
+	if (inst->cache_xlat_name) xlat_unregister(inst->cache_xlat_name, ldap_cache_xlat, instance);
+	rlm_ldap_cache_free(inst);
+
+	rlm_ldap_mux_free(inst);
 	fr_connection_pool_delete(inst->pool);
 
 	if (inst->user_map) {
@@ -676,6 +739,21 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	xlat_register(inst->xlat_name, ldap_xlat, rlm_ldap_escape_func, inst);
 
+	if (inst->cache_enable) {
+		if (inst->cache_lifetime == 0) {
+			LDAP_ERR("Cache \"lifetime\" must be greater than 0");
+			return -1;
+		}
+		if (inst->cache_max_entries == 0) {
+			LDAP_ERR("Cache \"max_entries\" must be greater than 0");
+			return -1;
+		}
+		if (rlm_ldap_cache_init(inst) < 0) return -1;
+
+		inst->cache_xlat_name = talloc_typed_asprintf(inst, "%s-cache", inst->xlat_name);
+		xlat_register(inst->cache_xlat_name, ldap_cache_xlat, NULL, inst);
+	}
+
 	/*
 	 *	Setup the cache attribute
 	 */
@@ -701,6 +779,44 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	And the connections shared by searches.
+	 */
+	if (inst->multiplex > 0) {
+		if (rlm_ldap_mux_init(inst) < 0) {
+			return -1;
+		}
+	}
+
+	/*
+	 *	And the local replica of the user objects.
+	 */
+	if (inst->sync_enable) {
+#ifdef WITH_EDIR
+		if (inst->edir) {
+			LDAP_ERR("Universal Passwords can't be retrieved from the local replica, disable 'edir' or "
+				 "'sync.enable'");
+
+			return -1;
+		}
+#endif
+		/*
+		 *	The replica is loaded once, for everyone, so
+		 *	where it comes from can't depend on the request.
+		 */
+		if (strchr(inst->userobj_base_dn, '%') || strchr(inst->sync_filter, '%')) {
+			LDAP_ERR("'user.base_dn' and 'sync.filter' can't be expanded when 'sync.enable' is set");
+
+			return -1;
+		}
+
+		if (inst->sync_retry_interval < 1) inst->sync_retry_interval = 1;
+
+		if (rlm_ldap_sync_init(inst) < 0) {
+			return -1;
+		}
+	}
+
 	/*
 	 *	Bulk load dynamic clients.
 	 */
@@ -826,8 +942,9 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	ldap_instance_t	*inst = instance;
 	char		**vals;
 	VALUE_PAIR	*vp;
-	ldap_handle_t	*conn;
-	LDAPMessage	*result, *entry;
+	ldap_handle_t	*conn = NULL;
+	LDAPMessage	*result = NULL, *entry = NULL;
+	ldap_sync_entry_t *replica = NULL;
 	char const 	*dn = NULL;
 	rlm_ldap_map_xlat_t	expanded; /* faster than mallocing every time */
 
@@ -850,8 +967,61 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	conn = rlm_ldap_get_socket(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
+	/*
+	 *	Look for the user in the local replica first.  If it's
+	 *	current, it has the answer.
+	 */
+	if (inst->sync) {
+		char key[LDAP_MAX_ATTR_STR_LEN];
+
+		if (radius_xlat(key, sizeof(key), request, inst->sync_key, NULL, NULL) < 0) {
+			REDEBUG("Failed creating replica key");
+
+			rcode = RLM_MODULE_INVALID;
+			goto finish;
+		}
+
+		switch (rlm_ldap_sync_find(inst, request, key, &replica)) {
+		case 1:
+			dn = rlm_ldap_sync_dn(replica);
+			pairmake(request, &request->config_items, "LDAP-UserDN", dn, T_OP_EQ);
+			break;
+
+		case 0:
+			RDEBUG("User object not found in local replica");
+
+			rcode = RLM_MODULE_NOTFOUND;
+			goto finish;
+
+		default:
+			RDEBUG2("Can't use local replica, searching the directory");
+			break;
+		}
+	}
+
+	/*
+	 *	The user's profiles, and their groups, are still
+	 *	searched for.
+	 */
+	if (!replica || inst->default_profile || inst->profile_attr ||
+	    inst->cacheable_group_dn || inst->cacheable_group_name) {
+#ifdef WITH_EDIR
+		/*
+		 *	Retrieving the Universal Password, and binding as the
+		 *	user, need a connection of our own.
+		 */
+		if (inst->edir) {
+			conn = rlm_ldap_get_socket(inst, request);
+		} else
+#endif
+		{
+			conn = rlm_ldap_get_search_socket(inst, request);
+		}
+		if (!conn) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
 
 	/*
 	 *	Add any additional attributes we need for checking access, memberships, and profiles
@@ -874,24 +1044,26 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 
 	expanded.attrs[expanded.count] = NULL;
 
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
-	}
+	if (!replica) {
+		dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
+		if (!dn) {
+			goto finish;
+		}
 
-	entry = ldap_first_entry(conn->handle, result);
-	if (!entry) {
-		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
+		entry = ldap_first_entry(conn->handle, result);
+		if (!entry) {
+			ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+			REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+			goto finish;
+		}
 	}
 
 	/*
 	 *	Check for access.
 	 */
 	if (inst->userobj_access_attr) {
-		rcode = rlm_ldap_check_access(inst, request, conn, entry);
+		rcode = rlm_ldap_check_access(inst, request, conn, entry, replica);
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
@@ -902,7 +1074,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
 		if (inst->userobj_membership_attr) {
-			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
+			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, replica,
+							   inst->userobj_membership_attr);
 			if (rcode != RLM_MODULE_OK) {
 				goto finish;
 			}
@@ -1013,19 +1186,19 @@ skip_edir:
 	 *	Apply a SET of user profiles.
 	 */
 	if (inst->profile_attr) {
-		vals = ldap_get_values(conn->handle, entry, inst->profile_attr);
+		vals = rlm_ldap_sync_get_values(replica ? NULL : conn->handle, entry, replica, inst->profile_attr);
 		if (vals != NULL) {
 			for (i = 0; vals[i] != NULL; i++) {
 				rlm_ldap_map_profile(inst, request, &conn, vals[i], &expanded);
 			}
 
-			ldap_value_free(vals);
+			rlm_ldap_sync_free_values(replica, vals);
 		}
 	}
 
 	if (inst->user_map || inst->valuepair_attr) {
 		RDEBUG("Processing user attributes");
-		rlm_ldap_map_do(inst, request, conn->handle, &expanded, entry);
+		rlm_ldap_map_do(inst, request, replica ? NULL : conn->handle, &expanded, entry, replica);
 		rlm_ldap_check_reply(inst, request);
 	}
 
@@ -1034,6 +1207,7 @@ finish:
 	if (result) {
 		ldap_msgfree(result);
 	}
+	talloc_free(replica);
 	rlm_ldap_release_socket(inst, conn);
 
 	return rcode;
@@ -0,0 +1,910 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sync.c
+ * @brief Local replica of user objects, kept current with syncrepl.
+ *
+ * A thread of our own runs an RFC 4533 (Content Synchronization) search in refreshAndPersist mode, for all the
+ * user objects under the user base_dn which match the sync filter.  The server sends every matching entry, tells
+ * us when it's done, and then sends each change as it's made.
+ *
+ * The entries are indexed by the value of "key_attribute", so "authorize" can find the user without a search.
+ * Until the first refresh is complete, or whenever the connection is lost, lookups fail, and the caller searches
+ * the directory as usual.
+ *
+ * No cookie is kept.  After a reconnect the server sends everything again, into a new index, which replaces the
+ * old one when it's complete.
+ *
+ * @copyright 2014 The FreeRADIUS Server Project.
+ */
+#include	<freeradius-devel/rad_assert.h>
+
+#include	<ctype.h>
+
+#include	"ldap.h"
+
+/** One attribute of a replicated entry
+ *
+ */
+typedef struct ldap_sync_attr {
+	char			*name;
+	char			**values;	//!< NULL terminated, as returned by ldap_get_values.
+} ldap_sync_attr_t;
+
+struct ldap_sync_entry {
+	uint8_t			uuid[16];	//!< entryUUID, which identifies the entry across renames.
+	char			*dn;
+	char			*key;		//!< Lower cased first value of the key attribute, or NULL.
+	ldap_sync_entry_t	*next_key;	//!< Next entry with the same key.
+
+	int			num_attrs;
+	ldap_sync_attr_t	*attrs;
+};
+
+/** Accessor for the DN of a replicated entry
+ *
+ * @param entry from rlm_ldap_sync_find.
+ * @return the DN.
+ */
+char const *rlm_ldap_sync_dn(ldap_sync_entry_t const *entry)
+{
+	return entry->dn;
+}
+
+/** Retrieve the values of an attribute from a search result, or from the local replica
+ *
+ * @param handle the entry was retrieved with, ignored if replica is set.
+ * @param entry from a search, ignored if replica is set.
+ * @param replica the entry from the local replica, or NULL.
+ * @param attr name of the attribute.
+ * @return NULL terminated array of values, to be freed with rlm_ldap_sync_free_values, or NULL if the
+ *	attribute isn't present.
+ */
+char **rlm_ldap_sync_get_values(LDAP *handle, LDAPMessage *entry, ldap_sync_entry_t const *replica, char const *attr)
+{
+	int i;
+
+	if (!replica) return ldap_get_values(handle, entry, attr);
+
+	for (i = 0; i < replica->num_attrs; i++) {
+		if (strcasecmp(replica->attrs[i].name, attr) == 0) return replica->attrs[i].values;
+	}
+
+	return NULL;
+}
+
+/** Free values returned by rlm_ldap_sync_get_values
+ *
+ * @param replica passed to rlm_ldap_sync_get_values.
+ * @param values to free.
+ */
+void rlm_ldap_sync_free_values(ldap_sync_entry_t const *replica, char **values)
+{
+	/*
+	 *	Values from the replica belong to the request's
+	 *	copy of the entry.
+	 */
+	if (replica || !values) return;
+
+	ldap_value_free(values);
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LDAP_PARSE_INTERMEDIATE)
+
+#ifndef LDAP_CONTROL_SYNC
+#  define LDAP_CONTROL_SYNC		"1.3.6.1.4.1.4203.1.9.1.1"
+#  define LDAP_CONTROL_SYNC_STATE	"1.3.6.1.4.1.4203.1.9.1.2"
+#  define LDAP_SYNC_INFO		"1.3.6.1.4.1.4203.1.9.1.4"
+#endif
+
+#ifndef LDAP_SYNC_REFRESH_AND_PERSIST
+#  define LDAP_SYNC_REFRESH_AND_PERSIST	3
+#endif
+
+#ifndef LDAP_SYNC_PRESENT
+#  define LDAP_SYNC_PRESENT		0
+#  define LDAP_SYNC_ADD			1
+#  define LDAP_SYNC_MODIFY		2
+#  define LDAP_SYNC_DELETE		3
+#endif
+
+/*
+ *	Sync Info Message choices (RFC 4533 section 2.5).
+ */
+#define LDAP_SYNC_TAG_REFRESH_DELETE	((ber_tag_t) 0xa1U)
+#define LDAP_SYNC_TAG_REFRESH_PRESENT	((ber_tag_t) 0xa2U)
+#define LDAP_SYNC_TAG_ID_SET		((ber_tag_t) 0xa3U)
+
+#define LDAP_SYNC_TAG_OCTETSTRING	((ber_tag_t) 0x04U)
+#define LDAP_SYNC_TAG_BOOLEAN		((ber_tag_t) 0x01U)
+
+/** Entries indexed by entryUUID and by key
+ *
+ * Entries belong to the uuid table.  Entries without a key are only in the uuid table.  If several entries have
+ * the same key, the key table holds one of them, and the others are chained from it, so that deleting one
+ * leaves the rest findable.
+ */
+typedef struct ldap_sync_index {
+	fr_hash_table_t		*by_uuid;
+	fr_hash_table_t		*by_key;
+} ldap_sync_index_t;
+
+struct ldap_sync {
+	ldap_instance_t		*inst;		//!< rlm_ldap configuration.
+
+	char			**attrs;	//!< Attributes to retrieve.
+
+	pthread_t		thread;
+	bool			started;	//!< Whether the thread was created.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	pthread_cond_t		wakeup;		//!< Signalled to stop the thread.
+	bool			stop;		//!< Set when the module is detached.
+
+	ldap_sync_index_t	*live;		//!< Used by lookups.
+	bool			current;	//!< Whether live is complete, and being kept current.
+};
+
+static uint32_t ldap_sync_uuid_hash(void const *data)
+{
+	ldap_sync_entry_t const *e = data;
+
+	return fr_hash(e->uuid, sizeof(e->uuid));
+}
+
+static int ldap_sync_uuid_cmp(void const *one, void const *two)
+{
+	ldap_sync_entry_t const *a = one;
+	ldap_sync_entry_t const *b = two;
+
+	return memcmp(a->uuid, b->uuid, sizeof(a->uuid));
+}
+
+static uint32_t ldap_sync_key_hash(void const *data)
+{
+	ldap_sync_entry_t const *e = data;
+
+	return fr_hash_string(e->key);
+}
+
+static int ldap_sync_key_cmp(void const *one, void const *two)
+{
+	ldap_sync_entry_t const *a = one;
+	ldap_sync_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static void ldap_sync_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static void ldap_sync_index_free(ldap_sync_index_t *index)
+{
+	if (!index) return;
+
+	/*
+	 *	The key table doesn't own its entries, so it has to go
+	 *	first.
+	 */
+	if (index->by_key) fr_hash_table_free(index->by_key);
+	if (index->by_uuid) fr_hash_table_free(index->by_uuid);
+	talloc_free(index);
+}
+
+static ldap_sync_index_t *ldap_sync_index_alloc(void)
+{
+	ldap_sync_index_t *index;
+
+	index = talloc_zero(NULL, ldap_sync_index_t);
+	if (!index) return NULL;
+
+	index->by_uuid = fr_hash_table_create(ldap_sync_uuid_hash, ldap_sync_uuid_cmp, ldap_sync_entry_free);
+	index->by_key = fr_hash_table_create(ldap_sync_key_hash, ldap_sync_key_cmp, NULL);
+	if (!index->by_uuid || !index->by_key) {
+		ldap_sync_index_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+/** Remove the entry with the same entryUUID as e, if there is one
+ *
+ */
+static void ldap_sync_index_delete(ldap_sync_index_t *index, ldap_sync_entry_t const *e)
+{
+	ldap_sync_entry_t *old, *head, *p;
+
+	old = fr_hash_table_finddata(index->by_uuid, e);
+	if (!old) return;
+
+	if (old->key) {
+		head = fr_hash_table_finddata(index->by_key, old);
+		if (head == old) {
+			fr_hash_table_delete(index->by_key, old);
+			if (old->next_key) fr_hash_table_insert(index->by_key, old->next_key);
+		} else if (head) {
+			for (p = head; p->next_key; p = p->next_key) {
+				if (p->next_key != old) continue;
+
+				p->next_key = old->next_key;
+				break;
+			}
+		}
+	}
+	fr_hash_table_delete(index->by_uuid, old);
+}
+
+/** Add an entry, replacing any previous version of it
+ *
+ */
+static void ldap_sync_index_add(ldap_sync_index_t *index, ldap_sync_entry_t *e)
+{
+	ldap_sync_entry_t *head;
+
+	ldap_sync_index_delete(index, e);
+
+	if (!fr_hash_table_insert(index->by_uuid, e)) {
+		talloc_free(e);
+		return;
+	}
+
+	if (!e->key) return;
+
+	head = fr_hash_table_finddata(index->by_key, e);
+	if (head) {
+		e->next_key = head->next_key;
+		head->next_key = e;
+		return;
+	}
+
+	if (!fr_hash_table_insert(index->by_key, e)) fr_hash_table_delete(index->by_uuid, e);
+}
+
+/** Build an entry from a search result
+ *
+ * @return the new entry, or NULL on error.
+ */
+static ldap_sync_entry_t *ldap_sync_entry_alloc(ldap_sync_t *sync, LDAP *handle, LDAPMessage *msg,
+						struct berval const *uuid)
+{
+	ldap_instance_t		*inst = sync->inst;
+	ldap_sync_entry_t	*e;
+	BerElement		*ber = NULL;
+	char			*name, *dn, **vals;
+	char			*p;
+	int			i, count;
+
+	if (uuid->bv_len != sizeof(e->uuid)) {
+		LDAP_ERR("Replica: Bad entryUUID length %i", (int) uuid->bv_len);
+		return NULL;
+	}
+
+	e = talloc_zero(NULL, ldap_sync_entry_t);
+	if (!e) return NULL;
+	memcpy(e->uuid, uuid->bv_val, sizeof(e->uuid));
+
+	dn = ldap_get_dn(handle, msg);
+	if (dn) {
+		e->dn = talloc_typed_strdup(e, dn);
+		ldap_memfree(dn);
+	}
+
+	for (name = ldap_first_attribute(handle, msg, &ber);
+	     name;
+	     name = ldap_next_attribute(handle, msg, ber)) {
+		vals = ldap_get_values(handle, msg, name);
+		if (!vals) {
+			ldap_memfree(name);
+			continue;
+		}
+
+		e->attrs = talloc_realloc(e, e->attrs, ldap_sync_attr_t, e->num_attrs + 1);
+		e->attrs[e->num_attrs].name = talloc_typed_strdup(e, name);
+
+		count = ldap_count_values(vals);
+		e->attrs[e->num_attrs].values = talloc_array(e, char *, count + 1);
+		for (i = 0; i < count; i++) {
+			e->attrs[e->num_attrs].values[i] = talloc_typed_strdup(e->attrs[e->num_attrs].values, vals[i]);
+		}
+		e->attrs[e->num_attrs].values[count] = NULL;
+
+		if (!e->key && (strcasecmp(name, inst->sync_key_attr) == 0) && (count > 0)) {
+			e->key = talloc_typed_strdup(e, vals[0]);
+			for (p = e->key; *p; p++) *p = tolower((int) *p);
+		}
+		e->num_attrs++;
+
+		ldap_value_free(vals);
+		ldap_memfree(name);
+	}
+	if (ber) ber_free(ber, 0);
+
+	return e;
+}
+
+/** Apply an entry, and its Sync State Control
+ *
+ * @return 0 on success, -1 if the message couldn't be parsed.
+ */
+static int ldap_sync_entry(ldap_sync_t *sync, LDAP *handle, LDAPMessage *msg, ldap_sync_index_t *pending)
+{
+	ldap_instance_t		*inst = sync->inst;
+	LDAPControl		**ctrls = NULL, *state_ctrl = NULL;
+	BerElement		*ber = NULL;
+	ber_int_t		state;
+	struct berval		uuid;
+	ldap_sync_entry_t	*e, find;
+	int			i, rcode = -1;
+
+	if ((ldap_get_entry_controls(handle, msg, &ctrls) != LDAP_SUCCESS) || !ctrls) {
+		LDAP_ERR("Replica: Entry has no Sync State Control");
+		return -1;
+	}
+
+	for (i = 0; ctrls[i]; i++) {
+		if (strcmp(ctrls[i]->ldctl_oid, LDAP_CONTROL_SYNC_STATE) == 0) {
+			state_ctrl = ctrls[i];
+			break;
+		}
+	}
+	if (!state_ctrl) {
+		LDAP_ERR("Replica: Entry has no Sync State Control");
+		goto finish;
+	}
+
+	ber = ber_init(&state_ctrl->ldctl_value);
+	if (!ber || (ber_scanf(ber, "{em", &state, &uuid) == LBER_ERROR)) {
+		LDAP_ERR("Replica: Malformed Sync State Control");
+		goto finish;
+	}
+
+	switch (state) {
+	case LDAP_SYNC_PRESENT:
+	case LDAP_SYNC_ADD:
+	case LDAP_SYNC_MODIFY:
+		e = ldap_sync_entry_alloc(sync, handle, msg, &uuid);
+		if (!e) goto finish;
+
+		LDAP_DBG3("Replica: %s \"%s\"", (state == LDAP_SYNC_MODIFY) ? "Modified" : "Added",
+			  e->dn ? e->dn : "");
+
+		if (pending) {
+			ldap_sync_index_add(pending, e);
+			break;
+		}
+
+		pthread_mutex_lock(&sync->mutex);
+		ldap_sync_index_add(sync->live, e);
+		pthread_mutex_unlock(&sync->mutex);
+		break;
+
+	case LDAP_SYNC_DELETE:
+		if (uuid.bv_len != sizeof(find.uuid)) break;
+		memcpy(find.uuid, uuid.bv_val, sizeof(find.uuid));
+
+		LDAP_DBG3("Replica: Deleted entry");
+
+		if (pending) {
+			ldap_sync_index_delete(pending, &find);
+			break;
+		}
+
+		pthread_mutex_lock(&sync->mutex);
+		ldap_sync_index_delete(sync->live, &find);
+		pthread_mutex_unlock(&sync->mutex);
+		break;
+
+	default:
+		LDAP_ERR("Replica: Unknown sync state %i", (int) state);
+		goto finish;
+	}
+
+	rcode = 0;
+
+finish:
+	if (ber) ber_free(ber, 1);
+	ldap_controls_free(ctrls);
+
+	return rcode;
+}
+
+/** Process a Sync Info Message
+ *
+ * We only care about the end of the refresh phase, and about entries deleted in bulk.
+ *
+ * @return 1 if the refresh phase is done, 0 if not, -1 if the message couldn't be parsed.
+ */
+static int ldap_sync_info(ldap_sync_t *sync, LDAP *handle, LDAPMessage *msg, ldap_sync_index_t *pending)
+{
+	ldap_instance_t		*inst = sync->inst;
+	char			*oid = NULL;
+	struct berval		*data = NULL;
+	BerElement		*ber = NULL;
+	ber_tag_t		tag;
+	ber_len_t		len;
+	ber_int_t		flag;
+	BerVarray		uuids = NULL;
+	ldap_sync_entry_t	find;
+	int			i, rcode = -1;
+
+	if (ldap_parse_intermediate(handle, msg, &oid, &data, NULL, 0) != LDAP_SUCCESS) {
+		LDAP_ERR("Replica: Failed parsing intermediate response");
+		return -1;
+	}
+
+	if (!oid || (strcmp(oid, LDAP_SYNC_INFO) != 0) || !data) {
+		rcode = 0;
+		goto finish;
+	}
+
+	ber = ber_init(data);
+	if (!ber) goto finish;
+
+	tag = ber_peek_tag(ber, &len);
+	switch (tag) {
+	case LDAP_SYNC_TAG_REFRESH_DELETE:
+	case LDAP_SYNC_TAG_REFRESH_PRESENT:
+		flag = 1;			/* refreshDone defaults to TRUE */
+
+		if (ber_scanf(ber, "{") == LBER_ERROR) goto malformed;
+
+		tag = ber_peek_tag(ber, &len);
+		if (tag == LDAP_SYNC_TAG_OCTETSTRING) {
+			if (ber_scanf(ber, "x") == LBER_ERROR) goto malformed;
+			tag = ber_peek_tag(ber, &len);
+		}
+		if (tag == LDAP_SYNC_TAG_BOOLEAN) {
+			if (ber_scanf(ber, "b", &flag) == LBER_ERROR) goto malformed;
+		}
+
+		rcode = flag ? 1 : 0;
+		break;
+
+	case LDAP_SYNC_TAG_ID_SET:
+		flag = 0;			/* refreshDeletes defaults to FALSE */
+
+		if (ber_scanf(ber, "{") == LBER_ERROR) goto malformed;
+
+		tag = ber_peek_tag(ber, &len);
+		if (tag == LDAP_SYNC_TAG_OCTETSTRING) {
+			if (ber_scanf(ber, "x") == LBER_ERROR) goto malformed;
+			tag = ber_peek_tag(ber, &len);
+		}
+		if (tag == LDAP_SYNC_TAG_BOOLEAN) {
+			if (ber_scanf(ber, "b", &flag) == LBER_ERROR) goto malformed;
+		}
+		if (ber_scanf(ber, "[W]", &uuids) == LBER_ERROR) goto malformed;
+
+		/*
+		 *	Without a cookie, the server has no reason to
+		 *	list the entries which are still present.
+		 */
+		if (flag && uuids) {
+			if (!pending) pthread_mutex_lock(&sync->mutex);
+			for (i = 0; uuids[i].bv_val; i++) {
+				if (uuids[i].bv_len != sizeof(find.uuid)) continue;
+
+				memcpy(find.uuid, uuids[i].bv_val, sizeof(find.uuid));
+				ldap_sync_index_delete(pending ? pending : sync->live, &find);
+			}
+			if (!pending) pthread_mutex_unlock(&sync->mutex);
+		}
+
+		rcode = 0;
+		break;
+
+	default:
+		rcode = 0;
+		break;
+	}
+
+finish:
+	if (uuids) ber_bvarray_free(uuids);
+	if (ber) ber_free(ber, 1);
+	if (data) ber_bvfree(data);
+	if (oid) ldap_memfree(oid);
+
+	return rcode;
+
+malformed:
+	LDAP_ERR("Replica: Malformed Sync Info Message");
+	rcode = -1;
+	goto finish;
+}
+
+/** Whether the module is being detached
+ *
+ */
+static bool ldap_sync_stopping(ldap_sync_t *sync)
+{
+	bool stop;
+
+	pthread_mutex_lock(&sync->mutex);
+	stop = sync->stop;
+	pthread_mutex_unlock(&sync->mutex);
+
+	return stop;
+}
+
+/** Wait before reconnecting, unless the module is detached first
+ *
+ */
+static void ldap_sync_wait(ldap_sync_t *sync)
+{
+	struct timeval now;
+	struct timespec deadline;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + sync->inst->sync_retry_interval;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock(&sync->mutex);
+	if (!sync->stop) pthread_cond_timedwait(&sync->wakeup, &sync->mutex, &deadline);
+	pthread_mutex_unlock(&sync->mutex);
+}
+
+/** Make the refreshAndPersist search, and apply its results until the connection fails
+ *
+ */
+static void ldap_sync_run(ldap_sync_t *sync, ldap_handle_t *conn)
+{
+	ldap_instance_t		*inst = sync->inst;
+	static char		sync_oid[] = LDAP_CONTROL_SYNC;
+
+	ldap_sync_index_t	*pending = NULL, *old;
+	LDAPControl		ctrl, *ctrls[2];
+	BerElement		*ber;
+	struct berval		*value = NULL;
+	LDAPMessage		*msg;
+	struct timeval		tv;
+	int			msgid, ldap_errno, rcode;
+
+	ber = ber_alloc_t(LBER_USE_DER);
+	if (!ber) return;
+
+	if ((ber_printf(ber, "{e}", (ber_int_t) LDAP_SYNC_REFRESH_AND_PERSIST) < 0) ||
+	    (ber_flatten(ber, &value) < 0)) {
+		ber_free(ber, 1);
+		LDAP_ERR("Replica: Failed encoding Sync Request Control");
+		return;
+	}
+	ber_free(ber, 1);
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.ldctl_oid = sync_oid;
+	ctrl.ldctl_value = *value;
+	ctrl.ldctl_iscritical = 1;
+	ctrls[0] = &ctrl;
+	ctrls[1] = NULL;
+
+	ldap_errno = ldap_search_ext(conn->handle, inst->userobj_base_dn, inst->userobj_scope, inst->sync_filter,
+				     sync->attrs, 0, ctrls, NULL, NULL, LDAP_NO_LIMIT, &msgid);
+	ber_bvfree(value);
+	if (ldap_errno != LDAP_SUCCESS) {
+		LDAP_ERR("Replica: Failed starting search: %s", ldap_err2string(ldap_errno));
+		return;
+	}
+
+	pending = ldap_sync_index_alloc();
+	if (!pending) return;
+
+	LDAP_DBG("Replica: Loading user objects from \"%s\"", inst->userobj_base_dn);
+
+	while (!ldap_sync_stopping(sync)) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		msg = NULL;
+		rcode = ldap_result(conn->handle, msgid, LDAP_MSG_ONE, &tv, &msg);
+		if (rcode == 0) continue;
+		if (rcode < 0) {
+			ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &ldap_errno);
+			LDAP_ERR("Replica: Connection failed: %s", ldap_err2string(ldap_errno));
+			break;
+		}
+
+		switch (ldap_msgtype(msg)) {
+		case LDAP_RES_SEARCH_ENTRY:
+			rcode = ldap_sync_entry(sync, conn->handle, msg, pending);
+			break;
+
+		case LDAP_RES_INTERMEDIATE:
+			rcode = ldap_sync_info(sync, conn->handle, msg, pending);
+			if ((rcode != 1) || !pending) break;
+
+			/*
+			 *	Everything's been sent.  Replace the
+			 *	live index with the new one.
+			 */
+			LDAP_INFO("Replica: Loaded %i user objects, keeping them current",
+				  fr_hash_table_num_elements(pending->by_uuid));
+
+			pthread_mutex_lock(&sync->mutex);
+			old = sync->live;
+			sync->live = pending;
+			sync->current = true;
+			pthread_mutex_unlock(&sync->mutex);
+
+			ldap_sync_index_free(old);
+			pending = NULL;
+			rcode = 0;
+			break;
+
+		case LDAP_RES_SEARCH_RESULT:
+			/*
+			 *	A persistent search only ends if there's
+			 *	an error, or the server wants us to start
+			 *	again.
+			 */
+			ldap_errno = LDAP_OTHER;
+			ldap_parse_result(conn->handle, msg, &ldap_errno, NULL, NULL, NULL, NULL, 0);
+			LDAP_ERR("Replica: Search ended: %s", ldap_err2string(ldap_errno));
+			rcode = -1;
+			break;
+
+		default:
+			rcode = 0;
+			break;
+		}
+		ldap_msgfree(msg);
+
+		if (rcode < 0) break;
+	}
+
+	ldap_abandon_ext(conn->handle, msgid, NULL, NULL);
+	ldap_sync_index_free(pending);
+}
+
+static void *ldap_sync_thread(void *arg)
+{
+	ldap_sync_t	*sync = arg;
+	ldap_instance_t	*inst = sync->inst;
+	ldap_handle_t	*conn;
+
+	while (!ldap_sync_stopping(sync)) {
+		conn = mod_conn_create(inst);
+		if (conn) {
+			ldap_sync_run(sync, conn);
+			mod_conn_delete(inst, conn);
+		}
+
+		/*
+		 *	The replica is missing changes.  Until it's
+		 *	been reloaded, requests search the directory.
+		 */
+		pthread_mutex_lock(&sync->mutex);
+		if (sync->current && !sync->stop) {
+			LDAP_WARN("Replica: No longer current, searching the directory until it's reloaded");
+		}
+		sync->current = false;
+		pthread_mutex_unlock(&sync->mutex);
+
+		if (ldap_sync_stopping(sync)) break;
+
+		LDAP_DBG("Replica: Reconnecting in %i seconds", inst->sync_retry_interval);
+		ldap_sync_wait(sync);
+	}
+
+	return NULL;
+}
+
+/** Add an attribute to the list to retrieve, if it's not already there
+ *
+ */
+static void ldap_sync_attr_add(ldap_sync_t *sync, int *count, char const *name)
+{
+	int i;
+
+	if (!name) return;
+
+	for (i = 0; i < *count; i++) {
+		if (strcasecmp(sync->attrs[i], name) == 0) return;
+	}
+
+	sync->attrs = talloc_realloc(sync, sync->attrs, char *, *count + 2);
+	sync->attrs[(*count)++] = talloc_typed_strdup(sync->attrs, name);
+	sync->attrs[*count] = NULL;
+}
+
+/** Start the local replica
+ *
+ * Works out which attributes are needed, and starts the thread which loads and updates the replica.
+ *
+ * @param inst rlm_ldap configuration.
+ * @return 0 on success, -1 on failure.
+ */
+int rlm_ldap_sync_init(ldap_instance_t *inst)
+{
+	ldap_sync_t		*sync;
+	value_pair_map_t const	*map;
+	int			count = 0;
+
+	sync = talloc_zero(inst, ldap_sync_t);
+	if (!sync) return -1;
+	sync->inst = inst;
+
+	/*
+	 *	If the names of any of the mapped attributes are only
+	 *	known when the request arrives, get all of them.
+	 */
+	for (map = inst->user_map; map != NULL; map = map->next) {
+		if (map->src->type != VPT_TYPE_LITERAL) {
+			count = 0;
+			break;
+		}
+		ldap_sync_attr_add(sync, &count, map->src->name);
+	}
+	if (map) {
+		talloc_free(sync->attrs);
+		sync->attrs = NULL;
+		ldap_sync_attr_add(sync, &count, "*");
+	}
+
+	ldap_sync_attr_add(sync, &count, inst->sync_key_attr);
+	ldap_sync_attr_add(sync, &count, inst->userobj_access_attr);
+	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
+		ldap_sync_attr_add(sync, &count, inst->userobj_membership_attr);
+	}
+	ldap_sync_attr_add(sync, &count, inst->profile_attr);
+	ldap_sync_attr_add(sync, &count, inst->valuepair_attr);
+
+	sync->live = ldap_sync_index_alloc();
+	if (!sync->live) {
+		talloc_free(sync);
+		return -1;
+	}
+
+	pthread_mutex_init(&sync->mutex, NULL);
+	pthread_cond_init(&sync->wakeup, NULL);
+	inst->sync = sync;
+
+	if (pthread_create(&sync->thread, NULL, ldap_sync_thread, sync) != 0) {
+		LDAP_ERR("Failed creating replica thread: %s", fr_syserror(errno));
+		return -1;
+	}
+	sync->started = true;
+
+	return 0;
+}
+
+/** Stop the local replica, and free it
+ *
+ * @param inst rlm_ldap configuration.
+ */
+void rlm_ldap_sync_free(ldap_instance_t *inst)
+{
+	ldap_sync_t *sync = inst->sync;
+
+	if (!sync) return;
+
+	if (sync->started) {
+		pthread_mutex_lock(&sync->mutex);
+		sync->stop = true;
+		pthread_cond_signal(&sync->wakeup);
+		pthread_mutex_unlock(&sync->mutex);
+
+		pthread_join(sync->thread, NULL);
+	}
+
+	ldap_sync_index_free(sync->live);
+
+	pthread_cond_destroy(&sync->wakeup);
+	pthread_mutex_destroy(&sync->mutex);
+
+	talloc_free(sync);
+	inst->sync = NULL;
+}
+
+/** Find a user object in the local replica
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] key value of the key attribute to look for, compared case insensitively.
+ * @param[out] out Where to write a copy of the entry, allocated in the request.
+ * @return 1 if the user was found, 0 if they weren't, or -1 if the replica isn't current, or several objects
+ *	have the same key, and the caller should search the directory instead.
+ */
+int rlm_ldap_sync_find(ldap_instance_t const *inst, REQUEST *request, char const *key, ldap_sync_entry_t **out)
+{
+	ldap_sync_t		*sync = inst->sync;
+	ldap_sync_entry_t	find, *found, *e;
+	char			buffer[LDAP_MAX_ATTR_STR_LEN];
+	char			*p;
+	int			i, j, count;
+
+	*out = NULL;
+
+	if (!sync) return -1;
+
+	strlcpy(buffer, key, sizeof(buffer));
+	for (p = buffer; *p; p++) *p = tolower((int) *p);
+	find.key = buffer;
+
+	pthread_mutex_lock(&sync->mutex);
+	if (!sync->current) {
+		pthread_mutex_unlock(&sync->mutex);
+		return -1;
+	}
+
+	found = fr_hash_table_finddata(sync->live->by_key, &find);
+	if (!found) {
+		pthread_mutex_unlock(&sync->mutex);
+		return 0;
+	}
+
+	/*
+	 *	Don't guess which one is meant.  The search will
+	 *	find them all, and fail.
+	 */
+	if (found->next_key) {
+		pthread_mutex_unlock(&sync->mutex);
+
+		RWDEBUG("Several user objects in local replica have %s \"%s\"", inst->sync_key_attr, key);
+		return -1;
+	}
+
+	/*
+	 *	The entry may be replaced as soon as we release the
+	 *	lock, so the request gets its own copy.
+	 */
+	e = talloc_zero(request, ldap_sync_entry_t);
+	memcpy(e->uuid, found->uuid, sizeof(e->uuid));
+	e->dn = talloc_typed_strdup(e, found->dn);
+	e->key = talloc_typed_strdup(e, found->key);
+	e->num_attrs = found->num_attrs;
+	e->attrs = talloc_array(e, ldap_sync_attr_t, found->num_attrs);
+	for (i = 0; i < found->num_attrs; i++) {
+		for (count = 0; found->attrs[i].values[count]; count++);
+
+		e->attrs[i].name = talloc_typed_strdup(e, found->attrs[i].name);
+		e->attrs[i].values = talloc_array(e, char *, count + 1);
+		for (j = 0; j < count; j++) {
+			e->attrs[i].values[j] = talloc_typed_strdup(e->attrs[i].values, found->attrs[i].values[j]);
+		}
+		e->attrs[i].values[count] = NULL;
+	}
+	pthread_mutex_unlock(&sync->mutex);
+
+	RDEBUG("Found user object \"%s\" in local replica", e->dn ? e->dn : "");
+	*out = e;
+
+	return 1;
+}
+
+#else
+int rlm_ldap_sync_init(ldap_instance_t *inst)
+{
+	LDAP_ERR("A local replica requires threads, and an LDAP library with ldap_parse_intermediate()");
+
+	return -1;
+}
+
+void rlm_ldap_sync_free(UNUSED ldap_instance_t *inst)
+{
+}
+
+int rlm_ldap_sync_find(UNUSED ldap_instance_t const *inst, UNUSED REQUEST *request, UNUSED char const *key,
+		       ldap_sync_entry_t **out)
+{
+	*out = NULL;
+
+	return -1;
+}
+#endif
@@ -0,0 +1,422 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @brief Run HTTP transfers from many requests through one shared curl multi handle.
+ * @file multi.c
+ *
+ * With curl_easy_perform each easy handle owns its connection, so the number of transfers in
+ * progress is limited by the number of pooled handles, and each one needs its own TCP (and TLS)
+ * connection to the server.  Here, the easy handles are added to a single multi handle, which
+ * owns the connections.  Transfers to the same server share kept-alive connections, and with
+ * HTTP/2 many transfers are multiplexed over one connection.
+ *
+ * Whichever waiting thread finds nobody driving the multi handle becomes the driver.  It adds any
+ * queued transfers, waits for activity on the sockets without holding the lock, and marks the
+ * finished transfers done, waking the threads waiting for them.  When its own transfer has
+ * finished it stops driving, and another waiting thread takes over.
+ *
+ * @copyright 2014 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/radiusd.h>
+
+#include "rest.h"
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#define PTHREAD_COND_BROADCAST pthread_cond_broadcast
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#define PTHREAD_COND_BROADCAST(_x)
+#endif
+
+/*
+ *	curl_multi_wait() was added in 7.28.0.
+ */
+#if LIBCURL_VERSION_NUM >= 0x071c00
+
+/*
+ *	The driver wakes up at least this often, even if curl has
+ *	no timers pending.
+ */
+#define REST_MULTI_WAIT_MSEC	(1000)
+
+/** The shared multi handle
+ *
+ */
+struct rest_multi {
+	rlm_rest_t		*inst;		//!< Instance the multi handle was created for.
+	CURLM			*mandle;	//!< Multi handle.  Only used by the driver.
+	bool			http2;		//!< libcurl supports HTTP/2.
+
+	int			wake[2];	//!< Written to when a transfer is queued, to interrupt
+						//!< the driver.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects driving, pending, and the done flags.
+	pthread_cond_t		cond;		//!< Signalled when transfers finish, or the driver stops.
+#endif
+	bool			driving;	//!< A thread is driving the multi handle.
+	rlm_rest_handle_t	*pending;	//!< Transfers waiting to be added to the multi handle.
+};
+
+/** Interrupt the driver, so that it adds newly queued transfers
+ *
+ */
+static void rest_multi_wake(rest_multi_t *multi)
+{
+	char c = 0;
+
+	/*
+	 *	If the pipe is full the driver already has
+	 *	a wakeup pending.
+	 */
+	if (write(multi->wake[1], &c, 1) < 0) return;
+}
+
+/** Discard any pending wakeups
+ *
+ */
+static void rest_multi_drain(rest_multi_t *multi)
+{
+	char buffer[64];
+
+	while (read(multi->wake[0], buffer, sizeof(buffer)) > 0);
+}
+
+/** Drive the multi handle until the caller's transfer has finished
+ *
+ * Must be called with the multi handle locked, and returns with it locked.
+ *
+ * @param multi handle to drive.
+ * @param randle whose transfer the caller is waiting for.
+ */
+static void rest_multi_drive(rest_multi_t *multi, rlm_rest_handle_t *randle)
+{
+	rlm_rest_t		*inst = multi->inst;
+	rlm_rest_handle_t	*add, *complete, *next;
+	CURLMsg			*msg;
+	CURLMcode		mret;
+	struct curl_waitfd	wfd;
+	long			timeout;
+	int			running, queued, numfds;
+
+	while (!randle->done) {
+		add = multi->pending;
+		multi->pending = NULL;
+		complete = NULL;
+
+		PTHREAD_MUTEX_UNLOCK(&multi->mutex);
+
+		for (; add; add = next) {
+			next = add->next;
+			add->next = NULL;
+
+			mret = curl_multi_add_handle(multi->mandle, add->handle);
+			if (mret != CURLM_OK) {
+				ERROR("rlm_rest (%s): Failed adding transfer: %i - %s", inst->xlat_name,
+				      mret, curl_multi_strerror(mret));
+
+				add->result = CURLE_FAILED_INIT;
+				add->next = complete;
+				complete = add;
+			}
+		}
+
+		do {
+			mret = curl_multi_perform(multi->mandle, &running);
+		} while (mret == CURLM_CALL_MULTI_PERFORM);
+		if (mret != CURLM_OK) {
+			ERROR("rlm_rest (%s): Failed performing transfers: %i - %s", inst->xlat_name,
+			      mret, curl_multi_strerror(mret));
+		}
+
+		while ((msg = curl_multi_info_read(multi->mandle, &queued))) {
+			char *private = NULL;
+			CURL *candle = msg->easy_handle;
+			CURLcode result;
+
+			if (msg->msg != CURLMSG_DONE) continue;
+
+			/*
+			 *	msg is invalid once the handle has been removed.
+			 */
+			result = msg->data.result;
+			curl_easy_getinfo(candle, CURLINFO_PRIVATE, &private);
+			curl_multi_remove_handle(multi->mandle, candle);
+
+			if (!private) continue;
+
+			add = (rlm_rest_handle_t *) private;
+			add->result = result;
+			add->next = complete;
+			complete = add;
+		}
+
+		PTHREAD_MUTEX_LOCK(&multi->mutex);
+
+		if (complete) {
+			for (; complete; complete = next) {
+				next = complete->next;
+				complete->next = NULL;
+				complete->done = true;
+			}
+			PTHREAD_COND_BROADCAST(&multi->cond);
+		}
+
+		if (randle->done) break;
+		if (multi->pending) continue;
+
+		PTHREAD_MUTEX_UNLOCK(&multi->mutex);
+
+		/*
+		 *	Any transfers queued from here on write to the
+		 *	wake pipe, which interrupts curl_multi_wait.
+		 */
+		if ((curl_multi_timeout(multi->mandle, &timeout) != CURLM_OK) ||
+		    (timeout < 0) || (timeout > REST_MULTI_WAIT_MSEC)) {
+			timeout = REST_MULTI_WAIT_MSEC;
+		}
+
+		memset(&wfd, 0, sizeof(wfd));
+		wfd.fd = multi->wake[0];
+		wfd.events = CURL_WAIT_POLLIN;
+
+		mret = curl_multi_wait(multi->mandle, &wfd, 1, (int) timeout, &numfds);
+		if (mret != CURLM_OK) {
+			ERROR("rlm_rest (%s): Failed waiting for transfers: %i - %s", inst->xlat_name,
+			      mret, curl_multi_strerror(mret));
+		}
+		rest_multi_drain(multi);
+
+		PTHREAD_MUTEX_LOCK(&multi->mutex);
+	}
+}
+
+/** Create the shared multi handle
+ *
+ * @param inst rlm_rest configuration.
+ * @return 0 on success, -1 on failure.
+ */
+int rest_multi_init(rlm_rest_t *inst)
+{
+	rest_multi_t		*multi;
+#ifdef CURL_VERSION_HTTP2
+	curl_version_info_data	*version;
+#endif
+
+	multi = talloc_zero(inst, rest_multi_t);
+	if (!multi) return -1;
+
+	multi->inst = inst;
+	multi->wake[0] = multi->wake[1] = -1;
+
+	multi->mandle = curl_multi_init();
+	if (!multi->mandle) {
+		ERROR("rlm_rest (%s): Failed creating CURL multi handle", inst->xlat_name);
+		goto error;
+	}
+
+#ifdef CURL_VERSION_HTTP2
+	version = curl_version_info(CURLVERSION_NOW);
+	if (version && (version->features & CURL_VERSION_HTTP2)) multi->http2 = true;
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt(multi->mandle, CURLMOPT_PIPELINING,
+			  (long) (multi->http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING));
+#endif
+
+	if (inst->max_host_connections) {
+#if LIBCURL_VERSION_NUM >= 0x071e00
+		curl_multi_setopt(multi->mandle, CURLMOPT_MAX_HOST_CONNECTIONS, (long) inst->max_host_connections);
+#else
+		WARN("rlm_rest (%s): Ignoring max_host_connections, libcurl >= 7.30.0 is required",
+		     inst->xlat_name);
+#endif
+	}
+
+	if (pipe(multi->wake) < 0) {
+		ERROR("rlm_rest (%s): Failed creating wake pipe: %s", inst->xlat_name, fr_syserror(errno));
+		multi->wake[0] = multi->wake[1] = -1;
+		goto error;
+	}
+
+	if ((fr_nonblock(multi->wake[0]) < 0) || (fr_nonblock(multi->wake[1]) < 0)) {
+		ERROR("rlm_rest (%s): Failed setting wake pipe non-blocking: %s", inst->xlat_name,
+		      fr_syserror(errno));
+		goto error;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&multi->mutex, NULL) < 0) {
+		ERROR("rlm_rest (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
+		goto error;
+	}
+
+	if (pthread_cond_init(&multi->cond, NULL) < 0) {
+		pthread_mutex_destroy(&multi->mutex);
+		ERROR("rlm_rest (%s): Failed initializing condition variable: %s", inst->xlat_name,
+		      fr_syserror(errno));
+		goto error;
+	}
+#endif
+
+	DEBUG("rlm_rest (%s): Sharing connections between transfers%s", inst->xlat_name,
+	      multi->http2 ? ", multiplexing with HTTP/2" : "");
+
+	inst->multi = multi;
+
+	return 0;
+
+error:
+	if (multi->wake[0] >= 0) close(multi->wake[0]);
+	if (multi->wake[1] >= 0) close(multi->wake[1]);
+	if (multi->mandle) curl_multi_cleanup(multi->mandle);
+	talloc_free(multi);
+
+	return -1;
+}
+
+/** Free the shared multi handle
+ *
+ * No transfers may be in progress.
+ *
+ * @param inst rlm_rest configuration.
+ */
+void rest_multi_free(rlm_rest_t *inst)
+{
+	rest_multi_t *multi = inst->multi;
+
+	if (!multi) return;
+
+	rad_assert(!multi->driving && !multi->pending);
+
+	curl_multi_cleanup(multi->mandle);
+	close(multi->wake[0]);
+	close(multi->wake[1]);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&multi->cond);
+	pthread_mutex_destroy(&multi->mutex);
+#endif
+
+	talloc_free(multi);
+	inst->multi = NULL;
+}
+
+/** Perform a transfer using the shared multi handle
+ *
+ * Blocks until the transfer has finished, driving the multi handle if no other thread is.
+ *
+ * @param inst rlm_rest configuration.
+ * @param request Current request.
+ * @param randle configured by rest_request_config.
+ * @return the result of the transfer.
+ */
+CURLcode rest_multi_perform(rlm_rest_t *inst, REQUEST *request, rlm_rest_handle_t *randle)
+{
+	rest_multi_t	*multi = inst->multi;
+	CURL		*candle = randle->handle;
+	CURLcode	ret;
+
+	rad_assert(multi);
+
+	/*
+	 *	Any curl options set here are cleared by
+	 *	rest_request_cleanup.
+	 */
+	ret = curl_easy_setopt(candle, CURLOPT_PRIVATE, randle);
+	if (ret != CURLE_OK) return ret;
+
+	/*
+	 *	Signals can't be used to time out name resolution
+	 *	when another thread may be running the transfer.
+	 */
+	ret = curl_easy_setopt(candle, CURLOPT_NOSIGNAL, 1L);
+	if (ret != CURLE_OK) return ret;
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	if (multi->http2) {
+		/*
+		 *	Negotiate HTTP/2 for https:// URIs, and wait for
+		 *	an existing connection to the server rather than
+		 *	opening a new one, so that transfers are multiplexed.
+		 */
+		ret = curl_easy_setopt(candle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+		if (ret != CURLE_OK) return ret;
+
+		ret = curl_easy_setopt(candle, CURLOPT_PIPEWAIT, 1L);
+		if (ret != CURLE_OK) return ret;
+	}
+#endif
+
+	randle->done = false;
+	randle->result = CURLE_OK;
+
+	PTHREAD_MUTEX_LOCK(&multi->mutex);
+	randle->next = multi->pending;
+	multi->pending = randle;
+
+	if (multi->driving) rest_multi_wake(multi);
+
+	while (!randle->done) {
+		if (!multi->driving) {
+			multi->driving = true;
+			rest_multi_drive(multi, randle);
+			multi->driving = false;
+
+			/*
+			 *	Let another waiting thread take over.
+			 */
+			PTHREAD_COND_BROADCAST(&multi->cond);
+			continue;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_wait(&multi->cond, &multi->mutex);
+#endif
+	}
+	PTHREAD_MUTEX_UNLOCK(&multi->mutex);
+
+	RDEBUG3("Transfer finished: %i", randle->result);
+
+	return randle->result;
+}
+
+#else
+int rest_multi_init(rlm_rest_t *inst)
+{
+	ERROR("rlm_rest (%s): multiplex requires libcurl >= 7.28.0", inst->xlat_name);
+
+	return -1;
+}
+
+void rest_multi_free(UNUSED rlm_rest_t *inst)
+{
+}
+
+CURLcode rest_multi_perform(UNUSED rlm_rest_t *inst, UNUSED REQUEST *request, UNUSED rlm_rest_handle_t *randle)
+{
+	return CURLE_FAILED_INIT;
+}
+#endif
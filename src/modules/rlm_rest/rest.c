@@ -311,6 +311,12 @@ void *mod_conn_create(void *instance)
 		return NULL;
 	}
 
+	/*
+	 *  The shared multi handle owns the connections, so there's
+	 *  nothing to pre-connect.
+	 */
+	if (inst->multi) goto finish;
+
 	if (!inst->connect_uri) {
 		ERROR("rlm_rest (%s): Skipping pre-connect, connect_uri not specified", inst->xlat_name);
 		return candle;
@@ -333,6 +339,7 @@ void *mod_conn_create(void *instance)
 		goto connection_error;
 	}
 
+finish:
 	/*
 	 *  Allocate memory for the connection handle abstraction.
 	 */
@@ -388,6 +395,12 @@ int mod_conn_alive(void *instance, void *handle)
 	long last_socket;
 	CURLcode ret;
 
+	/*
+	 *  Connections belong to the shared multi handle, which
+	 *  replaces them itself.
+	 */
+	if (inst->multi) return true;
+
 	ret = curl_easy_getinfo(candle, CURLINFO_LASTSOCKET, &last_socket);
 	if (ret != CURLE_OK) {
 		ERROR("rlm_rest (%s): Couldn't determine socket state: %i - %s", inst->xlat_name, ret,
@@ -2113,14 +2126,18 @@ error_header:
  * @param[in] handle to use.
  * @return 0 on success or -1 on error.
  */
-int rest_request_perform(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
+int rest_request_perform(rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
 			 REQUEST *request, void *handle)
 {
 	rlm_rest_handle_t	*randle = handle;
 	CURL			*candle = randle->handle;
 	CURLcode		ret;
 
-	ret = curl_easy_perform(candle);
+	if (instance->multi) {
+		ret = rest_multi_perform(instance, request, randle);
+	} else {
+		ret = curl_easy_perform(candle);
+	}
 	if (ret != CURLE_OK) {
 		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
 
@@ -136,6 +136,8 @@ typedef struct rlm_rest_section_t {
 	size_t			chunk;		//!< Max chunk-size (mainly for testing the encoders)
 } rlm_rest_section_t;
 
+typedef struct rest_multi rest_multi_t;
+
 /*
  *	Structure for module configuration
  */
@@ -147,6 +149,11 @@ typedef struct rlm_rest_t {
 
 	fr_connection_pool_t	*conn_pool;	//!< Pointer to the connection pool.
 
+	bool			multiplex;	//!< Run transfers through a shared multi handle.
+	uint32_t		max_host_connections;	//!< Limit on connections the multi handle
+							//!< opens to each server.
+	rest_multi_t		*multi;		//!< Shared multi handle.
+
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
 	rlm_rest_section_t	accounting;	//!< Configuration specific to accounting.
@@ -230,6 +237,11 @@ typedef struct rlm_rest_curl_context_t {
 typedef struct rlm_rest_handle_t {
 	void			*handle;	//!< Real Handle.
 	rlm_rest_curl_context_t	*ctx;		//!< Context.
+
+	bool			done;		//!< Transfer run through the multi handle has finished.
+	CURLcode		result;		//!< Result of the transfer.
+	struct rlm_rest_handle_t *next;		//!< Next transfer waiting to be added to, or finished
+						//!< by, the multi handle.
 } rlm_rest_handle_t;
 
 /*
@@ -252,6 +264,15 @@ int mod_conn_alive(void *instance, void *handle);
 
 int mod_conn_delete(void *instance, void *handle);
 
+/*
+ *	Shared multi handle API
+ */
+int rest_multi_init(rlm_rest_t *instance);
+
+void rest_multi_free(rlm_rest_t *instance);
+
+CURLcode rest_multi_perform(rlm_rest_t *instance, REQUEST *request, rlm_rest_handle_t *randle);
+
 /*
  *	Request processing API
  */
@@ -86,6 +86,8 @@ static const CONF_PARSER section_config[] = {
 
 static const CONF_PARSER module_config[] = {
 	{ "connect_uri", PW_TYPE_STRING_PTR, offsetof(rlm_rest_t, connect_uri), NULL, NULL },
+	{ "multiplex", PW_TYPE_BOOLEAN, offsetof(rlm_rest_t, multiplex), NULL, "no" },
+	{ "max_host_connections", PW_TYPE_INTEGER, offsetof(rlm_rest_t, max_host_connections), NULL, "0" },
 
 	{ NULL, -1, 0, NULL, NULL }
 };
@@ -606,6 +608,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Must be created before the connection pool, so that
+	 *	new connections skip the pre-connect.
+	 */
+	if (inst->multiplex && (rest_multi_init(inst) < 0)) {
+		return -1;
+	}
+
 	inst->conn_pool = fr_connection_pool_init(conf, inst, mod_conn_create, mod_conn_alive, mod_conn_delete, NULL);
 	if (!inst->conn_pool) {
 		return -1;
@@ -626,6 +636,8 @@ static int mod_detach(void *instance)
 
 	xlat_unregister(inst->xlat_name, rest_xlat, instance);
 
+	rest_multi_free(inst);
+
 	/* Free any memory used by libcurl */
 	rest_cleanup();
 
@@ -0,0 +1,184 @@
+/*
+ * cache.c	rlm_sql - Cache the results of authorization queries.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/*
+ *	The check, reply, and group membership queries are usually
+ *	the same few queries, run over and over again for the same
+ *	users.  When the cache is enabled, the parsed result of each
+ *	one is kept, keyed by the expanded query, for "lifetime"
+ *	seconds.  Requests which expand a query to the same text get
+ *	a copy of the cached result, without using a connection.
+ *
+ *	Each entry is tagged with the SQL-User-Name it was read for,
+ *	so that the entries for one user can be removed when their
+ *	rows in the database change.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include "rlm_sql.h"
+
+typedef struct sql_cache_entry {
+	fr_cache_entry_t	entry;		//!< Must be first.
+
+	char const		*key;		//!< The expanded query.
+	char const		*user;		//!< SQL-User-Name, or NULL.
+
+	int			rows;
+	VALUE_PAIR		*vps;		//!< Check or reply pairs.
+	rlm_sql_grouplist_t	*groups;	//!< Or group names.
+} sql_cache_entry_t;
+
+/*
+ *	Where to copy a cached result to.
+ */
+typedef struct sql_cache_copy {
+	TALLOC_CTX		*ctx;
+	VALUE_PAIR		**pair;
+	rlm_sql_grouplist_t	**groups;
+} sql_cache_copy_t;
+
+static int sql_cache_entry_cmp(void const *one, void const *two)
+{
+	sql_cache_entry_t const *a = one;
+	sql_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static rlm_sql_grouplist_t *sql_cache_groups_copy(TALLOC_CTX *ctx, rlm_sql_grouplist_t const *from)
+{
+	rlm_sql_grouplist_t *head = NULL, **last = &head;
+
+	for (; from; from = from->next) {
+		*last = talloc_zero(head ? (TALLOC_CTX *) head : ctx, rlm_sql_grouplist_t);
+		(*last)->name = talloc_typed_strdup(*last, from->name);
+		last = &(*last)->next;
+	}
+
+	return head;
+}
+
+static int sql_cache_copy(void *ctx, void const *entry)
+{
+	sql_cache_copy_t *out = ctx;
+	sql_cache_entry_t const *c = entry;
+
+	if (out->pair) pairadd(out->pair, paircopy(out->ctx, c->vps));
+	if (out->groups) *out->groups = sql_cache_groups_copy(out->ctx, c->groups);
+
+	return c->rows;
+}
+
+static bool sql_cache_match_user(void *ctx, void const *entry)
+{
+	char const *user = ctx;
+	sql_cache_entry_t const *c = entry;
+
+	return c->user && (strcmp(c->user, user) == 0);
+}
+
+int sql_cache_init(rlm_sql_t *inst)
+{
+	inst->cache = fr_cache_create(inst, inst->config->cache_max_entries, sql_cache_entry_cmp, 1);
+	if (!inst->cache) {
+		ERROR("rlm_sql (%s): Failed creating cache: %s", inst->config->xlat_name, fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+void sql_cache_free(rlm_sql_t *inst)
+{
+	fr_cache_free(inst->cache);
+	inst->cache = NULL;
+}
+
+/*
+ *	Look up the result of an expanded query.
+ *
+ *	On a hit, copies the cached pairs into "pair", or the cached
+ *	group list into "groups", and returns the number of rows.
+ *	Returns -1 on a miss.
+ */
+int sql_cache_find(rlm_sql_t *inst, REQUEST *request, char const *key,
+		   TALLOC_CTX *ctx, VALUE_PAIR **pair, rlm_sql_grouplist_t **groups)
+{
+	sql_cache_entry_t my_c;
+	sql_cache_copy_t out;
+	int rows;
+
+	my_c.key = key;
+	my_c.entry.hash = fr_hash_string(key);
+
+	out.ctx = ctx;
+	out.pair = pair;
+	out.groups = groups;
+
+	rows = fr_cache_find(inst->cache, &my_c, request->timestamp, 0, sql_cache_copy, &out);
+	if (rows >= 0) RDEBUG2("Using cached result (%d rows)", rows);
+
+	return rows;
+}
+
+/*
+ *	Add the result of an expanded query.  The pairs or groups are
+ *	copied, and remain owned by the caller.
+ */
+void sql_cache_add(rlm_sql_t *inst, REQUEST *request, char const *key, int rows,
+		   VALUE_PAIR *vps, rlm_sql_grouplist_t const *groups)
+{
+	sql_cache_entry_t *c;
+	VALUE_PAIR *vp;
+
+	c = talloc_zero(NULL, sql_cache_entry_t);
+	if (!c) return;
+
+	c->key = talloc_typed_strdup(c, key);
+	c->entry.hash = fr_hash_string(key);
+	c->entry.expires = request->timestamp + inst->config->cache_lifetime;
+	c->rows = rows;
+	c->vps = paircopy(c, vps);
+	c->groups = sql_cache_groups_copy(c, groups);
+
+	vp = pairfind(request->packet->vps, inst->sql_user->attr, inst->sql_user->vendor, TAG_ANY);
+	if (vp) c->user = talloc_typed_strdup(c, vp->vp_strvalue);
+
+	fr_cache_insert(inst->cache, c, request->timestamp);
+}
+
+/*
+ *	Remove the entries for one user, or all entries if "user" is
+ *	NULL.  Returns the number of entries removed.
+ */
+int sql_cache_flush(rlm_sql_t *inst, char const *user)
+{
+	void *ctx;
+
+	if (!inst->cache) return 0;
+
+	memcpy(&ctx, &user, sizeof(ctx)); /* const issues */
+
+	return fr_cache_flush(inst->cache, user ? sql_cache_match_user : NULL, ctx);
+}
@@ -835,5 +835,10 @@ rlm_sql_module_t rlm_sql_freetds = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_select_query,
-	sql_affected_rows
+	sql_affected_rows,
+	NULL, /* sql_prepare */
+	NULL, /* sql_bind */
+	NULL, /* sql_execute */
+	NULL, /* sql_query_pipeline */
+	NULL, /* sql_fetch_fields */
 };
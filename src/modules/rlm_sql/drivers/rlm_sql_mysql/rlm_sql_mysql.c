@@ -42,6 +42,13 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+/*
+ *	MySQL 8 removed my_bool.
+ */
+#if (MYSQL_VERSION_ID >= 80000) && !defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+
 static int mysql_instance_count = 0;
 
 typedef struct rlm_sql_mysql_conn {
@@ -49,6 +56,17 @@ typedef struct rlm_sql_mysql_conn {
 	MYSQL		*sock;
 	MYSQL_RES	*result;
 	rlm_sql_row_t	row;
+
+	MYSQL_STMT	**stmts;	//!< Prepared statements, by id.
+	int		num_stmts;
+	MYSQL_STMT	*stmt;		//!< Statement whose results are being read, if any.
+	MYSQL_BIND	*bind;		//!< Bound parameters, or result columns.
+	unsigned long	*lengths;
+	my_bool		*is_null;
+	int		num_fields;
+
+	rlm_sql_field_t	*fields;	//!< Columns of the current row, for sql_fetch_fields.
+	char		*buf;		//!< Column values of the current statement row.
 } rlm_sql_mysql_conn_t;
 
 typedef struct rlm_sql_mysql_config {
@@ -81,11 +99,18 @@ static const CONF_PARSER driver_config[] = {
 
 /* Prototypes */
 static sql_rcode_t sql_free_result(rlm_sql_handle_t*, rlm_sql_config_t*);
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_handle_t *handle);
 
 static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
+	int i;
+
 	DEBUG2("rlm_sql_mysql: Socket destructor called, closing socket");
 
+	for (i = 0; i < conn->num_stmts; i++) {
+		if (conn->stmts[i]) mysql_stmt_close(conn->stmts[i]);
+	}
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -323,6 +348,8 @@ static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *con
 	int num = 0;
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_field_count(conn->stmt);
+
 #if MYSQL_VERSION_ID >= 32224
 	if (!(num = mysql_field_count(conn->sock))) {
 #else
@@ -378,6 +405,8 @@ static int sql_num_rows(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *conf
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_num_rows(conn->stmt);
+
 	if (conn->result) {
 		return mysql_num_rows(conn->result);
 	}
@@ -401,6 +430,8 @@ static sql_rcode_t sql_fetch_row(rlm_sql_handle_t * handle, UNUSED rlm_sql_confi
 	sql_rcode_t rcode;
 	int ret;
 
+	if (conn->stmt) return sql_stmt_fetch_row(handle);
+
 	/*
 	 *  Check pointer before de-referencing it.
 	 */
@@ -452,6 +483,16 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t * handle, UNUSED rlm_sql_con
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		TALLOC_FREE(conn->bind);
+		TALLOC_FREE(conn->lengths);
+		TALLOC_FREE(conn->is_null);
+		TALLOC_FREE(conn->row);
+		handle->row = NULL;
+	}
+
 	if (conn->result) {
 		mysql_free_result(conn->result);
 		conn->result = NULL;
@@ -497,6 +538,11 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_co
 	sql_rcode_t rcode;
 	int ret;
 
+	/*
+	 *	Prepared statements only have one result.
+	 */
+	if (conn->stmt) return sql_free_result(handle, config);
+
 skip_next_result:
 	rcode = sql_store_result(handle, config);
 	if (rcode != RLM_SQL_OK) {
@@ -531,10 +577,13 @@ skip_next_result:
  *************************************************************************/
 static sql_rcode_t sql_finish_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config)
 {
+	rlm_sql_mysql_conn_t *conn = handle->conn;
 #if (MYSQL_VERSION_ID >= 40100)
 	int ret;
-	rlm_sql_mysql_conn_t *conn = handle->conn;
 #endif
+
+	if (conn->stmt) return sql_free_result(handle, config);
+
 	sql_free_result(handle, config);
 #if (MYSQL_VERSION_ID >= 40100)
 	ret = mysql_next_result(conn->sock);
@@ -563,9 +612,293 @@ static int sql_affected_rows(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_prepare
+ *
+ *	Purpose: Prepare a statement on the connection, if it hasn't
+ *	been prepared already.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	MYSQL_STMT *my_stmt;
+	sql_rcode_t rcode;
+
+	if (!conn->sock) {
+		ERROR("rlm_sql_mysql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if ((stmt->id < conn->num_stmts) && conn->stmts[stmt->id]) return RLM_SQL_OK;
+
+	if (stmt->id >= conn->num_stmts) {
+		conn->stmts = talloc_realloc(conn, conn->stmts, MYSQL_STMT *, stmt->id + 1);
+		memset(conn->stmts + conn->num_stmts, 0,
+		       sizeof(conn->stmts[0]) * (stmt->id + 1 - conn->num_stmts));
+		conn->num_stmts = stmt->id + 1;
+	}
+
+	my_stmt = mysql_stmt_init(conn->sock);
+	if (!my_stmt) {
+		ERROR("rlm_sql_mysql: Failed allocating statement");
+		return RLM_SQL_ERROR;
+	}
+
+	if (mysql_stmt_prepare(my_stmt, stmt->query, strlen(stmt->query)) != 0) {
+		rcode = sql_check_error(mysql_stmt_errno(my_stmt));
+		ERROR("rlm_sql_mysql: Failed preparing statement: %s", mysql_stmt_error(my_stmt));
+		mysql_stmt_close(my_stmt);
+
+		return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+	}
+
+	conn->stmts[stmt->id] = my_stmt;
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_bind
+ *
+ *	Purpose: Set the parameters for the next execution of a statement.
+ *	All parameters are sent as strings.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_bind(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			    rlm_sql_stmt_t const *stmt, char const **values)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	MYSQL_STMT *my_stmt = conn->stmts[stmt->id];
+	int i;
+
+	TALLOC_FREE(conn->bind);
+	if (stmt->num_params == 0) return RLM_SQL_OK;
+
+	MEM(conn->bind = talloc_zero_array(conn, MYSQL_BIND, stmt->num_params));
+	for (i = 0; i < stmt->num_params; i++) {
+		conn->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		memcpy(&conn->bind[i].buffer, &values[i], sizeof(conn->bind[i].buffer));
+		conn->bind[i].buffer_length = strlen(values[i]);
+	}
+
+	if (mysql_stmt_bind_param(my_stmt, conn->bind) != 0) {
+		ERROR("rlm_sql_mysql: Failed binding parameters: %s", mysql_stmt_error(my_stmt));
+		TALLOC_FREE(conn->bind);
+
+		return RLM_SQL_ERROR;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_execute
+ *
+ *	Purpose: Execute a prepared statement.  The results of a select
+ *	are stored on the client, and read one column at a time by
+ *	sql_fetch_row, so that no fixed size buffers are needed.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt, bool select)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	MYSQL_STMT *my_stmt = conn->stmts[stmt->id];
+	int i;
+
+	if (mysql_stmt_execute(my_stmt) != 0) goto error;
+
+	TALLOC_FREE(conn->bind);
+	conn->stmt = my_stmt;
+
+	if (!select) return RLM_SQL_OK;
+
+	if (mysql_stmt_store_result(my_stmt) != 0) goto error;
+
+	conn->num_fields = mysql_stmt_field_count(my_stmt);
+	if (conn->num_fields == 0) return RLM_SQL_OK;
+
+	MEM(conn->bind = talloc_zero_array(conn, MYSQL_BIND, conn->num_fields));
+	MEM(conn->lengths = talloc_zero_array(conn, unsigned long, conn->num_fields));
+	MEM(conn->is_null = talloc_zero_array(conn, my_bool, conn->num_fields));
+	for (i = 0; i < conn->num_fields; i++) {
+		conn->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		conn->bind[i].length = &conn->lengths[i];
+		conn->bind[i].is_null = &conn->is_null[i];
+	}
+
+	if (mysql_stmt_bind_result(my_stmt, conn->bind) != 0) goto error;
+
+	return RLM_SQL_OK;
+
+error:
+	ERROR("rlm_sql_mysql: Failed executing statement: %s", mysql_stmt_error(my_stmt));
+	conn->stmt = my_stmt;
+
+	return sql_check_error(mysql_stmt_errno(my_stmt));
+}
+
+/*
+ *	Make room for the columns of a row.
+ */
+static void sql_fields_alloc(rlm_sql_mysql_conn_t *conn, int num)
+{
+	if (conn->fields && (talloc_array_length(conn->fields) >= (size_t) num)) return;
+
+	talloc_free(conn->fields);
+	MEM(conn->fields = talloc_array(conn, rlm_sql_field_t, num));
+}
+
+/*
+ *	Fetch the next row of a statement.  All of its columns are
+ *	read into one buffer, which is re-used for every row.
+ */
+static sql_rcode_t sql_stmt_fetch_fields(rlm_sql_handle_t *handle, rlm_sql_field_t const **fields, int *num)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	MYSQL_BIND bind;
+	size_t total = 1, offset = 0;
+	int i, ret;
+
+	*fields = NULL;
+	*num = 0;
+
+	if (!conn->bind) return RLM_SQL_OK;
+
+	ret = mysql_stmt_fetch(conn->stmt);
+	if (ret == MYSQL_NO_DATA) return RLM_SQL_OK;
+	if ((ret != 0) && (ret != MYSQL_DATA_TRUNCATED)) {
+		ERROR("rlm_sql_mysql: Cannot fetch row");
+		ERROR("rlm_sql_mysql: MySQL error '%s'", mysql_stmt_error(conn->stmt));
+
+		return sql_check_error(mysql_stmt_errno(conn->stmt));
+	}
+
+	for (i = 0; i < conn->num_fields; i++) {
+		if (!conn->is_null[i]) total += conn->lengths[i];
+	}
+
+	if (!conn->buf || (talloc_array_length(conn->buf) < total)) {
+		talloc_free(conn->buf);
+		MEM(conn->buf = talloc_array(conn, char, total));
+	}
+	sql_fields_alloc(conn, conn->num_fields);
+
+	for (i = 0; i < conn->num_fields; i++) {
+		if (conn->is_null[i]) {
+			conn->fields[i].value = NULL;
+			conn->fields[i].length = 0;
+			continue;
+		}
+
+		conn->fields[i].value = conn->buf + offset;
+		conn->fields[i].length = conn->lengths[i];
+		if (conn->lengths[i] == 0) continue;
+
+		memset(&bind, 0, sizeof(bind));
+		bind.buffer_type = MYSQL_TYPE_STRING;
+		bind.buffer = conn->buf + offset;
+		bind.buffer_length = conn->lengths[i];
+
+		if (mysql_stmt_fetch_column(conn->stmt, &bind, i, 0) != 0) {
+			ERROR("rlm_sql_mysql: Cannot fetch column %i: %s", i, mysql_stmt_error(conn->stmt));
+
+			return RLM_SQL_ERROR;
+		}
+		offset += conn->lengths[i];
+	}
+
+	*fields = conn->fields;
+	*num = conn->num_fields;
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_stmt_fetch_row
+ *
+ *	Purpose: Fetch the next row of a prepared statement's results.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_stmt_fetch_row(rlm_sql_handle_t *handle)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	rlm_sql_field_t const *fields;
+	sql_rcode_t rcode;
+	int i, num;
+
+	TALLOC_FREE(conn->row);
+	handle->row = NULL;
+
+	rcode = sql_stmt_fetch_fields(handle, &fields, &num);
+	if ((rcode != RLM_SQL_OK) || !fields) return rcode;
+
+	MEM(conn->row = talloc_zero_array(conn, char *, num + 1));
+	for (i = 0; i < num; i++) {
+		if (!fields[i].value) continue;
+
+		MEM(conn->row[i] = talloc_strndup(conn->row, fields[i].value, fields[i].length));
+	}
+	handle->row = conn->row;
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_fetch_fields
+ *
+ *	Purpose: Point at the values of the next row, without copying
+ *	them.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_fetch_fields(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				    rlm_sql_field_t const **fields, int *num)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+	unsigned long *lengths;
+	sql_rcode_t rcode;
+	int i, records;
+
+	if (conn->stmt) return sql_stmt_fetch_fields(handle, fields, num);
+
+	*fields = NULL;
+	*num = 0;
+
+	/*
+	 *	The values of a row are already in the result set,
+	 *	only their lengths are needed.
+	 */
+	rcode = sql_fetch_row(handle, config);
+	if ((rcode != RLM_SQL_OK) || !handle->row) return rcode;
+
+	records = mysql_num_fields(conn->result);
+	lengths = mysql_fetch_lengths(conn->result);
+	if (!lengths) return RLM_SQL_ERROR;
+
+	sql_fields_alloc(conn, records);
+	for (i = 0; i < records; i++) {
+		conn->fields[i].value = handle->row[i];
+		conn->fields[i].length = handle->row[i] ? lengths[i] : 0;
+	}
+
+	*fields = conn->fields;
+	*num = records;
+
+	return RLM_SQL_OK;
+}
+
 
 /* Exported to rlm_sql */
 rlm_sql_module_t rlm_sql_mysql = {
@@ -582,5 +915,10 @@ rlm_sql_module_t rlm_sql_mysql = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_select_query,
-	sql_affected_rows
+	sql_affected_rows,
+	sql_prepare,
+	sql_bind,
+	sql_execute,
+	NULL, /* sql_query_pipeline */
+	sql_fetch_fields
 };
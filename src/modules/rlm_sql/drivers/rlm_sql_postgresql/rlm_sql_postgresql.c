@@ -57,8 +57,24 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	rlm_sql_field_t	*fields;	//!< Columns of the current row, for sql_fetch_fields.
+
+	bool		*prepared;	//!< Statements prepared on this connection, by id.
+	int		num_prepared;
+	char const	**values;	//!< Bound parameters of the next statement.
 } rlm_sql_postgres_conn_t;
 
+typedef struct rlm_sql_postgres_config {
+	int		pipeline_depth;	//!< Most queries sent before reading their results.
+} rlm_sql_postgres_config_t;
+
+static const CONF_PARSER driver_config[] = {
+	{"pipeline_depth", PW_TYPE_INTEGER,
+	 offsetof(rlm_sql_postgres_config_t, pipeline_depth), NULL, "64"},
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
 
 /** Return the number of affected rows of the result as an int instead of the string that postgresql provides
  *
@@ -144,6 +160,20 @@ static sql_rcode_t sql_classify_error(UNUSED PGresult const *result)
 }
 #endif
 
+static int mod_instantiate(CONF_SECTION *conf, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_config_t *driver;
+
+	MEM(driver = config->driver = talloc_zero(config, rlm_sql_postgres_config_t));
+	if (cf_section_parse(conf, driver, driver_config) < 0) {
+		return -1;
+	}
+
+	if (driver->pipeline_depth < 1) driver->pipeline_depth = 1;
+
+	return 0;
+}
+
 static int _sql_socket_destructor(rlm_sql_postgres_conn_t *conn)
 {
 	DEBUG2("rlm_sql_postgresql: Socket destructor called, closing socket");
@@ -222,11 +252,11 @@ static int sql_init_socket(rlm_sql_handle_t *handle, rlm_sql_config_t *config) {
  *	Purpose: Issue a query to the database
  *
  *************************************************************************/
+static sql_rcode_t sql_check_result(rlm_sql_postgres_conn_t *conn);
+
 static sql_rcode_t sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config, char const *query)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
-	ExecStatusType status;
-	int numfields = 0;
 
 	if (!conn->db) {
 		ERROR("rlm_sql_postgresql: Socket not connected");
@@ -243,6 +273,17 @@ static sql_rcode_t sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t
 	 */
 	conn->result = PQexec(conn->db, query);
 
+	return sql_check_result(conn);
+}
+
+/** Check the result of a query, or of a prepared statement
+ *
+ */
+static sql_rcode_t sql_check_result(rlm_sql_postgres_conn_t *conn)
+{
+	ExecStatusType status;
+	int numfields = 0;
+
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -307,6 +348,15 @@ static sql_rcode_t sql_query(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t
 	case PGRES_NONFATAL_ERROR:
 	case PGRES_FATAL_ERROR:
 		return sql_classify_error(conn->result);
+
+#ifdef HAVE_PQENTERPIPELINEMODE
+	/*
+	 *  An earlier query in the pipeline failed, so this one wasn't run.
+	 */
+	case PGRES_PIPELINE_ABORTED:
+	case PGRES_PIPELINE_SYNC:
+		return RLM_SQL_ERROR;
+#endif
 	}
 
 	return RLM_SQL_ERROR;
@@ -365,6 +415,51 @@ static sql_rcode_t sql_fetch_row(rlm_sql_handle_t * handle, UNUSED rlm_sql_confi
 	return 0;
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_fetch_fields
+ *
+ *	Purpose: Point at the values of the next row in the result,
+ *	without copying them.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_fetch_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				    rlm_sql_field_t const **fields, int *num)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	int i, records;
+
+	*fields = NULL;
+	*num = 0;
+
+	if (!conn->result || (conn->cur_row >= PQntuples(conn->result))) return RLM_SQL_OK;
+
+	records = PQnfields(conn->result);
+	if (records == 0) return RLM_SQL_OK;
+
+	if (!conn->fields || (talloc_array_length(conn->fields) < (size_t) records)) {
+		talloc_free(conn->fields);
+		MEM(conn->fields = talloc_array(conn, rlm_sql_field_t, records));
+	}
+
+	for (i = 0; i < records; i++) {
+		if (PQgetisnull(conn->result, conn->cur_row, i)) {
+			conn->fields[i].value = NULL;
+			conn->fields[i].length = 0;
+			continue;
+		}
+
+		conn->fields[i].value = PQgetvalue(conn->result, conn->cur_row, i);
+		conn->fields[i].length = PQgetlength(conn->result, conn->cur_row, i);
+	}
+	conn->cur_row++;
+
+	*fields = conn->fields;
+	*num = records;
+
+	return RLM_SQL_OK;
+}
+
 /*************************************************************************
  *
  *      Function: sql_num_fields
@@ -463,10 +558,195 @@ static int sql_affected_rows(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t
 	return conn->affected_rows;
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_prepare
+ *
+ *	Purpose: Prepare a statement on the connection, if it hasn't
+ *	been prepared already.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char name[32];
+	sql_rcode_t rcode;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if ((stmt->id < conn->num_prepared) && conn->prepared[stmt->id]) return RLM_SQL_OK;
+
+	if (stmt->id >= conn->num_prepared) {
+		conn->prepared = talloc_realloc(conn, conn->prepared, bool, stmt->id + 1);
+		memset(conn->prepared + conn->num_prepared, 0,
+		       sizeof(conn->prepared[0]) * (stmt->id + 1 - conn->num_prepared));
+		conn->num_prepared = stmt->id + 1;
+	}
+
+	snprintf(name, sizeof(name), "fr_stmt_%d", stmt->id);
+
+	/*
+	 *  The parameter types are left for the server to infer.
+	 */
+	conn->result = PQprepare(conn->db, name, stmt->query_numbered, stmt->num_params, NULL);
+	if (!conn->result) {
+		ERROR("rlm_sql_postgresql: Failed preparing statement: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_check_result(conn);
+	PQclear(conn->result);
+	conn->result = NULL;
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	DEBUG2("rlm_sql_postgresql: Prepared statement %s", name);
+	conn->prepared[stmt->id] = true;
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_bind
+ *
+ *	Purpose: Set the parameters for the next execution of a statement
+ *
+ *************************************************************************/
+static sql_rcode_t sql_bind(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			    UNUSED rlm_sql_stmt_t const *stmt, char const **values)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	conn->values = values;
+
+	return RLM_SQL_OK;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_execute
+ *
+ *	Purpose: Execute a prepared statement, with the bound parameters
+ *
+ *************************************************************************/
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt, UNUSED bool select)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char name[32];
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "fr_stmt_%d", stmt->id);
+
+	/*
+	 *  All parameters are sent as text.
+	 */
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params, conn->values, NULL, NULL, 0);
+	conn->values = NULL;
+	if (!conn->result) {
+		ERROR("rlm_sql_postgresql: Failed getting query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_check_result(conn);
+}
+
+#ifdef HAVE_PQENTERPIPELINEMODE
+/*************************************************************************
+ *
+ *	Function: sql_query_pipeline
+ *
+ *	Purpose: Send queries without waiting for each result.  Up to
+ *	pipeline_depth queries are sent, then their results are read.
+ *	Each group of queries ends with a sync, so an error only stops
+ *	the rest of its group, and no more groups are sent after one.
+ *
+ *************************************************************************/
+static sql_rcode_t sql_query_pipeline(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				      char const **queries, int num, sql_rcode_t *rcodes, int *affected)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	rlm_sql_postgres_config_t *driver = config->driver;
+	PGresult *result;
+	bool failed = false;
+	int i, j, end;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	for (i = 0; i < num; i++) {
+		rcodes[i] = RLM_SQL_ERROR;
+		affected[i] = 0;
+	}
+
+	if (PQenterPipelineMode(conn->db) != 1) {
+		ERROR("rlm_sql_postgresql: Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_ERROR;
+	}
+
+	for (i = 0; (i < num) && !failed; i = end) {
+		end = i + driver->pipeline_depth;
+		if (end > num) end = num;
+
+		for (j = i; j < end; j++) {
+			if (PQsendQueryParams(conn->db, queries[j], 0, NULL, NULL, NULL, NULL, 0) != 1) goto error;
+		}
+		if (PQpipelineSync(conn->db) != 1) goto error;
+
+		DEBUG2("rlm_sql_postgresql: Sent %d queries", end - i);
+
+		for (j = i; j < end; j++) {
+			conn->result = PQgetResult(conn->db);
+			if (!conn->result) goto error;
+
+			rcodes[j] = sql_check_result(conn);
+			if (rcodes[j] == RLM_SQL_OK) {
+				affected[j] = conn->affected_rows;
+			} else {
+				failed = true;
+			}
+			PQclear(conn->result);
+			conn->result = NULL;
+
+			/*
+			 *  The results of each query end with a NULL.
+			 */
+			while ((result = PQgetResult(conn->db)) != NULL) PQclear(result);
+		}
+
+		result = PQgetResult(conn->db);
+		if (!result || (PQresultStatus(result) != PGRES_PIPELINE_SYNC)) {
+			if (result) PQclear(result);
+			goto error;
+		}
+		PQclear(result);
+	}
+
+	if (PQexitPipelineMode(conn->db) != 1) goto error;
+
+	return RLM_SQL_OK;
+
+error:
+	ERROR("rlm_sql_postgresql: Pipeline failed: %s", PQerrorMessage(conn->db));
+
+	return RLM_SQL_RECONNECT;
+}
+#endif
+
 /* Exported to rlm_sql */
 rlm_sql_module_t rlm_sql_postgresql = {
 	"rlm_sql_postgresql",
-	NULL,
+	mod_instantiate,
 	sql_init_socket,
 	sql_query,
 	sql_select_query,
@@ -479,4 +759,13 @@ rlm_sql_module_t rlm_sql_postgresql = {
 	sql_finish_query,
 	sql_finish_select_query,
 	sql_affected_rows,
+	sql_prepare,
+	sql_bind,
+	sql_execute,
+#ifdef HAVE_PQENTERPIPELINEMODE
+	sql_query_pipeline,
+#else
+	NULL, /* sql_query_pipeline */
+#endif
+	sql_fetch_fields
 };
@@ -47,6 +47,10 @@ typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+
+	sqlite3_stmt **stmts;		//!< Prepared statements, by id.
+	int num_stmts;
+	bool prepared;			//!< statement is one of stmts, and is reused.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct rlm_sql_sqlite_config {
@@ -331,9 +335,14 @@ static int mod_instantiate(CONF_SECTION *conf, rlm_sql_config_t *config)
 static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 {
 	int status = 0;
+	int i;
 
 	DEBUG2("rlm_sql_sqlite: Socket destructor called, closing socket");
 
+	for (i = 0; i < conn->num_stmts; i++) {
+		if (conn->stmts[i]) (void) sqlite3_finalize(conn->stmts[i]);
+	}
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) {
@@ -574,7 +583,16 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle,
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Prepared statements are kept for the next use.
+		 */
+		if (conn->prepared) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->prepared = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -619,6 +637,69 @@ static int sql_affected_rows(rlm_sql_handle_t *handle,
 	return -1;
 }
 
+static sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt)
+{
+	int status;
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+	char const *z_tail;
+
+	if ((stmt->id < conn->num_stmts) && conn->stmts[stmt->id]) return RLM_SQL_OK;
+
+	if (stmt->id >= conn->num_stmts) {
+		conn->stmts = talloc_realloc(conn, conn->stmts, sqlite3_stmt *, stmt->id + 1);
+		memset(conn->stmts + conn->num_stmts, 0,
+		       sizeof(conn->stmts[0]) * (stmt->id + 1 - conn->num_stmts));
+		conn->num_stmts = stmt->id + 1;
+	}
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &conn->stmts[stmt->id], &z_tail);
+#else
+	status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &conn->stmts[stmt->id], &z_tail);
+#endif
+	if (status != SQLITE_OK) {
+		conn->stmts[stmt->id] = NULL;
+		return sql_check_error(conn->db);
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_bind(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			    rlm_sql_stmt_t const *stmt, char const **values)
+{
+	int i;
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	for (i = 0; i < stmt->num_params; i++) {
+		if (sqlite3_bind_text(conn->stmts[stmt->id], i + 1, values[i], -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+			(void) sqlite3_clear_bindings(conn->stmts[stmt->id]);
+			return sql_check_error(conn->db);
+		}
+	}
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+			       rlm_sql_stmt_t const *stmt, bool select)
+{
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	conn->statement = conn->stmts[stmt->id];
+	conn->prepared = true;
+	conn->col_count = 0;
+
+	/*
+	 *	Rows are stepped through by sql_fetch_row.
+	 */
+	if (select) return RLM_SQL_OK;
+
+	(void) sqlite3_step(conn->statement);
+
+	return sql_check_error(conn->db);
+}
 
 /* Exported to rlm_sql */
 rlm_sql_module_t rlm_sql_sqlite = {
@@ -635,5 +716,10 @@ rlm_sql_module_t rlm_sql_sqlite = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_query,
-	sql_affected_rows
+	sql_affected_rows,
+	sql_prepare,
+	sql_bind,
+	sql_execute,
+	NULL, /* sql_query_pipeline */
+	NULL, /* sql_fetch_fields */
 };
@@ -0,0 +1,294 @@
+/*
+ * replica.c	rlm_sql - Send authorization queries to read replicas.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/*
+ *	Each "replica" section describes another server with a copy
+ *	of the database.  It gets its own connection pool, and its
+ *	connections are opened with the instance configuration, with
+ *	the server, port, login, password and database of the replica.
+ *
+ *	Authorization queries pick a replica at random, weighted by
+ *	the inverse of its average query time, so faster replicas do
+ *	more of the work.  If the replica picked has no free
+ *	connections, the others are tried in turn.  A replica which
+ *	can't be connected to isn't used for "retry_delay" seconds.
+ *	If no replica can be used, the queries go to the primary,
+ *	unless "replica_fallback" is disabled.
+ *
+ *	Everything else, including all writes, uses the primary.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_sql.h"
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+static const CONF_PARSER replica_config[] = {
+	{"server", PW_TYPE_STRING_PTR,
+	 offsetof(sql_replica_t, server), NULL, NULL},
+	{"port", PW_TYPE_STRING_PTR,
+	 offsetof(sql_replica_t, port), NULL, NULL},
+	{"login", PW_TYPE_STRING_PTR,
+	 offsetof(sql_replica_t, login), NULL, NULL},
+	{"password", PW_TYPE_STRING_PTR | PW_TYPE_SECRET,
+	 offsetof(sql_replica_t, password), NULL, NULL},
+	{"radius_db", PW_TYPE_STRING_PTR,
+	 offsetof(sql_replica_t, db), NULL, NULL},
+	{"retry_delay", PW_TYPE_INTEGER,
+	 offsetof(sql_replica_t, retry_delay), NULL, "10"},
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
+static void *mod_replica_conn_create(void *ctx)
+{
+	sql_replica_t *replica = ctx;
+	void *handle;
+
+	handle = sql_conn_create(replica->inst, replica, &replica->config);
+	if (!handle) sql_replica_down(replica->inst, replica);
+
+	return handle;
+}
+
+static int mod_replica_conn_delete(UNUSED void *ctx, void *handle)
+{
+	return talloc_free(handle);
+}
+
+/*
+ *	Faster replicas get proportionally more queries.  A replica
+ *	with no measurements yet gets the most, until it has some.
+ */
+static uint32_t sql_replica_weight(sql_replica_t const *replica)
+{
+	return 1000000000 / (replica->latency + 1000);
+}
+
+static sql_replica_t *sql_replica_pick(rlm_sql_t *inst)
+{
+	sql_replica_t *replica = NULL;
+	time_t now = time(NULL);
+	uint64_t total = 0, pick;
+	int i;
+
+	PTHREAD_MUTEX_LOCK(&inst->replica_mutex);
+	for (i = 0; i < inst->num_replicas; i++) {
+		if (inst->replicas[i]->down_until > now) continue;
+
+		total += sql_replica_weight(inst->replicas[i]);
+	}
+
+	if (total > 0) {
+		pick = fr_rand() % total;
+
+		for (i = 0; i < inst->num_replicas; i++) {
+			if (inst->replicas[i]->down_until > now) continue;
+
+			if (pick < sql_replica_weight(inst->replicas[i])) {
+				replica = inst->replicas[i];
+				break;
+			}
+			pick -= sql_replica_weight(inst->replicas[i]);
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->replica_mutex);
+
+	return replica;
+}
+
+static bool sql_replica_up(rlm_sql_t *inst, sql_replica_t const *replica)
+{
+	bool up;
+
+	PTHREAD_MUTEX_LOCK(&inst->replica_mutex);
+	up = (replica->down_until <= time(NULL));
+	PTHREAD_MUTEX_UNLOCK(&inst->replica_mutex);
+
+	return up;
+}
+
+int sql_replica_init(rlm_sql_t *inst)
+{
+	CONF_SECTION *cs;
+	sql_replica_t *replica;
+	char *prefix;
+	int num = 0;
+
+	for (cs = cf_subsection_find_next(inst->cs, NULL, "replica");
+	     cs;
+	     cs = cf_subsection_find_next(inst->cs, cs, "replica")) {
+		num++;
+	}
+	if (!num) return 0;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->replica_mutex, NULL) < 0) {
+		ERROR("rlm_sql (%s): Failed initializing mutex: %s",
+		      inst->config->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	inst->replicas = talloc_zero_array(inst, sql_replica_t *, num);
+	if (!inst->replicas) return -1;
+
+	for (cs = cf_subsection_find_next(inst->cs, NULL, "replica");
+	     cs;
+	     cs = cf_subsection_find_next(inst->cs, cs, "replica")) {
+		replica = talloc_zero(inst->replicas, sql_replica_t);
+		if (!replica) return -1;
+
+		replica->inst = inst;
+		replica->cs = cs;
+		replica->name = cf_section_name2(cs);
+		if (!replica->name) {
+			cf_log_err_cs(cs, "A replica section must have a name");
+			return -1;
+		}
+
+		if (cf_section_parse(cs, replica, replica_config) < 0) return -1;
+
+		/*
+		 *	Anything the replica doesn't set is the same as
+		 *	for the primary.
+		 */
+		memcpy(&replica->config, inst->config, sizeof(replica->config));
+		if (replica->server) replica->config.sql_server = replica->server;
+		if (replica->port) replica->config.sql_port = replica->port;
+		if (replica->login) replica->config.sql_login = replica->login;
+		if (replica->password) replica->config.sql_password = replica->password;
+		if (replica->db) replica->config.sql_db = replica->db;
+
+		INFO("rlm_sql (%s): Attempting to connect to replica %s \"%s\"",
+		     inst->config->xlat_name, replica->name, replica->config.sql_server);
+
+		prefix = talloc_typed_asprintf(replica, "rlm_sql (%s) replica %s",
+					       inst->config->xlat_name, replica->name);
+		replica->pool = fr_connection_pool_init(cs, replica, mod_replica_conn_create,
+							NULL, mod_replica_conn_delete, prefix);
+		talloc_free(prefix);
+		if (!replica->pool) return -1;
+
+		inst->replicas[inst->num_replicas++] = replica;
+	}
+
+	return 0;
+}
+
+void sql_replica_free(rlm_sql_t *inst)
+{
+	int i;
+
+	if (!inst->replicas) return;
+
+	for (i = 0; i < inst->num_replicas; i++) {
+		fr_connection_pool_delete(inst->replicas[i]->pool);
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->replica_mutex);
+#endif
+	talloc_free(inst->replicas);
+	inst->replicas = NULL;
+	inst->num_replicas = 0;
+}
+
+/*
+ *	Get a handle for authorization queries, from a replica if
+ *	there's one which can be used.
+ */
+rlm_sql_handle_t *sql_get_read_socket(rlm_sql_t *inst)
+{
+	sql_replica_t *replica;
+	rlm_sql_handle_t *handle;
+	int i;
+
+	if (!inst->num_replicas) return sql_get_socket(inst);
+
+	replica = sql_replica_pick(inst);
+	if (replica) {
+		handle = fr_connection_get(replica->pool);
+		if (handle) return handle;
+
+		/*
+		 *	Its pool is busy, or it couldn't be connected
+		 *	to, in which case mod_replica_conn_create()
+		 *	has marked it down.  Either way, try the
+		 *	others.  A busy pool says nothing about the
+		 *	replica's health, so it's left alone.
+		 */
+		for (i = 0; i < inst->num_replicas; i++) {
+			if (inst->replicas[i] == replica) continue;
+			if (!sql_replica_up(inst, inst->replicas[i])) continue;
+
+			handle = fr_connection_get(inst->replicas[i]->pool);
+			if (handle) return handle;
+		}
+	}
+
+	if (!inst->config->replica_fallback) {
+		ERROR("rlm_sql (%s): No replicas available", inst->config->xlat_name);
+		return NULL;
+	}
+
+	DEBUG("rlm_sql (%s): No replicas available, using the primary", inst->config->xlat_name);
+
+	return sql_get_socket(inst);
+}
+
+void sql_replica_down(rlm_sql_t *inst, sql_replica_t *replica)
+{
+	PTHREAD_MUTEX_LOCK(&inst->replica_mutex);
+	replica->down_until = time(NULL) + replica->retry_delay;
+
+	/*
+	 *	It may be faster, or slower, when it comes back.
+	 */
+	replica->latency = 0;
+	PTHREAD_MUTEX_UNLOCK(&inst->replica_mutex);
+
+	WARN("rlm_sql (%s): Replica %s is unavailable, not using it for %d seconds",
+	     inst->config->xlat_name, replica->name, replica->retry_delay);
+}
+
+/*
+ *	Moving average, with each query counting for 1/8th.
+ */
+void sql_replica_latency(rlm_sql_t *inst, sql_replica_t *replica, uint32_t usec)
+{
+	PTHREAD_MUTEX_LOCK(&inst->replica_mutex);
+	if (!replica->latency) {
+		replica->latency = usec;
+	} else {
+		replica->latency = replica->latency - (replica->latency / 8) + (usec / 8);
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->replica_mutex);
+}
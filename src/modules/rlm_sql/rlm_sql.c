@@ -36,11 +36,48 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+static const CONF_PARSER write_behind_config[] = {
+	{"enable", PW_TYPE_BOOLEAN,
+	 offsetof(sql_acct_section_t, wb_enable), NULL, "no"},
+	{"journal", PW_TYPE_FILE_OUTPUT,
+	 offsetof(sql_acct_section_t, wb_journal), NULL, NULL},
+	{"max_rows", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, wb_max_rows), NULL, "100"},
+	{"interval", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, wb_interval), NULL, "100"},
+	{"max_queue", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, wb_max_queue), NULL, "10000"},
+	{"max_wait", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, wb_max_wait), NULL, "100"},
+	{"retry_interval", PW_TYPE_INTEGER,
+	 offsetof(sql_acct_section_t, wb_retry_interval), NULL, "5"},
+	{"begin", PW_TYPE_STRING_PTR,
+	 offsetof(sql_acct_section_t, wb_begin), NULL, "BEGIN"},
+	{"commit", PW_TYPE_STRING_PTR,
+	 offsetof(sql_acct_section_t, wb_commit), NULL, "COMMIT"},
+	{"rollback", PW_TYPE_STRING_PTR,
+	 offsetof(sql_acct_section_t, wb_rollback), NULL, "ROLLBACK"},
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
 static const CONF_PARSER acct_section_config[] = {
 	{"reference", PW_TYPE_STRING_PTR,
 	  offsetof(sql_acct_section_t, reference), NULL, ".query"},
 	{"logfile", PW_TYPE_STRING_PTR,
 	 offsetof(sql_acct_section_t, logfile), NULL, NULL},
+	{"write_behind", PW_TYPE_SUBSECTION, 0, NULL, (void const *) write_behind_config},
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
+static const CONF_PARSER cache_config[] = {
+	{"enable", PW_TYPE_BOOLEAN,
+	 offsetof(rlm_sql_config_t, cache_enable), NULL, "no"},
+	{"lifetime", PW_TYPE_INTEGER,
+	 offsetof(rlm_sql_config_t, cache_lifetime), NULL, "300"},
+	{"max_entries", PW_TYPE_INTEGER,
+	 offsetof(rlm_sql_config_t, cache_max_entries), NULL, "65536"},
 
 	{NULL, -1, 0, NULL, NULL}
 };
@@ -107,6 +144,17 @@ static const CONF_PARSER module_config[] = {
 	{"query_timeout", PW_TYPE_INTEGER,
 	 offsetof(rlm_sql_config_t,query_timeout), NULL, NULL},
 
+	/*
+	 *	So does this.
+	 */
+	{"prepared_statements", PW_TYPE_BOOLEAN,
+	 offsetof(rlm_sql_config_t,prepared_statements), NULL, "no"},
+
+	{"replica_fallback", PW_TYPE_BOOLEAN,
+	 offsetof(rlm_sql_config_t,replica_fallback), NULL, "yes"},
+
+	{"cache", PW_TYPE_SUBSECTION, 0, NULL, (void const *) cache_config},
+
 	{NULL, -1, 0, NULL, NULL}
 };
 
@@ -127,6 +175,32 @@ static int fallthrough(VALUE_PAIR *vp)
 static int generate_sql_clients(rlm_sql_t *inst);
 static size_t sql_escape_func(REQUEST *, char *out, size_t outlen, char const *in, void *arg);
 
+/*
+ *	Remove cached authorization results
+ *
+ *  %{sql-cache-flush:<user>} removes the entries read for one
+ *  SQL-User-Name, and %{sql-cache-flush:*} removes everything.
+ *  Returns the number of entries removed.
+ */
+static ssize_t sql_cache_flush_xlat(void *instance, REQUEST *request, char const *fmt, char *out, size_t freespace)
+{
+	rlm_sql_t *inst = instance;
+	int removed;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (!*fmt) {
+		REDEBUG("No user name given");
+		*out = '\0';
+		return -1;
+	}
+
+	removed = sql_cache_flush(inst, (strcmp(fmt, "*") == 0) ? NULL : fmt);
+	RDEBUG2("Removed %d cached results", removed);
+
+	return snprintf(out, freespace, "%d", removed);
+}
+
 /*
  *			SQL xlat function
  *
@@ -448,13 +522,13 @@ int sql_set_user(rlm_sql_t *inst, REQUEST *request, char const *username)
 }
 
 
-static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle, REQUEST *request,
+static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t **handle, REQUEST *request,
 			     rlm_sql_grouplist_t **phead)
 {
-	char    *expanded = NULL;
 	int     num_groups = 0;
 	rlm_sql_row_t row;
 	rlm_sql_grouplist_t *entry;
+	char *key = NULL;
 	int ret;
 
 	/* NOTE: sql_set_user should have been run before calling this function */
@@ -465,29 +539,53 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle, REQUEST
 		return 0;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->groupmemb_query, sql_escape_func, inst) < 0) {
-		return -1;
+	if (inst->cache) {
+		if (radius_axlat(&key, request, inst->config->groupmemb_query, sql_escape_func, inst) < 0) {
+			REDEBUG("Error generating query");
+			return -1;
+		}
+
+		num_groups = sql_cache_find(inst, request, key, request, NULL, phead);
+		if (num_groups >= 0) {
+			talloc_free(key);
+			return num_groups;
+		}
+		num_groups = 0;
+
+		if (!*handle) {
+			*handle = sql_get_read_socket(inst);
+			if (!*handle) {
+				talloc_free(key);
+				return -1;
+			}
+		}
 	}
 
-	ret = rlm_sql_select_query(&handle, inst, expanded);
-	talloc_free(expanded);
+	if (key && !sql_stmt_find(inst, inst->config->groupmemb_query)) {
+		ret = rlm_sql_select_query(handle, inst, key);
+	} else {
+		ret = rlm_sql_select_fmt(handle, inst, request, inst->config->groupmemb_query);
+	}
 	if (ret < 0) {
+		talloc_free(key);
 		return -1;
 	}
 
-	while (rlm_sql_fetch_row(&handle, inst) == 0) {
-		row = handle->row;
+	while (rlm_sql_fetch_row(handle, inst) == 0) {
+		row = (*handle)->row;
 		if (!row)
 			break;
 		if (!row[0]){
 			RDEBUG("row[0] returned NULL");
-			(inst->module->sql_finish_select_query)(handle, inst->config);
-			talloc_free(entry);
+			(inst->module->sql_finish_select_query)(*handle, inst->config);
+			talloc_free(*phead);
+			*phead = NULL;
+			talloc_free(key);
 			return -1;
 		}
 
 		if (!*phead) {
-			*phead = talloc_zero(handle, rlm_sql_grouplist_t);
+			*phead = talloc_zero(request, rlm_sql_grouplist_t);
 			entry = *phead;
 		} else {
 			entry->next = talloc_zero(*phead, rlm_sql_grouplist_t);
@@ -499,7 +597,12 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle, REQUEST
 		num_groups++;
 	}
 
-	(inst->module->sql_finish_select_query)(handle, inst->config);
+	(inst->module->sql_finish_select_query)(*handle, inst->config);
+
+	if (key) {
+		sql_cache_add(inst, request, key, num_groups, NULL, *phead);
+		talloc_free(key);
+	}
 
 	return num_groups;
 }
@@ -515,7 +618,7 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t *handle, REQUEST
 static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *request_vp, VALUE_PAIR *check,
 			UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
 {
-	rlm_sql_handle_t *handle;
+	rlm_sql_handle_t *handle = NULL;
 	rlm_sql_t *inst = instance;
 	rlm_sql_grouplist_t *head, *entry;
 
@@ -535,17 +638,20 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 		return 1;
 
 	/*
-	 *	Get a socket for this lookup
+	 *	Get a socket for this lookup.  With the cache, one is
+	 *	only needed if the query has to be run.
 	 */
-	handle = sql_get_socket(inst);
-	if (!handle) {
-		return 1;
+	if (!inst->cache) {
+		handle = sql_get_read_socket(inst);
+		if (!handle) {
+			return 1;
+		}
 	}
 
 	/*
 	 *	Get the list of groups this user is a member of
 	 */
-	if (sql_get_grouplist(inst, handle, request, &head) < 0) {
+	if (sql_get_grouplist(inst, &handle, request, &head) < 0) {
 		REDEBUG("Error getting group membership");
 		sql_release_socket(inst, handle);
 		return 1;
@@ -571,14 +677,13 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	return 1;
 }
 
-static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t *handle,
+static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
 					  bool *dofallthrough)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
-	char			*expanded = NULL;
 	int			rows;
 
 	rad_assert(request != NULL);
@@ -614,18 +719,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 		}
 
 		if (inst->config->authorize_group_check_query && (inst->config->authorize_group_check_query != '\0')) {
-			/*
-			 *	Expand the group query
-			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_check_query,
-					 sql_escape_func, inst) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(inst, &handle, request, &check_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(inst, request, handle, request, &check_tmp,
+					     inst->config->authorize_group_check_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -654,15 +749,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_reply_query,
-					 sql_escape_func, inst) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(inst, &handle, request->reply, &reply_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(inst, request, handle, request->reply, &reply_tmp,
+					     inst->config->authorize_group_reply_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -695,9 +783,21 @@ static int mod_detach(void *instance)
 	rlm_sql_t *inst = instance;
 
 	if (inst->config) {
+		/*
+		 *	The queues are written before the pool goes.
+		 */
+		if (inst->config->accounting) sql_wb_free(inst->config->accounting);
+		if (inst->config->postauth) sql_wb_free(inst->config->postauth);
+
 		if (inst->pool) sql_poolfree(inst);
+		sql_replica_free(inst);
 	}
 
+	sql_stmt_free(inst);
+
+	if (inst->cache_xlat_name) xlat_unregister(inst->cache_xlat_name, sql_cache_flush_xlat, instance);
+	sql_cache_free(inst);
+
 	if (inst->handle) {
 #if 0
 		/*
@@ -826,6 +926,21 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	xlat_register(inst->config->xlat_name, sql_xlat, sql_escape_func, inst);
 
+	if (inst->config->cache_enable) {
+		if (inst->config->cache_lifetime == 0) {
+			ERROR("rlm_sql (%s): Cache \"lifetime\" must be greater than 0", inst->config->xlat_name);
+			return -1;
+		}
+		if (inst->config->cache_max_entries == 0) {
+			ERROR("rlm_sql (%s): Cache \"max_entries\" must be greater than 0", inst->config->xlat_name);
+			return -1;
+		}
+		if (sql_cache_init(inst) < 0) return -1;
+
+		inst->cache_xlat_name = talloc_typed_asprintf(inst, "%s-cache-flush", inst->config->xlat_name);
+		xlat_register(inst->cache_xlat_name, sql_cache_flush_xlat, NULL, inst);
+	}
+
 	/*
 	 *	Sanity check for crazy people.
 	 */
@@ -900,8 +1015,26 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	INFO("rlm_sql (%s): Attempting to connect to database \"%s\"",
 	       inst->config->xlat_name, inst->config->sql_db);
 
+	if (inst->config->prepared_statements) {
+		if (!inst->module->sql_prepare) {
+			WARN("rlm_sql (%s): Driver %s does not support prepared statements, ignoring "
+			     "\"prepared_statements\"", inst->config->xlat_name, inst->config->sql_driver_name);
+		} else if (sql_stmt_init(inst) < 0) {
+			ERROR("rlm_sql (%s): Failed initializing statement cache", inst->config->xlat_name);
+			return -1;
+		}
+	}
+
 	if (sql_socket_pool_init(inst) < 0) return -1;
 
+	if (sql_replica_init(inst) < 0) return -1;
+
+	if (inst->config->accounting && inst->config->accounting->wb_enable &&
+	    (sql_wb_init(inst, inst->config->accounting) < 0)) return -1;
+
+	if (inst->config->postauth && inst->config->postauth->wb_enable &&
+	    (sql_wb_init(inst, inst->config->postauth) < 0)) return -1;
+
 	if (inst->config->groupmemb_query &&
 	    inst->config->groupmemb_query[0]) {
 		paircompare_register(dict_attrbyvalue(PW_SQL_GROUP, 0),
@@ -924,7 +1057,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
 
 	rlm_sql_t *inst = instance;
-	rlm_sql_handle_t  *handle;
+	rlm_sql_handle_t  *handle = NULL;
 
 	VALUE_PAIR *check_tmp = NULL;
 	VALUE_PAIR *reply_tmp = NULL;
@@ -934,8 +1067,6 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	bool	dofallthrough = true;
 	int	rows;
 
-	char	*expanded = NULL;
-
 	rad_assert(request != NULL);
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
@@ -952,26 +1083,24 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 	 *
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
+	 *
+	 *	With the cache, a socket is only reserved by the first
+	 *	query which isn't cached.
 	 */
-	handle = sql_get_socket(inst);
-	if (!handle) {
-		rcode = RLM_MODULE_FAIL;
-		goto error;
+	if (!inst->cache) {
+		handle = sql_get_read_socket(inst);
+		if (!handle) {
+			rcode = RLM_MODULE_FAIL;
+			goto error;
+		}
 	}
 
 	/*
 	 *	Query the check table to find any conditions associated with this user/realm/whatever...
 	 */
 	if (inst->config->authorize_check_query && (inst->config->authorize_check_query[0] != '\0')) {
-		if (radius_axlat(&expanded, request, inst->config->authorize_check_query,
-				 sql_escape_func, inst) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(inst, &handle, request, &check_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(inst, request, &handle, request, &check_tmp,
+				     inst->config->authorize_check_query);
 		if (rows < 0) {
 			REDEBUG("SQL query error");
 			rcode = RLM_MODULE_FAIL;
@@ -1000,15 +1129,8 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
-				sql_escape_func, inst) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(inst, &handle, request->reply, &reply_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(inst, request, &handle, request->reply, &reply_tmp,
+				     inst->config->authorize_reply_query);
 		if (rows < 0) {
 			REDEBUG("SQL query error");
 			rcode = RLM_MODULE_FAIL;
@@ -1047,7 +1169,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 		rlm_rcode_t ret;
 
 		RDEBUG3("... falling-through to group processing");
-		ret = rlm_sql_process_groups(inst, request, handle, &dofallthrough);
+		ret = rlm_sql_process_groups(inst, request, &handle, &dofallthrough);
 		switch (ret) {
 			/*
 			 *	Nothing bad happened, continue...
@@ -1101,7 +1223,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST * request)
 			goto error;
 		}
 
-		ret = rlm_sql_process_groups(inst, request, handle, &dofallthrough);
+		ret = rlm_sql_process_groups(inst, request, &handle, &dofallthrough);
 		switch (ret) {
 			/*
 			 *	Nothing bad happened, continue...
@@ -1172,6 +1294,9 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 	char			*p = path;
 	char			*expanded = NULL;
 
+	rlm_sql_stmt_t const	*stmt;
+	bool			prepare;
+
 	rad_assert(section);
 
 	if (section->reference[0] != '.') {
@@ -1203,6 +1328,13 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 
 	RDEBUG2("Using query template '%s'", attr);
 
+	if (section->wb) {
+		sql_set_user(inst, request, NULL);
+		rcode = sql_wb_enqueue(inst, request, section, pair);
+
+		goto finish;
+	}
+
 	handle = sql_get_socket(inst);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
@@ -1212,6 +1344,12 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 
 	sql_set_user(inst, request, NULL);
 
+	/*
+	 *	Queries which are logged must be expanded, so that the
+	 *	log can be replayed.
+	 */
+	prepare = !section->logfile && !inst->config->logfile;
+
 	while (true) {
 		value = cf_pair_value(pair);
 		if (!value) {
@@ -1221,6 +1359,18 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 			goto finish;
 		}
 
+		stmt = prepare ? sql_stmt_find(inst, value) : NULL;
+		if (stmt) {
+			sql_ret = rlm_sql_stmt_run(&handle, inst, request, stmt, false);
+			if (sql_ret == -1) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+
+			goto check;
+		}
+
 		if (radius_axlat(&expanded, request, value, sql_escape_func, inst) < 0) {
 			rcode = RLM_MODULE_FAIL;
 
@@ -1249,6 +1399,7 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 		sql_ret = rlm_sql_query(&handle, inst, expanded);
 		TALLOC_FREE(expanded);
 
+	check:
 		if (sql_ret == RLM_SQL_RECONNECT) {
 			rcode = RLM_MODULE_FAIL;
 
@@ -1339,8 +1490,6 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 	uint32_t		nas_addr = 0;
 	int			nas_port = 0;
 
-	char 			*expanded = NULL;
-
 	/* If simul_count_query is not defined, we don't do any checking */
 	if (!inst->config->simul_count_query || (inst->config->simul_count_query[0] == '\0')) {
 		return RLM_MODULE_NOOP;
@@ -1357,18 +1506,13 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 		return RLM_MODULE_FAIL;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_count_query, sql_escape_func, inst) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-
 	/* initialize the sql socket */
 	handle = sql_get_socket(inst);
 	if (!handle) {
-		talloc_free(expanded);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (rlm_sql_select_query(&handle, inst, expanded)) {
+	if (rlm_sql_select_fmt(&handle, inst, request, inst->config->simul_count_query)) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
 	}
@@ -1388,7 +1532,6 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 	request->simul_count = atoi(row[0]);
 
 	(inst->module->sql_finish_select_query)(handle, inst->config);
-	TALLOC_FREE(expanded);
 
 	if(request->simul_count < request->simul_max) {
 		rcode = RLM_MODULE_OK;
@@ -1405,13 +1548,7 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 		goto finish;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_verify_query, sql_escape_func, inst) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	if(rlm_sql_select_query(&handle, inst, expanded)) {
+	if (rlm_sql_select_fmt(&handle, inst, request, inst->config->simul_verify_query)) {
 		goto finish;
 	}
 
@@ -1511,7 +1648,6 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request) {
 
 	(inst->module->sql_finish_select_query)(handle, inst->config);
 	sql_release_socket(inst, handle);
-	talloc_free(expanded);
 
 	/*
 	 *	The Auth module apparently looks at request->simul_count,
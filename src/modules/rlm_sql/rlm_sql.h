@@ -29,6 +29,32 @@ typedef enum {
 
 typedef char **rlm_sql_row_t;
 
+/*
+ *	A column of the current row, pointing into the driver's own
+ *	buffers.  The value isn't NUL terminated, and is only valid
+ *	until the next row is fetched, or the result is freed.
+ */
+typedef struct rlm_sql_field {
+	char const	*value;		//!< NULL if the column is NULL.
+	size_t		length;
+} rlm_sql_field_t;
+
+/*
+ *	A configured query, compiled into a statement.  The %{...}
+ *	expansions are passed to the database as parameters, so they
+ *	don't need escaping, and the database can re-use its plan.
+ */
+typedef struct rlm_sql_stmt {
+	int		id;		//!< Unique within the module instance.
+	char const	*query;		//!< With "?" placeholders.
+	char const	*query_numbered; //!< With "$1", "$2"... placeholders.
+	int		num_params;
+	char const	**params;	//!< xlat format of each parameter.
+} rlm_sql_stmt_t;
+
+typedef struct sql_wb sql_wb_t;
+typedef struct sql_replica sql_replica_t;
+
 /*
  * Sections where we dynamically resolve the config entry to use,
  * by xlating reference.
@@ -39,6 +65,23 @@ typedef struct sql_acct_section {
 	char const	*reference;
 
 	char const	*logfile;
+
+	/*
+	 *	Write-behind queue.
+	 */
+	bool		wb_enable;
+	char const	*wb_journal;	//!< Where queued queries are written before
+					//!< the request is acknowledged.
+	int		wb_max_rows;	//!< Most queries written in one batch.
+	int		wb_interval;	//!< Milliseconds to wait for a batch to fill.
+	int		wb_max_queue;	//!< Most queries waiting to be written.
+	int		wb_max_wait;	//!< Milliseconds to wait for room in the queue.
+	int		wb_retry_interval; //!< Seconds to wait after the database fails.
+	char const	*wb_begin;	//!< Starts a transaction.
+	char const	*wb_commit;
+	char const	*wb_rollback;
+
+	sql_wb_t	*wb;
 } sql_acct_section_t;
 
 typedef struct sql_config {
@@ -70,6 +113,13 @@ typedef struct sql_config {
 	bool const	deletestalesessions;
 	char const	*allowed_chars;
 	int const	query_timeout;
+	bool const	prepared_statements;
+
+	bool		replica_fallback;
+
+	bool		cache_enable;
+	int		cache_lifetime;
+	int		cache_max_entries;
 
 	void		*driver;	//!< Where drivers should write a
 					//!< pointer to their configurations.
@@ -92,6 +142,7 @@ typedef struct rlm_sql_handle {
 	void	*conn;
 	rlm_sql_row_t row;
 	rlm_sql_t *inst;
+	sql_replica_t *replica;	//!< The replica this handle is connected to, NULL for the primary.
 } rlm_sql_handle_t;
 
 typedef struct rlm_sql_module_t {
@@ -110,8 +161,66 @@ typedef struct rlm_sql_module_t {
 	sql_rcode_t (*sql_finish_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_affected_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Prepared statements.  Optional.
+	 *
+	 *	sql_prepare is called before every use of a statement,
+	 *	and should do nothing if the statement has already been
+	 *	prepared on this handle.  sql_bind sets the parameter
+	 *	values, which remain valid until sql_execute returns.
+	 *	The results are then read, and released, as for
+	 *	sql_query and sql_select_query.
+	 */
+	sql_rcode_t (*sql_prepare)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt);
+	sql_rcode_t (*sql_bind)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt,
+				char const **values);
+	sql_rcode_t (*sql_execute)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, rlm_sql_stmt_t const *stmt,
+				   bool select);
+
+	/*
+	 *	Pipelined queries.  Optional.
+	 *
+	 *	Sends the queries without waiting for each result, and
+	 *	fills in the rcode, and number of affected rows, of each
+	 *	one.  The queries after one which fails may not be run.
+	 *	Returns RLM_SQL_RECONNECT if the connection failed.
+	 */
+	sql_rcode_t (*sql_query_pipeline)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  char const **queries, int num, sql_rcode_t *rcodes, int *affected);
+
+	/*
+	 *	Fetch the next row without copying it.  Optional.
+	 *
+	 *	Sets *fields to the columns of the row, or to NULL if
+	 *	there are no more rows.
+	 */
+	sql_rcode_t (*sql_fetch_fields)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					rlm_sql_field_t const **fields, int *num);
 } rlm_sql_module_t;
 
+/*
+ *	A read replica, used for authorization queries.
+ */
+struct sql_replica {
+	char const		*name;
+	rlm_sql_t		*inst;
+	CONF_SECTION		*cs;
+
+	char const		*server;
+	char const		*port;
+	char const		*login;
+	char const		*password;
+	char const		*db;
+	int			retry_delay;	//!< Seconds to avoid the replica after it fails.
+
+	rlm_sql_config_t	config;		//!< Copy of the instance configuration, with the above.
+	fr_connection_pool_t	*pool;
+
+	time_t			down_until;	//!< Not used before this time.
+	uint32_t		latency;	//!< Moving average of query times, in microseconds.
+};
+
 struct sql_inst {
 	rlm_sql_config_t	myconfig; /* HACK */
 	fr_connection_pool_t	*pool;
@@ -125,6 +234,21 @@ struct sql_inst {
 	void *handle;
 	rlm_sql_module_t *module;
 
+	fr_hash_table_t		*stmts;		//!< Compiled queries, by format.
+	int			num_stmts;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		stmt_mutex;
+#endif
+
+	fr_cache_t		*cache;		//!< Authorization query results, or NULL.
+	char const		*cache_xlat_name;
+
+	sql_replica_t		**replicas;	//!< Servers for authorization queries.
+	int			num_replicas;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		replica_mutex;
+#endif
+
 	int (*sql_set_user)(rlm_sql_t *inst, REQUEST *request, char const *username);
 	rlm_sql_handle_t *(*sql_get_socket)(rlm_sql_t *inst);
 	int (*sql_release_socket)(rlm_sql_t *inst, rlm_sql_handle_t *handle);
@@ -145,8 +269,10 @@ int     sql_close_socket(rlm_sql_t *inst, rlm_sql_handle_t *handle);
 rlm_sql_handle_t *sql_get_socket(rlm_sql_t *inst);
 int     sql_release_socket(rlm_sql_t *inst, rlm_sql_handle_t *handle);
 int     sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **first_pair, rlm_sql_row_t row);
+int	sql_fieldparse(TALLOC_CTX *ctx, VALUE_PAIR **first_pair, rlm_sql_field_t const *fields, int num);
 int     sql_read_realms(rlm_sql_handle_t *handle);
-int     sql_getvpdata(rlm_sql_t *inst, rlm_sql_handle_t **handle, TALLOC_CTX *ctx, VALUE_PAIR **pair, char const *query);
+int     sql_getvpdata(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle, TALLOC_CTX *ctx,
+		      VALUE_PAIR **pair, char const *fmt);
 int     sql_read_naslist(rlm_sql_handle_t *handle);
 int     sql_read_clients(rlm_sql_handle_t *handle);
 int     sql_dict_init(rlm_sql_handle_t *handle);
@@ -155,5 +281,29 @@ void 	rlm_sql_query_log(rlm_sql_t *inst, REQUEST *request,
 int	rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query);
 int	rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query);
 int	rlm_sql_fetch_row(rlm_sql_handle_t **handle, rlm_sql_t *inst);
+int	rlm_sql_fetch_fields(rlm_sql_handle_t **handle, rlm_sql_t *inst, rlm_sql_field_t const **fields, int *num);
 int	sql_set_user(rlm_sql_t *inst, REQUEST *request, char const *username);
+int	sql_stmt_init(rlm_sql_t *inst);
+void	sql_stmt_free(rlm_sql_t *inst);
+rlm_sql_stmt_t const *sql_stmt_find(rlm_sql_t *inst, char const *fmt);
+int	rlm_sql_stmt_run(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request,
+			 rlm_sql_stmt_t const *stmt, bool select);
+int	rlm_sql_select_fmt(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request, char const *fmt);
+int	sql_wb_init(rlm_sql_t *inst, sql_acct_section_t *section);
+void	sql_wb_free(sql_acct_section_t *section);
+rlm_rcode_t sql_wb_enqueue(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t *section, CONF_PAIR *pair);
+int	sql_cache_init(rlm_sql_t *inst);
+void	sql_cache_free(rlm_sql_t *inst);
+int	sql_cache_find(rlm_sql_t *inst, REQUEST *request, char const *key,
+		       TALLOC_CTX *ctx, VALUE_PAIR **pair, rlm_sql_grouplist_t **groups);
+void	sql_cache_add(rlm_sql_t *inst, REQUEST *request, char const *key, int rows,
+		      VALUE_PAIR *vps, rlm_sql_grouplist_t const *groups);
+int	sql_cache_flush(rlm_sql_t *inst, char const *user);
+void	*sql_conn_create(rlm_sql_t *inst, sql_replica_t *replica, rlm_sql_config_t *config);
+fr_connection_pool_t *sql_handle_pool(rlm_sql_t *inst, rlm_sql_handle_t *handle);
+int	sql_replica_init(rlm_sql_t *inst);
+void	sql_replica_free(rlm_sql_t *inst);
+rlm_sql_handle_t *sql_get_read_socket(rlm_sql_t *inst);
+void	sql_replica_down(rlm_sql_t *inst, sql_replica_t *replica);
+void	sql_replica_latency(rlm_sql_t *inst, sql_replica_t *replica, uint32_t usec);
 #endif
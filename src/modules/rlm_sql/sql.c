@@ -37,6 +37,11 @@ RCSID("$Id$")
 #include	"rlm_sql.h"
 
 #ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
 static int _sql_conn_destructor(rlm_sql_handle_t *conn)
@@ -50,19 +55,23 @@ static int _sql_conn_destructor(rlm_sql_handle_t *conn)
 	return 0;
 }
 
-static void *mod_conn_create(void *instance)
+/*
+ *	Open a connection to the primary, or to a replica, which has
+ *	its own copy of the configuration with a different server.
+ */
+void *sql_conn_create(rlm_sql_t *inst, sql_replica_t *replica, rlm_sql_config_t *config)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
-	handle = talloc_zero(instance, rlm_sql_handle_t);
+	handle = talloc_zero(replica ? (void *) replica : (void *) inst, rlm_sql_handle_t);
 
 	/*
 	 *	Handle requires a pointer to the SQL inst so the
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
 	/*
 	 *	When something frees this handle the destructor set by
@@ -72,7 +81,7 @@ static void *mod_conn_create(void *instance)
 	 */
 	talloc_set_destructor(handle, _sql_conn_destructor);
 
-	rcode = (inst->module->sql_socket_init)(handle, inst->config);
+	rcode = (inst->module->sql_socket_init)(handle, config);
 	if (rcode == 0) {
 		exec_trigger(NULL, inst->cs, "modules.sql.open", false);
 
@@ -88,6 +97,13 @@ static void *mod_conn_create(void *instance)
 	return NULL;
 }
 
+static void *mod_conn_create(void *instance)
+{
+	rlm_sql_t *inst = instance;
+
+	return sql_conn_create(inst, NULL, inst->config);
+}
+
 /*
  *	@todo Calls to this should eventually go away.
  */
@@ -138,6 +154,16 @@ rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
 	return fr_connection_get(inst->pool);
 }
 
+/*
+ *	The pool a handle came from, and must go back to.
+ */
+fr_connection_pool_t *sql_handle_pool(rlm_sql_t *inst, rlm_sql_handle_t *handle)
+{
+	if (handle && handle->replica) return handle->replica->pool;
+
+	return inst->pool;
+}
+
 /*************************************************************************
  *
  *	Function: sql_release_socket
@@ -147,19 +173,16 @@ rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
  *************************************************************************/
 int sql_release_socket(rlm_sql_t * inst, rlm_sql_handle_t * handle)
 {
-	fr_connection_release(inst->pool, handle);
+	fr_connection_release(sql_handle_pool(inst, handle), handle);
 	return 0;
 }
 
 
-/*************************************************************************
- *
- *	Function: sql_userparse
- *
- *	Purpose: Read entries from the database and fill VALUE_PAIR structures
- *
- *************************************************************************/
-int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
+/*
+ *	Make a pair from the attribute, value and op columns of a row.
+ */
+static int sql_pairparse(TALLOC_CTX *ctx, VALUE_PAIR **head,
+			 char const *attribute, char const *data, char const *op)
 {
 	VALUE_PAIR *vp;
 	char const *ptr, *value;
@@ -170,7 +193,7 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 	/*
 	 *	Verify the 'Attribute' field
 	 */
-	if (!row[2] || row[2][0] == '\0') {
+	if (!attribute || attribute[0] == '\0') {
 		ERROR("rlm_sql: The 'Attribute' field is empty or NULL, skipping the entire row");
 		return -1;
 	}
@@ -178,12 +201,12 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 	/*
 	 *	Verify the 'op' field
 	 */
-	if (row[4] != NULL && row[4][0] != '\0') {
-		ptr = row[4];
+	if (op != NULL && op[0] != '\0') {
+		ptr = op;
 		operator = gettoken(&ptr, buf, sizeof(buf));
 		if ((operator < T_OP_ADD) ||
 		    (operator > T_OP_CMP_EQ)) {
-			ERROR("rlm_sql: Invalid operator \"%s\" for attribute %s", row[4], row[2]);
+			ERROR("rlm_sql: Invalid operator \"%s\" for attribute %s", op, attribute);
 			return -1;
 		}
 
@@ -192,21 +215,21 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 		 *  Complain about empty or invalid 'op' field
 		 */
 		operator = T_OP_CMP_EQ;
-		ERROR("rlm_sql: The 'op' field for attribute '%s = %s' is NULL, or non-existent.", row[2], row[3]);
+		ERROR("rlm_sql: The 'op' field for attribute '%s = %s' is NULL, or non-existent.", attribute, data);
 		ERROR("rlm_sql: You MUST FIX THIS if you want the configuration to behave as you expect");
 	}
 
 	/*
 	 *	The 'Value' field may be empty or NULL
 	 */
-	value = row[3];
+	value = data;
 	/*
 	 *	If we have a new-style quoted string, where the
 	 *	*entire* string is quoted, do xlat's.
 	 */
-	if (row[3] != NULL &&
-	   ((row[3][0] == '\'') || (row[3][0] == '`') || (row[3][0] == '"')) &&
-	   (row[3][0] == row[3][strlen(row[3])-1])) {
+	if (data != NULL &&
+	   ((data[0] == '\'') || (data[0] == '`') || (data[0] == '"')) &&
+	   (data[0] == data[strlen(data)-1])) {
 
 		token = gettoken(&value, buf, sizeof(buf));
 		switch (token) {
@@ -230,7 +253,7 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 		 *	Keep the original string.
 		 */
 		default:
-			value = row[3];
+			value = data;
 			break;
 		}
 	}
@@ -238,7 +261,7 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 	/*
 	 *	Create the pair
 	 */
-	vp = pairmake(ctx, NULL, row[2], NULL, operator);
+	vp = pairmake(ctx, NULL, attribute, NULL, operator);
 	if (!vp) {
 		ERROR("rlm_sql: Failed to create the pair: %s",
 		       fr_strerror());
@@ -269,6 +292,111 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 }
 
 
+/*************************************************************************
+ *
+ *	Function: sql_userparse
+ *
+ *	Purpose: Read entries from the database and fill VALUE_PAIR structures
+ *
+ *************************************************************************/
+int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
+{
+	return sql_pairparse(ctx, head, row[2], row[3], row[4]);
+}
+
+/*
+ *	Make a C string of a field, in the buffer if it fits, or else
+ *	in "spill", which the caller frees.
+ */
+static char const *sql_field_cstr(rlm_sql_field_t const *field, char *buf, size_t buflen, char **spill)
+{
+	if (!field->value) return NULL;
+
+	if (field->length >= buflen) {
+		*spill = talloc_strndup(NULL, field->value, field->length);
+		return *spill;
+	}
+
+	memcpy(buf, field->value, field->length);
+	buf[field->length] = '\0';
+
+	return buf;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_fieldparse
+ *
+ *	Purpose: As sql_userparse, but for a row which points into the
+ *	driver's buffers.  The columns are copied to the stack, and
+ *	parsed from there.
+ *
+ *************************************************************************/
+int sql_fieldparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_field_t const *fields, int num)
+{
+	char attribute[256], data[MAX_STRING_LEN * 4], op[16];
+	char *spill[3] = { NULL, NULL, NULL };
+	char const *value;
+	int ret;
+
+	if (num < 5) {
+		ERROR("rlm_sql: Expected at least 5 columns in the result, got %d", num);
+		return -1;
+	}
+
+	/*
+	 *	A NULL value is the same as an empty one.
+	 */
+	value = sql_field_cstr(&fields[3], data, sizeof(data), &spill[1]);
+	if (!value) value = "";
+
+	ret = sql_pairparse(ctx, head,
+			    sql_field_cstr(&fields[2], attribute, sizeof(attribute), &spill[0]),
+			    value,
+			    sql_field_cstr(&fields[4], op, sizeof(op), &spill[2]));
+
+	talloc_free(spill[0]);
+	talloc_free(spill[1]);
+	talloc_free(spill[2]);
+
+	return ret;
+}
+
+
+/*
+ *	Reconnect a handle after a query failed.  If the handle was
+ *	connected to a replica, and no connection to it can be made,
+ *	the replica has been marked down by mod_replica_conn_create(),
+ *	and another server is used.
+ */
+static bool sql_reconnect(rlm_sql_t *inst, rlm_sql_handle_t **handle)
+{
+	sql_replica_t *replica = *handle ? (*handle)->replica : NULL;
+
+	*handle = fr_connection_reconnect(sql_handle_pool(inst, *handle), *handle);
+	if (*handle) return true;
+	if (!replica) return false;
+
+	*handle = sql_get_read_socket(inst);
+
+	return (*handle != NULL);
+}
+
+/*
+ *	Add the time taken by a select query to the average for the
+ *	replica it was sent to.
+ */
+static void sql_replica_time(rlm_sql_t *inst, rlm_sql_handle_t *handle, struct timeval const *start)
+{
+	struct timeval now;
+
+	if (!handle->replica) return;
+
+	gettimeofday(&now, NULL);
+	sql_replica_latency(inst, handle->replica,
+			    ((now.tv_sec - start->tv_sec) * 1000000) + (now.tv_usec - start->tv_usec));
+}
+
 /*************************************************************************
  *
  *	Function: rlm_sql_fetch_row
@@ -299,6 +427,35 @@ int rlm_sql_fetch_row(rlm_sql_handle_t **handle, rlm_sql_t *inst)
 	return ret;
 }
 
+/*************************************************************************
+ *
+ *	Function: rlm_sql_fetch_fields
+ *
+ *	Purpose: call the module's sql_fetch_fields.  As with
+ *	rlm_sql_fetch_row, there's no reconnect logic.
+ *
+ *************************************************************************/
+int rlm_sql_fetch_fields(rlm_sql_handle_t **handle, rlm_sql_t *inst, rlm_sql_field_t const **fields, int *num)
+{
+	int ret;
+
+	*fields = NULL;
+	*num = 0;
+
+	if (!*handle || !(*handle)->conn) {
+		return -1;
+	}
+
+	ret = (inst->module->sql_fetch_fields)(*handle, inst->config, fields, num);
+	if (ret < 0) {
+		char const *error = (inst->module->sql_error)(*handle, inst->config);
+		EDEBUG("rlm_sql (%s): Error fetching row: %s",
+		       inst->config->xlat_name, error ? error : "<UNKNOWN>");
+	}
+
+	return ret;
+}
+
 static void rlm_sql_query_error(rlm_sql_handle_t *handle, rlm_sql_t *inst)
 {
 	char const *p, *q;
@@ -388,8 +545,7 @@ int rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query)
 		 */
 		case RLM_SQL_RECONNECT:
 		sql_down:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
-			if (!*handle) return RLM_SQL_RECONNECT;
+			if (!sql_reconnect(inst, handle)) return RLM_SQL_RECONNECT;
 			continue;
 
 		case RLM_SQL_QUERY_ERROR:
@@ -417,6 +573,7 @@ int rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query)
 int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query)
 {
 	int ret = -1;
+	struct timeval start;
 
 	/*
 	 *	If there's no query, return an error.
@@ -432,9 +589,11 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
 	while (true) {
 		DEBUG("rlm_sql (%s): Executing query: '%s'", inst->config->xlat_name, query);
 
+		gettimeofday(&start, NULL);
 		ret = (inst->module->sql_select_query)(*handle, inst->config, query);
 		switch (ret) {
 		case RLM_SQL_OK:
+			sql_replica_time(inst, *handle, &start);
 			break;
 
 		/*
@@ -443,8 +602,7 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
 		 */
 		case RLM_SQL_RECONNECT:
 		sql_down:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
-			if (!*handle) return RLM_SQL_RECONNECT;
+			if (!sql_reconnect(inst, handle)) return RLM_SQL_RECONNECT;
 			continue;
 
 		case RLM_SQL_QUERY_ERROR:
@@ -463,6 +621,325 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
 }
 
 
+/*
+ *	Compiled queries, cached by their format.  Queries which can't
+ *	be compiled are cached too, with a NULL statement, so they're
+ *	only looked at once.
+ */
+typedef struct sql_stmt_entry {
+	char const		*fmt;
+	rlm_sql_stmt_t		*stmt;
+} sql_stmt_entry_t;
+
+static uint32_t sql_stmt_hash(void const *data)
+{
+	sql_stmt_entry_t const *entry = data;
+
+	return fr_hash_string(entry->fmt);
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	sql_stmt_entry_t const *a = one;
+	sql_stmt_entry_t const *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+/*
+ *	Skip over an expansion, returning a pointer to the character
+ *	after it, or NULL if it's not terminated.
+ */
+static char const *sql_stmt_skip_xlat(char const *p)
+{
+	int depth = 0;
+
+	rad_assert(*p == '%');
+
+	if (p[1] != '{') return p[1] ? p + 2 : NULL;
+
+	for (p++; *p; p++) {
+		if (*p == '\\') {
+			if (!p[1]) return NULL;
+			p++;
+			continue;
+		}
+
+		if (*p == '{') depth++;
+		if ((*p == '}') && (--depth == 0)) return p + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Compile a query into a statement.
+ *
+ *	Only expansions which are inside a single quoted string are
+ *	turned into parameters, as that string is plainly a value.
+ *	The whole of the string becomes the parameter, so
+ *	'%{User-Name}@%{Realm}' is one parameter.  An expansion
+ *	anywhere else may produce SQL, or a value whose type the
+ *	database would have to guess, so those queries aren't
+ *	compiled, and are run as before.  The same goes for strings
+ *	which use the SQL escapes '' and \.
+ */
+static rlm_sql_stmt_t *sql_stmt_compile(TALLOC_CTX *ctx, char const *fmt)
+{
+	rlm_sql_stmt_t *stmt;
+	char const *p, *q, *start;
+	char *query, *numbered;
+	bool dynamic;
+
+	stmt = talloc_zero(ctx, rlm_sql_stmt_t);
+	query = talloc_strdup(stmt, "");
+	numbered = talloc_strdup(stmt, "");
+
+	p = start = fmt;
+	while (*p) {
+		switch (*p) {
+		/*
+		 *	An expansion outside of a string.
+		 */
+		case '%':
+			goto fail;
+
+		/*
+		 *	Identifiers, or MySQL strings.  Leave them
+		 *	alone, so long as they're not dynamic.
+		 */
+		case '"':
+		case '`':
+			q = strchr(p + 1, *p);
+			if (!q || memchr(p, '%', q - p)) goto fail;
+			p = q + 1;
+			break;
+
+		case '\'':
+			dynamic = false;
+			for (q = p + 1; *q && (*q != '\''); q++) {
+				if (*q == '\\') goto fail;
+
+				if (*q == '%') {
+					dynamic = true;
+					q = sql_stmt_skip_xlat(q);
+					if (!q) goto fail;
+					q--;
+				}
+			}
+			if ((*q != '\'') || (q[1] == '\'')) goto fail;
+
+			if (!dynamic) {
+				p = q + 1;
+				break;
+			}
+
+			query = talloc_asprintf_append_buffer(query, "%.*s?", (int) (p - start), start);
+			numbered = talloc_asprintf_append_buffer(numbered, "%.*s$%d", (int) (p - start), start,
+								 stmt->num_params + 1);
+
+			stmt->params = talloc_realloc(stmt, stmt->params, char const *, stmt->num_params + 1);
+			stmt->params[stmt->num_params++] = talloc_strndup(stmt, p + 1, q - (p + 1));
+
+			p = start = q + 1;
+			break;
+
+		default:
+			p++;
+			break;
+		}
+	}
+
+	if (!stmt->num_params) goto fail;
+
+	stmt->query = talloc_asprintf_append_buffer(query, "%s", start);
+	stmt->query_numbered = talloc_asprintf_append_buffer(numbered, "%s", start);
+
+	return stmt;
+
+fail:
+	talloc_free(stmt);
+	return NULL;
+}
+
+int sql_stmt_init(rlm_sql_t *inst)
+{
+	inst->stmts = fr_hash_table_create(sql_stmt_hash, sql_stmt_cmp, NULL);
+	if (!inst->stmts) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->stmt_mutex, NULL);
+#endif
+
+	return 0;
+}
+
+void sql_stmt_free(rlm_sql_t *inst)
+{
+	if (!inst->stmts) return;
+
+	fr_hash_table_free(inst->stmts);
+	inst->stmts = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->stmt_mutex);
+#endif
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_stmt_find
+ *
+ *	Purpose: Return the statement for a configured query, or NULL if
+ *	it should be expanded and run as a string.
+ *
+ *************************************************************************/
+rlm_sql_stmt_t const *sql_stmt_find(rlm_sql_t *inst, char const *fmt)
+{
+	sql_stmt_entry_t my_entry, *entry;
+	rlm_sql_stmt_t *stmt;
+
+	if (!inst->stmts || !fmt) return NULL;
+
+	my_entry.fmt = fmt;
+
+	PTHREAD_MUTEX_LOCK(&inst->stmt_mutex);
+	entry = fr_hash_table_finddata(inst->stmts, &my_entry);
+	if (!entry) {
+		MEM(entry = talloc_zero(inst, sql_stmt_entry_t));
+		entry->fmt = talloc_strdup(entry, fmt);
+
+		entry->stmt = stmt = sql_stmt_compile(entry, fmt);
+		if (stmt) {
+			stmt->id = inst->num_stmts++;
+			DEBUG2("rlm_sql (%s): Compiled query into statement %d: '%s'",
+			       inst->config->xlat_name, stmt->id, stmt->query);
+		} else {
+			DEBUG2("rlm_sql (%s): Query will be expanded, not prepared: '%s'",
+			       inst->config->xlat_name, fmt);
+		}
+
+		if (!fr_hash_table_insert(inst->stmts, entry)) {
+			talloc_free(entry);
+			entry = NULL;
+		}
+	}
+	stmt = entry ? entry->stmt : NULL;
+	PTHREAD_MUTEX_UNLOCK(&inst->stmt_mutex);
+
+	return stmt;
+}
+
+/*************************************************************************
+ *
+ *	Function: rlm_sql_stmt_run
+ *
+ *	Purpose: Expand the parameters of a statement, call the module's
+ *	prepare, bind and execute functions, and implement re-connect
+ *
+ *************************************************************************/
+int rlm_sql_stmt_run(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request,
+		     rlm_sql_stmt_t const *stmt, bool select)
+{
+	char const **values;
+	char *value;
+	int i, ret = -1;
+	struct timeval start;
+
+	values = talloc_zero_array(request, char const *, stmt->num_params);
+	for (i = 0; i < stmt->num_params; i++) {
+		if (radius_axlat(&value, request, stmt->params[i], NULL, NULL) < 0) {
+			REDEBUG("Error generating query parameter %d", i + 1);
+			goto finish;
+		}
+		values[i] = talloc_steal(values, value);
+	}
+
+	if (!*handle || !(*handle)->conn) {
+		goto sql_down;
+	}
+
+	while (true) {
+		DEBUG("rlm_sql (%s): Executing statement %d: '%s'", inst->config->xlat_name,
+		      stmt->id, stmt->query);
+		for (i = 0; i < stmt->num_params; i++) {
+			DEBUG2("rlm_sql (%s):   $%d = '%s'", inst->config->xlat_name, i + 1, values[i]);
+		}
+
+		gettimeofday(&start, NULL);
+		ret = (inst->module->sql_prepare)(*handle, inst->config, stmt);
+		if (ret == RLM_SQL_OK) {
+			ret = (inst->module->sql_bind)(*handle, inst->config, stmt, values);
+		}
+		if (ret == RLM_SQL_OK) {
+			ret = (inst->module->sql_execute)(*handle, inst->config, stmt, select);
+		}
+
+		switch (ret) {
+		case RLM_SQL_OK:
+			if (select) sql_replica_time(inst, *handle, &start);
+			break;
+
+		/*
+		 *	Run through all available sockets until we exhaust all existing
+		 *	sockets in the pool and fail to establish a *new* connection.
+		 */
+		case RLM_SQL_RECONNECT:
+		sql_down:
+			if (!sql_reconnect(inst, handle)) {
+				ret = RLM_SQL_RECONNECT;
+				goto finish;
+			}
+			continue;
+
+		case RLM_SQL_QUERY_ERROR:
+		case RLM_SQL_ERROR:
+			rlm_sql_query_error(*handle, inst);
+			break;
+
+		case RLM_SQL_DUPLICATE:
+			rlm_sql_query_debug(*handle, inst);
+			break;
+
+		}
+
+		break;
+	}
+
+finish:
+	talloc_free(values);
+
+	return ret;
+}
+
+/*************************************************************************
+ *
+ *	Function: rlm_sql_select_fmt
+ *
+ *	Purpose: Run a configured select query, as a prepared statement
+ *	if possible, otherwise by expanding and escaping it.
+ *
+ *************************************************************************/
+int rlm_sql_select_fmt(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request, char const *fmt)
+{
+	rlm_sql_stmt_t const *stmt;
+	char *expanded = NULL;
+	int ret;
+
+	stmt = sql_stmt_find(inst, fmt);
+	if (stmt) return rlm_sql_stmt_run(handle, inst, request, stmt, true);
+
+	if (radius_axlat(&expanded, request, fmt, inst->sql_escape_func, inst) < 0) {
+		REDEBUG("Error generating query");
+		return -1;
+	}
+
+	ret = rlm_sql_select_query(handle, inst, expanded);
+	talloc_free(expanded);
+
+	return ret;
+}
+
 /*************************************************************************
  *
  *	Function: sql_getvpdata
@@ -470,24 +947,75 @@ int rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
  *	Purpose: Get any group check or reply pairs
  *
  *************************************************************************/
-int sql_getvpdata(rlm_sql_t * inst, rlm_sql_handle_t **handle,
-		  TALLOC_CTX *ctx, VALUE_PAIR **pair, char const *query)
+int sql_getvpdata(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+		  TALLOC_CTX *ctx, VALUE_PAIR **pair, char const *fmt)
 {
 	rlm_sql_row_t row;
+	rlm_sql_field_t const *fields;
 	int     rows = 0;
+	int	ret, num;
+	char	*key = NULL;
+	VALUE_PAIR *head = NULL;
+
+	/*
+	 *	The expanded query is the cache key.  On a miss, it's
+	 *	also the query, unless it's run as a prepared statement.
+	 */
+	if (inst->cache) {
+		if (radius_axlat(&key, request, fmt, inst->sql_escape_func, inst) < 0) {
+			REDEBUG("Error generating query");
+			return -1;
+		}
 
-	if (rlm_sql_select_query(handle, inst, query)) {
+		rows = sql_cache_find(inst, request, key, ctx, pair, NULL);
+		if (rows >= 0) {
+			talloc_free(key);
+			return rows;
+		}
+		rows = 0;
+
+		if (!*handle) {
+			*handle = sql_get_read_socket(inst);
+			if (!*handle) {
+				talloc_free(key);
+				return -1;
+			}
+		}
+	}
+
+	if (key && !sql_stmt_find(inst, fmt)) {
+		ret = rlm_sql_select_query(handle, inst, key);
+	} else {
+		ret = rlm_sql_select_fmt(handle, inst, request, fmt);
+	}
+	if (ret) {
+		talloc_free(key);
 		return -1;
 	}
 
-	while (rlm_sql_fetch_row(handle, inst) == 0) {
-		row = (*handle)->row;
-		if (!row)
-			break;
-		if (sql_userparse(ctx, pair, row) != 0) {
+	while (true) {
+		/*
+		 *	Parse the rows in place if the driver can.
+		 */
+		if (inst->module->sql_fetch_fields) {
+			if (rlm_sql_fetch_fields(handle, inst, &fields, &num) != 0) break;
+			if (!fields) break;
+
+			ret = sql_fieldparse(ctx, &head, fields, num);
+		} else {
+			if (rlm_sql_fetch_row(handle, inst) != 0) break;
+			row = (*handle)->row;
+			if (!row) break;
+
+			ret = sql_userparse(ctx, &head, row);
+		}
+
+		if (ret != 0) {
 			ERROR("rlm_sql (%s): Error parsing user data from database result", inst->config->xlat_name);
 
 			(inst->module->sql_finish_select_query)(*handle, inst->config);
+			pairfree(&head);
+			talloc_free(key);
 
 			return -1;
 		}
@@ -495,6 +1023,12 @@ int sql_getvpdata(rlm_sql_t * inst, rlm_sql_handle_t **handle,
 	}
 	(inst->module->sql_finish_select_query)(*handle, inst->config);
 
+	if (key) {
+		sql_cache_add(inst, request, key, rows, head, NULL);
+		talloc_free(key);
+	}
+	pairadd(pair, head);
+
 	return rows;
 }
 
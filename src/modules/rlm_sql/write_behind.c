@@ -0,0 +1,973 @@
+/*
+ * write_behind.c	rlm_sql - Queue accounting queries, and write them in batches.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/*
+ *	When "write_behind" is enabled for a section, its queries are
+ *	expanded as usual, but instead of being run by the request
+ *	thread, they are appended to a journal, and to a queue.  The
+ *	request is acknowledged once the journal is on disk.
+ *
+ *	A thread takes up to "max_rows" queries at a time from the
+ *	queue, and writes them to the database in one transaction.
+ *	Runs of single row INSERTs into the same columns are sent as
+ *	one multi-row INSERT.  When the driver supports pipelining, the
+ *	whole transaction is sent without waiting for each result.  If
+ *	a query would need one of its alternatives, the transaction is
+ *	rolled back, and sent again without the pipeline.  If anything
+ *	in the transaction fails,
+ *	it's rolled back, and the queries are run one at a time, with
+ *	their alternatives, exactly as they would have been without
+ *	the queue.  If the database is down, the queries stay at the
+ *	head of the queue, and are retried later.
+ *
+ *	The journal is replayed when the server starts, so queries
+ *	which were acknowledged but not written aren't lost.  Queries
+ *	which were written, but not yet removed from the journal, may
+ *	be written twice.  The usual accounting queries allow for
+ *	that, as they fall back from INSERT to UPDATE.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "rlm_sql.h"
+
+#ifdef HAVE_PTHREAD_H
+#define USEC (1000000)
+
+/*
+ *	Rewrite the journal once it's this large, and mostly holds
+ *	queries which have already been written.
+ */
+#define SQL_WB_COMPACT_SIZE	(1024 * 1024)
+
+typedef struct sql_wb_entry sql_wb_entry_t;
+
+struct sql_wb_entry {
+	struct timeval		when;		//!< When the entry was queued.
+	int			num_queries;
+	char			**queries;	//!< The query, and its alternatives.
+	size_t			len;		//!< Size of the journal record.
+	sql_wb_entry_t		*next;
+};
+
+typedef struct sql_wb_stmt {
+	char const		*query;
+	sql_wb_entry_t		*entry;		//!< The entry, or NULL for a multi-row INSERT.
+	int			rows;		//!< Rows the statement inserts.
+} sql_wb_stmt_t;
+
+struct sql_wb {
+	rlm_sql_t		*inst;
+	sql_acct_section_t	*section;
+	char const		*name;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		work;		//!< Signalled when there's something to write.
+	pthread_cond_t		space;		//!< Signalled when entries leave the queue.
+	sql_wb_entry_t		*head;
+	sql_wb_entry_t		*tail;
+	int			num_queued;
+	bool			stop;
+	pthread_t		thread;
+	bool			started;
+
+	int			fd;		//!< Journal, or -1.
+	size_t			journal_size;
+	size_t			live_size;	//!< Size of the records still queued.
+	uint64_t		written;	//!< Records written to the journal.
+
+	pthread_mutex_t		sync_mutex;	//!< Held when syncing or replacing the journal.
+	uint64_t		synced;		//!< Records known to be on disk.
+};
+
+static void sql_wb_entry_free(sql_wb_entry_t *entry)
+{
+	sql_wb_entry_t *next;
+
+	for (; entry; entry = next) {
+		next = entry->next;
+		talloc_free(entry);
+	}
+}
+
+/*
+ *	A journal record is the number of queries, then the length and
+ *	text of each query, each on its own line.
+ */
+static char *sql_wb_record(sql_wb_entry_t const *entry)
+{
+	char *record;
+	int i;
+
+	record = talloc_asprintf(NULL, "%d\n", entry->num_queries);
+	for (i = 0; i < entry->num_queries; i++) {
+		record = talloc_asprintf_append_buffer(record, "%zu\n%s\n",
+						       strlen(entry->queries[i]), entry->queries[i]);
+	}
+
+	return record;
+}
+
+static int sql_wb_write(int fd, char const *buff, size_t len)
+{
+	ssize_t slen;
+
+	while (len > 0) {
+		slen = write(fd, buff, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buff += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/*
+ *	Make sure record "seq" is on disk.  Writers which arrive while
+ *	another is syncing share the next sync.
+ */
+static int sql_wb_journal_sync(sql_wb_t *wb, uint64_t seq)
+{
+	uint64_t written;
+	int rcode = 0;
+
+	pthread_mutex_lock(&wb->sync_mutex);
+	if (wb->synced < seq) {
+		pthread_mutex_lock(&wb->mutex);
+		written = wb->written;
+		pthread_mutex_unlock(&wb->mutex);
+
+		if (fsync(wb->fd) < 0) {
+			rcode = -1;
+		} else {
+			wb->synced = written;
+		}
+	}
+	pthread_mutex_unlock(&wb->sync_mutex);
+
+	return rcode;
+}
+
+/*
+ *	Queue the entries from a journal left by a previous run.  A
+ *	partial record at the end was never acknowledged, so it's
+ *	ignored.
+ */
+static int sql_wb_journal_load(sql_wb_t *wb, char const *filename)
+{
+	FILE *fp;
+	sql_wb_entry_t *entry;
+	int i, num, count = 0;
+	size_t len;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("rlm_sql (%s): Failed opening journal %s: %s", wb->name, filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while ((fscanf(fp, "%d", &num) == 1) && (fgetc(fp) == '\n') && (num > 0)) {
+		MEM(entry = talloc_zero(NULL, sql_wb_entry_t));
+		MEM(entry->queries = talloc_zero_array(entry, char *, num));
+
+		for (i = 0; i < num; i++) {
+			if ((fscanf(fp, "%zu", &len) != 1) || (fgetc(fp) != '\n')) break;
+
+			MEM(entry->queries[i] = talloc_array(entry, char, len + 1));
+			if ((fread(entry->queries[i], 1, len, fp) != len) || (fgetc(fp) != '\n')) break;
+			entry->queries[i][len] = '\0';
+		}
+		if (i < num) {
+			talloc_free(entry);
+			break;
+		}
+
+		entry->num_queries = num;
+		entry->len = ftell(fp) - wb->journal_size;
+		wb->journal_size += entry->len;
+		wb->live_size += entry->len;
+		gettimeofday(&entry->when, NULL);
+
+		if (wb->tail) {
+			wb->tail->next = entry;
+		} else {
+			wb->head = entry;
+		}
+		wb->tail = entry;
+		wb->num_queued++;
+		count++;
+	}
+
+	/*
+	 *	New records are appended, so anything after the last
+	 *	complete record has to go.
+	 */
+	if (!feof(fp) || (ftell(fp) > (long) wb->journal_size)) {
+		WARN("rlm_sql (%s): Ignoring incomplete record at the end of journal %s", wb->name, filename);
+		if (truncate(filename, wb->journal_size) < 0) {
+			ERROR("rlm_sql (%s): Failed truncating journal %s: %s", wb->name, filename,
+			      fr_syserror(errno));
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	if (count) INFO("rlm_sql (%s): Queued %d unwritten queries from journal %s", wb->name, count, filename);
+
+	return 0;
+}
+
+static int sql_wb_journal_open(sql_wb_t *wb, char const *filename)
+{
+	wb->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (wb->fd < 0) {
+		ERROR("rlm_sql (%s): Failed opening journal %s: %s", wb->name, filename, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Throw away the records of queries which have been written.
+ *	Called with both mutexes held, and nothing being written.
+ */
+static void sql_wb_journal_compact(sql_wb_t *wb)
+{
+	char const *filename = wb->section->wb_journal;
+	char *tmp, *record;
+	int fd;
+	sql_wb_entry_t *entry;
+
+	if (!wb->head) {
+		if (ftruncate(wb->fd, 0) < 0) {
+			ERROR("rlm_sql (%s): Failed truncating journal %s: %s", wb->name, filename,
+			      fr_syserror(errno));
+			return;
+		}
+		wb->journal_size = 0;
+		wb->live_size = 0;
+		return;
+	}
+
+	if ((wb->journal_size < SQL_WB_COMPACT_SIZE) || (wb->journal_size < (4 * wb->live_size))) return;
+
+	tmp = talloc_asprintf(NULL, "%s.tmp", filename);
+	fd = open(tmp, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+	if (fd < 0) {
+		ERROR("rlm_sql (%s): Failed opening %s: %s", wb->name, tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return;
+	}
+
+	for (entry = wb->head; entry; entry = entry->next) {
+		record = sql_wb_record(entry);
+		if (sql_wb_write(fd, record, talloc_array_length(record) - 1) < 0) {
+			talloc_free(record);
+			goto error;
+		}
+		talloc_free(record);
+	}
+
+	if ((fsync(fd) < 0) || (rename(tmp, filename) < 0)) {
+	error:
+		ERROR("rlm_sql (%s): Failed writing %s: %s", wb->name, tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		talloc_free(tmp);
+		return;
+	}
+	talloc_free(tmp);
+
+	DEBUG2("rlm_sql (%s): Compacted journal from %zu to %zu bytes", wb->name,
+	       wb->journal_size, wb->live_size);
+	wb->journal_size = wb->live_size;
+	wb->synced = wb->written;
+
+	/*
+	 *	If the reopen fails, sql_wb_enqueue() refuses new
+	 *	queries and tries again.
+	 */
+	close(wb->fd);
+	wb->fd = -1;
+	close(fd);
+	(void) sql_wb_journal_open(wb, filename);
+}
+
+static sql_rcode_t sql_wb_query(sql_wb_t *wb, rlm_sql_handle_t **handle, char const *query, int *affected)
+{
+	rlm_sql_t *inst = wb->inst;
+	sql_rcode_t rcode;
+
+	*affected = 0;
+
+	rcode = rlm_sql_query(handle, inst, query);
+	if (rcode == RLM_SQL_RECONNECT) return rcode;
+
+	if (rcode == RLM_SQL_OK) *affected = (inst->module->sql_affected_rows)(*handle, inst->config);
+	(inst->module->sql_finish_query)(*handle, inst->config);
+
+	return rcode;
+}
+
+/*
+ *	If the query is a single row "INSERT ... VALUES (...)", find
+ *	the row, so it can be sent with others in one INSERT.
+ */
+static bool sql_wb_insert_row(char const *query, size_t *prefix_len, size_t *row_len)
+{
+	char const *p = query, *row = NULL;
+	char quote = '\0';
+	int depth = 0;
+
+	while (isspace((int) *p)) p++;
+	if (strncasecmp(p, "INSERT", 6) != 0) return false;
+
+	for (p += 6; *p; p++) {
+		if (quote) {
+			if ((*p == '\\') && p[1]) {
+				p++;
+			} else if (*p == quote) {
+				quote = '\0';
+			}
+			continue;
+		}
+
+		if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+			quote = *p;
+			continue;
+		}
+
+		if ((strncasecmp(p, "VALUES", 6) == 0) &&
+		    (isspace((int) p[-1]) || (p[-1] == ')')) &&
+		    (isspace((int) p[6]) || (p[6] == '('))) {
+			row = p + 6;
+			break;
+		}
+	}
+	if (!row) return false;
+
+	while (isspace((int) *row)) row++;
+	if (*row != '(') return false;
+
+	for (p = row; *p; p++) {
+		if (quote) {
+			if ((*p == '\\') && p[1]) {
+				p++;
+			} else if (*p == quote) {
+				quote = '\0';
+			}
+			continue;
+		}
+
+		if ((*p == '\'') || (*p == '"') || (*p == '`')) {
+			quote = *p;
+			continue;
+		}
+
+		if (*p == '(') depth++;
+		if ((*p == ')') && (--depth == 0)) break;
+	}
+	if (!*p) return false;
+
+	*prefix_len = row - query;
+	*row_len = (p + 1) - row;
+
+	/*
+	 *	Nothing, such as "ON DUPLICATE KEY", may follow the row.
+	 */
+	for (p++; *p; p++) {
+		if (!isspace((int) *p) && (*p != ';')) return false;
+	}
+
+	return true;
+}
+
+/*
+ *	Turn a batch into the statements to send.  Runs of single row
+ *	INSERTs with the same prefix become one multi-row INSERT.
+ */
+static sql_wb_stmt_t *sql_wb_stmts(TALLOC_CTX *ctx, sql_wb_entry_t *batch, int *num)
+{
+	sql_wb_stmt_t *stmts;
+	sql_wb_entry_t *entry, *end;
+	size_t prefix_len, row_len, len, rlen;
+	char *query;
+	int count;
+
+	*num = 0;
+	for (entry = batch; entry; entry = entry->next) (*num)++;
+	MEM(stmts = talloc_zero_array(ctx, sql_wb_stmt_t, *num));
+
+	*num = 0;
+	for (entry = batch; entry; entry = end) {
+		end = entry->next;
+		count = 1;
+
+		if (sql_wb_insert_row(entry->queries[0], &prefix_len, &row_len)) {
+			query = NULL;
+			for (; end; end = end->next, count++) {
+				if (!sql_wb_insert_row(end->queries[0], &len, &rlen) || (len != prefix_len) ||
+				    (strncmp(end->queries[0], entry->queries[0], prefix_len) != 0)) break;
+
+				if (!query) query = talloc_strndup(stmts, entry->queries[0], prefix_len + row_len);
+				query = talloc_asprintf_append_buffer(query, ", %.*s", (int) rlen,
+								      end->queries[0] + prefix_len);
+			}
+
+			if (query) {
+				stmts[*num].query = query;
+				stmts[*num].rows = count;
+				(*num)++;
+				continue;
+			}
+		}
+
+		stmts[*num].query = entry->queries[0];
+		stmts[*num].entry = entry;
+		stmts[*num].rows = 1;
+		(*num)++;
+	}
+
+	return stmts;
+}
+
+/*
+ *	Send all the statements, and BEGIN, in one pipeline.  If a
+ *	query would have to fall back to one of its alternatives, the
+ *	batch is written again without the pipeline.
+ */
+static bool sql_wb_pipeline(sql_wb_t *wb, rlm_sql_handle_t **handle, sql_wb_stmt_t *stmts, int num)
+{
+	rlm_sql_t *inst = wb->inst;
+	char const **queries;
+	sql_rcode_t rcode, *rcodes;
+	int *affected;
+	int i;
+
+	MEM(queries = talloc_array(stmts, char const *, num + 1));
+	MEM(rcodes = talloc_array(stmts, sql_rcode_t, num + 1));
+	MEM(affected = talloc_array(stmts, int, num + 1));
+
+	queries[0] = wb->section->wb_begin;
+	for (i = 0; i < num; i++) queries[i + 1] = stmts[i].query;
+
+	DEBUG2("rlm_sql (%s): Pipelining %d statements", wb->name, num);
+
+	rcode = (inst->module->sql_query_pipeline)(*handle, inst->config, queries, num + 1, rcodes, affected);
+	if (rcode == RLM_SQL_RECONNECT) {
+		*handle = fr_connection_reconnect(inst->pool, *handle);
+		return false;
+	}
+	if (rcode != RLM_SQL_OK) return false;
+
+	for (i = 0; i <= num; i++) {
+		if (rcodes[i] != RLM_SQL_OK) return false;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (stmts[i].entry) {
+			if ((affected[i + 1] == 0) && (stmts[i].entry->num_queries > 1)) return false;
+		} else if (affected[i + 1] != stmts[i].rows) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ *	Write a batch in one transaction.  Returns true if all of it
+ *	was committed.
+ */
+static bool sql_wb_flush_transaction(sql_wb_t *wb, rlm_sql_handle_t **handle, sql_wb_entry_t *batch,
+				     bool pipeline)
+{
+	sql_acct_section_t *section = wb->section;
+	rlm_sql_handle_t *orig = *handle;
+	sql_wb_stmt_t *stmts;
+	sql_wb_entry_t *entry;
+	int i, j, num, affected;
+
+	if (!section->wb_begin || !*section->wb_begin || !section->wb_commit || !*section->wb_commit) return false;
+
+	stmts = sql_wb_stmts(NULL, batch, &num);
+
+	if (pipeline) {
+		if (!sql_wb_pipeline(wb, handle, stmts, num)) goto fail;
+		goto commit;
+	}
+
+	if (sql_wb_query(wb, handle, section->wb_begin, &affected) != RLM_SQL_OK) goto fail;
+
+	for (i = 0; i < num; i++) {
+		entry = stmts[i].entry;
+
+		if (!entry) {
+			DEBUG2("rlm_sql (%s): Writing %d rows in one INSERT", wb->name, stmts[i].rows);
+			if ((sql_wb_query(wb, handle, stmts[i].query, &affected) != RLM_SQL_OK) ||
+			    (affected != stmts[i].rows)) goto fail;
+		} else for (j = 0; j < entry->num_queries; j++) {
+			if (sql_wb_query(wb, handle, entry->queries[j], &affected) != RLM_SQL_OK) goto fail;
+			if (affected > 0) break;
+		}
+
+		/*
+		 *	A reconnect means the transaction was lost.
+		 */
+		if (*handle != orig) goto fail;
+	}
+
+commit:
+	if (sql_wb_query(wb, handle, section->wb_commit, &affected) != RLM_SQL_OK) goto fail;
+
+	talloc_free(stmts);
+	return true;
+
+fail:
+	if (*handle && (*handle == orig) && section->wb_rollback && *section->wb_rollback) {
+		(void) sql_wb_query(wb, handle, section->wb_rollback, &affected);
+	}
+	talloc_free(stmts);
+
+	return false;
+}
+
+/*
+ *	Write each query in turn, trying its alternatives, as
+ *	acct_redundant() would.  Returns the entries which weren't
+ *	written because the database is down.
+ */
+static sql_wb_entry_t *sql_wb_flush_each(sql_wb_t *wb, rlm_sql_handle_t **handle, sql_wb_entry_t *batch)
+{
+	sql_wb_entry_t *entry;
+	sql_rcode_t rcode = RLM_SQL_OK;
+	int i, affected = 0;
+
+	while (batch) {
+		entry = batch;
+
+		for (i = 0; i < entry->num_queries; i++) {
+			rcode = sql_wb_query(wb, handle, entry->queries[i], &affected);
+			if (rcode == RLM_SQL_RECONNECT) return batch;
+			if ((rcode == RLM_SQL_OK) && (affected > 0)) break;
+		}
+
+		if ((i == entry->num_queries) && (rcode != RLM_SQL_OK)) {
+			ERROR("rlm_sql (%s): Discarding query which failed: %s", wb->name, entry->queries[0]);
+		}
+
+		batch = entry->next;
+		talloc_free(entry);
+	}
+
+	return NULL;
+}
+
+static sql_wb_entry_t *sql_wb_flush(sql_wb_t *wb, sql_wb_entry_t *batch)
+{
+	rlm_sql_handle_t *handle;
+
+	handle = sql_get_socket(wb->inst);
+	if (!handle) return batch;
+
+	if ((wb->inst->module->sql_query_pipeline && sql_wb_flush_transaction(wb, &handle, batch, true)) ||
+	    (handle && sql_wb_flush_transaction(wb, &handle, batch, false))) {
+		sql_wb_entry_free(batch);
+		batch = NULL;
+	} else if (handle) {
+		DEBUG("rlm_sql (%s): Batch failed, writing queries one at a time", wb->name);
+		batch = sql_wb_flush_each(wb, &handle, batch);
+	}
+
+	if (handle) sql_release_socket(wb->inst, handle);
+
+	return batch;
+}
+
+static void *sql_wb_thread(void *arg)
+{
+	sql_wb_t *wb = arg;
+	sql_acct_section_t *section = wb->section;
+	sql_wb_entry_t *batch, *entry, *last;
+	struct timeval now, when, retry_at;
+	struct timespec deadline;
+	bool retry = false;
+	bool journal = (section->wb_journal != NULL);
+	int count;
+	size_t len, rlen;
+
+	timerclear(&retry_at);
+
+	pthread_mutex_lock(&wb->mutex);
+	while (true) {
+		/*
+		 *	Wait for a full batch, for the oldest query to
+		 *	have waited long enough, or for a retry.
+		 */
+		while (!wb->stop) {
+			if (!wb->head) {
+				pthread_cond_wait(&wb->work, &wb->mutex);
+				continue;
+			}
+
+			if (retry) {
+				when = retry_at;
+			} else if (wb->num_queued >= section->wb_max_rows) {
+				break;
+			} else {
+				when = wb->head->when;
+				when.tv_usec += (section->wb_interval % 1000) * 1000;
+				when.tv_sec += (section->wb_interval / 1000) + (when.tv_usec / USEC);
+				when.tv_usec %= USEC;
+			}
+
+			gettimeofday(&now, NULL);
+			if (!timercmp(&now, &when, <)) break;
+
+			deadline.tv_sec = when.tv_sec;
+			deadline.tv_nsec = when.tv_usec * 1000;
+			pthread_cond_timedwait(&wb->work, &wb->mutex, &deadline);
+		}
+
+		/*
+		 *	On exit, make one last attempt to write the
+		 *	queue.  Anything left is still in the journal.
+		 */
+		if (wb->stop && (!wb->head || retry)) break;
+
+		batch = last = wb->head;
+		len = last->len;
+		for (count = 1; (count < section->wb_max_rows) && last->next; count++) {
+			last = last->next;
+			len += last->len;
+		}
+		wb->head = last->next;
+		if (!wb->head) wb->tail = NULL;
+		last->next = NULL;
+		wb->num_queued -= count;
+		pthread_cond_broadcast(&wb->space);
+		pthread_mutex_unlock(&wb->mutex);
+
+		DEBUG2("rlm_sql (%s): Writing %d queued queries", wb->name, count);
+		batch = sql_wb_flush(wb, batch);
+
+		if (journal) pthread_mutex_lock(&wb->sync_mutex);
+		pthread_mutex_lock(&wb->mutex);
+
+		rlen = 0;
+		if (batch) {
+			for (entry = batch, count = 1, rlen = entry->len; entry->next; entry = entry->next) {
+				count++;
+				rlen += entry->next->len;
+			}
+			entry->next = wb->head;
+			wb->head = batch;
+			if (!wb->tail) wb->tail = entry;
+			wb->num_queued += count;
+
+			ERROR("rlm_sql (%s): Failed writing queued queries, will retry in %d seconds (%d waiting)",
+			      wb->name, section->wb_retry_interval, wb->num_queued);
+
+			gettimeofday(&retry_at, NULL);
+			retry_at.tv_sec += section->wb_retry_interval;
+			retry = true;
+		} else {
+			retry = false;
+		}
+
+		/*
+		 *	The records of the queries which were written
+		 *	are now dead.
+		 */
+		if (journal) {
+			len -= rlen;
+			wb->live_size = (wb->live_size > len) ? wb->live_size - len : 0;
+			if (!retry && (wb->fd >= 0)) sql_wb_journal_compact(wb);
+			pthread_mutex_unlock(&wb->sync_mutex);
+		}
+	}
+	pthread_mutex_unlock(&wb->mutex);
+
+	return NULL;
+}
+
+/** Start the write-behind queue for a section
+ *
+ */
+int sql_wb_init(rlm_sql_t *inst, sql_acct_section_t *section)
+{
+	sql_wb_t *wb;
+	char const *name;
+
+	if (section->wb_max_rows < 1) section->wb_max_rows = 1;
+	if (section->wb_max_queue < section->wb_max_rows) section->wb_max_queue = section->wb_max_rows;
+	if (section->wb_interval < 1) section->wb_interval = 1;
+	if (section->wb_retry_interval < 1) section->wb_retry_interval = 1;
+
+	MEM(wb = talloc_zero(section, sql_wb_t));
+	wb->inst = inst;
+	wb->section = section;
+	wb->fd = -1;
+
+	name = cf_section_name1(section->cs);
+	wb->name = talloc_asprintf(wb, "%s.%s", inst->config->xlat_name, name);
+
+	pthread_mutex_init(&wb->mutex, NULL);
+	pthread_mutex_init(&wb->sync_mutex, NULL);
+	pthread_cond_init(&wb->work, NULL);
+	pthread_cond_init(&wb->space, NULL);
+	section->wb = wb;
+
+	if (section->wb_journal) {
+		if (sql_wb_journal_load(wb, section->wb_journal) < 0) return -1;
+		if (sql_wb_journal_open(wb, section->wb_journal) < 0) return -1;
+	} else {
+		WARN("rlm_sql (%s): No write_behind journal, queued queries will be lost if the server stops",
+		     wb->name);
+	}
+
+	if (pthread_create(&wb->thread, NULL, sql_wb_thread, wb) != 0) {
+		ERROR("rlm_sql (%s): Failed creating write_behind thread: %s", wb->name, fr_syserror(errno));
+		return -1;
+	}
+	wb->started = true;
+
+	DEBUG("rlm_sql (%s): Writing queries in batches of up to %d, every %d ms", wb->name,
+	      section->wb_max_rows, section->wb_interval);
+
+	return 0;
+}
+
+/** Stop the write-behind queue for a section
+ *
+ * Makes one last attempt to write the queued queries.
+ */
+void sql_wb_free(sql_acct_section_t *section)
+{
+	sql_wb_t *wb = section->wb;
+
+	if (!wb) return;
+
+	if (wb->started) {
+		pthread_mutex_lock(&wb->mutex);
+		wb->stop = true;
+		pthread_cond_signal(&wb->work);
+		pthread_mutex_unlock(&wb->mutex);
+
+		pthread_join(wb->thread, NULL);
+	}
+
+	if (wb->head) {
+		WARN("rlm_sql (%s): %d queries were not written%s", wb->name, wb->num_queued,
+		     (wb->fd >= 0) ? ", they will be written on the next start" : "");
+	}
+	sql_wb_entry_free(wb->head);
+
+	if (wb->fd >= 0) close(wb->fd);
+
+	pthread_cond_destroy(&wb->space);
+	pthread_cond_destroy(&wb->work);
+	pthread_mutex_destroy(&wb->sync_mutex);
+	pthread_mutex_destroy(&wb->mutex);
+
+	talloc_free(wb);
+	section->wb = NULL;
+}
+
+/** Queue the queries for a request
+ *
+ * Expands the query, and its alternatives, and adds them to the
+ * queue for the section.  If the queue stays full for "max_wait"
+ * milliseconds, the request fails, so that the NAS sends it again
+ * later.
+ */
+rlm_rcode_t sql_wb_enqueue(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t *section, CONF_PAIR *pair)
+{
+	sql_wb_t *wb = section->wb;
+	sql_wb_entry_t *entry;
+	char const *attr = cf_pair_attr(pair);
+	char const *value;
+	char *expanded, *record, *query;
+	struct timeval when;
+	struct timespec deadline;
+	uint64_t seq = 0;
+	int num;
+	bool journal = (section->wb_journal != NULL);
+
+	MEM(entry = talloc_zero(NULL, sql_wb_entry_t));
+
+	for (; pair; pair = cf_pair_find_next(section->cs, pair, attr)) {
+		value = cf_pair_value(pair);
+		if (!value) break;
+
+		if (radius_axlat(&expanded, request, value, inst->sql_escape_func, inst) < 0) {
+			talloc_free(entry);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (!*expanded) {
+			talloc_free(expanded);
+			break;
+		}
+
+		entry->queries = talloc_realloc(entry, entry->queries, char *, entry->num_queries + 1);
+		entry->queries[entry->num_queries++] = talloc_steal(entry, expanded);
+	}
+
+	if (!entry->num_queries) {
+		RDEBUG("Ignoring null query");
+		talloc_free(entry);
+		return RLM_MODULE_NOOP;
+	}
+
+	/*
+	 *	Once queued, the entry belongs to the writer thread,
+	 *	so log a copy of the query.
+	 */
+	MEM(query = talloc_strdup(request, entry->queries[0]));
+	gettimeofday(&entry->when, NULL);
+
+	pthread_mutex_lock(&wb->mutex);
+
+	/*
+	 *	Compaction couldn't reopen the journal.  Try again,
+	 *	taking the locks in the same order as the writer thread.
+	 */
+	if (journal && (wb->fd < 0)) {
+		pthread_mutex_unlock(&wb->mutex);
+		pthread_mutex_lock(&wb->sync_mutex);
+		pthread_mutex_lock(&wb->mutex);
+		if (wb->fd < 0) (void) sql_wb_journal_open(wb, section->wb_journal);
+		pthread_mutex_unlock(&wb->sync_mutex);
+	}
+
+	if ((wb->num_queued >= section->wb_max_queue) && (section->wb_max_wait > 0)) {
+		when = entry->when;
+		when.tv_usec += (section->wb_max_wait % 1000) * 1000;
+		when.tv_sec += (section->wb_max_wait / 1000) + (when.tv_usec / USEC);
+		deadline.tv_sec = when.tv_sec;
+		deadline.tv_nsec = (when.tv_usec % USEC) * 1000;
+
+		while (wb->num_queued >= section->wb_max_queue) {
+			if (pthread_cond_timedwait(&wb->space, &wb->mutex, &deadline) == ETIMEDOUT) break;
+		}
+	}
+
+	if (wb->num_queued >= section->wb_max_queue) {
+		num = wb->num_queued;
+		pthread_mutex_unlock(&wb->mutex);
+
+		REDEBUG("Write-behind queue is full (%d queries waiting)", num);
+		talloc_free(query);
+		talloc_free(entry);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	The query is only acknowledged once it's in the
+	 *	journal, if there's meant to be one.
+	 */
+	if (journal) {
+		if (wb->fd < 0) {
+			pthread_mutex_unlock(&wb->mutex);
+
+			RERROR("Journal %s is not open, refusing to queue query", section->wb_journal);
+			talloc_free(query);
+			talloc_free(entry);
+			return RLM_MODULE_FAIL;
+		}
+
+		record = sql_wb_record(entry);
+		entry->len = talloc_array_length(record) - 1;
+
+		if (sql_wb_write(wb->fd, record, entry->len) < 0) {
+			pthread_mutex_unlock(&wb->mutex);
+
+			RERROR("Failed writing to journal %s: %s", section->wb_journal, fr_syserror(errno));
+			talloc_free(record);
+			talloc_free(query);
+			talloc_free(entry);
+			return RLM_MODULE_FAIL;
+		}
+		talloc_free(record);
+
+		wb->journal_size += entry->len;
+		wb->live_size += entry->len;
+		seq = ++wb->written;
+	}
+
+	if (wb->tail) {
+		wb->tail->next = entry;
+	} else {
+		wb->head = entry;
+	}
+	wb->tail = entry;
+	num = ++wb->num_queued;
+	if ((num == 1) || (num >= section->wb_max_rows)) pthread_cond_signal(&wb->work);
+	pthread_mutex_unlock(&wb->mutex);
+
+	rlm_sql_query_log(inst, request, section, query);
+	talloc_free(query);
+
+	/*
+	 *	The query is queued, and will still be written, but
+	 *	if it's not on disk the NAS has to be told to resend.
+	 */
+	if (seq && (sql_wb_journal_sync(wb, seq) < 0)) {
+		RERROR("Failed syncing journal %s: %s", section->wb_journal, fr_syserror(errno));
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Queued query for writing (%d waiting)", num);
+
+	return RLM_MODULE_OK;
+}
+#else
+int sql_wb_init(rlm_sql_t *inst, UNUSED sql_acct_section_t *section)
+{
+	ERROR("rlm_sql (%s): write_behind requires a server built with threads", inst->config->xlat_name);
+	return -1;
+}
+
+void sql_wb_free(UNUSED sql_acct_section_t *section)
+{
+}
+
+rlm_rcode_t sql_wb_enqueue(UNUSED rlm_sql_t *inst, UNUSED REQUEST *request, UNUSED sql_acct_section_t *section,
+			   UNUSED CONF_PAIR *pair)
+{
+	return RLM_MODULE_FAIL;
+}
+#endif
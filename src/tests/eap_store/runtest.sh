@@ -0,0 +1,176 @@
+#!/bin/bash
+#
+#  Test the EAP session store.  Two servers share a "file" session
+#  store, and EAP-MD5 sessions started on one are continued on the
+#  other.
+#
+#  Run from the top of the source tree, after "make".  Skipped if
+#  xxd or openssl aren't installed, as they're needed to calculate
+#  the EAP-MD5 response.
+#
+
+: ${BIN_PATH=./build/bin/local}
+: ${LIB_PATH=./build/lib/.libs/}
+: ${PORT=12340}
+: ${SECRET=testing123}
+: ${TEST_DIR=./build/tests/eap_store}
+
+PORT_A=$PORT
+PORT_B=`expr $PORT + 1`
+RCODE=0
+
+if ! command -v xxd > /dev/null || ! command -v openssl > /dev/null; then
+	echo "xxd or openssl is not installed, skipping"
+	exit 0
+fi
+
+rm -rf "$TEST_DIR"
+mkdir -p "$TEST_DIR/store"
+export LIB_PATH TEST_DIR
+
+cleanup() {
+	[ -n "$RADIUSD_A" ] && kill -TERM $RADIUSD_A 2> /dev/null
+	[ -n "$RADIUSD_B" ] && kill -TERM $RADIUSD_B 2> /dev/null
+}
+trap cleanup EXIT
+
+radiusd_start() {
+	local port=$1
+
+	PORT=$port $BIN_PATH/radiusd -fxx -l stdout -d src/tests/eap_store -n radiusd -D share \
+		> "$TEST_DIR/radius-$port.log" 2>&1 &
+	RADIUSD_PID=$!
+
+	for i in `seq 1 50`; do
+		grep -q 'Ready to process requests' "$TEST_DIR/radius-$port.log" && return
+		kill -0 $RADIUSD_PID 2> /dev/null || break
+		sleep 0.1
+	done
+
+	echo "FreeRADIUS didn't start on port $port"
+	cat "$TEST_DIR/radius-$port.log"
+	exit 1
+}
+
+#
+#  Send an Access-Request to a server.  The reply is left in
+#  $TEST_DIR/radclient.log
+#
+send() {
+	local port=$1
+
+	shift
+	echo "$@" | $BIN_PATH/radclient -D share -r 1 -t 2 127.0.0.1:$port auth $SECRET \
+		> "$TEST_DIR/radclient.log" 2>&1
+}
+
+reply_attr() {
+	sed -n "s/^[[:space:]]*$1 = 0x//p" "$TEST_DIR/radclient.log" | head -1
+}
+
+reply_code() {
+	sed -n 's/^Received reply ID [0-9]*, code \([0-9]*\),.*/\1/p' "$TEST_DIR/radclient.log"
+}
+
+#
+#  Start an EAP-MD5 session with the EAP-Identity, and set STATE
+#  and RESPONSE to what the client sends next.
+#
+start() {
+	local port=$1 password=$2 eap id challenge digest
+
+	STATE=
+	RESPONSE=
+
+	# Response, id 1, length 8, Identity, "bob"
+	send $port 'User-Name = "bob", EAP-Message = 0x0201000801626f62, Message-Authenticator = 0x00'
+	[ "`reply_code`" = "11" ] || return
+
+	STATE=`reply_attr State`
+	eap=`reply_attr EAP-Message`
+
+	# Request, id, length 22, MD5-Challenge, value size 16, value
+	id=${eap:2:2}
+	challenge=${eap:12:32}
+
+	digest=`{ echo -n $id | xxd -r -p; echo -n $password; echo -n $challenge | xxd -r -p; } | \
+		openssl md5 -binary | xxd -p`
+
+	# Response, id, length 22, MD5-Challenge, value size 16, digest
+	RESPONSE="User-Name = \"bob\", State = 0x$STATE, EAP-Message = 0x02${id}00160410${digest}"
+	RESPONSE="$RESPONSE, Message-Authenticator = 0x00"
+}
+
+check() {
+	local name=$1 expected=$2 code=`reply_code`
+
+	if [ "$code" = "$expected" ]; then
+		echo "$name : Success"
+	else
+		echo "$name : FAILED (expected code $expected, got '$code')"
+		RCODE=1
+	fi
+}
+
+stored() {
+	ls "$TEST_DIR/store" | wc -l | tr -d ' '
+}
+
+radiusd_start $PORT_A
+RADIUSD_A=$RADIUSD_PID
+radiusd_start $PORT_B
+RADIUSD_B=$RADIUSD_PID
+
+echo "Running tests:"
+
+#
+#  Continued by the server which started the session.  The
+#  exported copy is removed.
+#
+start $PORT_A bob1
+send $PORT_A "$RESPONSE"
+check "local" 2
+if [ "`stored`" = "0" ]; then
+	echo "local-removed : Success"
+else
+	echo "local-removed : FAILED"
+	RCODE=1
+fi
+
+#
+#  Continued by the other server.
+#
+start $PORT_A bob1
+send $PORT_B "$RESPONSE"
+check "remote" 2
+
+#
+#  The other server took the session from the store, so a copy
+#  of the response can't continue it again.
+#
+send $PORT_B "$RESPONSE"
+check "remote-taken" 3
+
+#
+#  The password is still checked.
+#
+start $PORT_B wrong
+send $PORT_A "$RESPONSE"
+check "remote-password" 3
+
+for pid in $RADIUSD_A $RADIUSD_B; do
+	if ! kill -0 $pid 2> /dev/null; then
+		echo "FreeRADIUS terminated during test"
+		RCODE=1
+	fi
+done
+
+if [ "$RCODE" = "0" ]; then
+	echo "All tests succeeded"
+else
+	echo "Last log entries were:"
+	tail -n 40 "$TEST_DIR/radius-$PORT_A.log" "$TEST_DIR/radius-$PORT_B.log"
+	echo "See $TEST_DIR for more details"
+fi
+
+exit $RCODE
@@ -0,0 +1,227 @@
+#!/bin/bash
+#
+#  Test the local replica of rlm_ldap against slapd, with the
+#  syncprov overlay.  Checks that the users are loaded, that changes
+#  to them are applied, and that the replica is reloaded after the
+#  connection is lost.
+#
+#  Run from the top of the source tree, after "make".  Skipped if
+#  slapd or the OpenLDAP tools aren't installed.
+#
+
+: ${BIN_PATH=./build/bin/local}
+: ${LIB_PATH=./build/lib/.libs/}
+: ${PORT=12340}
+: ${LDAP_PORT=12389}
+: ${SECRET=testing123}
+: ${TEST_DIR=./build/tests/ldap_sync}
+: ${SLAPD=`command -v slapd || ls /usr/sbin/slapd /usr/libexec/slapd /usr/local/libexec/slapd 2>/dev/null | head -1`}
+
+BASE_DN="dc=example,dc=com"
+ADMIN_DN="cn=admin,${BASE_DN}"
+ADMIN_PW="secret"
+LDAP_URI="ldap://127.0.0.1:${LDAP_PORT}/"
+RCODE=0
+
+if [ -z "$SLAPD" ] || ! command -v ldapadd > /dev/null; then
+	echo "slapd or the OpenLDAP tools are not installed, skipping"
+	exit 0
+fi
+
+for x in /etc/ldap/schema /etc/openldap/schema /usr/local/etc/openldap/schema; do
+	if [ -f "$x/inetorgperson.schema" ]; then
+		SCHEMA_DIR=$x
+		break
+	fi
+done
+for x in /usr/lib/ldap /usr/lib64/openldap /usr/lib/openldap /usr/local/libexec/openldap; do
+	if ls $x/syncprov.* > /dev/null 2>&1; then
+		MODULE_DIR=$x
+		break
+	fi
+done
+
+if [ -z "$SCHEMA_DIR" ]; then
+	echo "Can't find the OpenLDAP schema, skipping"
+	exit 0
+fi
+
+rm -rf "$TEST_DIR"
+mkdir -p "$TEST_DIR/db"
+export LIB_PATH TEST_DIR PORT LDAP_PORT
+
+#
+#  Modules which aren't built in have to be loaded.
+#
+{
+	echo "include $SCHEMA_DIR/core.schema"
+	echo "include $SCHEMA_DIR/cosine.schema"
+	echo "include $SCHEMA_DIR/inetorgperson.schema"
+	echo "pidfile $TEST_DIR/slapd.pid"
+	if [ -n "$MODULE_DIR" ]; then
+		echo "modulepath $MODULE_DIR"
+		for x in back_mdb syncprov; do
+			if ls $MODULE_DIR/$x.* > /dev/null 2>&1; then
+				echo "moduleload $x"
+			fi
+		done
+	fi
+	echo "database mdb"
+	echo "maxsize 10485760"
+	echo "suffix \"$BASE_DN\""
+	echo "rootdn \"$ADMIN_DN\""
+	echo "rootpw $ADMIN_PW"
+	echo "directory $TEST_DIR/db"
+	echo "overlay syncprov"
+} > "$TEST_DIR/slapd.conf"
+
+slapd_start() {
+	if ! $SLAPD -f "$TEST_DIR/slapd.conf" -h "$LDAP_URI" > "$TEST_DIR/slapd.log" 2>&1; then
+		echo "Failed starting slapd"
+		cat "$TEST_DIR/slapd.log"
+		exit 1
+	fi
+
+	for i in `seq 1 50`; do
+		ldapsearch -x -H "$LDAP_URI" -s base -b "" > /dev/null 2>&1 && return
+		sleep 0.1
+	done
+
+	echo "slapd didn't start"
+	exit 1
+}
+
+slapd_stop() {
+	local pid
+
+	[ -f "$TEST_DIR/slapd.pid" ] || return
+	pid=`cat "$TEST_DIR/slapd.pid"`
+	kill -TERM $pid 2> /dev/null
+	while kill -0 $pid 2> /dev/null; do
+		sleep 0.1
+	done
+	rm -f "$TEST_DIR/slapd.pid"
+}
+
+cleanup() {
+	[ -n "$RADIUSD_PID" ] && kill -TERM $RADIUSD_PID 2> /dev/null
+	slapd_stop
+}
+trap cleanup EXIT
+
+ldap() {
+	local cmd=$1
+
+	shift
+	$cmd -x -H "$LDAP_URI" -D "$ADMIN_DN" -w "$ADMIN_PW" "$@" > /dev/null
+}
+
+#
+#  Send an Access-Request, and print "accept" or "reject"
+#
+auth() {
+	echo "User-Name = \"$1\", User-Password = \"$2\"" | \
+		$BIN_PATH/radclient -D share -r 1 -t 2 127.0.0.1:$PORT auth $SECRET > "$TEST_DIR/radclient.log" 2>&1
+
+	if grep -q 'code 2,' "$TEST_DIR/radclient.log"; then
+		echo accept
+	else
+		echo reject
+	fi
+}
+
+#
+#  The replica is updated asynchronously, so wait for the expected
+#  result for a while.
+#
+expect() {
+	local name=$1 user=$2 password=$3 result=$4
+
+	for i in `seq 1 20`; do
+		if [ "`auth $user $password`" = "$result" ]; then
+			echo "$name : Success"
+			return
+		fi
+		sleep 0.5
+	done
+
+	echo "$name : FAILED"
+	RCODE=1
+}
+
+slapd_start
+if ! ldap ldapadd -f src/tests/ldap_sync/example.ldif; then
+	echo "Failed loading the directory"
+	exit 1
+fi
+
+$BIN_PATH/radiusd -fxx -l stdout -d src/tests/ldap_sync -n radiusd -D share > "$TEST_DIR/radius.log" 2>&1 &
+RADIUSD_PID=$!
+
+echo "Running tests:"
+
+#
+#  Load
+#
+expect "load" alice alice1 accept
+expect "load-password" alice wrong reject
+expect "load-other" bob bob1 accept
+
+#
+#  Two users have the same key, so neither is found.
+#
+expect "ambiguous" carol carol1 reject
+
+#
+#  Modify
+#
+ldap ldapmodify <<EOF
+dn: uid=alice,ou=people,$BASE_DN
+changetype: modify
+replace: userPassword
+userPassword: alice2
+EOF
+expect "modify" alice alice2 accept
+expect "modify-old" alice alice1 reject
+
+#
+#  Delete
+#
+ldap ldapdelete "uid=bob,ou=people,$BASE_DN"
+expect "delete" bob bob1 reject
+
+ldap ldapdelete "cn=carol two,ou=people,$BASE_DN"
+expect "delete-duplicate" carol carol1 accept
+
+#
+#  Reconnect.  Until the replica is reloaded, users are searched
+#  for, and the user filter never matches.
+#
+slapd_stop
+expect "disconnected" alice alice2 reject
+
+slapd_start
+expect "reconnect" alice alice2 accept
+
+ldap ldapmodify <<EOF
+dn: uid=alice,ou=people,$BASE_DN
+changetype: modify
+replace: userPassword
+userPassword: alice3
+EOF
+expect "reconnect-modify" alice alice3 accept
+
+if ! kill -0 $RADIUSD_PID 2> /dev/null; then
+	echo "FreeRADIUS terminated during test"
+	RCODE=1
+fi
+
+if [ "$RCODE" = "0" ]; then
+	echo "All tests succeeded"
+else
+	echo "Last log entries were:"
+	tail -n 40 "$TEST_DIR/radius.log"
+	echo "See $TEST_DIR/radius.log for more details"
+fi
+
+exit $RCODE
@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+#  Test the OpenMetrics exporter.  Sends some packets, then checks
+#  that the exposition has no duplicate series, and no samples for
+#  listener types which weren't built.
+#
+#  Run from the top of the source tree, after "make".  Skipped if
+#  curl isn't installed.
+#
+
+: ${BIN_PATH=./build/bin/local}
+: ${LIB_PATH=./build/lib/.libs/}
+: ${PORT=12340}
+: ${SECRET=testing123}
+: ${TEST_DIR=./build/tests/metrics}
+
+ACCT_PORT=`expr $PORT + 1`
+METRICS_PORT=`expr $PORT + 2`
+RCODE=0
+
+if ! command -v curl > /dev/null; then
+	echo "curl is not installed, skipping"
+	exit 0
+fi
+
+rm -rf "$TEST_DIR"
+mkdir -p "$TEST_DIR"
+export LIB_PATH TEST_DIR PORT ACCT_PORT METRICS_PORT
+
+cleanup() {
+	[ -n "$RADIUSD_PID" ] && kill -TERM $RADIUSD_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+$BIN_PATH/radiusd -fxx -l stdout -d src/tests/metrics -n radiusd -D share > "$TEST_DIR/radius.log" 2>&1 &
+RADIUSD_PID=$!
+
+for i in `seq 1 50`; do
+	grep -q 'Ready to process requests' "$TEST_DIR/radius.log" && break
+	if ! kill -0 $RADIUSD_PID 2> /dev/null || [ $i = 50 ]; then
+		echo "FreeRADIUS didn't start"
+		cat "$TEST_DIR/radius.log"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+pass() {
+	echo "$1 : Success"
+}
+
+fail() {
+	echo "$1 : FAILED"
+	[ -n "$2" ] && echo "$2"
+	RCODE=1
+}
+
+echo 'User-Name = "bob", User-Password = "bob"' | \
+	$BIN_PATH/radclient -D share -r 1 -t 2 127.0.0.1:$PORT auth $SECRET > /dev/null 2>&1
+echo 'User-Name = "bob", Acct-Status-Type = Start, Acct-Session-Id = "01"' | \
+	$BIN_PATH/radclient -D share -r 1 -t 2 127.0.0.1:$ACCT_PORT acct $SECRET > /dev/null 2>&1
+
+echo "Running tests:"
+
+if ! curl -s -f -o "$TEST_DIR/metrics.txt" "http://127.0.0.1:$METRICS_PORT/metrics"; then
+	fail "fetch"
+else
+	pass "fetch"
+
+	#
+	#  A series is the metric name and its labels.
+	#
+	dups=`grep -v '^#' "$TEST_DIR/metrics.txt" | sed 's/ [^ ]*$//' | sort | uniq -d`
+	if [ -z "$dups" ]; then
+		pass "unique-series"
+	else
+		fail "unique-series" "$dups"
+	fi
+
+	if grep -q '"undefined"' "$TEST_DIR/metrics.txt"; then
+		fail "no-undefined" "`grep '"undefined"' "$TEST_DIR/metrics.txt"`"
+	else
+		pass "no-undefined"
+	fi
+
+	if grep -q '^freeradius_queue_length{queue="auth"} ' "$TEST_DIR/metrics.txt"; then
+		pass "queue-auth"
+	else
+		fail "queue-auth"
+	fi
+fi
+
+if ! kill -0 $RADIUSD_PID 2> /dev/null; then
+	echo "FreeRADIUS terminated during test"
+	RCODE=1
+fi
+
+if [ "$RCODE" = "0" ]; then
+	echo "All tests succeeded"
+else
+	echo "See $TEST_DIR for more details"
+fi
+
+exit $RCODE
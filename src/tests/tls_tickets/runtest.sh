@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+#  Test TLS session tickets.  The session cache is disabled, so
+#  sessions can only be resumed from tickets.  EAP-TLS sessions,
+#  where the client certificate was verified, must be resumed.
+#  PEAP sessions, where the user is authenticated inside the
+#  tunnel, must never be.
+#
+#  Run from the top of the source tree, after "make", and after
+#  creating the test certificates in raddb/certs.  Skipped if
+#  eapol_test isn't installed.
+#
+
+: ${BIN_PATH=./build/bin/local}
+: ${LIB_PATH=./build/lib/.libs/}
+: ${PORT=12340}
+: ${SECRET=testing123}
+: ${TEST_DIR=./build/tests/tls_tickets}
+: ${EAPOL_TEST=eapol_test}
+
+RCODE=0
+
+if ! command -v $EAPOL_TEST > /dev/null; then
+	echo "eapol_test is not installed, skipping"
+	exit 0
+fi
+
+for x in server.pem ca.pem dh client.crt client.key; do
+	if [ ! -f raddb/certs/$x ]; then
+		echo "raddb/certs/$x doesn't exist, skipping.  Run \"make\" in raddb/certs"
+		exit 0
+	fi
+done
+
+rm -rf "$TEST_DIR"
+mkdir -p "$TEST_DIR"
+export LIB_PATH TEST_DIR PORT
+
+cleanup() {
+	[ -n "$RADIUSD_PID" ] && kill -TERM $RADIUSD_PID 2> /dev/null
+}
+trap cleanup EXIT
+
+$BIN_PATH/radiusd -fxx -l stdout -d src/tests/tls_tickets -n radiusd -D share > "$TEST_DIR/radius.log" 2>&1 &
+RADIUSD_PID=$!
+
+for i in `seq 1 50`; do
+	grep -q 'Ready to process requests' "$TEST_DIR/radius.log" && break
+	if ! kill -0 $RADIUSD_PID 2> /dev/null || [ $i = 50 ]; then
+		echo "FreeRADIUS didn't start"
+		cat "$TEST_DIR/radius.log"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+resumed() {
+	grep -c 'Adding cached attributes for session' "$TEST_DIR/radius.log"
+}
+
+#
+#  Authenticate, then re-authenticate once.  Check that the
+#  authentications succeeded, and how many sessions were resumed.
+#
+run() {
+	local name=$1 conf=$2 expected=$3 before after
+
+	before=`resumed`
+	if ! $EAPOL_TEST -c src/tests/tls_tickets/$conf -a 127.0.0.1 -p $PORT -s $SECRET -r 1 \
+		> "$TEST_DIR/$name.log" 2>&1; then
+		echo "$name : FAILED (see $TEST_DIR/$name.log)"
+		RCODE=1
+		return
+	fi
+	after=`resumed`
+
+	if [ `expr $after - $before` = "$expected" ]; then
+		echo "$name : Success"
+	else
+		echo "$name : FAILED (expected $expected resumed sessions, got `expr $after - $before`)"
+		RCODE=1
+	fi
+}
+
+echo "Running tests:"
+
+run "eap-tls" eap-tls.conf 1
+run "peap" peap.conf 0
+
+if ! kill -0 $RADIUSD_PID 2> /dev/null; then
+	echo "FreeRADIUS terminated during test"
+	RCODE=1
+fi
+
+if [ "$RCODE" = "0" ]; then
+	echo "All tests succeeded"
+else
+	echo "Last log entries were:"
+	tail -n 40 "$TEST_DIR/radius.log"
+	echo "See $TEST_DIR/radius.log for more details"
+fi
+
+exit $RCODE